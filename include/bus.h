@@ -0,0 +1,79 @@
+#ifndef VIBE_VMM_BUS_H
+#define VIBE_VMM_BUS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/* Forward declarations */
+struct device;
+
+/*
+ * Address range routed to a device
+ *
+ * An access at addr is delivered to dev at offset
+ * (addr - base) + dev_offset, so a device can expose several
+ * sub-ranges (e.g. a BAR split around a hole) on the same bus.
+ */
+struct bus_range {
+    uint64_t base;
+    uint64_t size;
+    struct device *dev;
+    uint64_t dev_offset;
+};
+
+/*
+ * Sorted, immutable range table
+ *
+ * Published with a release store and never modified afterwards; replaced
+ * tables are kept on the retired list until the bus is destroyed, so
+ * lookups on vCPU threads take no locks.
+ */
+struct bus_table {
+    uint64_t gen;                       /* Unique generation (cache tag) */
+    struct bus_table *retired;          /* Previously published tables */
+    int num_ranges;
+    struct bus_range ranges[];          /* Sorted by base, non-overlapping */
+};
+
+/* Address space bus (one for MMIO, one for port I/O) */
+struct bus {
+    const char *name;
+    pthread_mutex_t lock;               /* Serializes registration */
+    struct bus_range *ranges;           /* Writer-side copy */
+    int num_ranges;
+    int max_ranges;
+    struct bus_table *table;            /* Published lookup table */
+};
+
+/* Per-vCPU last-hit cache */
+struct bus_cache {
+    uint64_t gen;
+    const struct bus_range *range;
+};
+
+/* Initialize/destroy a bus */
+int bus_init(struct bus *bus, const char *name);
+void bus_destroy(struct bus *bus);
+
+/* Register [base, base + size) for dev; overlapping ranges are rejected */
+int bus_register(struct bus *bus, uint64_t base, uint64_t size,
+                 struct device *dev, uint64_t dev_offset);
+
+/* Remove every range belonging to dev */
+int bus_unregister_device(struct bus *bus, struct device *dev);
+
+/* Find the range containing addr (cache may be NULL) */
+const struct bus_range* bus_find(struct bus *bus, uint64_t addr,
+                                 struct bus_cache *cache);
+
+/*
+ * Dispatch an access to the device owning addr.
+ * Returns -1 with errno = ENODEV if nothing is mapped there.
+ */
+int bus_read(struct bus *bus, uint64_t addr, void *data, size_t size,
+             struct bus_cache *cache);
+int bus_write(struct bus *bus, uint64_t addr, const void *data, size_t size,
+              struct bus_cache *cache);
+
+#endif /* VIBE_VMM_BUS_H */
@@ -7,6 +7,7 @@
 /* Forward declarations */
 struct vm;
 struct device;
+struct iothread;
 
 /* Device operations */
 struct device_ops {
@@ -18,8 +19,19 @@ struct device_ops {
     /* Write to device */
     int (*write)(struct device *dev, uint64_t offset, const void *data, size_t size);
 
-    /* Destroy device */
+    /* Called once the device is registered with a VM / before removal */
+    int (*attach)(struct device *dev);
+    void (*detach)(struct device *dev);
+
+    /* Destroy device (frees the device itself) */
     void (*destroy)(struct device *dev);
+
+    /* Print statistics (optional) */
+    void (*print_stats)(struct device *dev);
+
+    /* Level-triggered line: does the device still have an interrupt
+     * pending? Checked on guest EOI to re-raise the line (optional) */
+    int (*irq_pending)(struct device *dev);
 };
 
 /* MMIO device */
@@ -40,6 +52,10 @@ struct device {
     /* Interrupt handling */
     int              irq;
     int              irq_fd;  /* eventfd for interrupt injection */
+    int              irq_resample_fd;  /* signalled on guest EOI (level) */
+    int              irq_edge;         /* edge-triggered line */
+    int              irq_routed;       /* irq_fd is an in-kernel irqfd */
+    struct iothread *irq_iothread;     /* Watches irq_resample_fd */
 
     /* Linked list */
     struct device   *next;
@@ -48,6 +64,15 @@ struct device {
 /* Register an MMIO device */
 int device_register(struct vm *vm, struct device *dev);
 
+/*
+ * Map an additional MMIO or port I/O sub-range to a registered device.
+ * Accesses are delivered at (addr - base) + offset.
+ */
+int device_add_mmio_range(struct device *dev, uint64_t gpa, uint64_t size,
+                          uint64_t offset);
+int device_add_pio_range(struct device *dev, uint16_t port, uint16_t count,
+                         uint64_t offset);
+
 /* Unregister a device */
 void device_unregister(struct device *dev);
 
@@ -68,6 +93,9 @@ struct device* device_create(const char *name, size_t priv_size);
 /* Destroy device */
 void device_destroy(struct device *dev);
 
+/* Print device statistics, if the device keeps any */
+void device_print_stats(struct device *dev);
+
 /* Get private data */
 static inline void* device_get_priv(struct device *dev) {
     return dev->data;
@@ -76,7 +104,9 @@ static inline void* device_get_priv(struct device *dev) {
 /* Device creation functions */
 struct device* mmio_console_create(void);
 struct device* virtio_console_create(void);
-struct device* virtio_blk_create(const char *disk_path);
-struct device* virtio_net_create(const char *tap_name);
+struct device* virtio_blk_create(const char *disk_spec);
+struct device* virtio_net_create(const char *net_spec);
+struct device* vhost_user_blk_create(const char *spec);
+struct device* vhost_user_net_create(const char *spec);
 
 #endif /* VIBE_VMM_DEVICES_H */
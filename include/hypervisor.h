@@ -157,6 +157,10 @@ struct hv_memory_slot {
     uint64_t flags;
 };
 
+/* ioeventfd flags */
+#define HV_IOEVENTFD_DATAMATCH  (1 << 0)    /* Only signal on a matching value */
+#define HV_IOEVENTFD_PIO        (1 << 1)    /* addr is an I/O port */
+
 /* Hypervisor operations (abstract interface) */
 struct hv_ops {
     int (*init)(void);
@@ -177,13 +181,38 @@ struct hv_ops {
     int (*run)(struct hv_vcpu *vcpu);
     int (*get_exit)(struct hv_vcpu *vcpu, struct hv_exit *exit);
 
+    /* Return the data of a handled IN or MMIO read exit (optional: the
+     * backend already completed it) */
+    int (*complete_exit)(struct hv_vcpu *vcpu, const struct hv_exit *exit);
+
     int (*get_regs)(struct hv_vcpu *vcpu, struct hv_regs *regs);
     int (*set_regs)(struct hv_vcpu *vcpu, const struct hv_regs *regs);
 
     int (*get_sregs)(struct hv_vcpu *vcpu, struct hv_sregs *sregs);
     int (*set_sregs)(struct hv_vcpu *vcpu, const struct hv_sregs *sregs);
 
+    /*
+     * Create in-kernel interrupt controllers and timer (PIC, IOAPIC, local
+     * APICs, PIT) before any vCPU (optional). Interrupts, EOIs and timer
+     * ticks are then handled without leaving the kernel, and a halted
+     * vCPU sleeps there until it has an interrupt.
+     */
+    int (*create_irqchip)(struct hv_vm *vm);
+
     int (*irq_line)(struct hv_vm *vm, int irq, int level);
+
+    /* Route an eventfd to a guest IRQ in the kernel (optional).
+     * resample_fd >= 0 makes the line level-triggered: it is lowered on
+     * guest EOI and resample_fd is signalled. */
+    int (*irqfd)(struct hv_vm *vm, int fd, int resample_fd, int gsi, int assign);
+
+    /* Signal an eventfd on guest writes to addr instead of exiting (optional) */
+    int (*ioeventfd)(struct hv_vm *vm, int fd, uint64_t addr, uint32_t len,
+                     uint64_t datamatch, uint32_t flags, int assign);
+
+    /* Limit how long a vCPU halted in the kernel polls for a wake-up
+     * before sleeping (optional; with an in-kernel irqchip) */
+    int (*set_halt_poll)(struct hv_vm *vm, uint64_t max_ns);
 };
 
 /* Opaque VM and vCPU structures */
@@ -227,6 +256,7 @@ int hv_unmap_mem(struct hv_vm *vm, uint32_t slot);
 /* Run operations */
 int hv_run(struct hv_vcpu *vcpu);
 int hv_get_exit(struct hv_vcpu *vcpu, struct hv_exit *exit);
+int hv_complete_exit(struct hv_vcpu *vcpu, const struct hv_exit *exit);
 
 /* Register operations */
 int hv_get_regs(struct hv_vcpu *vcpu, struct hv_regs *regs);
@@ -236,6 +266,15 @@ int hv_get_sregs(struct hv_vcpu *vcpu, struct hv_sregs *sregs);
 int hv_set_sregs(struct hv_vcpu *vcpu, const struct hv_sregs *sregs);
 
 /* IRQ operations */
+int hv_create_irqchip(struct hv_vm *vm);
 int hv_irq_line(struct hv_vm *vm, int irq, int level);
+int hv_irqfd(struct hv_vm *vm, int fd, int resample_fd, int gsi, int assign);
+
+/* Guest write notifications */
+int hv_ioeventfd(struct hv_vm *vm, int fd, uint64_t addr, uint32_t len,
+                 uint64_t datamatch, uint32_t flags, int assign);
+
+/* In-kernel halt polling */
+int hv_set_halt_poll(struct hv_vm *vm, uint64_t max_ns);
 
 #endif /* VIBE_VMM_HYPERVISOR_H */
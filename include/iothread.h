@@ -0,0 +1,67 @@
+#ifndef VIBE_VMM_IOTHREAD_H
+#define VIBE_VMM_IOTHREAD_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* Default number of I/O threads */
+#define IOTHREAD_DEFAULT_COUNT  1
+#define IOTHREAD_MAX_COUNT      64
+
+/* Callback for a ready fd (events are EPOLLIN/EPOLLOUT/...) */
+typedef void (*iothread_fn)(int fd, uint32_t events, void *opaque);
+
+/* Registered fd */
+struct iothread_handler {
+    int fd;
+    iothread_fn fn;
+    void *opaque;
+    int dead;                           /* Removed; freed after the batch */
+    struct iothread_handler *next;      /* Live or zombie list */
+};
+
+/* I/O thread: one epoll loop */
+struct iothread {
+    int index;
+    int cpu;                            /* Pinned CPU, or -1 */
+    int epoll_fd;
+    int stop_fd;                        /* eventfd to stop the loop */
+    pthread_t thread;
+    int running;
+
+    /* Held (recursively) while dispatching a batch; removal waits on it */
+    pthread_mutex_t lock;
+    struct iothread_handler *handlers;
+    struct iothread_handler *zombies;
+    int num_handlers;
+};
+
+/* Pool of I/O threads shared by a VM's devices */
+struct iothread_pool {
+    struct iothread *threads;
+    int num_threads;
+    int next;                           /* Round-robin assignment */
+};
+
+/*
+ * Create a pool of count threads. cpus is an optional CPU list
+ * ("2,3" or "2-5"); threads are pinned to its entries round-robin.
+ */
+struct iothread_pool* iothread_pool_create(int count, const char *cpus);
+void iothread_pool_destroy(struct iothread_pool *pool);
+
+/* Pick a thread for a new device (round-robin) */
+struct iothread* iothread_pool_pick(struct iothread_pool *pool);
+
+/* Register/modify/remove an fd on a thread */
+int iothread_add_fd(struct iothread *t, int fd, uint32_t events,
+                    iothread_fn fn, void *opaque);
+int iothread_mod_fd(struct iothread *t, int fd, uint32_t events);
+
+/*
+ * Remove an fd. When called from another thread this waits for any
+ * in-flight callback to finish, so opaque may be freed afterwards.
+ */
+int iothread_del_fd(struct iothread *t, int fd);
+
+#endif /* VIBE_VMM_IOTHREAD_H */
@@ -10,6 +10,26 @@
 #define MM_FLAG_EXECUTABLE (1 << 2)
 #define MM_FLAG_LOG_DIRTY  (1 << 3)
 
+/* Guest memory page sizes */
+#define MM_PAGE_SIZE_4K    (4ULL << 10)
+#define MM_PAGE_SIZE_2M    (2ULL << 20)
+#define MM_PAGE_SIZE_1G    (1ULL << 30)
+
+/* Guest memory backing */
+enum mm_backing {
+    MM_BACKING_ANON,      /* Anonymous private mapping */
+    MM_BACKING_MEMFD,     /* Shared memfd (fd can be passed to other processes) */
+};
+
+/* Guest memory allocation */
+struct mm_guest_mem {
+    void     *hva;        /* Host virtual address (aligned to page_size) */
+    uint64_t size;        /* Mapped size (multiple of page_size) */
+    uint64_t page_size;   /* Backing page size: 4K, 2M or 1G */
+    enum mm_backing backing;
+    int       fd;         /* memfd, or -1 for anonymous memory */
+};
+
 /* Memory slot */
 struct mm_slot {
     uint64_t gpa;         /* Guest physical address */
@@ -19,13 +39,45 @@ struct mm_slot {
     uint64_t flags;       /* Flags */
 };
 
+/*
+ * Sorted, immutable GPA -> HVA lookup table
+ *
+ * Tables are never modified after publication. Writers build a new table,
+ * publish it with mm_slot_table_publish() and keep the old one on the
+ * retired list until the owner is destroyed, so lock-free readers never
+ * see freed memory.
+ */
+struct mm_slot_table {
+    uint64_t gen;                       /* Unique generation (cache tag) */
+    struct mm_slot_table *retired;      /* Previously published tables */
+    int num_slots;
+    struct mm_slot slots[];             /* Sorted by GPA, non-overlapping */
+};
+
 /* Memory context */
 struct mm_ctx {
-    struct mm_slot slots[32];  /* Maximum 32 slots */
+    struct mm_slot *slots;              /* Slots in insertion order */
     int num_slots;
+    int max_slots;
     uint64_t total_size;
+    struct mm_slot_table *table;        /* Published lookup table */
 };
 
+/* Build a lookup table from an unsorted slot array */
+struct mm_slot_table* mm_slot_table_build(const struct mm_slot *slots, int num_slots);
+
+/* Publish a new table (the old one is retired, not freed) */
+void mm_slot_table_publish(struct mm_slot_table **table, struct mm_slot_table *new_table);
+
+/* Free a table and everything it retired */
+void mm_slot_table_free(struct mm_slot_table *table);
+
+/*
+ * Find the slot containing gpa. Checks the calling thread's last hit
+ * first, then binary searches.
+ */
+const struct mm_slot* mm_slot_table_find(const struct mm_slot_table *table, uint64_t gpa);
+
 /* Initialize memory context */
 struct mm_ctx* mm_create(void);
 void mm_destroy(struct mm_ctx *mm);
@@ -36,6 +88,20 @@ void* mm_alloc_guest_mem(uint64_t size);
 /* Free guest memory */
 void mm_free_guest_mem(void *ptr, uint64_t size);
 
+/*
+ * Allocate guest memory with an explicit backing and page size.
+ * 2M/1G page sizes use hugetlbfs pages; 4K mappings of 2M or more are
+ * aligned to 2M and marked for transparent hugepages.
+ */
+int mm_guest_mem_alloc(struct mm_guest_mem *mem, uint64_t size,
+                       enum mm_backing backing, uint64_t page_size);
+void mm_guest_mem_free(struct mm_guest_mem *mem);
+
+/* Parse backing/page size names ("anon", "memfd", "4K", "2M", "1G") */
+int mm_parse_backing(const char *str, enum mm_backing *backing);
+int mm_parse_page_size(const char *str, uint64_t *page_size);
+const char *mm_backing_name(enum mm_backing backing);
+
 /* Add memory slot to context */
 int mm_add_slot(struct mm_ctx *mm, uint64_t gpa, void *hva, uint64_t size, uint64_t flags);
 
@@ -0,0 +1,72 @@
+#ifndef VIBE_VMM_URING_H
+#define VIBE_VMM_URING_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Minimal io_uring wrapper
+ *
+ * Talks to the kernel through the raw syscalls so there is no liburing
+ * dependency. A ring is owned by one thread at a time (callers serialize
+ * prep/submit/reap with their own lock). Completions are signalled on an
+ * eventfd that can be watched by an I/O thread.
+ *
+ * On platforms without io_uring, uring_create() fails with ENOSYS.
+ */
+struct uring;
+
+/* Operations */
+enum uring_op {
+    URING_OP_READ,
+    URING_OP_WRITE,
+    URING_OP_FDATASYNC,
+};
+
+/* Completion callback: res is bytes transferred or -errno */
+typedef void (*uring_complete_fn)(void *opaque, uint64_t user_data, int32_t res);
+
+/* Create a ring with at least entries submission slots */
+struct uring* uring_create(unsigned entries);
+void uring_destroy(struct uring *ring);
+
+/* eventfd signalled whenever completions are posted */
+int uring_event_fd(struct uring *ring);
+
+/*
+ * Register fixed buffers. Buffers larger than the kernel's 1 GiB limit are
+ * split into several entries. Returns the number of entries registered.
+ */
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, int count);
+
+/* Index of the registered buffer covering [buf, buf + len), or -1 */
+int uring_find_buffer(struct uring *ring, const void *buf, uint64_t len);
+
+/* Free submission slots */
+unsigned uring_sq_space(struct uring *ring);
+
+/*
+ * Queue one operation. buf_index >= 0 selects a registered buffer
+ * (READ_FIXED/WRITE_FIXED). Returns -1 if the submission queue is full.
+ */
+int uring_prep(struct uring *ring, enum uring_op op, int fd, void *buf,
+               uint32_t len, uint64_t offset, int buf_index, uint64_t user_data);
+
+/* Queue a vectored read/write (iov must stay valid until completion) */
+int uring_prepv(struct uring *ring, enum uring_op op, int fd,
+                const struct iovec *iov, int iovcnt, uint64_t offset,
+                uint64_t user_data);
+
+/* Submit everything queued with a single io_uring_enter */
+int uring_submit(struct uring *ring);
+
+/* Submit everything queued and wait for min_complete completions, in one call */
+int uring_submit_and_wait(struct uring *ring, unsigned min_complete);
+
+/* Wait until at least min_complete completions are available */
+int uring_wait(struct uring *ring, unsigned min_complete);
+
+/* Run fn for every posted completion; returns the number reaped */
+int uring_reap(struct uring *ring, uring_complete_fn fn, void *opaque);
+
+#endif /* VIBE_VMM_URING_H */
@@ -16,9 +16,9 @@
 /* Bit manipulation */
 #define BIT(x) (1U << (x))
 
-/* Align macros */
-#define ALIGN_UP(x, a)   (((x) + ((a) - 1)) & ~((a) - 1))
-#define ALIGN_DOWN(x, a) ((x) & ~((a) - 1))
+/* Align macros (mask is widened to the type of x so 64-bit values survive) */
+#define ALIGN_UP(x, a)   (((x) + ((a) - 1)) & ~((typeof(x))(a) - 1))
+#define ALIGN_DOWN(x, a) ((x) & ~((typeof(x))(a) - 1))
 #define IS_ALIGNED(x, a) (((x) & ((a) - 1)) == 0)
 
 /* Page size (4KB) */
@@ -51,6 +51,9 @@
 #define PACKED  __attribute__((packed))
 #define ALIGN(x) __attribute__((aligned(x)))
 
+/* Keeps data written by one thread off other threads' lines */
+#define CACHELINE_SIZE 64
+
 /* Logging functions */
 extern int log_level;
 
@@ -72,6 +75,18 @@ extern int log_level;
 #define log_debug(fmt, ...)                                            \
     do { if (log_level >= LOG_LEVEL_DEBUG) fprintf(stderr, "[DEBUG] %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); } while (0)
 
+/*
+ * Per-exit tracing for the vCPU run loop: compiled in only with
+ * -DVMM_TRACE (or a debug build), then printed at debug level.
+ * Otherwise the arguments are type-checked but never evaluated.
+ */
+#if defined(VMM_TRACE) || defined(DEBUG)
+#define log_trace(fmt, ...)  log_debug(fmt, ##__VA_ARGS__)
+#else
+#define log_trace(fmt, ...)                                            \
+    do { if (0) fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+#endif
+
 /* Panic function */
 #define panic(fmt, ...)                                                \
     do {                                                               \
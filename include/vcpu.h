@@ -3,9 +3,38 @@
 
 #include "hypervisor.h"
 #include "vm.h"
+#include "utils.h"
 #include <stdint.h>
 #include <pthread.h>
 
+/* Halt state (vcpu->halt_state) */
+#define VCPU_HALT_NONE      0
+#define VCPU_HALT_POLLING   1
+#define VCPU_HALT_SLEEPING  2
+
+/* First poll window once polling pays off, in ns */
+#define VCPU_HALT_POLL_START_NS  10000
+
+/*
+ * Exit statistics. Written only by the vCPU's own thread, on every exit,
+ * so they get cache lines of their own.
+ */
+struct vcpu_stats {
+    uint64_t exit_count;        /* Total VM exits */
+    uint64_t io_count;          /* I/O exits */
+    uint64_t mmio_count;        /* MMIO exits */
+    uint64_t halt_count;        /* HLT exits */
+    uint64_t halt_poll_success; /* Halts ended while polling */
+    uint64_t halt_sleep_count;  /* Halts that slept on halt_fd */
+    uint64_t halt_wait_ns;      /* Time spent halted */
+    uint64_t shutdown_count;    /* Shutdown exits */
+    uint64_t exception_count;   /* Exception exits */
+    uint64_t canceled_count;    /* Canceled exits (ARM64) */
+    uint64_t vtimer_count;      /* VTimer exits (ARM64) */
+    uint64_t unknown_count;     /* Unknown exits */
+    uint64_t total_run_time_us; /* Time spent in the run loop */
+} ALIGN(CACHELINE_SIZE);
+
 /* vCPU state */
 enum vcpu_state {
     VCPU_STATE_STOPPED,
@@ -27,26 +56,27 @@ struct vcpu {
     pthread_t thread;
     int should_stop;
 
+    /* Last device hit on each bus (see bus_find) */
+    struct bus_cache mmio_cache;
+    struct bus_cache pio_cache;
+
+    /*
+     * Halt (HLT exits, i.e. no in-kernel irqchip): the thread polls for a
+     * kick for up to halt_poll_ns, then sleeps on halt_fd. The window
+     * grows while wake-ups come within vm->halt_poll_max_ns and shrinks
+     * when they don't, like KVM's halt_poll_ns.
+     */
+    int halt_fd;                /* eventfd, written only while sleeping */
+    int halt_state;             /* VCPU_HALT_* (atomic) */
+    int kick_pending;           /* Set by vcpu_kick() (atomic) */
+    uint64_t halt_poll_ns;      /* Current poll window */
+
     /* Initial register state (for ARM64 where vCPU is created in thread) */
     uint64_t initial_rip;       /* Initial program counter */
     int has_initial_state;      /* Flag indicating if initial state is set */
 
     /* Exit statistics */
-    uint64_t exit_count;        /* Total VM exits */
-    uint64_t io_count;          /* I/O exits */
-    uint64_t mmio_count;        /* MMIO exits */
-    uint64_t halt_count;        /* HLT exits */
-    uint64_t shutdown_count;    /* Shutdown exits */
-    uint64_t exception_count;   /* Exception exits */
-    uint64_t canceled_count;    /* Canceled exits (ARM64) */
-    uint64_t vtimer_count;      /* VTimer exits (ARM64) */
-    uint64_t unknown_count;     /* Unknown exits */
-
-    /* Timing statistics */
-    uint64_t total_run_time_us; /* Total run time in microseconds */
-
-    /* Instruction execution stats (estimated) */
-    uint64_t instructions_executed;
+    struct vcpu_stats stats;
 };
 
 /* Create/destroy vCPU */
@@ -58,6 +88,9 @@ int vcpu_start(struct vcpu *vcpu);
 int vcpu_stop(struct vcpu *vcpu);
 int vcpu_reset(struct vcpu *vcpu);
 
+/* Wake the vCPU from HLT (an interrupt may be pending); any thread */
+void vcpu_kick(struct vcpu *vcpu);
+
 /* vCPU running (main loop) */
 int vcpu_run(struct vcpu *vcpu);
 
@@ -0,0 +1,138 @@
+#ifndef VIBE_VMM_VHOST_H
+#define VIBE_VMM_VHOST_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/*
+ * vhost: virtqueue datapath outside the VMM
+ *
+ * A vhost backend reads and writes a device's rings in guest memory
+ * directly. We hand it the memory table, each ring's address and
+ * position, the queue's kick eventfd and a call eventfd; from then on
+ * the guest's kicks go to the backend without passing through us, and
+ * we only turn its calls into interrupts. Config space, feature
+ * negotiation and reset stay in the device model.
+ *
+ * The backend is reached through the vhost request set: VHOST_SET_*
+ * ioctls for the in-kernel one, the same requests as messages on a unix
+ * socket for a vhost-user one (a process sharing guest RAM through the
+ * memfds it is backed with).
+ */
+struct vm;
+struct virtio_dev;
+struct vhost_dev;
+
+/*
+ * Request set (the <linux/vhost.h> ABI, which can't be included next to
+ * our own vring definitions)
+ */
+#define VHOST_VIRTIO    0xAF
+
+struct vhost_vring_state {
+    unsigned int index;
+    unsigned int num;
+};
+
+struct vhost_vring_file {
+    unsigned int index;
+    int fd;                         /* -1: unbind */
+};
+
+struct vhost_vring_addr {
+    unsigned int index;
+    unsigned int flags;
+    uint64_t desc_user_addr;
+    uint64_t used_user_addr;
+    uint64_t avail_user_addr;
+    uint64_t log_guest_addr;
+};
+
+struct vhost_memory_region {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t flags_padding;
+};
+
+struct vhost_memory {
+    uint32_t nregions;
+    uint32_t padding;
+    struct vhost_memory_region regions[];
+};
+
+#define VHOST_GET_FEATURES      _IOR(VHOST_VIRTIO, 0x00, uint64_t)
+#define VHOST_SET_FEATURES      _IOW(VHOST_VIRTIO, 0x00, uint64_t)
+#define VHOST_SET_OWNER         _IO(VHOST_VIRTIO, 0x01)
+#define VHOST_SET_MEM_TABLE     _IOW(VHOST_VIRTIO, 0x03, struct vhost_memory)
+#define VHOST_SET_VRING_NUM     _IOW(VHOST_VIRTIO, 0x10, struct vhost_vring_state)
+#define VHOST_SET_VRING_ADDR    _IOW(VHOST_VIRTIO, 0x11, struct vhost_vring_addr)
+#define VHOST_SET_VRING_BASE    _IOW(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
+#define VHOST_GET_VRING_BASE    _IOWR(VHOST_VIRTIO, 0x12, struct vhost_vring_state)
+#define VHOST_SET_VRING_KICK    _IOW(VHOST_VIRTIO, 0x20, struct vhost_vring_file)
+#define VHOST_SET_VRING_CALL    _IOW(VHOST_VIRTIO, 0x21, struct vhost_vring_file)
+#define VHOST_NET_SET_BACKEND   _IOW(VHOST_VIRTIO, 0x30, struct vhost_vring_file)
+
+/* Most rings one vhost device serves */
+#define VHOST_MAX_VQS   16
+
+/* Backend transport: issue one vhost request (VHOST_* ioctl number) */
+struct vhost_ops {
+    int (*request)(struct vhost_dev *hdev, unsigned long req, void *arg);
+    void (*cleanup)(struct vhost_dev *hdev);
+
+    /* Start or stop processing ring n (optional: rings always run) */
+    int (*set_vring_enable)(struct vhost_dev *hdev, int n, int enable);
+};
+
+/* One backend instance, serving nvqs consecutive virtqueues */
+struct vhost_dev {
+    const struct vhost_ops *ops;
+    int fd;
+    uint64_t features;              /* Offered by the backend */
+    uint64_t protocol_features;     /* vhost-user: negotiated extensions */
+
+    /* Set while started */
+    struct virtio_dev *vdev;
+    int first_vq;
+    int nvqs;
+    int call_fds[VHOST_MAX_VQS];    /* Backend -> us: buffers used */
+    int started;
+};
+
+/* Open an in-kernel backend (e.g. /dev/vhost-net) and take ownership */
+int vhost_kernel_init(struct vhost_dev *hdev, const char *path);
+
+/*
+ * Connect to a vhost-user backend listening on a unix socket. Guest RAM
+ * must be fd-backed (--mem-backing memfd) by the time the device starts.
+ */
+int vhost_user_init(struct vhost_dev *hdev, const char *path);
+
+/* vhost-user: device config space, and how many rings the backend has */
+int vhost_user_get_config(struct vhost_dev *hdev, void *config, uint32_t size);
+int vhost_user_get_queue_num(struct vhost_dev *hdev);
+
+void vhost_dev_cleanup(struct vhost_dev *hdev);
+
+/*
+ * Start serving vdev->queues[first_vq .. first_vq + nvqs) with the
+ * negotiated features. The device must be attached, with its queues
+ * ready. vdev->lock held.
+ */
+int vhost_dev_start(struct vhost_dev *hdev, struct virtio_dev *vdev,
+                    int first_vq, int nvqs);
+
+/* Stop the backend and take the queues' kicks back (vdev->lock held) */
+void vhost_dev_stop(struct vhost_dev *hdev);
+
+/* Let the backend process ring n of a started device, or pause it */
+int vhost_dev_set_vring_enable(struct vhost_dev *hdev, int n, int enable);
+
+/* Issue a device-specific request */
+int vhost_dev_request(struct vhost_dev *hdev, unsigned long req, void *arg);
+
+/* vhost-net: attach a TAP fd to ring index (-1 detaches) */
+int vhost_net_set_backend(struct vhost_dev *hdev, int index, int fd);
+
+#endif /* VIBE_VMM_VHOST_H */
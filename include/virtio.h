@@ -3,8 +3,49 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
 #include "devices.h"
 
+/* Maximum virtqueues per device (8 net queue pairs plus the control queue) */
+#define VIRTIO_MAX_QUEUES   17
+
+/* Largest queue a driver may configure (QueueNumMax) */
+#define VIRTQUEUE_MAX_SIZE  1024
+
+/* Maximum segments in one descriptor chain (after splitting at slots) */
+#define VIRTQUEUE_MAX_SEGS  256
+
+/* Virtio MMIO (version 2) register offsets */
+#define VIRTIO_MMIO_MAGIC_VALUE         0x000
+#define VIRTIO_MMIO_VERSION             0x004
+#define VIRTIO_MMIO_DEVICE_ID           0x008
+#define VIRTIO_MMIO_VENDOR_ID           0x00c
+#define VIRTIO_MMIO_DEVICE_FEATURES     0x010
+#define VIRTIO_MMIO_DEVICE_FEATURES_SEL 0x014
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_DRIVER_FEATURES_SEL 0x024
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM_MAX       0x034
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_READY         0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_QUEUE_AVAIL_LOW     0x090   /* "Driver" area */
+#define VIRTIO_MMIO_QUEUE_AVAIL_HIGH    0x094
+#define VIRTIO_MMIO_QUEUE_USED_LOW      0x0a0   /* "Device" area */
+#define VIRTIO_MMIO_QUEUE_USED_HIGH     0x0a4
+#define VIRTIO_MMIO_CONFIG_GENERATION   0x0fc
+#define VIRTIO_MMIO_CONFIG              0x100
+
+/* InterruptStatus bits */
+#define VIRTIO_MMIO_INT_VRING           (1U << 0)
+#define VIRTIO_MMIO_INT_CONFIG          (1U << 1)
+
 /* Virtio device IDs */
 enum virtio_device_id {
     VIRTIO_ID_NET          = 1,
@@ -18,6 +59,7 @@ enum virtio_device_id {
 #define VIRTIO_CONFIG_S_DRIVER         2
 #define VIRTIO_CONFIG_S_DRIVER_OK      4
 #define VIRTIO_CONFIG_S_FEATURES_OK    8
+#define VIRTIO_CONFIG_S_NEEDS_RESET    0x40
 #define VIRTIO_CONFIG_FAILED           0x80
 
 /* Virtio feature flags */
@@ -33,9 +75,20 @@ enum virtio_device_id {
 #define VIRTIO_BLK_F_FLUSH            9
 #define VIRTIO_BLK_F_RO               5
 
-#define VIRTIO_NET_F_CSUM             1
-#define VIRTIO_NET_F_GSO              6
+#define VIRTIO_NET_F_CSUM             0   /* Device handles partial checksums */
+#define VIRTIO_NET_F_GUEST_CSUM       1   /* Driver handles partial checksums */
+#define VIRTIO_NET_F_GSO              6   /* Legacy, not offered */
+#define VIRTIO_NET_F_GUEST_TSO4       7
+#define VIRTIO_NET_F_GUEST_TSO6       8
+#define VIRTIO_NET_F_GUEST_ECN        9
+#define VIRTIO_NET_F_GUEST_UFO        10
+#define VIRTIO_NET_F_HOST_TSO4        11
+#define VIRTIO_NET_F_HOST_TSO6        12
+#define VIRTIO_NET_F_HOST_ECN         13
+#define VIRTIO_NET_F_HOST_UFO         14
 #define VIRTIO_NET_F_MRG_RXBUF        15
+#define VIRTIO_NET_F_CTRL_VQ          17
+#define VIRTIO_NET_F_MQ               22
 
 /* Virtio queue descriptor */
 struct vring_desc {
@@ -50,6 +103,10 @@ struct vring_desc {
 #define VRING_DESC_F_WRITE     2
 #define VRING_DESC_F_INDIRECT  4
 
+/* Ring flags (used when VIRTIO_F_RING_EVENT_IDX is not negotiated) */
+#define VRING_AVAIL_F_NO_INTERRUPT  1   /* Guest: don't interrupt me */
+#define VRING_USED_F_NO_NOTIFY      1   /* Device: don't kick me */
+
 /* Virtio available ring */
 struct vring_avail {
     uint16_t flags;
@@ -69,6 +126,33 @@ struct vring_used {
     struct vring_used_elem ring[];
 };
 
+/*
+ * Packed virtqueue (VIRTIO_F_RING_PACKED): a single descriptor ring whose
+ * flags say whether each slot is available or used, so the driver and the
+ * device share one array instead of three.
+ */
+struct vring_packed_desc {
+    uint64_t addr;      /* Address (guest-physical) */
+    uint32_t len;       /* Length */
+    uint16_t id;        /* Buffer id */
+    uint16_t flags;     /* VRING_DESC_F_* and the bits below */
+};
+
+/* Packed descriptor flags: equal to (!=) the wrap counter when available */
+#define VRING_PACKED_DESC_F_AVAIL   (1 << 7)
+#define VRING_PACKED_DESC_F_USED    (1 << 15)
+
+/* Packed ring event suppression (driver area and device area) */
+struct vring_packed_desc_event {
+    uint16_t off_wrap;  /* Ring offset, wrap counter in bit 15 */
+    uint16_t flags;
+};
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2   /* At off_wrap (EVENT_IDX only) */
+#define VRING_PACKED_EVENT_F_WRAP_CTR   15
+
 /* Virtio queue */
 struct virtqueue {
     struct device *dev;
@@ -85,58 +169,164 @@ struct virtqueue {
     struct vring_avail *avail;
     struct vring_used *used;
 
+    /*
+     * Packed layout (VIRTIO_F_RING_PACKED). desc/avail/used stay NULL and
+     * last_avail_idx/last_used_idx are ring offsets with wrap counters.
+     */
+    int packed;
+    struct vring_packed_desc *desc_packed;
+    struct vring_packed_desc_event *driver_event;   /* Driver area */
+    struct vring_packed_desc_event *device_event;   /* Device area */
+    int avail_wrap_counter;     /* At last_avail_idx */
+    int used_wrap_counter;      /* At last_used_idx */
+    uint16_t used_fill_idx;     /* Next used slot, counting unpublished ones */
+    int used_fill_wrap;
+    uint16_t used_head_flags;   /* First unpublished entry's flags (flush) */
+    uint16_t popped_slots;      /* Ring slots of the last popped chain */
+    uint16_t desc_count[VIRTQUEUE_MAX_SIZE];    /* Ring slots per buffer id */
+
     /* Last seen indices */
     uint16_t last_avail_idx;
     uint16_t last_used_idx;
+    uint16_t shadow_avail_idx;  /* avail->idx as last read */
+    uint16_t used_pending;      /* Filled used entries not yet published */
+
+    /* Owning device's InterruptStatus (NULL outside a virtio device) */
+    uint32_t *isr;
+
+    /* Notification suppression (VIRTIO_F_RING_EVENT_IDX) */
+    int event_idx;              /* Negotiated */
+    uint16_t signalled_used;    /* used->idx at the last interrupt */
+    int signalled_used_valid;
+
+    /*
+     * Interrupt moderation (off while coalesce_usecs is 0): the interrupt
+     * for a completion is held for up to coalesce_usecs, or until
+     * coalesce_frames completions are pending
+     */
+    uint32_t coalesce_usecs;
+    uint32_t coalesce_frames;   /* 0: no count limit */
+    uint32_t irq_pending;       /* Completions published since the last interrupt */
+    int coalesce_timer_fd;      /* timerfd on the device's I/O thread */
+    int coalesce_timer_armed;
+
+    /* Statistics */
+    uint64_t stat_completions;      /* Used entries published */
+    uint64_t stat_irqs;             /* Interrupts raised */
+    uint64_t stat_irqs_suppressed;  /* Not wanted by the guest */
+    uint64_t stat_irqs_coalesced;   /* Held back and merged by moderation */
 
     /* Ready flag */
     int ready;
 
+    /* Guest notifications: eventfd signalled by ioeventfd or MMIO write */
+    int kick_fd;
+    int kick_routed;    /* kick_fd is attached in the hypervisor */
+    int kick_external;  /* kick_fd is consumed by a backend (vhost), not us */
+
+    /*
+     * Serializes this queue's emulation. Queues are independent, so each
+     * can be served by its own I/O thread; register writes take the
+     * device lock first, then the queue lock.
+     */
+    pthread_mutex_t lock;
+
+    /* I/O thread that consumes this queue's kicks (set while attached) */
+    struct iothread *iothread;
+
     /* Private data */
     void *priv;
 };
 
-/* Virtio device common configuration (MMIO layout) */
-struct virtio_mmio_config {
-    /* About 4KB */
-    uint32_t magic_value;           /* 0x00: Magic value */
-    uint32_t version;               /* 0x04: Version */
-    uint32_t device_id;             /* 0x08: Device ID */
-    uint32_t vendor_id;             /* 0x0C: Vendor ID */
-    uint32_t device_features;       /* 0x10: Device features */
-    uint32_t device_features_sel;   /* 0x14: Device features selector */
-    uint32_t driver_features;       /* 0x18: Driver features */
-    uint32_t driver_features_sel;   /* 0x1C: Driver features selector */
-    uint32_t guest_page_size;       /* 0x20: Guest page size */
-    uint32_t queue_sel;             /* 0x24: Queue select */
-    uint32_t queue_num_max;         /* 0x28: Queue maximum size */
-    uint32_t queue_num;             /* 0x2C: Queue size */
-    uint32_t queue_ready;           /* 0x30: Queue ready */
-    uint32_t queue_notify;          /* 0x34: Queue notify */
-    uint32_t interrupt_status;      /* 0x38: Interrupt status */
-    uint32_t interrupt_ack;         /* 0x3C: Interrupt acknowledge */
-    uint32_t device_status;         /* 0x40: Device status */
-    uint8_t  config[0x100];         /* 0x100+: Device-specific config */
-    /* Queue notifications follow at offset 0x200 + queue_index * 2 */
+/*
+ * EVENT_IDX fields live just past the rings: used_event after avail->ring
+ * (written by the guest), avail_event after used->ring (written by us)
+ */
+static inline uint16_t* vring_used_event(struct virtqueue *vq)
+{
+    return &vq->avail->ring[vq->size];
+}
+
+static inline uint16_t* vring_avail_event(struct virtqueue *vq)
+{
+    return (uint16_t *)&vq->used->ring[vq->size];
+}
+
+/* True if event_idx lies in [old, new): the other side asked to be told */
+static inline int vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx)
+{
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+/*
+ * A popped descriptor chain, mapped to host memory
+ *
+ * Device-readable buffers ("out", driver -> device) come first in iov,
+ * followed by device-writable ones ("in", device -> driver), matching the
+ * order the spec requires within a chain.
+ */
+struct virtqueue_elem {
+    uint16_t head;                      /* Id to return in the used ring */
+    int out_num;
+    int in_num;
+    struct iovec iov[VIRTQUEUE_MAX_SEGS];
 };
 
+static inline struct iovec* virtqueue_elem_out(struct virtqueue_elem *elem)
+{
+    return elem->iov;
+}
+
+static inline struct iovec* virtqueue_elem_in(struct virtqueue_elem *elem)
+{
+    return elem->iov + elem->out_num;
+}
+
 /* Virtio device structure */
 struct virtio_dev {
     struct device device;          /* Base device */
 
     /* Configuration */
     enum virtio_device_id device_id;
-    uint32_t device_features;
-    uint32_t driver_features;
+    uint64_t device_features;
+    uint64_t driver_features;
+    uint32_t device_features_sel;
+    uint32_t driver_features_sel;
     uint8_t  device_status;
+    uint32_t interrupt_status;     /* VIRTIO_MMIO_INT_* (atomic) */
+    uint32_t config_generation;
 
     /* Queues */
-    struct virtqueue queues[8];
+    struct virtqueue queues[VIRTIO_MAX_QUEUES];
     int num_queues;
+    uint32_t queue_sel;
+    int queues_per_iothread;       /* Consecutive queues sharing a thread (0: 1) */
+
+    /* Serializes register and config space access (see virtqueue.lock) */
+    pthread_mutex_t lock;
 
     /* Queue notification handler */
     int (*queue_notify)(struct virtio_dev *vdev, struct virtqueue *vq);
 
+    /* Device reset (Status = 0; vdev->lock held, queues already reset); optional */
+    void (*reset)(struct virtio_dev *vdev);
+
+    /*
+     * Device reset, before the queues are torn down: wait for requests in
+     * flight so none completes into a reset ring (vdev->lock held); optional
+     */
+    void (*drain)(struct virtio_dev *vdev);
+
+    /* Features accepted by the driver (FEATURES_OK; vdev->lock held); optional */
+    void (*set_features)(struct virtio_dev *vdev, uint64_t features);
+
+    /*
+     * Driver ready (DRIVER_OK), and leaving that state on reset before the
+     * queues are torn down (vdev->lock held); optional
+     */
+    void (*start)(struct virtio_dev *vdev);
+    void (*stop)(struct virtio_dev *vdev);
+
     /* Config space read/write */
     int (*config_read)(struct virtio_dev *vdev, uint64_t offset, void *data, size_t size);
     int (*config_write)(struct virtio_dev *vdev, uint64_t offset, const void *data, size_t size);
@@ -149,19 +339,115 @@ struct virtio_dev {
 int virtio_init(struct virtio_dev *vdev, enum virtio_device_id id);
 void virtio_cleanup(struct virtio_dev *vdev);
 
+/* Create the device's virtqueues */
+int virtio_setup_queues(struct virtio_dev *vdev, int num_queues);
+
+/*
+ * device_ops attach/detach: wire each queue's notify register to a kick
+ * eventfd (ioeventfd where supported) and run queue_notify on one of the
+ * VM's I/O threads.
+ */
+int virtio_attach(struct device *dev);
+void virtio_detach(struct device *dev);
+
 /* Queue operations */
 int virtqueue_setup(struct virtqueue *vq, struct device *dev, uint16_t index);
 void virtqueue_cleanup(struct virtqueue *vq);
 
-/* Pop next available descriptor from queue */
+/*
+ * Pop next available descriptor from queue (split ring only; devices use
+ * virtqueue_pop_chain(), which handles both layouts)
+ */
 struct vring_desc* virtqueue_pop(struct virtqueue *vq);
 
-/* Push descriptor to used ring */
+/*
+ * Pop the next chain, following NEXT and INDIRECT descriptors and
+ * splitting buffers at memory slot boundaries. Returns 1 if a chain was
+ * popped and 0 if the ring is empty. Malformed chains are filled into the
+ * used ring with length 0 (published by the next flush) and skipped.
+ */
+int virtqueue_pop_chain(struct virtqueue *vq, struct virtqueue_elem *elem);
+
+/* Give back the last popped chain (e.g. no host buffer to fill it yet) */
+void virtqueue_unpop(struct virtqueue *vq);
+
+/*
+ * Completing a batch: virtqueue_fill() writes used entries without
+ * exposing them; virtqueue_flush() publishes all of them with a single
+ * used->idx store and returns how many were published, so the caller
+ * raises at most one interrupt per batch:
+ *
+ *     virtqueue_fill(vq, head, len);  ...
+ *     if (virtqueue_flush(vq))
+ *         virtqueue_notify(vq);
+ */
+void virtqueue_fill(struct virtqueue *vq, uint32_t id, uint32_t len);
+int virtqueue_flush(struct virtqueue *vq);
+
+/* Push one descriptor to the used ring and notify (fill + flush + notify) */
 void virtqueue_push(struct virtqueue *vq, uint32_t id, uint32_t len);
 
-/* Notify guest about used buffers */
+/* Interrupt the guest about used buffers, unless it suppressed that */
 void virtqueue_notify(struct virtqueue *vq);
 
+/*
+ * Interrupt the guest for buffers a backend outside this process (vhost)
+ * used; the backend has already honoured the guest's suppression
+ */
+void virtqueue_interrupt(struct virtqueue *vq);
+
+/*
+ * Hand the queue's kick eventfd to such a backend (stop watching it) or
+ * take it back (attached queues only)
+ */
+int virtqueue_set_kick_external(struct virtqueue *vq, int external);
+
+/*
+ * Interrupt moderation: hold a queue's interrupt for up to usecs after the
+ * first unsignalled completion, or until frames completions are pending
+ * (0: no count limit). usecs == 0 disables it. Set before the device is
+ * attached; the timer runs on the device's I/O thread.
+ */
+void virtqueue_set_coalescing(struct virtqueue *vq, uint32_t frames, uint32_t usecs);
+
+/*
+ * Guest kicks: disable while draining the queue; enable returns 1 if new
+ * buffers arrived meanwhile (the caller must process them, the guest
+ * won't kick for them)
+ */
+void virtqueue_disable_notify(struct virtqueue *vq);
+int virtqueue_enable_notify(struct virtqueue *vq);
+
+/* iovec helpers */
+size_t iov_size(const struct iovec *iov, int cnt);
+size_t iov_to_buf(const struct iovec *iov, int cnt, size_t offset,
+                  void *buf, size_t len);
+size_t iov_from_buf(const struct iovec *iov, int cnt, size_t offset,
+                    const void *buf, size_t len);
+
+/* Drop len bytes from the front/back of an iovec array (in place) */
+size_t iov_discard_front(struct iovec **iov, int *cnt, size_t len);
+size_t iov_discard_back(struct iovec *iov, int *cnt, size_t len);
+
+/*
+ * Parse a "key=<unsigned>" device option: 1 if opt is key (value stored),
+ * 0 if it is some other option, -1 if the value is malformed
+ */
+int virtio_parse_uint_opt(const char *opt, const char *key, uint32_t *val);
+
+/* Reject a frame limit without a time limit (it would do nothing): 0 or -1 */
+int virtio_check_coalescing(const char *frames_key, uint32_t frames,
+                            const char *usecs_key, uint32_t usecs);
+
+/* device_ops print_stats: per-queue completion and interrupt counters */
+void virtio_print_stats(struct device *dev);
+
+/* device_ops irq_pending: InterruptStatus not yet acknowledged */
+int virtio_irq_pending(struct device *dev);
+
+/* The device can't carry on until the driver resets it (vdev->lock held) */
+void virtio_set_needs_reset(struct virtio_dev *vdev);
+
 /* MMIO access handlers */
 int virtio_mmio_read(struct virtio_dev *vdev, uint64_t offset, void *data, size_t size);
 int virtio_mmio_write(struct virtio_dev *vdev, uint64_t offset, const void *data, size_t size);
@@ -2,13 +2,18 @@
 #define VIBE_VMM_VM_H
 
 #include "hypervisor.h"
+#include "mm.h"
+#include "bus.h"
+#include "iothread.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
-/* Maximum number of memory slots */
-#define VM_MAX_SLOTS      32
+/* Limits */
 #define VM_MAX_VCPUS      8
-#define VM_MAX_DEVICES    16
+#define VM_MAX_IRQ        23      /* Last IOAPIC pin */
+#define VM_HALT_POLL_MAX_NS 1000000000ULL  /* Longest halt-poll window (1 s) */
 
 /* VM state */
 enum vm_state {
@@ -25,6 +30,7 @@ struct vm_mem_region {
     uint64_t size;        /* Size in bytes */
     uint32_t slot;        /* Hypervisor slot number */
     int       used;       /* Whether this region is in use */
+    struct mm_guest_mem mem;  /* Backing allocation (fd, page size) */
 };
 
 /* VM structure */
@@ -33,16 +39,30 @@ struct vm {
     enum vm_state state;              /* VM state */
 
     /* Memory */
-    struct vm_mem_region mem_regions[VM_MAX_SLOTS];
+    struct vm_mem_region *mem_regions;    /* Indexed by hypervisor slot */
+    int num_mem_regions;
+    int max_mem_regions;
+    struct mm_slot_table *mem_table;      /* Published GPA -> HVA index */
+    pthread_mutex_t mem_lock;             /* Serializes memory updates */
     uint64_t mem_size;                /* Total guest memory size */
+    enum mm_backing mem_backing;      /* Backing for new regions */
+    uint64_t mem_page_size;           /* Page size for new regions */
 
     /* vCPUs */
     struct vcpu *vcpus[VM_MAX_VCPUS];
     int num_vcpus;
 
     /* Devices */
-    struct device *devices[VM_MAX_DEVICES];
+    struct device **devices;
     int num_devices;
+    int max_devices;
+    struct bus mmio_bus;              /* GPA -> device dispatch */
+    struct bus pio_bus;               /* I/O port -> device dispatch */
+
+    /* I/O threads (started on first use) */
+    struct iothread_pool *iothreads;
+    int num_iothreads;
+    char *iothread_cpus;              /* CPU list for pinning, or NULL */
 
     /* Configuration */
     char *kernel_path;
@@ -50,7 +70,10 @@ struct vm {
     char *cmdline;
 
     /* IRQ routing */
+    int irqchip;                      /* Interrupt controllers and PIT in the kernel */
+    uint64_t halt_poll_max_ns;        /* Halt-poll window limit (0: sleep at once) */
     int irq_base;                     /* Base IRQ number for devices */
+    int next_irq;                     /* Next IRQ handed to a device */
 };
 
 /* Create/destroy VM */
@@ -63,13 +86,32 @@ int vm_stop(struct vm *vm);
 int vm_pause(struct vm *vm);
 
 /* Memory management */
+int vm_set_memory_backing(struct vm *vm, enum mm_backing backing, uint64_t page_size);
 int vm_add_memory_region(struct vm *vm, uint64_t gpa, uint64_t size);
 void *vm_gpa_to_hva(struct vm *vm, uint64_t gpa, uint64_t size);
 
+/*
+ * Translate a guest range that may span memory slots into host iovecs.
+ * Returns the number of iovecs used, or -1 if part of the range is
+ * unmapped or more than max_iov would be needed.
+ */
+int vm_gpa_to_iov(struct vm *vm, uint64_t gpa, uint64_t size,
+                  struct iovec *iov, int max_iov);
+
 /* Device management */
 int vm_register_device(struct vm *vm, struct device *dev);
 struct device* vm_find_device_at_gpa(struct vm *vm, uint64_t gpa);
 
+/* I/O threads: configure before registering devices */
+int vm_set_iothreads(struct vm *vm, int count, const char *cpus);
+
+/* Limit how long a halted vCPU polls for a wake-up before sleeping (ns) */
+int vm_set_halt_poll(struct vm *vm, uint64_t max_ns);
+
+/* Wake halted vCPUs: an interrupt was raised outside the hypervisor */
+void vm_kick_vcpus(struct vm *vm);
+struct iothread* vm_get_iothread(struct vm *vm);
+
 /* vCPU management */
 int vm_create_vcpus(struct vm *vm, int num_vcpus);
 
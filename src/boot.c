@@ -274,6 +274,19 @@ static int setup_cmdline(struct vm *vm, const char *cmdline)
     return 0;
 }
 
+/*
+ * End of the RAM region starting at GPA 0 (the initrd must live below it)
+ */
+static uint64_t low_ram_end(struct vm *vm)
+{
+    for (int i = 0; i < vm->num_mem_regions; i++) {
+        if (vm->mem_regions[i].used && vm->mem_regions[i].gpa == 0)
+            return vm->mem_regions[i].size;
+    }
+
+    return vm->mem_size;
+}
+
 /*
  * Setup E820 memory map
  */
@@ -304,11 +317,24 @@ static int setup_e820(struct vm *vm)
     e820[num_entries].type = E820_RESERVED;
     num_entries++;
 
-    /* RAM: 1M to end of memory (simplified) */
-    e820[num_entries].addr = 0x100000;
-    e820[num_entries].size = vm->mem_size - 0x100000;
-    e820[num_entries].type = E820_RAM;
-    num_entries++;
+    /* RAM: every memory region above 1M (low RAM and high RAM above 4G) */
+    for (int i = 0; i < vm->num_mem_regions; i++) {
+        struct vm_mem_region *region = &vm->mem_regions[i];
+        uint64_t start, end;
+
+        if (!region->used)
+            continue;
+
+        start = MAX(region->gpa, 0x100000);
+        end = region->gpa + region->size;
+        if (end <= start)
+            continue;
+
+        e820[num_entries].addr = start;
+        e820[num_entries].size = end - start;
+        e820[num_entries].type = E820_RAM;
+        num_entries++;
+    }
 
     /* Update e820_entries count */
     *(uint8_t *)((char *)hva + 0x1E8) = num_entries;
@@ -400,7 +426,7 @@ int boot_setup_linux(struct vm *vm)
 
     /* Load initrd if specified */
     if (vm->initrd_path) {
-        ret = load_initrd(vm, vm->initrd_path, vm->mem_size);
+        ret = load_initrd(vm, vm->initrd_path, low_ram_end(vm));
         if (ret < 0) {
             log_error("Failed to load initrd");
             return -1;
@@ -0,0 +1,258 @@
+/*
+ * MMIO/PIO address space bus
+ */
+
+#include "bus.h"
+#include "devices.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Generation counter for published range tables (shared by all buses) */
+static uint64_t bus_table_gen;
+
+/*
+ * Compare ranges by base (for qsort)
+ */
+static int bus_range_cmp(const void *a, const void *b)
+{
+    const struct bus_range *ra = a, *rb = b;
+
+    if (ra->base < rb->base)
+        return -1;
+    return ra->base > rb->base;
+}
+
+/*
+ * Build and publish a table from the writer-side range list (lock held)
+ */
+static int bus_publish(struct bus *bus)
+{
+    struct bus_table *table;
+    size_t bytes = bus->num_ranges * sizeof(struct bus_range);
+
+    table = calloc(1, sizeof(*table) + bytes);
+    if (!table)
+        return -1;
+
+    if (bytes)
+        memcpy(table->ranges, bus->ranges, bytes);
+    qsort(table->ranges, bus->num_ranges, sizeof(struct bus_range), bus_range_cmp);
+    table->num_ranges = bus->num_ranges;
+    table->gen = __atomic_add_fetch(&bus_table_gen, 1, __ATOMIC_RELAXED);
+
+    table->retired = bus->table;
+    __atomic_store_n(&bus->table, table, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * Initialize a bus
+ */
+int bus_init(struct bus *bus, const char *name)
+{
+    memset(bus, 0, sizeof(*bus));
+    bus->name = name;
+    pthread_mutex_init(&bus->lock, NULL);
+
+    /* Publish an empty table so lookups never see NULL */
+    return bus_publish(bus);
+}
+
+/*
+ * Destroy a bus (no lookups may be in flight)
+ */
+void bus_destroy(struct bus *bus)
+{
+    struct bus_table *table = bus->table;
+
+    while (table) {
+        struct bus_table *next = table->retired;
+
+        free(table);
+        table = next;
+    }
+
+    free(bus->ranges);
+    pthread_mutex_destroy(&bus->lock);
+    bus->table = NULL;
+    bus->ranges = NULL;
+    bus->num_ranges = 0;
+    bus->max_ranges = 0;
+}
+
+/*
+ * Register an address range
+ */
+int bus_register(struct bus *bus, uint64_t base, uint64_t size,
+                 struct device *dev, uint64_t dev_offset)
+{
+    struct bus_range *range;
+    int i;
+
+    if (size == 0 || base + size - 1 < base) {
+        log_error("%s: invalid range 0x%lx+0x%lx", bus->name, base, size);
+        return -1;
+    }
+
+    pthread_mutex_lock(&bus->lock);
+
+    for (i = 0; i < bus->num_ranges; i++) {
+        range = &bus->ranges[i];
+        if (base <= range->base + (range->size - 1) &&
+            range->base <= base + (size - 1)) {
+            log_error("%s: range 0x%lx+0x%lx for %s overlaps %s",
+                      bus->name, base, size, dev->name, range->dev->name);
+            goto err_unlock;
+        }
+    }
+
+    if (bus->num_ranges == bus->max_ranges) {
+        int max = bus->max_ranges ? bus->max_ranges * 2 : 16;
+        struct bus_range *ranges;
+
+        ranges = realloc(bus->ranges, max * sizeof(*ranges));
+        if (!ranges) {
+            log_error("%s: failed to grow range table", bus->name);
+            goto err_unlock;
+        }
+        bus->ranges = ranges;
+        bus->max_ranges = max;
+    }
+
+    range = &bus->ranges[bus->num_ranges++];
+    range->base = base;
+    range->size = size;
+    range->dev = dev;
+    range->dev_offset = dev_offset;
+
+    if (bus_publish(bus) < 0) {
+        bus->num_ranges--;
+        log_error("%s: failed to publish range table", bus->name);
+        goto err_unlock;
+    }
+
+    pthread_mutex_unlock(&bus->lock);
+
+    log_debug("%s: 0x%lx-0x%lx -> %s (+0x%lx)", bus->name,
+              base, base + size - 1, dev->name, dev_offset);
+    return 0;
+
+err_unlock:
+    pthread_mutex_unlock(&bus->lock);
+    return -1;
+}
+
+/*
+ * Remove all ranges belonging to a device
+ */
+int bus_unregister_device(struct bus *bus, struct device *dev)
+{
+    int i, n = 0, ret = 0;
+
+    pthread_mutex_lock(&bus->lock);
+
+    for (i = 0; i < bus->num_ranges; i++) {
+        if (bus->ranges[i].dev != dev)
+            bus->ranges[n++] = bus->ranges[i];
+    }
+
+    if (n != bus->num_ranges) {
+        bus->num_ranges = n;
+        ret = bus_publish(bus);
+    }
+
+    pthread_mutex_unlock(&bus->lock);
+    return ret;
+}
+
+/*
+ * Find the range containing addr
+ */
+const struct bus_range* bus_find(struct bus *bus, uint64_t addr,
+                                 struct bus_cache *cache)
+{
+    const struct bus_table *table;
+    const struct bus_range *range;
+    int lo, hi;
+
+    table = __atomic_load_n(&bus->table, __ATOMIC_ACQUIRE);
+
+    /* Fast path: same range as this vCPU's last access */
+    if (cache && likely(cache->gen == table->gen)) {
+        range = cache->range;
+        if (addr - range->base < range->size)
+            return range;
+    }
+
+    /* Binary search for the last range starting at or below addr */
+    lo = 0;
+    hi = table->num_ranges - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        range = &table->ranges[mid];
+        if (addr < range->base) {
+            hi = mid - 1;
+        } else if (addr - range->base >= range->size) {
+            lo = mid + 1;
+        } else {
+            if (cache) {
+                cache->gen = table->gen;
+                cache->range = range;
+            }
+            return range;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Read from the device at addr
+ */
+int bus_read(struct bus *bus, uint64_t addr, void *data, size_t size,
+             struct bus_cache *cache)
+{
+    const struct bus_range *range = bus_find(bus, addr, cache);
+    struct device *dev;
+
+    if (unlikely(!range)) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    dev = range->dev;
+    if (unlikely(!dev->ops || !dev->ops->read)) {
+        log_warn("Device %s has no read handler", dev->name);
+        return -1;
+    }
+
+    return dev->ops->read(dev, addr - range->base + range->dev_offset, data, size);
+}
+
+/*
+ * Write to the device at addr
+ */
+int bus_write(struct bus *bus, uint64_t addr, const void *data, size_t size,
+              struct bus_cache *cache)
+{
+    const struct bus_range *range = bus_find(bus, addr, cache);
+    struct device *dev;
+
+    if (unlikely(!range)) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    dev = range->dev;
+    if (unlikely(!dev->ops || !dev->ops->write)) {
+        log_warn("Device %s has no write handler", dev->name);
+        return -1;
+    }
+
+    return dev->ops->write(dev, addr - range->base + range->dev_offset, data, size);
+}
@@ -3,6 +3,7 @@
  */
 
 #include "devices.h"
+#include "iothread.h"
 #include "utils.h"
 #include "vm.h"
 
@@ -13,6 +14,7 @@
 #include <unistd.h>
 
 #ifdef __linux__
+#include <sys/epoll.h>
 #include <sys/eventfd.h>
 #else
 /* Stub for platforms without eventfd */
@@ -55,6 +57,7 @@ struct device* device_create(const char *name, size_t priv_size)
     }
 
     dev->irq_fd = -1;
+    dev->irq_resample_fd = -1;
 
     log_debug("Created device: %s", name);
     return dev;
@@ -68,46 +71,222 @@ void device_destroy(struct device *dev)
     if (!dev)
         return;
 
-    if (dev->ops && dev->ops->destroy)
-        dev->ops->destroy(dev);
-
     if (dev->irq_fd >= 0)
         close(dev->irq_fd);
+    if (dev->irq_resample_fd >= 0)
+        close(dev->irq_resample_fd);
+
+    /* A destroy hook owns the device memory */
+    if (dev->ops && dev->ops->destroy) {
+        dev->ops->destroy(dev);
+        return;
+    }
 
     free(dev->data);
     free(dev->name);
     free(dev);
 }
 
+/*
+ * Print device statistics
+ */
+void device_print_stats(struct device *dev)
+{
+    if (dev && dev->ops && dev->ops->print_stats)
+        dev->ops->print_stats(dev);
+}
+
+/*
+ * Guest EOI on a routed level-triggered line (resample_fd, I/O thread)
+ *
+ * The kernel has just lowered the line. A notification that came while
+ * it was still high, or a cause the guest hasn't acknowledged yet, would
+ * otherwise be lost: raise it again while the device has one pending.
+ */
+static void device_irq_resample(int fd, uint32_t events, void *opaque)
+{
+    struct device *dev = opaque;
+    uint64_t value;
+
+    (void)events;
+
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+        return;
+
+    if (dev->ops->irq_pending(dev)) {
+        value = 1;
+        if (write(dev->irq_fd, &value, sizeof(value)) != sizeof(value))
+            perror("write eventfd");
+    }
+}
+
+/*
+ * Route a device's IRQ eventfd to the guest through the hypervisor
+ *
+ * Level-triggered lines get a resample eventfd so the kernel can lower the
+ * line on EOI; if the device can say whether it still has an interrupt
+ * pending, an I/O thread watches it and re-raises the line. If the
+ * backend has no irqfd support (or no in-kernel irqchip), the eventfd is
+ * left unrouted.
+ */
+static void device_route_irq(struct vm *vm, struct device *dev)
+{
+    if (!dev->irq_edge) {
+        dev->irq_resample_fd = eventfd(0, EFD_NONBLOCK);
+        if (dev->irq_resample_fd < 0) {
+            perror("eventfd");
+            return;
+        }
+    }
+
+    if (hv_irqfd(vm->hv_vm, dev->irq_fd, dev->irq_resample_fd, dev->irq, 1) < 0) {
+        log_debug("Device %s: IRQ %d not routed in kernel", dev->name, dev->irq);
+        if (dev->irq_resample_fd >= 0) {
+            close(dev->irq_resample_fd);
+            dev->irq_resample_fd = -1;
+        }
+        return;
+    }
+
+    dev->irq_routed = 1;
+
+    if (dev->irq_resample_fd >= 0 && dev->ops && dev->ops->irq_pending) {
+        struct iothread *t = vm_get_iothread(vm);
+
+        if (!t || iothread_add_fd(t, dev->irq_resample_fd, EPOLLIN,
+                                  device_irq_resample, dev) < 0) {
+            log_warn("Device %s: IRQ %d resample not watched", dev->name, dev->irq);
+            return;
+        }
+        dev->irq_iothread = t;
+    }
+}
+
+/*
+ * Undo device_route_irq()
+ */
+static void device_unroute_irq(struct vm *vm, struct device *dev)
+{
+    if (dev->irq_iothread) {
+        iothread_del_fd(dev->irq_iothread, dev->irq_resample_fd);
+        dev->irq_iothread = NULL;
+    }
+
+    if (dev->irq_routed) {
+        hv_irqfd(vm->hv_vm, dev->irq_fd, dev->irq_resample_fd, dev->irq, 0);
+        dev->irq_routed = 0;
+    }
+
+    if (dev->irq_resample_fd >= 0) {
+        close(dev->irq_resample_fd);
+        dev->irq_resample_fd = -1;
+    }
+}
+
 /*
  * Register a device with VM
  */
 int device_register(struct vm *vm, struct device *dev)
 {
+    int next_irq, irq;
+
     if (!vm || !dev)
         return -1;
 
-    if (vm->num_devices >= VM_MAX_DEVICES) {
-        log_error("Too many devices");
-        return -1;
+    if (vm->num_devices == vm->max_devices) {
+        int max = vm->max_devices ? vm->max_devices * 2 : 16;
+        struct device **devices;
+
+        devices = realloc(vm->devices, max * sizeof(*devices));
+        if (!devices) {
+            log_error("Too many devices");
+            return -1;
+        }
+        vm->devices = devices;
+        vm->max_devices = max;
     }
 
     dev->vm = vm;
 
+    /* Hand out IRQs round-robin; level-triggered lines can be shared */
+    next_irq = vm->next_irq;
+    irq = dev->irq;
+    if (dev->irq <= 0) {
+        dev->irq = vm->next_irq++;
+        if (vm->next_irq > VM_MAX_IRQ)
+            vm->next_irq = vm->irq_base;
+    }
+
     /* Create eventfd for IRQ if not already created */
     if (dev->irq_fd < 0) {
         dev->irq_fd = eventfd(0, EFD_NONBLOCK);
         if (dev->irq_fd < 0) {
             perror("eventfd");
-            return -1;
+            goto err_unroute;
         }
     }
 
+    if (!dev->irq_routed)
+        device_route_irq(vm, dev);
+
+    /* Map the primary MMIO window, if the device has one */
+    if (dev->gpa_end > dev->gpa_start) {
+        if (dev->size == 0)
+            dev->size = dev->gpa_end - dev->gpa_start + 1;
+
+        if (bus_register(&vm->mmio_bus, dev->gpa_start, dev->size, dev, 0) < 0)
+            goto err_unroute;
+    }
+
     vm->devices[vm->num_devices++] = dev;
 
-    log_info("Registered device: %s at GPA 0x%lx-0x%lx",
-             dev->name, dev->gpa_start, dev->gpa_end);
+    if (dev->ops && dev->ops->attach && dev->ops->attach(dev) < 0) {
+        log_error("Failed to attach device %s", dev->name);
+        vm->num_devices--;
+        bus_unregister_device(&vm->mmio_bus, dev);
+        bus_unregister_device(&vm->pio_bus, dev);
+        goto err_unroute;
+    }
+
+    log_info("Registered device: %s at GPA 0x%lx-0x%lx, IRQ %d%s",
+             dev->name, dev->gpa_start, dev->gpa_end, dev->irq,
+             dev->irq_routed ? " (irqfd)" : "");
     return 0;
+
+err_unroute:
+    /* Give the line and the IRQ number back */
+    device_unroute_irq(vm, dev);
+    dev->irq = irq;
+    vm->next_irq = next_irq;
+    return -1;
+}
+
+/*
+ * Map an additional MMIO range to a device
+ */
+int device_add_mmio_range(struct device *dev, uint64_t gpa, uint64_t size,
+                          uint64_t offset)
+{
+    if (!dev->vm) {
+        log_error("Device %s is not registered", dev->name);
+        return -1;
+    }
+
+    return bus_register(&dev->vm->mmio_bus, gpa, size, dev, offset);
+}
+
+/*
+ * Map a port I/O range to a device
+ */
+int device_add_pio_range(struct device *dev, uint16_t port, uint16_t count,
+                         uint64_t offset)
+{
+    if (!dev->vm) {
+        log_error("Device %s is not registered", dev->name);
+        return -1;
+    }
+
+    return bus_register(&dev->vm->pio_bus, port, count, dev, offset);
 }
 
 /*
@@ -125,7 +304,15 @@ void device_unregister(struct device *dev)
     if (!vm)
         return;
 
-    /* Find and remove device from VM */
+    if (dev->ops && dev->ops->detach)
+        dev->ops->detach(dev);
+
+    /* Stop dispatching to the device, then remove it from the VM */
+    bus_unregister_device(&vm->mmio_bus, dev);
+    bus_unregister_device(&vm->pio_bus, dev);
+
+    device_unroute_irq(vm, dev);
+
     for (i = 0; i < vm->num_devices; i++) {
         if (vm->devices[i] == dev) {
             /* Shift remaining devices */
@@ -144,16 +331,7 @@ void device_unregister(struct device *dev)
  */
 struct device* device_find_at_gpa(struct vm *vm, uint64_t gpa)
 {
-    int i;
-
-    for (i = 0; i < vm->num_devices; i++) {
-        struct device *dev = vm->devices[i];
-
-        if (gpa >= dev->gpa_start && gpa <= dev->gpa_end)
-            return dev;
-    }
-
-    return NULL;
+    return vm_find_device_at_gpa(vm, gpa);
 }
 
 /*
@@ -162,33 +340,15 @@ struct device* device_find_at_gpa(struct vm *vm, uint64_t gpa)
 int device_handle_mmio(struct vm *vm, uint64_t gpa, int is_write,
                        uint64_t *data, uint8_t size)
 {
-    struct device *dev;
-    uint64_t offset;
     int ret;
 
-    dev = device_find_at_gpa(vm, gpa);
-    if (!dev) {
-        log_warn("No device at GPA 0x%lx", gpa);
-        return -1;
-    }
-
-    offset = gpa - dev->gpa_start;
+    if (is_write)
+        ret = bus_write(&vm->mmio_bus, gpa, data, size, NULL);
+    else
+        ret = bus_read(&vm->mmio_bus, gpa, data, size, NULL);
 
-    if (is_write) {
-        if (dev->ops && dev->ops->write) {
-            ret = dev->ops->write(dev, offset, data, size);
-        } else {
-            log_warn("Device %s has no write handler", dev->name);
-            ret = -1;
-        }
-    } else {
-        if (dev->ops && dev->ops->read) {
-            ret = dev->ops->read(dev, offset, data, size);
-        } else {
-            log_warn("Device %s has no read handler", dev->name);
-            ret = -1;
-        }
-    }
+    if (ret < 0 && errno == ENODEV)
+        log_warn("No device at GPA 0x%lx", gpa);
 
     return ret;
 }
@@ -210,16 +370,28 @@ int device_assert_irq(struct device *dev)
         return -1;
     }
 
+    /* Not injected by the kernel: a vCPU may be halted waiting for it */
+    if (!dev->irq_routed && dev->vm)
+        vm_kick_vcpus(dev->vm);
+
     log_debug("Device %s asserted IRQ %d", dev->name, dev->irq);
     return 0;
 }
 
 /*
  * Deassert IRQ
+ *
+ * For a routed level-triggered line the kernel lowers the line itself on
+ * EOI; only the resample notification needs to be consumed here, unless
+ * an I/O thread already does (device_irq_resample).
  */
 int device_deassert_irq(struct device *dev)
 {
     uint64_t value;
+    int fd = dev->irq_routed ? dev->irq_resample_fd : dev->irq_fd;
+
+    if (dev->irq_iothread)
+        fd = -1;
 
     if (dev->irq_fd < 0) {
         log_warn("Device %s has no IRQ fd", dev->name);
@@ -227,7 +399,7 @@ int device_deassert_irq(struct device *dev)
     }
 
     /* Read to clear */
-    if (read(dev->irq_fd, &value, sizeof(value)) != sizeof(value)) {
+    if (fd >= 0 && read(fd, &value, sizeof(value)) != sizeof(value)) {
         /* If no data, that's OK */
     }
 
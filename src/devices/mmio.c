@@ -199,6 +199,10 @@ static void mmio_console_destroy(struct device *dev)
         }
     }
 
+    free(dev->data);
+    free(dev->name);
+    free(dev);
+
     log_info("MMIO console destroyed");
 }
 
@@ -0,0 +1,503 @@
+/*
+ * vhost-user devices: virtio-blk and virtio-net served by another process
+ *
+ * The backend connects over a unix socket and maps guest RAM from the
+ * memfds it is backed with. We keep the MMIO transport, feature
+ * negotiation and config space; once the driver is ready every data
+ * queue goes to the backend, and its calls come back as interrupts.
+ */
+
+#include "virtio.h"
+#include "vm.h"
+#include "mm.h"
+#include "vhost.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+
+/* Block features whose config fields we pass through */
+#define VIRTIO_BLK_F_SIZE_MAX   1
+#define VIRTIO_BLK_F_SEG_MAX    2
+#define VIRTIO_BLK_F_GEOMETRY   4
+#define VIRTIO_BLK_F_RO         5
+#define VIRTIO_BLK_F_BLK_SIZE   6
+#define VIRTIO_BLK_F_FLUSH      9
+#define VIRTIO_BLK_F_TOPOLOGY   10
+#define VIRTIO_BLK_F_MQ         12
+
+#define VHOST_USER_BLK_FEATURES \
+    ((1ULL << VIRTIO_BLK_F_SIZE_MAX) | (1ULL << VIRTIO_BLK_F_SEG_MAX) | \
+     (1ULL << VIRTIO_BLK_F_GEOMETRY) | (1ULL << VIRTIO_BLK_F_RO) | \
+     (1ULL << VIRTIO_BLK_F_BLK_SIZE) | (1ULL << VIRTIO_BLK_F_FLUSH) | \
+     (1ULL << VIRTIO_BLK_F_TOPOLOGY) | (1ULL << VIRTIO_BLK_F_MQ))
+
+/* Config space up to num_queues, and where that sits */
+#define VHOST_USER_BLK_CONFIG_SIZE      36
+#define VHOST_USER_BLK_NUM_QUEUES       34
+
+/* Offloads and mergeable buffers are the backend's business */
+#define VHOST_USER_NET_FEATURES \
+    ((1ULL << VIRTIO_NET_F_CSUM) | (1ULL << VIRTIO_NET_F_GUEST_CSUM) | \
+     (1ULL << VIRTIO_NET_F_GUEST_TSO4) | (1ULL << VIRTIO_NET_F_GUEST_TSO6) | \
+     (1ULL << VIRTIO_NET_F_GUEST_ECN) | (1ULL << VIRTIO_NET_F_GUEST_UFO) | \
+     (1ULL << VIRTIO_NET_F_HOST_TSO4) | (1ULL << VIRTIO_NET_F_HOST_TSO6) | \
+     (1ULL << VIRTIO_NET_F_HOST_ECN) | (1ULL << VIRTIO_NET_F_HOST_UFO) | \
+     (1ULL << VIRTIO_NET_F_MRG_RXBUF))
+
+/* Ring features vhost rings support (no packed layout) */
+#define VHOST_USER_RING_FEATURES \
+    ((1ULL << VIRTIO_F_VERSION_1) | (1ULL << VIRTIO_F_RING_INDIRECT_DESC) | \
+     (1ULL << VIRTIO_F_RING_EVENT_IDX))
+
+/* Control virtqueue: only the queue pair count */
+#define VIRTIO_NET_CTRL_MQ                  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET     0
+#define VIRTIO_NET_OK   0
+#define VIRTIO_NET_ERR  1
+
+#define VHOST_USER_NET_MAX_QUEUE_PAIRS  (VHOST_MAX_VQS / 2)
+
+/* Default GPAs: the slots of the built-in block and network devices */
+#define VHOST_USER_BLK_GPA  0xa001000
+#define VHOST_USER_NET_GPA  0xa002000
+#define VHOST_USER_SIZE     0x1000
+
+/* Virtio net configuration (mac, status, max_virtqueue_pairs) */
+struct vhost_user_net_config {
+    uint8_t  mac[6];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+} PACKED;
+
+/* Device state */
+struct vhost_user_state {
+    struct vhost_dev hdev;
+    char    *path;
+
+    /* Data queues the backend serves (net: RX/TX pairs) */
+    uint32_t num_queues;
+
+    /* Config space: read from the backend (blk) or our own (net) */
+    uint8_t  config[VHOST_USER_BLK_CONFIG_SIZE];
+    uint32_t config_size;
+
+    /* net: control queue after the pairs, handled here */
+    uint16_t curr_queue_pairs;
+    struct virtqueue_elem ctrl_elem;
+};
+
+static int vhost_user_config_read(struct virtio_dev *vdev, uint64_t offset,
+                                  void *data, size_t size)
+{
+    struct vhost_user_state *s = vdev->priv;
+
+    memset(data, 0, size);
+    if (offset < s->config_size)
+        memcpy(data, s->config + offset, MIN(size, s->config_size - offset));
+
+    return 0;
+}
+
+/*
+ * Config writes stay local: the net MAC and status are ours, and no block
+ * config field we offer is writable
+ */
+static int vhost_user_config_write(struct virtio_dev *vdev, uint64_t offset,
+                                   const void *data, size_t size)
+{
+    struct vhost_user_state *s = vdev->priv;
+
+    if (vdev->device_id == VIRTIO_ID_NET && offset + size <= s->config_size)
+        memcpy(s->config + offset, data, size);
+
+    return 0;
+}
+
+/*
+ * Control queue: the pair count is recorded and acknowledged. The backend
+ * keeps every ring running, and the driver only posts to the pairs it
+ * enabled.
+ */
+static int vhost_user_net_handle_ctrl(struct virtio_dev *vdev,
+                                      struct virtqueue *vq)
+{
+    struct vhost_user_state *s = vdev->priv;
+    struct virtqueue_elem *elem = &s->ctrl_elem;
+    struct {
+        uint8_t  class;
+        uint8_t  cmd;
+        uint16_t pairs;
+    } PACKED cmd;
+    uint8_t status = VIRTIO_NET_ERR;
+
+    while (virtqueue_pop_chain(vq, elem)) {
+        size_t len = iov_to_buf(virtqueue_elem_out(elem), elem->out_num, 0,
+                                &cmd, sizeof(cmd));
+
+        if (elem->in_num == 0) {
+            log_error("Malformed control command");
+            virtqueue_fill(vq, elem->head, 0);
+            continue;
+        }
+
+        status = VIRTIO_NET_ERR;
+        if (len == sizeof(cmd) && cmd.class == VIRTIO_NET_CTRL_MQ &&
+            cmd.cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET &&
+            cmd.pairs >= 1 && cmd.pairs <= s->num_queues / 2) {
+            s->curr_queue_pairs = cmd.pairs;
+            log_debug("%s: %u queue pairs enabled", vdev->device.name, cmd.pairs);
+            status = VIRTIO_NET_OK;
+        }
+
+        iov_from_buf(virtqueue_elem_in(elem), elem->in_num, 0, &status,
+                     sizeof(status));
+        virtqueue_fill(vq, elem->head, sizeof(status));
+    }
+
+    return 0;
+}
+
+/*
+ * Data queues in use: all of them, except that a net driver without
+ * VIRTIO_NET_F_MQ has one pair (and its control queue follows it)
+ */
+static uint32_t vhost_user_data_queues(struct virtio_dev *vdev)
+{
+    struct vhost_user_state *s = vdev->priv;
+
+    if (vdev->device_id == VIRTIO_ID_NET &&
+        !(vdev->driver_features & (1ULL << VIRTIO_NET_F_MQ)))
+        return 2;
+
+    return s->num_queues;
+}
+
+/*
+ * Queue notification: data queues are the backend's once the driver is
+ * ready (and their kicks no longer reach us); before that they wait
+ */
+static int vhost_user_queue_notify(struct virtio_dev *vdev, struct virtqueue *vq)
+{
+    if (vdev->device_id == VIRTIO_ID_NET &&
+        (vdev->driver_features & (1ULL << VIRTIO_NET_F_CTRL_VQ)) &&
+        vq->index == vhost_user_data_queues(vdev))
+        return vhost_user_net_handle_ctrl(vdev, vq);
+
+    return 0;
+}
+
+static void vhost_user_reset(struct virtio_dev *vdev)
+{
+    struct vhost_user_state *s = vdev->priv;
+
+    s->curr_queue_pairs = 1;
+}
+
+/*
+ * Driver ready: hand the data queues it set up to the backend, then kick
+ * each one in case the driver already did while we held them. If the
+ * backend can't take them nothing would ever complete, so the device
+ * asks the driver for a reset instead.
+ */
+static void vhost_user_start(struct virtio_dev *vdev)
+{
+    struct vhost_user_state *s = vdev->priv;
+    uint32_t i, n, num = vhost_user_data_queues(vdev);
+
+    for (n = 0; n < num && vdev->queues[n].ready; n++)
+        ;
+
+    if (n == 0) {
+        log_warn("%s: driver set up no queues", vdev->device.name);
+        return;
+    }
+
+    if (vhost_dev_start(&s->hdev, vdev, 0, n) < 0) {
+        log_error("%s: backend %s not started", vdev->device.name, s->path);
+        virtio_set_needs_reset(vdev);
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+        eventfd_write(vdev->queues[i].kick_fd, 1);
+
+    log_debug("%s: %u queues on %s", vdev->device.name, n, s->path);
+}
+
+static void vhost_user_stop(struct virtio_dev *vdev)
+{
+    struct vhost_user_state *s = vdev->priv;
+
+    vhost_dev_stop(&s->hdev);
+}
+
+/* Device operations */
+static int vhost_user_read(struct device *dev, uint64_t offset,
+                           void *data, size_t size)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    return virtio_mmio_read(vdev, offset, data, size);
+}
+
+static int vhost_user_write(struct device *dev, uint64_t offset,
+                            const void *data, size_t size)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    return virtio_mmio_write(vdev, offset, data, size);
+}
+
+/*
+ * Attach: the backend can only map fd-backed guest RAM
+ */
+static int vhost_user_attach(struct device *dev)
+{
+    if (dev->vm->mem_backing != MM_BACKING_MEMFD) {
+        log_error("%s needs fd-backed guest RAM (--mem-backing memfd)", dev->name);
+        return -1;
+    }
+
+    return virtio_attach(dev);
+}
+
+/*
+ * Detach: take the rings back while the I/O threads are known
+ */
+static void vhost_user_detach(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+
+    pthread_mutex_lock(&vdev->lock);
+    if (vdev->device_status & VIRTIO_CONFIG_S_DRIVER_OK)
+        vhost_user_stop(vdev);
+    pthread_mutex_unlock(&vdev->lock);
+
+    virtio_detach(dev);
+}
+
+static void vhost_user_destroy(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    struct vhost_user_state *s = vdev->priv;
+
+    if (s) {
+        vhost_dev_cleanup(&s->hdev);
+        free(s->path);
+    }
+
+    virtio_cleanup(vdev);
+    free(s);
+    free(vdev->device.name);
+    free(vdev);
+}
+
+static const struct device_ops vhost_user_ops = {
+    .name = "vhost-user",
+    .read = vhost_user_read,
+    .write = vhost_user_write,
+    .attach = vhost_user_attach,
+    .detach = vhost_user_detach,
+    .destroy = vhost_user_destroy,
+    .print_stats = virtio_print_stats,
+    .irq_pending = virtio_irq_pending,
+};
+
+/*
+ * Parse "socket[,queues=N]" and connect. *queues stays 0 unless given.
+ */
+static struct vhost_user_state* vhost_user_connect(const char *spec,
+                                                   uint32_t *queues)
+{
+    struct vhost_user_state *s;
+    char *opt, *save = NULL;
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->path = strdup(spec);
+    if (!s->path) {
+        free(s);
+        return NULL;
+    }
+
+    opt = strchr(s->path, ',');
+    if (opt) {
+        *opt++ = '\0';
+        for (opt = strtok_r(opt, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+            int ret = virtio_parse_uint_opt(opt, "queues", queues);
+
+            if (ret == 0)
+                log_error("Unknown vhost-user option: %s", opt);
+            if (ret <= 0)
+                goto err;
+        }
+    }
+
+    if (vhost_user_init(&s->hdev, s->path) < 0)
+        goto err;
+
+    return s;
+
+err:
+    free(s->path);
+    free(s);
+    return NULL;
+}
+
+/*
+ * Common device setup around the backend connection
+ */
+static struct device* vhost_user_create(struct vhost_user_state *s,
+                                        enum virtio_device_id id,
+                                        uint64_t features, int num_queues,
+                                        const char *name, uint64_t gpa)
+{
+    struct virtio_dev *vdev;
+
+    vdev = calloc(1, sizeof(*vdev));
+    if (!vdev) {
+        vhost_dev_cleanup(&s->hdev);
+        free(s->path);
+        free(s);
+        return NULL;
+    }
+
+    virtio_init(vdev, id);
+    vdev->device_features = features;
+    virtio_setup_queues(vdev, num_queues);
+
+    vdev->priv = s;
+    vdev->config_read = vhost_user_config_read;
+    vdev->config_write = vhost_user_config_write;
+    vdev->queue_notify = vhost_user_queue_notify;
+    vdev->reset = vhost_user_reset;
+    vdev->start = vhost_user_start;
+    vdev->stop = vhost_user_stop;
+
+    vdev->device.ops = &vhost_user_ops;
+    vdev->device.name = strdup(name);
+    vdev->device.data = vdev;
+    vdev->device.gpa_start = gpa;
+    vdev->device.gpa_end = gpa + VHOST_USER_SIZE - 1;
+    vdev->device.size = VHOST_USER_SIZE;
+
+    log_info("Created %s at GPA 0x%lx (%s, %u queues)", name, gpa, s->path,
+             s->num_queues);
+    return &vdev->device;
+}
+
+/*
+ * Backend queue count, or -1 if it has fewer than asked for
+ */
+static int vhost_user_queues(struct vhost_user_state *s, uint32_t want)
+{
+    int num = vhost_user_get_queue_num(&s->hdev);
+
+    if (num < 0)
+        return -1;
+
+    if (want > (uint32_t)num) {
+        log_error("vhost-user: %s has %d queues, %u requested", s->path, num, want);
+        return -1;
+    }
+
+    return num;
+}
+
+/*
+ * Create a vhost-user block device: "socket[,queues=N]". Capacity and
+ * the rest of the config space come from the backend.
+ */
+struct device* vhost_user_blk_create(const char *spec)
+{
+    struct vhost_user_state *s;
+    uint32_t queues = 0;
+    uint64_t features;
+    int num;
+
+    s = vhost_user_connect(spec, &queues);
+    if (!s)
+        return NULL;
+
+    num = vhost_user_queues(s, queues);
+    if (num < 0)
+        goto err;
+    if (queues == 0)
+        queues = num;
+    if (!(s->hdev.features & (1ULL << VIRTIO_BLK_F_MQ)))
+        queues = 1;
+    s->num_queues = MIN(queues, VHOST_MAX_VQS);
+
+    s->config_size = VHOST_USER_BLK_CONFIG_SIZE;
+    if (vhost_user_get_config(&s->hdev, s->config, s->config_size) < 0) {
+        log_error("vhost-user: can't read block config from %s", s->path);
+        goto err;
+    }
+
+    features = s->hdev.features & (VHOST_USER_BLK_FEATURES | VHOST_USER_RING_FEATURES);
+    if (s->num_queues > 1) {
+        uint16_t num_queues = s->num_queues;
+
+        memcpy(s->config + VHOST_USER_BLK_NUM_QUEUES, &num_queues, sizeof(num_queues));
+    } else {
+        features &= ~(1ULL << VIRTIO_BLK_F_MQ);
+    }
+
+    return vhost_user_create(s, VIRTIO_ID_BLOCK, features, s->num_queues,
+                             "vhost-user-blk", VHOST_USER_BLK_GPA);
+
+err:
+    vhost_dev_cleanup(&s->hdev);
+    free(s->path);
+    free(s);
+    return NULL;
+}
+
+/*
+ * Create a vhost-user network device: "socket[,queues=N]" (queue pairs).
+ * With more than one pair, a control queue handled here follows them.
+ */
+struct device* vhost_user_net_create(const char *spec)
+{
+    struct vhost_user_state *s;
+    struct vhost_user_net_config cfg = {
+        .mac = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 },
+        .status = 0x01,         /* Link up */
+    };
+    uint32_t pairs = 0;
+    uint64_t features;
+    int num;
+
+    s = vhost_user_connect(spec, &pairs);
+    if (!s)
+        return NULL;
+
+    num = vhost_user_queues(s, 2 * pairs);
+    if (num < 0)
+        goto err;
+    if (pairs == 0)
+        pairs = MAX(num / 2, 1);
+    pairs = MIN(pairs, VHOST_USER_NET_MAX_QUEUE_PAIRS);
+
+    s->num_queues = 2 * pairs;
+    s->curr_queue_pairs = 1;
+    cfg.max_virtqueue_pairs = pairs;
+    memcpy(s->config, &cfg, sizeof(cfg));
+    s->config_size = sizeof(cfg);
+
+    features = s->hdev.features & (VHOST_USER_NET_FEATURES | VHOST_USER_RING_FEATURES);
+    if (pairs > 1)
+        features |= (1ULL << VIRTIO_NET_F_CTRL_VQ) | (1ULL << VIRTIO_NET_F_MQ);
+
+    return vhost_user_create(s, VIRTIO_ID_NET, features,
+                             pairs > 1 ? s->num_queues + 1 : s->num_queues,
+                             "vhost-user-net", VHOST_USER_NET_GPA);
+
+err:
+    vhost_dev_cleanup(&s->hdev);
+    free(s->path);
+    free(s);
+    return NULL;
+}
@@ -0,0 +1,759 @@
+/*
+ * vhost backends: hand a device's virtqueues to a datapath outside the VMM
+ */
+
+#include "vhost.h"
+#include "virtio.h"
+#include "vm.h"
+#include "iothread.h"
+#include "utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * In-kernel backend: every request is an ioctl on the vhost fd
+ */
+static int vhost_kernel_request(struct vhost_dev *hdev, unsigned long req, void *arg)
+{
+    return ioctl(hdev->fd, req, arg);
+}
+
+static void vhost_kernel_cleanup(struct vhost_dev *hdev)
+{
+    close(hdev->fd);
+}
+
+static const struct vhost_ops vhost_kernel_ops = {
+    .request = vhost_kernel_request,
+    .cleanup = vhost_kernel_cleanup,
+};
+
+int vhost_kernel_init(struct vhost_dev *hdev, const char *path)
+{
+    memset(hdev, 0, sizeof(*hdev));
+    hdev->fd = open(path, O_RDWR | O_CLOEXEC);
+    if (hdev->fd < 0) {
+        log_error("Failed to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+    hdev->ops = &vhost_kernel_ops;
+
+    /* The rings and memory table belong to this process from now on */
+    if (ioctl(hdev->fd, VHOST_SET_OWNER, NULL) < 0) {
+        perror("ioctl VHOST_SET_OWNER");
+        goto err;
+    }
+
+    if (ioctl(hdev->fd, VHOST_GET_FEATURES, &hdev->features) < 0) {
+        perror("ioctl VHOST_GET_FEATURES");
+        goto err;
+    }
+
+    log_debug("%s: features 0x%lx", path, hdev->features);
+    return 0;
+
+err:
+    close(hdev->fd);
+    hdev->ops = NULL;
+    hdev->fd = -1;
+    return -1;
+}
+
+void vhost_dev_cleanup(struct vhost_dev *hdev)
+{
+    if (hdev->started)
+        vhost_dev_stop(hdev);
+    if (hdev->ops)
+        hdev->ops->cleanup(hdev);
+    hdev->ops = NULL;
+    hdev->fd = -1;
+}
+
+int vhost_dev_request(struct vhost_dev *hdev, unsigned long req, void *arg)
+{
+    return hdev->ops->request(hdev, req, arg);
+}
+
+/*
+ * vhost-user: the same requests as messages on a unix socket, with fds
+ * (memory regions, eventfds) passed as SCM_RIGHTS
+ */
+#define VHOST_USER_VERSION          0x1
+#define VHOST_USER_FLAG_REPLY       (1U << 2)
+#define VHOST_USER_FLAG_NEED_REPLY  (1U << 3)
+
+enum vhost_user_request {
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+};
+
+/* Feature bit announcing protocol extensions, and the extensions we use */
+#define VHOST_USER_F_PROTOCOL_FEATURES      30
+#define VHOST_USER_PROTOCOL_F_MQ            0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK     3
+#define VHOST_USER_PROTOCOL_F_CONFIG        9
+#define VHOST_USER_PROTOCOL_FEATURES \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+#define VHOST_USER_MAX_REGIONS      8
+#define VHOST_USER_VRING_NOFD       (1ULL << 8)
+#define VHOST_USER_CONFIG_MAX       256
+
+struct vhost_user_region {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr;
+    uint64_t mmap_offset;           /* Into the region's fd */
+};
+
+struct vhost_user_memory {
+    uint32_t nregions;
+    uint32_t padding;
+    struct vhost_user_region regions[VHOST_USER_MAX_REGIONS];
+};
+
+struct vhost_user_config {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t  data[VHOST_USER_CONFIG_MAX];
+};
+
+struct vhost_user_msg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;                  /* Payload bytes */
+    union {
+        uint64_t u64;
+        struct vhost_vring_state state;
+        struct vhost_vring_addr addr;
+        struct vhost_user_memory mem;
+        struct vhost_user_config config;
+    } payload;
+} PACKED;
+
+#define VHOST_USER_HDR_SIZE offsetof(struct vhost_user_msg, payload)
+
+static int vhost_user_send(struct vhost_dev *hdev, struct vhost_user_msg *msg,
+                           const int *fds, int nfds)
+{
+    char control[CMSG_SPACE(VHOST_USER_MAX_REGIONS * sizeof(int))];
+    size_t len = VHOST_USER_HDR_SIZE + msg->size;
+    struct iovec iov = { .iov_base = msg, .iov_len = len };
+    struct msghdr mh;
+    ssize_t ret;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    if (nfds > 0) {
+        struct cmsghdr *cmsg;
+
+        memset(control, 0, sizeof(control));
+        mh.msg_control = control;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+
+    do {
+        ret = sendmsg(hdev->fd, &mh, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != (ssize_t)len) {
+        log_error("vhost-user: sending request %u failed: %s", msg->request,
+                  ret < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+    return 0;
+}
+
+static int vhost_user_read(struct vhost_dev *hdev, void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = recv(hdev->fd, (char *)buf + done, len - done, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+    return 0;
+}
+
+static int vhost_user_recv(struct vhost_dev *hdev, struct vhost_user_msg *msg,
+                           uint32_t request)
+{
+    if (vhost_user_read(hdev, msg, VHOST_USER_HDR_SIZE) < 0 ||
+        msg->size > sizeof(msg->payload) ||
+        vhost_user_read(hdev, &msg->payload, msg->size) < 0) {
+        log_error("vhost-user: no reply to request %u", request);
+        return -1;
+    }
+
+    if (msg->request != request || !(msg->flags & VHOST_USER_FLAG_REPLY)) {
+        log_error("vhost-user: unexpected reply %u to request %u",
+                  msg->request, request);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Send a request. GETs (want_reply) read the reply back into msg; with
+ * REPLY_ACK negotiated, every other request waits for the backend's
+ * status, so it has taken effect when this returns.
+ */
+static int vhost_user_call(struct vhost_dev *hdev, struct vhost_user_msg *msg,
+                           const int *fds, int nfds, int want_reply)
+{
+    uint32_t request = msg->request;
+    int ack = !want_reply &&
+              (hdev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK));
+
+    msg->flags = VHOST_USER_VERSION | (ack ? VHOST_USER_FLAG_NEED_REPLY : 0);
+    if (vhost_user_send(hdev, msg, fds, nfds) < 0)
+        return -1;
+
+    if (!want_reply && !ack)
+        return 0;
+
+    if (vhost_user_recv(hdev, msg, request) < 0)
+        return -1;
+
+    if (ack && (msg->size != sizeof(uint64_t) || msg->payload.u64 != 0)) {
+        log_error("vhost-user: request %u failed", request);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static int vhost_user_get_u64(struct vhost_dev *hdev, uint32_t request,
+                              uint64_t *val)
+{
+    struct vhost_user_msg msg = { .request = request };
+
+    if (vhost_user_call(hdev, &msg, NULL, 0, 1) < 0)
+        return -1;
+    if (msg.size != sizeof(uint64_t)) {
+        errno = EIO;
+        return -1;
+    }
+    *val = msg.payload.u64;
+    return 0;
+}
+
+/*
+ * The backend maps guest RAM itself: pass each region's memfd and where
+ * in it the region starts
+ */
+static int vhost_user_set_mem_table(struct vhost_dev *hdev,
+                                    const struct vhost_memory *mem)
+{
+    struct vhost_user_msg msg = { .request = VHOST_USER_SET_MEM_TABLE };
+    struct vhost_user_memory table;
+    int fds[VHOST_USER_MAX_REGIONS];
+    struct vm *vm = hdev->vdev->device.vm;
+    uint32_t n;
+    int i;
+
+    if (mem->nregions > VHOST_USER_MAX_REGIONS) {
+        log_error("vhost-user: too many memory regions (%u)", mem->nregions);
+        return -1;
+    }
+
+    pthread_mutex_lock(&vm->mem_lock);
+    for (n = 0; n < mem->nregions; n++) {
+        struct vhost_user_region *r = &table.regions[n];
+
+        for (i = 0; i < vm->num_mem_regions; i++) {
+            if (vm->mem_regions[i].used &&
+                (uintptr_t)vm->mem_regions[i].hva == mem->regions[n].userspace_addr)
+                break;
+        }
+        if (i == vm->num_mem_regions || vm->mem_regions[i].mem.fd < 0) {
+            pthread_mutex_unlock(&vm->mem_lock);
+            log_error("vhost-user needs fd-backed guest RAM (--mem-backing memfd)");
+            return -1;
+        }
+
+        r->guest_phys_addr = mem->regions[n].guest_phys_addr;
+        r->memory_size = mem->regions[n].memory_size;
+        r->userspace_addr = mem->regions[n].userspace_addr;
+        r->mmap_offset = (char *)vm->mem_regions[i].hva -
+                         (char *)vm->mem_regions[i].mem.hva;
+        fds[n] = vm->mem_regions[i].mem.fd;
+    }
+    pthread_mutex_unlock(&vm->mem_lock);
+
+    table.nregions = mem->nregions;
+    table.padding = 0;
+    msg.size = offsetof(struct vhost_user_memory, regions) +
+               mem->nregions * sizeof(struct vhost_user_region);
+    memcpy(&msg.payload.mem, &table, msg.size);
+    return vhost_user_call(hdev, &msg, fds, mem->nregions, 0);
+}
+
+static int vhost_user_request(struct vhost_dev *hdev, unsigned long req, void *arg)
+{
+    struct vhost_user_msg msg;
+    struct vhost_vring_file *file = arg;
+
+    memset(&msg, 0, VHOST_USER_HDR_SIZE);
+
+    switch (req) {
+    case VHOST_GET_FEATURES:
+        return vhost_user_get_u64(hdev, VHOST_USER_GET_FEATURES, arg);
+
+    case VHOST_SET_FEATURES:
+        msg.request = VHOST_USER_SET_FEATURES;
+        msg.size = sizeof(uint64_t);
+        msg.payload.u64 = *(uint64_t *)arg;
+        /* Keeps the protocol extensions negotiated at connect time */
+        msg.payload.u64 |= hdev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+        break;
+
+    case VHOST_SET_OWNER:
+        msg.request = VHOST_USER_SET_OWNER;
+        break;
+
+    case VHOST_SET_MEM_TABLE:
+        return vhost_user_set_mem_table(hdev, arg);
+
+    case VHOST_SET_VRING_NUM:
+    case VHOST_SET_VRING_BASE:
+        msg.request = req == VHOST_SET_VRING_NUM ? VHOST_USER_SET_VRING_NUM :
+                                                   VHOST_USER_SET_VRING_BASE;
+        msg.size = sizeof(msg.payload.state);
+        msg.payload.state = *(struct vhost_vring_state *)arg;
+        break;
+
+    case VHOST_GET_VRING_BASE:
+        msg.request = VHOST_USER_GET_VRING_BASE;
+        msg.size = sizeof(msg.payload.state);
+        msg.payload.state = *(struct vhost_vring_state *)arg;
+        if (vhost_user_call(hdev, &msg, NULL, 0, 1) < 0)
+            return -1;
+        *(struct vhost_vring_state *)arg = msg.payload.state;
+        return 0;
+
+    case VHOST_SET_VRING_ADDR:
+        msg.request = VHOST_USER_SET_VRING_ADDR;
+        msg.size = sizeof(msg.payload.addr);
+        msg.payload.addr = *(struct vhost_vring_addr *)arg;
+        break;
+
+    case VHOST_SET_VRING_KICK:
+    case VHOST_SET_VRING_CALL:
+        msg.request = req == VHOST_SET_VRING_KICK ? VHOST_USER_SET_VRING_KICK :
+                                                    VHOST_USER_SET_VRING_CALL;
+        msg.size = sizeof(uint64_t);
+        msg.payload.u64 = file->index;
+        if (file->fd < 0) {
+            msg.payload.u64 |= VHOST_USER_VRING_NOFD;
+            break;
+        }
+        return vhost_user_call(hdev, &msg, &file->fd, 1, 0);
+
+    default:
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    return vhost_user_call(hdev, &msg, NULL, 0, 0);
+}
+
+/*
+ * With protocol extensions, rings start disabled until enabled here
+ */
+static int vhost_user_set_vring_enable(struct vhost_dev *hdev, int n, int enable)
+{
+    struct vhost_user_msg msg = { .request = VHOST_USER_SET_VRING_ENABLE };
+
+    if (!(hdev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+        return 0;
+
+    msg.size = sizeof(msg.payload.state);
+    msg.payload.state.index = n;
+    msg.payload.state.num = enable;
+    return vhost_user_call(hdev, &msg, NULL, 0, 0);
+}
+
+static void vhost_user_cleanup(struct vhost_dev *hdev)
+{
+    close(hdev->fd);
+}
+
+static const struct vhost_ops vhost_user_ops = {
+    .request = vhost_user_request,
+    .cleanup = vhost_user_cleanup,
+    .set_vring_enable = vhost_user_set_vring_enable,
+};
+
+int vhost_user_init(struct vhost_dev *hdev, const char *path)
+{
+    struct sockaddr_un addr;
+    uint64_t protocol;
+
+    memset(hdev, 0, sizeof(*hdev));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_error("vhost-user: socket path too long: %s", path);
+        hdev->fd = -1;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    hdev->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (hdev->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(hdev->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_error("vhost-user: can't connect to %s: %s", path, strerror(errno));
+        goto err;
+    }
+    hdev->ops = &vhost_user_ops;
+
+    if (vhost_dev_request(hdev, VHOST_GET_FEATURES, &hdev->features) < 0)
+        goto err;
+
+    if (hdev->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        struct vhost_user_msg msg = { .request = VHOST_USER_SET_PROTOCOL_FEATURES };
+
+        if (vhost_user_get_u64(hdev, VHOST_USER_GET_PROTOCOL_FEATURES, &protocol) < 0)
+            goto err;
+
+        msg.size = sizeof(uint64_t);
+        msg.payload.u64 = protocol & VHOST_USER_PROTOCOL_FEATURES;
+        if (vhost_user_call(hdev, &msg, NULL, 0, 0) < 0)
+            goto err;
+        hdev->protocol_features = msg.payload.u64;
+    }
+
+    if (vhost_dev_request(hdev, VHOST_SET_OWNER, NULL) < 0)
+        goto err;
+
+    log_info("vhost-user: connected to %s (features 0x%lx, protocol 0x%lx)",
+             path, hdev->features, hdev->protocol_features);
+    return 0;
+
+err:
+    close(hdev->fd);
+    hdev->ops = NULL;
+    hdev->fd = -1;
+    return -1;
+}
+
+int vhost_user_get_config(struct vhost_dev *hdev, void *config, uint32_t size)
+{
+    struct vhost_user_msg msg = { .request = VHOST_USER_GET_CONFIG };
+
+    if (!(hdev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG)) ||
+        size > VHOST_USER_CONFIG_MAX) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    msg.size = offsetof(struct vhost_user_config, data) + size;
+    msg.payload.config.size = size;
+    if (vhost_user_call(hdev, &msg, NULL, 0, 1) < 0)
+        return -1;
+
+    if (msg.size != offsetof(struct vhost_user_config, data) + size) {
+        log_error("vhost-user: short config reply");
+        errno = EIO;
+        return -1;
+    }
+
+    memcpy(config, msg.payload.config.data, size);
+    return 0;
+}
+
+int vhost_user_get_queue_num(struct vhost_dev *hdev)
+{
+    uint64_t num;
+
+    if (!(hdev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)))
+        return 1;
+
+    if (vhost_user_get_u64(hdev, VHOST_USER_GET_QUEUE_NUM, &num) < 0)
+        return -1;
+    return (int)num;
+}
+
+/*
+ * Describe guest RAM to the backend: the same GPA -> HVA slots the
+ * hypervisor has. Taken once at start; the layout is fixed after boot.
+ */
+static int vhost_set_mem_table(struct vhost_dev *hdev, struct vm *vm)
+{
+    struct vhost_memory *mem;
+    int i, ret;
+
+    pthread_mutex_lock(&vm->mem_lock);
+
+    mem = calloc(1, sizeof(*mem) +
+                 vm->num_mem_regions * sizeof(struct vhost_memory_region));
+    if (!mem) {
+        pthread_mutex_unlock(&vm->mem_lock);
+        return -1;
+    }
+
+    for (i = 0; i < vm->num_mem_regions; i++) {
+        struct vm_mem_region *region = &vm->mem_regions[i];
+        struct vhost_memory_region *r = &mem->regions[mem->nregions];
+
+        if (!region->used)
+            continue;
+
+        r->guest_phys_addr = region->gpa;
+        r->memory_size = region->size;
+        r->userspace_addr = (uintptr_t)region->hva;
+        mem->nregions++;
+    }
+
+    pthread_mutex_unlock(&vm->mem_lock);
+
+    ret = vhost_dev_request(hdev, VHOST_SET_MEM_TABLE, mem);
+    if (ret < 0)
+        perror("vhost SET_MEM_TABLE");
+
+    free(mem);
+    return ret;
+}
+
+/*
+ * Backend used buffers (runs on the queue's I/O thread)
+ */
+static void vhost_call_handler(int fd, uint32_t events, void *opaque)
+{
+    struct virtqueue *vq = opaque;
+    uint64_t count;
+
+    (void)events;
+
+    if (read(fd, &count, sizeof(count)) < 0)
+        return;
+
+    pthread_mutex_lock(&vq->lock);
+    virtqueue_interrupt(vq);
+    pthread_mutex_unlock(&vq->lock);
+}
+
+/*
+ * Program one ring: size, position, addresses and both eventfds
+ */
+static int vhost_vring_start(struct vhost_dev *hdev, int n)
+{
+    struct virtqueue *vq = &hdev->vdev->queues[hdev->first_vq + n];
+    struct vhost_vring_state state = { .index = n };
+    struct vhost_vring_addr addr = { .index = n };
+    struct vhost_vring_file file = { .index = n };
+
+    if (!vq->ready || vq->packed || !vq->iothread) {
+        log_error("%s: queue %d can't be handed to vhost",
+                  hdev->vdev->device.name, vq->index);
+        return -1;
+    }
+
+    state.num = vq->size;
+    if (vhost_dev_request(hdev, VHOST_SET_VRING_NUM, &state) < 0) {
+        perror("vhost SET_VRING_NUM");
+        return -1;
+    }
+
+    state.num = vq->last_avail_idx;
+    if (vhost_dev_request(hdev, VHOST_SET_VRING_BASE, &state) < 0) {
+        perror("vhost SET_VRING_BASE");
+        return -1;
+    }
+
+    addr.desc_user_addr = (uintptr_t)vq->desc;
+    addr.avail_user_addr = (uintptr_t)vq->avail;
+    addr.used_user_addr = (uintptr_t)vq->used;
+    if (vhost_dev_request(hdev, VHOST_SET_VRING_ADDR, &addr) < 0) {
+        perror("vhost SET_VRING_ADDR");
+        return -1;
+    }
+
+    /* Calls become interrupts on the queue's I/O thread */
+    hdev->call_fds[n] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (hdev->call_fds[n] < 0) {
+        perror("eventfd");
+        return -1;
+    }
+    if (iothread_add_fd(vq->iothread, hdev->call_fds[n], EPOLLIN,
+                        vhost_call_handler, vq) < 0)
+        goto err_call;
+
+    file.fd = hdev->call_fds[n];
+    if (vhost_dev_request(hdev, VHOST_SET_VRING_CALL, &file) < 0) {
+        perror("vhost SET_VRING_CALL");
+        goto err_handler;
+    }
+
+    /* Guest kicks (ioeventfd or the MMIO fallback) now wake the backend */
+    if (virtqueue_set_kick_external(vq, 1) < 0)
+        goto err_handler;
+
+    file.fd = vq->kick_fd;
+    if (vhost_dev_request(hdev, VHOST_SET_VRING_KICK, &file) < 0) {
+        perror("vhost SET_VRING_KICK");
+        virtqueue_set_kick_external(vq, 0);
+        goto err_handler;
+    }
+
+    return 0;
+
+err_handler:
+    iothread_del_fd(vq->iothread, hdev->call_fds[n]);
+err_call:
+    close(hdev->call_fds[n]);
+    hdev->call_fds[n] = -1;
+    return -1;
+}
+
+/*
+ * Stop one ring and undo the above. The backend returns its position,
+ * which becomes ours, so the userspace datapath (or a later start)
+ * carries on from where the backend left off.
+ */
+static void vhost_vring_stop(struct vhost_dev *hdev, int n)
+{
+    struct virtqueue *vq = &hdev->vdev->queues[hdev->first_vq + n];
+    struct vhost_vring_state state = { .index = n };
+    struct vhost_vring_file file = { .index = n, .fd = -1 };
+
+    if (hdev->call_fds[n] < 0)
+        return;
+
+    if (vhost_dev_request(hdev, VHOST_GET_VRING_BASE, &state) < 0) {
+        perror("vhost GET_VRING_BASE");
+    } else {
+        pthread_mutex_lock(&vq->lock);
+        vq->last_avail_idx = state.num;
+        vq->shadow_avail_idx = state.num;
+        if (vq->used) {
+            vq->last_used_idx = __atomic_load_n(&vq->used->idx, __ATOMIC_ACQUIRE);
+            vq->used_pending = 0;
+            vq->signalled_used_valid = 0;
+        }
+        pthread_mutex_unlock(&vq->lock);
+    }
+
+    vhost_dev_request(hdev, VHOST_SET_VRING_KICK, &file);
+    vhost_dev_request(hdev, VHOST_SET_VRING_CALL, &file);
+    virtqueue_set_kick_external(vq, 0);
+
+    if (vq->iothread)
+        iothread_del_fd(vq->iothread, hdev->call_fds[n]);
+    close(hdev->call_fds[n]);
+    hdev->call_fds[n] = -1;
+}
+
+int vhost_dev_start(struct vhost_dev *hdev, struct virtio_dev *vdev,
+                    int first_vq, int nvqs)
+{
+    uint64_t features = vdev->driver_features & hdev->features;
+    int i;
+
+    if (nvqs > VHOST_MAX_VQS)
+        return -1;
+
+    hdev->vdev = vdev;
+    hdev->first_vq = first_vq;
+    hdev->nvqs = nvqs;
+    for (i = 0; i < nvqs; i++)
+        hdev->call_fds[i] = -1;
+
+    if (vhost_dev_request(hdev, VHOST_SET_FEATURES, &features) < 0) {
+        perror("vhost SET_FEATURES");
+        return -1;
+    }
+
+    if (vhost_set_mem_table(hdev, vdev->device.vm) < 0)
+        return -1;
+
+    for (i = 0; i < nvqs; i++) {
+        if (vhost_vring_start(hdev, i) < 0)
+            goto err;
+    }
+
+    hdev->started = 1;
+    for (i = 0; i < nvqs; i++)
+        vhost_dev_set_vring_enable(hdev, i, 1);
+    return 0;
+
+err:
+    while (--i >= 0)
+        vhost_vring_stop(hdev, i);
+    return -1;
+}
+
+void vhost_dev_stop(struct vhost_dev *hdev)
+{
+    int i;
+
+    if (!hdev->started)
+        return;
+
+    for (i = 0; i < hdev->nvqs; i++)
+        vhost_vring_stop(hdev, i);
+
+    hdev->started = 0;
+}
+
+int vhost_net_set_backend(struct vhost_dev *hdev, int index, int fd)
+{
+    struct vhost_vring_file file = { .index = index, .fd = fd };
+
+    if (vhost_dev_request(hdev, VHOST_NET_SET_BACKEND, &file) < 0) {
+        perror("vhost NET_SET_BACKEND");
+        return -1;
+    }
+    return 0;
+}
+
+int vhost_dev_set_vring_enable(struct vhost_dev *hdev, int n, int enable)
+{
+    if (!hdev->ops->set_vring_enable)
+        return 0;
+    return hdev->ops->set_vring_enable(hdev, n, enable);
+}
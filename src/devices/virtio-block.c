@@ -4,12 +4,16 @@
 
 #include "virtio.h"
 #include "vm.h"
+#include "uring.h"
+#include "iothread.h"
 #include "utils.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -21,6 +25,7 @@
 #define VIRTIO_BLK_F_RO        5
 #define VIRTIO_BLK_F_BLK_SIZE  6
 #define VIRTIO_BLK_F_FLUSH     9
+#define VIRTIO_BLK_F_MQ        12
 
 /* Virtio block request types */
 #define VIRTIO_BLK_T_IN        0
@@ -43,6 +48,15 @@ struct virtio_blk_config {
         uint8_t  sectors;
     } geometry;
     uint32_t blk_size;
+    struct {
+        uint8_t  physical_block_exp;
+        uint8_t  alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t  writeback;
+    uint8_t  unused0;
+    uint16_t num_queues;        /* VIRTIO_BLK_F_MQ */
 } PACKED;
 
 /* Virtio block request */
@@ -52,12 +66,76 @@ struct virtio_blk_req {
     uint64_t sector;
 };
 
+/* Most request queues (queues=N) */
+#define VIRTIO_BLK_MAX_QUEUES   8
+
+/* Request offsets are always in 512-byte sectors */
+#define VIRTIO_BLK_SECTOR_SIZE  512
+
+/*
+ * io_uring submission queue depth. The completion queue is twice this, so
+ * it can hold a completion for every request a full-size queue can have
+ * in flight.
+ */
+#define VIRTIO_BLK_URING_DEPTH  (VIRTQUEUE_MAX_SIZE / 2)
+
+/* I/O engines */
+enum virtio_blk_aio {
+    VIRTIO_BLK_AIO_SYNC,        /* preadv/pwritev on the I/O thread */
+    VIRTIO_BLK_AIO_IO_URING,    /* Batched submission through io_uring */
+};
+
+struct virtio_blk_state;
+
+/* Request being processed */
+struct virtio_blk_io {
+    struct virtqueue *vq;
+    struct virtqueue_elem elem;
+    uint32_t type;
+    uint64_t offset;            /* Byte offset in the image */
+    struct iovec *data;         /* Data segments (points into elem) */
+    int      data_cnt;
+    uint64_t len;               /* A chain can carry more than 4 GiB */
+    uint8_t *status;
+    struct virtio_blk_io *next; /* Free list */
+};
+
+/*
+ * Per request queue state. Queues share nothing but the image fd: each has
+ * its own io_uring instance and request slots, and is served by its
+ * virtqueue's I/O thread under the virtqueue's lock.
+ */
+struct virtio_blk_queue {
+    struct virtio_blk_state *s;
+    struct virtqueue *vq;
+    struct uring *ring;
+    struct iothread *iothread;  /* Thread reaping completions */
+    int      num_fixed;
+    int      inflight;
+    int      throttled;         /* Stopped draining: out of request slots */
+
+    /* Request slots: a driver can't have more requests out than its queue size */
+    struct virtio_blk_io *ios;
+    struct virtio_blk_io *free_ios;
+};
+
 /* Virtio block device state */
 struct virtio_blk_state {
     struct virtio_blk_config config;
     int      disk_fd;
     uint64_t disk_size;
     uint32_t blk_size;
+
+    /* I/O engine */
+    enum virtio_blk_aio aio;
+    int      direct;            /* Image opened with O_DIRECT */
+    int      fixed;             /* Register guest RAM as fixed buffers */
+    uint32_t coalesce_usecs;    /* Interrupt moderation (0: off) */
+    uint32_t coalesce_frames;
+
+    /* Request queues */
+    uint32_t num_queues;
+    struct virtio_blk_queue queues[VIRTIO_BLK_MAX_QUEUES];
 };
 
 /* Default GPA for virtio block */
@@ -97,6 +175,9 @@ static int virtio_blk_config_read(struct virtio_dev *vdev,
     case 0x18:  /* blk_size */
         *(uint32_t *)data = cfg->blk_size;
         break;
+    case 0x22:  /* num_queues */
+        *(uint16_t *)data = cfg->num_queues;
+        break;
     default:
         memset(data, 0, size);
         break;
@@ -106,103 +187,325 @@ static int virtio_blk_config_read(struct virtio_dev *vdev,
 }
 
 /*
- * Handle queue notification
+ * Parse a request chain
+ *
+ * The chain is a 16-byte header, data segments and a one-byte status
+ * (the last writable byte). Data segments are used in place.
  */
-static int virtio_blk_queue_notify(struct virtio_dev *vdev,
-                                    struct virtqueue *vq)
+static int virtio_blk_parse(struct virtio_blk_io *io)
 {
-    struct vm *vm = vdev->device.vm;
-    struct virtio_blk_state *s = vdev->priv;
-    struct vring_desc *desc;
+    struct virtqueue_elem *elem = &io->elem;
+    struct iovec *out = virtqueue_elem_out(elem);
+    struct iovec *in = virtqueue_elem_in(elem);
+    int out_num = elem->out_num, in_num = elem->in_num;
     struct virtio_blk_req req;
-    void *req_hva, *data_hva, *status_hva;
-    uint8_t status;
-    ssize_t ret;
-
-    /* Pop request descriptor */
-    desc = virtqueue_pop(vq);
-    if (!desc)
-        return 0;
+    struct iovec *last;
 
-    /* Read request header */
-    req_hva = vm_gpa_to_hva(vm, desc->addr, sizeof(req));
-    if (!req_hva) {
-        log_error("Failed to translate request GPA");
+    if (iov_to_buf(out, out_num, 0, &req, sizeof(req)) != sizeof(req)) {
+        log_error("Block request header too short");
         return -1;
     }
+    iov_discard_front(&out, &out_num, sizeof(req));
 
-    memcpy(&req, req_hva, sizeof(req));
-
-    /* Get data descriptor (next in chain) */
-    if (!(desc->flags & VRING_DESC_F_NEXT)) {
-        log_error("Block request has no data descriptor");
+    if (in_num == 0) {
+        log_error("Block request has no status byte");
         return -1;
     }
+    last = &in[in_num - 1];
+    io->status = (uint8_t *)last->iov_base + last->iov_len - 1;
+    iov_discard_back(in, &in_num, 1);
 
-    desc = &vq->desc[desc->next];
-    data_hva = vm_gpa_to_hva(vm, desc->addr, desc->len);
-    if (!data_hva) {
-        log_error("Failed to translate data GPA");
-        return -1;
-    }
+    io->type = req.type;
+    io->offset = req.sector * VIRTIO_BLK_SECTOR_SIZE;
+    if (req.sector > UINT64_MAX / VIRTIO_BLK_SECTOR_SIZE)
+        io->offset = UINT64_MAX;    /* Fails the range check */
 
-    /* Get status descriptor */
-    if (!(desc->flags & VRING_DESC_F_NEXT)) {
-        log_error("Data descriptor has no status descriptor");
-        return -1;
+    switch (io->type) {
+    case VIRTIO_BLK_T_IN:
+        io->data = in;
+        io->data_cnt = in_num;
+        break;
+    case VIRTIO_BLK_T_OUT:
+        io->data = out;
+        io->data_cnt = out_num;
+        break;
+    default:
+        io->data = NULL;
+        io->data_cnt = 0;
+        break;
     }
+    io->len = iov_size(io->data, io->data_cnt);
 
-    desc = &vq->desc[desc->next];
-    status_hva = vm_gpa_to_hva(vm, desc->addr, 1);
-    if (!status_hva) {
-        log_error("Failed to translate status GPA");
-        return -1;
+    return 0;
+}
+
+/*
+ * Check that a read or write stays inside the image
+ */
+static int virtio_blk_in_range(struct virtio_blk_state *s, struct virtio_blk_io *io)
+{
+    if (io->type != VIRTIO_BLK_T_IN && io->type != VIRTIO_BLK_T_OUT)
+        return 1;
+
+    return io->offset <= s->disk_size && io->len <= s->disk_size - io->offset;
+}
+
+/*
+ * Finish a request: write status and return the chain to the guest
+ */
+static void virtio_blk_complete_io(struct virtio_blk_queue *bq,
+                                   struct virtio_blk_io *io, int32_t res)
+{
+    uint32_t used = 1;
+    uint8_t status = VIRTIO_BLK_S_OK;
+
+    if (io->type != VIRTIO_BLK_T_IN && io->type != VIRTIO_BLK_T_OUT &&
+        io->type != VIRTIO_BLK_T_FLUSH) {
+        status = VIRTIO_BLK_S_UNSUPP;
+    } else if (res < 0) {
+        log_debug("Block request failed: %s", strerror(-res));
+        status = VIRTIO_BLK_S_IOERR;
+    } else if (io->type != VIRTIO_BLK_T_FLUSH && (uint64_t)res != io->len) {
+        log_warn("Short %s: %d != %lu",
+                 io->type == VIRTIO_BLK_T_IN ? "read" : "write", res, io->len);
     }
 
-    /* Handle request */
-    status = VIRTIO_BLK_S_OK;
+    if (io->type == VIRTIO_BLK_T_IN && res > 0)
+        used += res;
+
+    *io->status = status;
+    virtqueue_fill(io->vq, io->elem.head, used);
+
+    io->next = bq->free_ios;
+    bq->free_ios = io;
+}
+
+/*
+ * Execute a request synchronously
+ */
+static int32_t virtio_blk_do_sync(struct virtio_blk_state *s,
+                                  struct virtio_blk_io *io)
+{
+    ssize_t ret;
 
-    switch (req.type) {
+    switch (io->type) {
     case VIRTIO_BLK_T_IN:
-        /* Read from disk */
-        ret = pread(s->disk_fd, data_hva, desc->len, req.sector * s->blk_size);
-        if (ret < 0) {
-            perror("pread");
-            status = VIRTIO_BLK_S_IOERR;
-        } else if ((size_t)ret != desc->len) {
-            log_warn("Short read: %zd != %d", ret, desc->len);
-        }
+        ret = preadv(s->disk_fd, io->data, io->data_cnt, io->offset);
         break;
-
     case VIRTIO_BLK_T_OUT:
-        /* Write to disk */
-        ret = pwrite(s->disk_fd, data_hva, desc->len, req.sector * s->blk_size);
-        if (ret < 0) {
-            perror("pwrite");
-            status = VIRTIO_BLK_S_IOERR;
-        } else if ((size_t)ret != desc->len) {
-            log_warn("Short write: %zd != %d", ret, desc->len);
-        }
+        ret = pwritev(s->disk_fd, io->data, io->data_cnt, io->offset);
         break;
-
     case VIRTIO_BLK_T_FLUSH:
-        /* Flush - not implemented */
-        status = VIRTIO_BLK_S_OK;
+        ret = fdatasync(s->disk_fd);
         break;
-
     default:
-        log_warn("Unknown block request type: %u", req.type);
-        status = VIRTIO_BLK_S_UNSUPP;
+        log_warn("Unknown block request type: %u", io->type);
+        return 0;
+    }
+
+    return ret < 0 ? -errno : (int32_t)ret;
+}
+
+/*
+ * Queue a request on the ring. Returns -1 if it must run synchronously.
+ */
+static int virtio_blk_prep(struct virtio_blk_queue *bq, struct virtio_blk_io *io)
+{
+    struct virtio_blk_state *s = bq->s;
+    uint64_t user_data = (uintptr_t)io;
+    enum uring_op op;
+    int buf_index;
+
+    switch (io->type) {
+    case VIRTIO_BLK_T_IN:
+        op = URING_OP_READ;
+        break;
+    case VIRTIO_BLK_T_OUT:
+        op = URING_OP_WRITE;
         break;
+    case VIRTIO_BLK_T_FLUSH:
+        return uring_prep(bq->ring, URING_OP_FDATASYNC, s->disk_fd, NULL, 0, 0,
+                          -1, user_data);
+    default:
+        return -1;
     }
 
-    /* Write status */
-    *(uint8_t *)status_hva = status;
+    /* Fixed buffers only cover single-segment transfers */
+    if (io->data_cnt == 1 && bq->num_fixed) {
+        buf_index = uring_find_buffer(bq->ring, io->data[0].iov_base, io->len);
+        if (buf_index >= 0)
+            return uring_prep(bq->ring, op, s->disk_fd, io->data[0].iov_base,
+                              io->len, io->offset, buf_index, user_data);
+    }
 
-    /* Complete request */
-    virtqueue_push(vq, 0, 1);
+    return uring_prepv(bq->ring, op, s->disk_fd, io->data, io->data_cnt,
+                       io->offset, user_data);
+}
 
-    return 0;
+/*
+ * Handle queue notification: drain the avail ring. With io_uring every
+ * request is queued and the batch is submitted with one io_uring_enter;
+ * completions are reaped on the I/O thread.
+ */
+static int virtio_blk_queue_notify(struct virtio_dev *vdev,
+                                    struct virtqueue *vq)
+{
+    struct virtio_blk_state *s = vdev->priv;
+    struct virtio_blk_queue *bq = &s->queues[vq->index];
+    int ret = 0;
+
+    for (;;) {
+        struct virtio_blk_io *io = bq->free_ios;
+
+        if (!io) {
+            /* Resumed from the completion handler */
+            bq->throttled = 1;
+            break;
+        }
+
+        if (!virtqueue_pop_chain(vq, &io->elem))
+            break;
+        bq->free_ios = io->next;
+        io->vq = vq;
+
+        if (virtio_blk_parse(io) < 0) {
+            virtqueue_fill(vq, io->elem.head, 0);
+            io->next = bq->free_ios;
+            bq->free_ios = io;
+            continue;
+        }
+
+        if (!virtio_blk_in_range(s, io)) {
+            log_debug("Block request out of range: 0x%lx+%lu", io->offset, io->len);
+            virtio_blk_complete_io(bq, io, -EIO);
+            continue;
+        }
+
+        if (bq->ring) {
+            /* Submission queue full: flush what we have and carry on */
+            if (uring_sq_space(bq->ring) == 0 && uring_submit(bq->ring) < 0)
+                ret = -1;
+
+            if (virtio_blk_prep(bq, io) == 0) {
+                bq->inflight++;
+                continue;
+            }
+        }
+
+        virtio_blk_complete_io(bq, io, virtio_blk_do_sync(s, io));
+    }
+
+    if (bq->ring && uring_submit(bq->ring) < 0)
+        ret = -1;
+
+    return ret;
+}
+
+/*
+ * Completion callback for one CQE (queue lock held)
+ */
+static void virtio_blk_uring_done(void *opaque, uint64_t user_data, int32_t res)
+{
+    struct virtio_blk_queue *bq = opaque;
+    struct virtio_blk_io *io = (struct virtio_blk_io *)(uintptr_t)user_data;
+
+    bq->inflight--;
+    virtio_blk_complete_io(bq, io, res);
+}
+
+/*
+ * Completion eventfd handler (runs on the queue's I/O thread)
+ */
+static void virtio_blk_uring_handler(int fd, uint32_t events, void *opaque)
+{
+    struct virtio_blk_queue *bq = opaque;
+    struct virtqueue *vq = bq->vq;
+    struct virtio_dev *vdev = container_of(vq->dev, struct virtio_dev, device);
+    uint64_t count;
+
+    (void)events;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+
+    pthread_mutex_lock(&vq->lock);
+
+    uring_reap(bq->ring, virtio_blk_uring_done, bq);
+
+    if (bq->throttled) {
+        bq->throttled = 0;
+        virtio_blk_queue_notify(vdev, vq);
+    }
+
+    /* One used->idx update and one interrupt for the whole batch */
+    if (virtqueue_flush(vq))
+        virtqueue_notify(vq);
+
+    pthread_mutex_unlock(&vq->lock);
+}
+
+/*
+ * Register guest RAM as fixed buffers
+ */
+static void virtio_blk_register_ram(struct virtio_blk_queue *bq, struct vm *vm)
+{
+    struct iovec *iov;
+    int i, n = 0;
+
+    iov = calloc(vm->num_mem_regions, sizeof(*iov));
+    if (!iov)
+        return;
+
+    for (i = 0; i < vm->num_mem_regions; i++) {
+        if (!vm->mem_regions[i].used)
+            continue;
+        iov[n].iov_base = vm->mem_regions[i].hva;
+        iov[n].iov_len = vm->mem_regions[i].size;
+        n++;
+    }
+
+    bq->num_fixed = n ? uring_register_buffers(bq->ring, iov, n) : 0;
+    if (bq->num_fixed < 0) {
+        log_warn("Failed to register guest RAM with io_uring (%s), "
+                 "using unregistered buffers", strerror(errno));
+        bq->num_fixed = 0;
+    } else {
+        log_debug("Registered guest RAM as %d io_uring buffers", bq->num_fixed);
+    }
+
+    free(iov);
+}
+
+/*
+ * Wait for a queue's in-flight requests (queue lock not held)
+ */
+static void virtio_blk_drain(struct virtio_blk_queue *bq)
+{
+    pthread_mutex_lock(&bq->vq->lock);
+    while (bq->inflight > 0) {
+        if (uring_wait(bq->ring, 1) < 0) {
+            perror("io_uring_enter(GETEVENTS)");
+            break;
+        }
+        uring_reap(bq->ring, virtio_blk_uring_done, bq);
+    }
+    bq->throttled = 0;
+    virtqueue_flush(bq->vq);
+    pthread_mutex_unlock(&bq->vq->lock);
+}
+
+/*
+ * Device reset: let every queue's in-flight I/O land before its ring goes
+ */
+static void virtio_blk_reset_drain(struct virtio_dev *vdev)
+{
+    struct virtio_blk_state *s = vdev->priv;
+    uint32_t i;
+
+    for (i = 0; i < s->num_queues; i++) {
+        if (s->queues[i].ring)
+            virtio_blk_drain(&s->queues[i]);
+    }
 }
 
 /* Device operations */
@@ -220,16 +523,141 @@ static int virtio_blk_write(struct device *dev, uint64_t offset,
     return virtio_mmio_write(vdev, offset, data, size);
 }
 
+static void virtio_blk_detach(struct device *dev);
+
+/*
+ * Completions of each queue are reaped on the I/O thread that takes its
+ * kicks, so a request never leaves its queue's thread
+ */
+static int virtio_blk_attach(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    struct virtio_blk_state *s = vdev->priv;
+    uint32_t i;
+
+    if (virtio_attach(dev) < 0)
+        return -1;
+
+    for (i = 0; i < s->num_queues; i++) {
+        struct virtio_blk_queue *bq = &s->queues[i];
+
+        if (!bq->ring)
+            continue;
+
+        if (s->fixed)
+            virtio_blk_register_ram(bq, dev->vm);
+
+        if (iothread_add_fd(bq->vq->iothread, uring_event_fd(bq->ring), EPOLLIN,
+                            virtio_blk_uring_handler, bq) < 0) {
+            virtio_blk_detach(dev);
+            return -1;
+        }
+        bq->iothread = bq->vq->iothread;
+    }
+
+    return 0;
+}
+
+static void virtio_blk_detach(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    struct virtio_blk_state *s = vdev->priv;
+    uint32_t i;
+
+    /* Stop new kicks first, then let in-flight I/O land in guest memory */
+    virtio_detach(dev);
+
+    for (i = 0; i < s->num_queues; i++) {
+        struct virtio_blk_queue *bq = &s->queues[i];
+
+        if (bq->iothread) {
+            iothread_del_fd(bq->iothread, uring_event_fd(bq->ring));
+            bq->iothread = NULL;
+            virtio_blk_drain(bq);
+        }
+    }
+}
+
+/*
+ * Free request slots and rings of all queues
+ */
+static void virtio_blk_free_queues(struct virtio_blk_state *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->num_queues; i++) {
+        struct virtio_blk_queue *bq = &s->queues[i];
+
+        if (bq->ring)
+            uring_destroy(bq->ring);
+        bq->ring = NULL;
+        free(bq->ios);
+        bq->ios = NULL;
+        bq->free_ios = NULL;
+    }
+}
+
+/*
+ * Allocate request slots and, with aio=io_uring, one ring per queue.
+ * If any ring can't be created the whole device falls back to sync I/O.
+ */
+static int virtio_blk_alloc_queues(struct virtio_blk_state *s)
+{
+    uint32_t i;
+    int j;
+
+    for (i = 0; i < s->num_queues; i++) {
+        struct virtio_blk_queue *bq = &s->queues[i];
+
+        bq->s = s;
+        bq->ios = calloc(VIRTQUEUE_MAX_SIZE, sizeof(*bq->ios));
+        if (!bq->ios) {
+            virtio_blk_free_queues(s);
+            return -1;
+        }
+        for (j = VIRTQUEUE_MAX_SIZE - 1; j >= 0; j--) {
+            bq->ios[j].next = bq->free_ios;
+            bq->free_ios = &bq->ios[j];
+        }
+    }
+
+    if (s->aio != VIRTIO_BLK_AIO_IO_URING)
+        return 0;
+
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].ring = uring_create(VIRTIO_BLK_URING_DEPTH);
+        if (!s->queues[i].ring) {
+            log_warn("io_uring unavailable (%s), using synchronous disk I/O",
+                     strerror(errno));
+            s->aio = VIRTIO_BLK_AIO_SYNC;
+            break;
+        }
+    }
+
+    if (s->aio == VIRTIO_BLK_AIO_SYNC) {
+        for (i = 0; i < s->num_queues; i++) {
+            if (s->queues[i].ring)
+                uring_destroy(s->queues[i].ring);
+            s->queues[i].ring = NULL;
+        }
+    }
+
+    return 0;
+}
+
 static void virtio_blk_destroy(struct device *dev)
 {
     struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
     struct virtio_blk_state *s = vdev->priv;
 
+    if (s)
+        virtio_blk_free_queues(s);
     if (s && s->disk_fd >= 0)
         close(s->disk_fd);
 
     virtio_cleanup(vdev);
     free(s);
+    free(vdev->device.name);
     free(vdev);
 }
 
@@ -237,17 +665,91 @@ static const struct device_ops virtio_blk_ops = {
     .name = "virtio-block",
     .read = virtio_blk_read,
     .write = virtio_blk_write,
+    .attach = virtio_blk_attach,
+    .detach = virtio_blk_detach,
     .destroy = virtio_blk_destroy,
+    .print_stats = virtio_print_stats,
+    .irq_pending = virtio_irq_pending,
 };
 
+/*
+ * Parse "path[,aio=io_uring|sync][,direct=on|off][,fixed=on|off]
+ *       [,queues=N][,coalesce-usecs=N][,coalesce-frames=N]"
+ * Returns the path (caller frees) or NULL on error.
+ */
+static char* virtio_blk_parse_opts(const char *spec, struct virtio_blk_state *s)
+{
+    char *path, *opt, *save = NULL;
+    int fixed = -1, ret;
+
+    path = strdup(spec);
+    if (!path)
+        return NULL;
+
+    opt = strchr(path, ',');
+    if (!opt)
+        return path;
+    *opt++ = '\0';
+
+    for (opt = strtok_r(opt, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+        if (strcmp(opt, "aio=io_uring") == 0) {
+            s->aio = VIRTIO_BLK_AIO_IO_URING;
+        } else if (strcmp(opt, "aio=sync") == 0) {
+            s->aio = VIRTIO_BLK_AIO_SYNC;
+        } else if (strcmp(opt, "direct=on") == 0) {
+            s->direct = 1;
+        } else if (strcmp(opt, "direct=off") == 0) {
+            s->direct = 0;
+        } else if (strcmp(opt, "fixed=on") == 0) {
+            fixed = 1;
+        } else if (strcmp(opt, "fixed=off") == 0) {
+            fixed = 0;
+        } else if ((ret = virtio_parse_uint_opt(opt, "queues",
+                                                &s->num_queues)) != 0 ||
+                   (ret = virtio_parse_uint_opt(opt, "coalesce-usecs",
+                                                &s->coalesce_usecs)) != 0 ||
+                   (ret = virtio_parse_uint_opt(opt, "coalesce-frames",
+                                                &s->coalesce_frames)) != 0) {
+            if (ret < 0) {
+                free(path);
+                return NULL;
+            }
+        } else {
+            log_error("Unknown disk option: %s", opt);
+            free(path);
+            return NULL;
+        }
+    }
+
+    if (s->num_queues < 1 || s->num_queues > VIRTIO_BLK_MAX_QUEUES) {
+        log_error("Invalid number of disk queues: %u (1-%d)",
+                  s->num_queues, VIRTIO_BLK_MAX_QUEUES);
+        free(path);
+        return NULL;
+    }
+
+    if (virtio_check_coalescing("coalesce-frames", s->coalesce_frames,
+                                "coalesce-usecs", s->coalesce_usecs) < 0) {
+        free(path);
+        return NULL;
+    }
+
+    /* Registered buffers pay off most with O_DIRECT (no per-I/O page pinning) */
+    s->fixed = fixed >= 0 ? fixed : s->direct;
+    return path;
+}
+
 /*
  * Create virtio block device
  */
-struct device* virtio_blk_create(const char *disk_path)
+struct device* virtio_blk_create(const char *disk_spec)
 {
     struct virtio_dev *vdev;
     struct virtio_blk_state *s;
     struct stat st;
+    char *path;
+    uint32_t i;
+    int flags;
 
     vdev = calloc(1, sizeof(*vdev));
     if (!vdev)
@@ -259,13 +761,24 @@ struct device* virtio_blk_create(const char *disk_path)
         return NULL;
     }
 
+    s->aio = VIRTIO_BLK_AIO_IO_URING;
+    s->num_queues = 1;
+    path = virtio_blk_parse_opts(disk_spec, s);
+    if (!path) {
+        free(s);
+        free(vdev);
+        return NULL;
+    }
+
     /* Open disk image */
-    s->disk_fd = open(disk_path, O_RDWR);
+    flags = s->direct ? O_DIRECT : 0;
+    s->disk_fd = open(path, O_RDWR | flags);
     if (s->disk_fd < 0) {
         /* Try read-only */
-        s->disk_fd = open(disk_path, O_RDONLY);
+        s->disk_fd = open(path, O_RDONLY | flags);
         if (s->disk_fd < 0) {
             perror("open disk image");
+            free(path);
             free(s);
             free(vdev);
             return NULL;
@@ -277,6 +790,16 @@ struct device* virtio_blk_create(const char *disk_path)
     if (fstat(s->disk_fd, &st) < 0) {
         perror("fstat");
         close(s->disk_fd);
+        free(path);
+        free(s);
+        free(vdev);
+        return NULL;
+    }
+
+    /* Request slots and rings; falls back to sync I/O without io_uring */
+    if (virtio_blk_alloc_queues(s) < 0) {
+        close(s->disk_fd);
+        free(path);
         free(s);
         free(vdev);
         return NULL;
@@ -288,19 +811,34 @@ struct device* virtio_blk_create(const char *disk_path)
     /* Initialize config */
     s->config.capacity = s->disk_size / s->blk_size;
     s->config.size_max = 65535;  /* Maximum segment size */
-    s->config.seg_max = 128;     /* Maximum segments in request */
+    s->config.seg_max = 128;     /* Maximum segments in request (< VIRTQUEUE_MAX_SEGS) */
     s->config.blk_size = s->blk_size;
+    s->config.num_queues = s->num_queues;
 
-    log_info("Disk image: %s (%ld MB, %ld sectors)",
-             disk_path, s->disk_size / (1024 * 1024), s->config.capacity);
+    log_info("Disk image: %s (%ld MB, %ld sectors, aio=%s%s, %u queue%s)",
+             path, s->disk_size / (1024 * 1024), s->config.capacity,
+             s->aio == VIRTIO_BLK_AIO_IO_URING ? "io_uring" : "sync",
+             s->direct ? ", O_DIRECT" : "",
+             s->num_queues, s->num_queues > 1 ? "s" : "");
+    free(path);
 
     /* Initialize virtio device */
     virtio_init(vdev, VIRTIO_ID_BLOCK);
+    vdev->device_features |= 1ULL << VIRTIO_BLK_F_SEG_MAX;
+    if (s->num_queues > 1)
+        vdev->device_features |= 1ULL << VIRTIO_BLK_F_MQ;
 
     vdev->priv = s;
     vdev->config_read = virtio_blk_config_read;
     vdev->config_write = NULL;
+    virtio_setup_queues(vdev, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].vq = &vdev->queues[i];
+        virtqueue_set_coalescing(&vdev->queues[i], s->coalesce_frames,
+                                 s->coalesce_usecs);
+    }
     vdev->queue_notify = virtio_blk_queue_notify;
+    vdev->drain = virtio_blk_reset_drain;
 
     /* Setup device */
     vdev->device.ops = &virtio_blk_ops;
@@ -23,6 +23,7 @@ struct virtio_console_state {
     struct virtio_console_config config;
     struct virtqueue *rx_vq;
     struct virtqueue *tx_vq;
+    struct virtqueue_elem elem;     /* Chain being written out */
 };
 
 /* Default GPA for virtio console */
@@ -88,31 +89,25 @@ static int virtio_console_config_write(struct virtio_dev *vdev,
 static int virtio_console_queue_notify(struct virtio_dev *vdev,
                                         struct virtqueue *vq)
 {
-    struct vm *vm = vdev->device.vm;
-    struct vring_desc *desc;
-    void *hva;
-    uint8_t *data;
-    uint32_t len;
+    struct virtio_console_state *s = vdev->priv;
+    struct virtqueue_elem *elem = &s->elem;
+    int i;
 
-    /* Process TX queue (guest -> host) */
-    while ((desc = virtqueue_pop(vq)) != NULL) {
-        hva = vm_gpa_to_hva(vm, desc->addr, desc->len);
-        if (!hva) {
-            log_error("Failed to translate GPA 0x%lx", desc->addr);
-            continue;
-        }
+    /* Receive buffers stay queued: there is no host input yet */
+    if (vq != s->tx_vq)
+        return 0;
 
-        data = hva;
-        len = desc->len;
+    /* Process TX queue (guest -> host) */
+    while (virtqueue_pop_chain(vq, elem)) {
+        struct iovec *out = virtqueue_elem_out(elem);
 
         /* Write to stdout */
-        for (uint32_t i = 0; i < len; i++) {
-            putchar(data[i]);
-        }
+        for (i = 0; i < elem->out_num; i++)
+            fwrite(out[i].iov_base, 1, out[i].iov_len, stdout);
         fflush(stdout);
 
-        /* Complete the request */
-        virtqueue_push(vq, desc - vq->desc, len);
+        /* Complete the request (nothing written back to the guest) */
+        virtqueue_fill(vq, elem->head, 0);
     }
 
     return 0;
@@ -138,6 +133,7 @@ static void virtio_console_destroy(struct device *dev)
     struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
     virtio_cleanup(vdev);
     free(vdev->priv);
+    free(vdev->device.name);
     free(vdev);
 }
 
@@ -145,7 +141,11 @@ static const struct device_ops virtio_console_ops = {
     .name = "virtio-console",
     .read = virtio_console_read,
     .write = virtio_console_write,
+    .attach = virtio_attach,
+    .detach = virtio_detach,
     .destroy = virtio_console_destroy,
+    .print_stats = virtio_print_stats,
+    .irq_pending = virtio_irq_pending,
 };
 
 /*
@@ -178,6 +178,9 @@ struct device* virtio_console_create(void)
     vdev->priv = s;
     vdev->config_read = virtio_console_config_read;
     vdev->config_write = virtio_console_config_write;
+    virtio_setup_queues(vdev, 2);
+    s->rx_vq = &vdev->queues[0];
+    s->tx_vq = &vdev->queues[1];
     vdev->queue_notify = virtio_console_queue_notify;
 
     /* Setup device */
@@ -4,6 +4,9 @@
 
 #include "virtio.h"
 #include "vm.h"
+#include "iothread.h"
+#include "uring.h"
+#include "vhost.h"
 #include "utils.h"
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +17,8 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
 #include <errno.h>
 
 #ifdef __linux__
@@ -24,9 +29,54 @@
 #include <net/if.h>
 #define IFF_TAP 0x0001
 #define IFF_NO_PI 0x1000
+#define IFF_MULTI_QUEUE 0x0100
+#define IFF_ATTACH_QUEUE 0x0200
+#define IFF_DETACH_QUEUE 0x0400
+#define IFF_VNET_HDR 0x4000
 #define TUNSETIFF  _IOR('T', 202, int)
+#define TUNSETOFFLOAD _IOW('T', 208, unsigned int)
+#define TUNSETVNETHDRSZ _IOW('T', 216, int)
+#define TUNSETQUEUE _IOW('T', 217, int)
+#define TUN_F_CSUM 0x01
+#define TUN_F_TSO4 0x02
+#define TUN_F_TSO6 0x04
+#define TUN_F_TSO_ECN 0x08
+#define TUN_F_UFO 0x10
 #endif
 
+/* Offloads for packets from the guest: the TAP accepts them all */
+#define VIRTIO_NET_HOST_OFFLOADS \
+    ((1ULL << VIRTIO_NET_F_CSUM) | (1ULL << VIRTIO_NET_F_HOST_TSO4) | \
+     (1ULL << VIRTIO_NET_F_HOST_TSO6) | (1ULL << VIRTIO_NET_F_HOST_ECN) | \
+     (1ULL << VIRTIO_NET_F_HOST_UFO))
+
+/*
+ * Ring features vhost-net implements itself: offered only if the kernel
+ * has them. Offloads are the TAP's business and pass through.
+ */
+#define VIRTIO_NET_VHOST_FEATURES \
+    ((1ULL << VIRTIO_F_RING_INDIRECT_DESC) | (1ULL << VIRTIO_F_RING_EVENT_IDX) | \
+     (1ULL << VIRTIO_F_RING_PACKED) | (1ULL << VIRTIO_F_VERSION_1) | \
+     (1ULL << VIRTIO_NET_F_MRG_RXBUF))
+
+/* Control virtqueue commands */
+#define VIRTIO_NET_CTRL_MQ                  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET     0
+
+/* Control command status */
+#define VIRTIO_NET_OK   0
+#define VIRTIO_NET_ERR  1
+
+/* Most queue pairs (queues=N); each pair has its own TAP queue */
+#define VIRTIO_NET_MAX_QUEUE_PAIRS  8
+
+/* Largest frame the TAP can return: a 64 KiB GSO packet with VLAN tag */
+#define VIRTIO_NET_MAX_FRAME        (65535 + 14 + 4)
+#define VIRTIO_NET_FRAME_OVERHEAD   (14 + 4)
+
+/* Most TX packets sent with one io_uring_enter (at most 32, see tx_pending) */
+#define VIRTIO_NET_TX_BURST         32
+
 /* Virtio net configuration */
 struct virtio_net_config {
     uint8_t  mac[6];
@@ -34,7 +84,11 @@ struct virtio_net_config {
     uint16_t max_virtqueue_pairs;
 } PACKED;
 
-/* Virtio net header */
+/*
+ * Virtio net header (VIRTIO_F_VERSION_1 layout). The TAP reads and writes
+ * it in front of every packet (IFF_VNET_HDR), so it passes between guest
+ * and host untouched, except num_buffers, which the TAP leaves alone.
+ */
 struct virtio_net_hdr {
     uint8_t  flags;
     uint8_t  gso_type;
@@ -42,13 +96,95 @@ struct virtio_net_hdr {
     uint16_t gso_size;
     uint16_t csum_start;
     uint16_t csum_offset;
+    uint16_t num_buffers;
+};
+
+/* Control virtqueue command header */
+struct virtio_net_ctrl_hdr {
+    uint8_t  class;
+    uint8_t  cmd;
+} PACKED;
+
+/*
+ * RX/TX queue pair (virtqueues 2N and 2N + 1). Each pair owns one queue of
+ * a multi-queue TAP and shares an I/O thread with nothing else.
+ */
+struct virtio_net_queue {
+    struct virtio_dev *vdev;
+    struct virtqueue *rx_vq;
+    struct virtqueue *tx_vq;
+    int      tap_fd;
+    int      enabled;           /* TAP queue attached (IFF_ATTACH_QUEUE) */
+
+    /* Chains being processed (each under its queue's lock) */
+    struct virtqueue_elem rx_elem;
+    struct virtqueue_elem tx_elems[VIRTIO_NET_TX_BURST];
+
+    /*
+     * TX burst in flight on tx_ring, one bit per tx_elems entry not yet
+     * completed. Without a ring each packet is its own writev.
+     */
+    struct uring *tx_ring;
+    uint32_t tx_pending;
+
+    /*
+     * Mergeable RX buffers popped but not yet used. A packet is read into
+     * as many of them as it needs; the rest stay mapped for the next one.
+     */
+    struct {
+        uint16_t head;
+        uint32_t size;
+        int      iov_cnt;
+    } rx_bufs[VIRTQUEUE_MAX_SEGS];
+    int      rx_nbufs;
+    struct iovec rx_iov[VIRTQUEUE_MAX_SEGS];
+    int      rx_iov_cnt;
+    size_t   rx_size;           /* Bytes in rx_bufs */
+
+    /* Statistics (each under its queue's lock) */
+    uint64_t rx_packets;
+    uint64_t rx_syscalls;
+    uint64_t tx_packets;
+    uint64_t tx_syscalls;
+};
+
+/* Why an RX pass stopped */
+enum virtio_net_rx_status {
+    VIRTIO_NET_RX_PACKET,       /* Received one; keep going */
+    VIRTIO_NET_RX_EMPTY,        /* Nothing left on the TAP */
+    VIRTIO_NET_RX_NO_BUFS,      /* Guest has no buffers posted */
 };
 
 /* Virtio net device state */
 struct virtio_net_state {
     struct virtio_net_config config;
-    int      tap_fd;
     char     tap_name[IFNAMSIZ];
+
+    /*
+     * Queue pairs; the driver enables the first curr_queue_pairs. Changed
+     * from the control queue and on reset, under pairs_lock.
+     */
+    uint32_t max_queue_pairs;
+    uint16_t curr_queue_pairs;
+    pthread_mutex_t pairs_lock;
+    struct virtio_net_queue queues[VIRTIO_NET_MAX_QUEUE_PAIRS];
+    struct virtqueue_elem ctrl_elem;
+
+    /* Offloads (offload=on|off) and the guest offloads the TAP supports */
+    int      offload;
+    uint64_t guest_offloads;
+
+    /* VIRTIO_NET_F_MRG_RXBUF negotiated; buffer space to gather per packet */
+    int      mergeable;
+    size_t   rx_max;
+
+    /* Interrupt moderation per direction (usecs 0: off) */
+    uint32_t rx_usecs, rx_frames;
+    uint32_t tx_usecs, tx_frames;
+
+    /* vhost=on: the kernel moves each pair's packets (vhost-net) */
+    int      vhost;
+    struct vhost_dev vhost_devs[VIRTIO_NET_MAX_QUEUE_PAIRS];
 };
 
 /* Default GPA for virtio network */
@@ -56,9 +192,10 @@ struct virtio_net_state {
 #define VIRTIO_NET_SIZE  0x1000
 
 /*
- * Open TAP device
+ * Open TAP device. With multi_queue, each call adds one queue to the same
+ * interface; name returns the interface name (IFNAMSIZ bytes).
  */
-static int open_tap(const char *ifname)
+static int open_tap(const char *ifname, int multi_queue, char *name)
 {
     struct ifreq ifr;
     int fd, ret;
@@ -70,10 +207,12 @@ static int open_tap(const char *ifname)
     }
 
     memset(&ifr, 0, sizeof(ifr));
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+    if (multi_queue)
+        ifr.ifr_flags |= IFF_MULTI_QUEUE;
 
     if (ifname) {
-        strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+        snprintf(ifr.ifr_name, IFNAMSIZ, "%s", ifname);
     }
 
     ret = ioctl(fd, TUNSETIFF, (void *)&ifr);
@@ -83,10 +222,120 @@ static int open_tap(const char *ifname)
         return -1;
     }
 
-    log_info("Opened TAP device: %s", ifr.ifr_name);
+    /* Set non-blocking */
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    memcpy(name, ifr.ifr_name, IFNAMSIZ);
+    log_debug("Opened TAP device: %s", ifr.ifr_name);
     return fd;
 }
 
+/*
+ * Tell the TAP which offloads the guest accepted: it then hands over
+ * partially checksummed packets and GSO super-packets instead of
+ * finishing them in software
+ */
+static int virtio_net_set_offload(struct virtio_net_state *s, uint64_t features)
+{
+    unsigned int offload = 0;
+
+    if (features & (1ULL << VIRTIO_NET_F_GUEST_CSUM)) {
+        offload |= TUN_F_CSUM;
+        if (features & (1ULL << VIRTIO_NET_F_GUEST_TSO4))
+            offload |= TUN_F_TSO4;
+        if (features & (1ULL << VIRTIO_NET_F_GUEST_TSO6))
+            offload |= TUN_F_TSO6;
+        if ((offload & (TUN_F_TSO4 | TUN_F_TSO6)) &&
+            (features & (1ULL << VIRTIO_NET_F_GUEST_ECN)))
+            offload |= TUN_F_TSO_ECN;
+        if (features & (1ULL << VIRTIO_NET_F_GUEST_UFO))
+            offload |= TUN_F_UFO;
+    }
+
+    /* Offloads are per interface; queue 0 is always attached */
+    if (ioctl(s->queues[0].tap_fd, TUNSETOFFLOAD, offload) < 0) {
+        perror("ioctl TUNSETOFFLOAD");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Find the guest offloads the TAP supports (UFO is missing on some
+ * kernels), then start with all of them off
+ */
+static void virtio_net_probe_offload(struct virtio_net_state *s)
+{
+    int fd = s->queues[0].tap_fd;
+
+    s->guest_offloads = 0;
+    if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 |
+                                 TUN_F_TSO_ECN | TUN_F_UFO) == 0) {
+        s->guest_offloads = (1ULL << VIRTIO_NET_F_GUEST_CSUM) |
+                            (1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                            (1ULL << VIRTIO_NET_F_GUEST_TSO6) |
+                            (1ULL << VIRTIO_NET_F_GUEST_ECN) |
+                            (1ULL << VIRTIO_NET_F_GUEST_UFO);
+    } else if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 |
+                                        TUN_F_TSO_ECN) == 0) {
+        s->guest_offloads = (1ULL << VIRTIO_NET_F_GUEST_CSUM) |
+                            (1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                            (1ULL << VIRTIO_NET_F_GUEST_TSO6) |
+                            (1ULL << VIRTIO_NET_F_GUEST_ECN);
+    } else {
+        log_warn("TAP offloads unavailable (%s)", strerror(errno));
+    }
+
+    virtio_net_set_offload(s, 0);
+}
+
+/*
+ * Attach or detach a pair's TAP queue. The kernel only steers received
+ * packets to attached queues, so queues the driver does not use are
+ * detached rather than left to fill up.
+ */
+static int virtio_net_set_tap_queue(struct virtio_net_queue *q, int enable)
+{
+    struct ifreq ifr;
+
+    if (q->enabled == enable)
+        return 0;
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = enable ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+
+    if (ioctl(q->tap_fd, TUNSETQUEUE, (void *)&ifr) < 0) {
+        perror("ioctl TUNSETQUEUE");
+        return -1;
+    }
+
+    q->enabled = enable;
+    return 0;
+}
+
+/*
+ * Enable the first pairs queue pairs and disable the rest
+ */
+static int virtio_net_set_queue_pairs(struct virtio_net_state *s, uint16_t pairs)
+{
+    uint32_t i;
+    int ret = 0;
+
+    pthread_mutex_lock(&s->pairs_lock);
+    if (s->max_queue_pairs > 1) {
+        for (i = 0; i < s->max_queue_pairs; i++) {
+            if (virtio_net_set_tap_queue(&s->queues[i], i < pairs) < 0)
+                ret = -1;
+        }
+    }
+
+    s->curr_queue_pairs = pairs;
+    pthread_mutex_unlock(&s->pairs_lock);
+    return ret;
+}
+
 /*
  * Net config read
  */
@@ -142,123 +391,556 @@ static int virtio_net_config_write(struct virtio_dev *vdev,
 }
 
 /*
- * Handle RX queue (host -> guest)
+ * Drop a queue's cached mergeable buffers (queue reset)
  */
-static int virtio_net_handle_rx(struct virtio_dev *vdev,
-                                 struct virtqueue *vq)
+static void virtio_net_rx_drop_bufs(struct virtio_net_queue *q)
+{
+    q->rx_nbufs = 0;
+    q->rx_iov_cnt = 0;
+    q->rx_size = 0;
+}
+
+/*
+ * Receive one packet into mergeable buffers (host -> guest)
+ *
+ * The packet size is unknown until it is read, so enough buffers for the
+ * largest possible packet are gathered first. The packet takes as many as
+ * it fills, num_buffers tells the guest how many, and the rest are kept
+ * for the next packet rather than returned to the ring.
+ */
+static enum virtio_net_rx_status virtio_net_rx_mergeable(struct virtio_dev *vdev,
+                                                         struct virtqueue *vq)
 {
-    struct vm *vm = vdev->device.vm;
     struct virtio_net_state *s = vdev->priv;
-    struct vring_desc *desc;
-    struct virtio_net_hdr *hdr;
-    uint8_t *data;
+    struct virtio_net_queue *q = &s->queues[vq->index / 2];
+    struct virtqueue_elem *elem = &q->rx_elem;
+    uint16_t num_buffers;
+    int i, iov_used;
+    size_t len, n;
     ssize_t ret;
 
-    /* Pop descriptor */
-    desc = virtqueue_pop(vq);
-    if (!desc)
-        return 0;
+    /* Top up the cache */
+    while (q->rx_size < s->rx_max && q->rx_nbufs < VIRTQUEUE_MAX_SEGS) {
+        if (!virtqueue_pop_chain(vq, elem))
+            break;
 
-    /* Get header address */
-    hdr = vm_gpa_to_hva(vm, desc->addr, sizeof(*hdr));
-    if (!hdr) {
-        log_error("Failed to translate header GPA");
-        return -1;
+        /* Every buffer must be able to start a packet */
+        if (elem->out_num ||
+            iov_size(elem->iov, elem->in_num) < sizeof(struct virtio_net_hdr)) {
+            log_error("RX buffer too small for header");
+            virtqueue_fill(vq, elem->head, 0);
+            continue;
+        }
+
+        if (q->rx_iov_cnt + elem->in_num > VIRTQUEUE_MAX_SEGS) {
+            virtqueue_unpop(vq);
+            break;
+        }
+
+        memcpy(&q->rx_iov[q->rx_iov_cnt], elem->iov,
+               elem->in_num * sizeof(struct iovec));
+        q->rx_bufs[q->rx_nbufs].head = elem->head;
+        q->rx_bufs[q->rx_nbufs].size = iov_size(elem->iov, elem->in_num);
+        q->rx_bufs[q->rx_nbufs].iov_cnt = elem->in_num;
+        q->rx_size += q->rx_bufs[q->rx_nbufs].size;
+        q->rx_iov_cnt += elem->in_num;
+        q->rx_nbufs++;
     }
 
-    memset(hdr, 0, sizeof(*hdr));
+    /*
+     * A short cache could truncate the packet, so wait for the guest to
+     * post more, unless the ring can't hold more than we have
+     */
+    if (q->rx_nbufs == 0 ||
+        (q->rx_size < s->rx_max && q->rx_nbufs < vq->size &&
+         q->rx_nbufs < VIRTQUEUE_MAX_SEGS))
+        return VIRTIO_NET_RX_NO_BUFS;
 
-    /* Get data address (next in chain) */
-    if (!(desc->flags & VRING_DESC_F_NEXT)) {
-        log_error("RX descriptor has no data descriptor");
-        return -1;
+    /* Read header and packet from TAP straight into the guest buffers */
+    ret = readv(q->tap_fd, q->rx_iov, q->rx_iov_cnt);
+    q->rx_syscalls++;
+    if (ret < 0) {
+        if (errno != EAGAIN && errno != EBADFD)
+            perror("read tap");
+        return VIRTIO_NET_RX_EMPTY;
     }
 
-    desc = &vq->desc[desc->next];
-    data = vm_gpa_to_hva(vm, desc->addr, desc->len);
-    if (!data) {
-        log_error("Failed to translate data GPA");
-        return -1;
+    /* Complete the buffers the packet filled */
+    len = ret;
+    iov_used = 0;
+    for (i = 0; i < q->rx_nbufs && (i == 0 || len > 0); i++) {
+        n = MIN(len, q->rx_bufs[i].size);
+        virtqueue_fill(vq, q->rx_bufs[i].head, n);
+        len -= n;
+        iov_used += q->rx_bufs[i].iov_cnt;
     }
 
-    /* Read packet from TAP */
-    ret = read(s->tap_fd, data, desc->len);
+    num_buffers = i;
+    iov_from_buf(q->rx_iov, iov_used, offsetof(struct virtio_net_hdr, num_buffers),
+                 &num_buffers, sizeof(num_buffers));
+
+    /* Keep the rest */
+    for (n = 0; n < (size_t)i; n++)
+        q->rx_size -= q->rx_bufs[n].size;
+    q->rx_nbufs -= i;
+    q->rx_iov_cnt -= iov_used;
+    memmove(q->rx_bufs, &q->rx_bufs[i], q->rx_nbufs * sizeof(q->rx_bufs[0]));
+    memmove(q->rx_iov, &q->rx_iov[iov_used], q->rx_iov_cnt * sizeof(struct iovec));
+
+    q->rx_packets++;
+    return VIRTIO_NET_RX_PACKET;
+}
+
+/*
+ * Receive one packet into one buffer (host -> guest)
+ */
+static enum virtio_net_rx_status virtio_net_rx_single(struct virtio_dev *vdev,
+                                                      struct virtqueue *vq)
+{
+    struct virtio_net_state *s = vdev->priv;
+    struct virtio_net_queue *q = &s->queues[vq->index / 2];
+    struct virtqueue_elem *elem = &q->rx_elem;
+    uint16_t num_buffers = 1;
+    struct iovec *in;
+    int in_num;
+    ssize_t ret;
+
+    if (!virtqueue_pop_chain(vq, elem))
+        return VIRTIO_NET_RX_NO_BUFS;
+
+    in = virtqueue_elem_in(elem);
+    in_num = elem->in_num;
+
+    if (iov_size(in, in_num) < sizeof(struct virtio_net_hdr)) {
+        log_error("RX buffer too small for header");
+        virtqueue_fill(vq, elem->head, 0);
+        return VIRTIO_NET_RX_PACKET;
+    }
+
+    /* Read header and packet from TAP straight into the guest buffers */
+    ret = readv(q->tap_fd, in, in_num);
+    q->rx_syscalls++;
     if (ret < 0) {
-        if (errno != EAGAIN)
+        /* Nothing to receive (or queue detached): keep the buffer */
+        virtqueue_unpop(vq);
+        if (errno != EAGAIN && errno != EBADFD)
             perror("read tap");
-        return -1;
+        return VIRTIO_NET_RX_EMPTY;
     }
 
+    iov_from_buf(in, in_num, offsetof(struct virtio_net_hdr, num_buffers),
+                 &num_buffers, sizeof(num_buffers));
+
     /* Complete request */
-    virtqueue_push(vq, 0, sizeof(*hdr) + ret);
+    virtqueue_fill(vq, elem->head, ret);
 
-    return 0;
+    q->rx_packets++;
+    return VIRTIO_NET_RX_PACKET;
 }
 
 /*
- * Handle TX queue (guest -> host)
+ * Move packets from the TAP into the guest until either runs out (RX queue
+ * lock held). Completions are left for the caller to flush, so the whole
+ * burst costs one interrupt.
  */
-static int virtio_net_handle_tx(struct virtio_dev *vdev,
-                                 struct virtqueue *vq)
+static enum virtio_net_rx_status virtio_net_rx(struct virtio_dev *vdev,
+                                               struct virtqueue *vq)
 {
-    struct vm *vm = vdev->device.vm;
     struct virtio_net_state *s = vdev->priv;
-    struct vring_desc *desc;
-    struct virtio_net_hdr *hdr;
-    uint8_t *data;
-    ssize_t ret;
+    enum virtio_net_rx_status st;
 
-    /* Pop descriptor */
-    desc = virtqueue_pop(vq);
-    if (!desc)
-        return 0;
+    do {
+        st = s->mergeable ? virtio_net_rx_mergeable(vdev, vq) :
+                            virtio_net_rx_single(vdev, vq);
+    } while (st == VIRTIO_NET_RX_PACKET);
 
-    /* Get header address */
-    hdr = vm_gpa_to_hva(vm, desc->addr, sizeof(*hdr));
-    if (!hdr) {
-        log_error("Failed to translate header GPA");
-        return -1;
+    return st;
+}
+
+/*
+ * RX queue kick: the guest posted buffers, so pick up whatever the TAP
+ * handler had to leave queued for lack of them
+ */
+static int virtio_net_handle_rx(struct virtio_dev *vdev,
+                                 struct virtqueue *vq)
+{
+    virtio_net_rx(vdev, vq);
+    return 0;
+}
+
+/*
+ * TAP queue readable (runs on the RX queue's I/O thread)
+ *
+ * The fd is edge-triggered: a pass that stops for lack of buffers leaves
+ * the rest on the TAP for the next RX kick instead of waking the loop
+ * again and again, and a detached queue's standing EPOLLERR fires once.
+ */
+static void virtio_net_tap_handler(int fd, uint32_t events, void *opaque)
+{
+    struct virtio_net_queue *q = opaque;
+    struct virtqueue *vq = q->rx_vq;
+
+    (void)fd;
+    (void)events;
+
+    pthread_mutex_lock(&vq->lock);
+    if (vq->ready) {
+        virtio_net_rx(q->vdev, vq);
+        if (virtqueue_flush(vq))
+            virtqueue_notify(vq);
     }
+    pthread_mutex_unlock(&vq->lock);
+}
 
-    /* Get data address (next in chain) */
-    if (!(desc->flags & VRING_DESC_F_NEXT)) {
-        log_error("TX descriptor has no data descriptor");
+/*
+ * Watch a pair's TAP queue on the I/O thread of its RX queue, or stop
+ */
+static int virtio_net_tap_watch(struct virtio_net_queue *q, int watch)
+{
+    if (!q->rx_vq->iothread)
         return -1;
+
+    if (!watch)
+        return iothread_del_fd(q->rx_vq->iothread, q->tap_fd);
+
+    return iothread_add_fd(q->rx_vq->iothread, q->tap_fd, EPOLLIN | EPOLLET,
+                           virtio_net_tap_handler, q);
+}
+
+/*
+ * One TX write completed (TX queue lock held). Dropped packets are still
+ * returned to the guest.
+ */
+static void virtio_net_tx_done(void *opaque, uint64_t user_data, int32_t res)
+{
+    struct virtio_net_queue *q = opaque;
+
+    if (res < 0)
+        log_error("write tap: %s", strerror(-res));
+    else
+        q->tx_packets++;
+
+    q->tx_pending &= ~(1U << user_data);
+    virtqueue_fill(q->tx_vq, q->tx_elems[user_data].head, 0);
+}
+
+/*
+ * Write the first n popped chains to the TAP (TX queue lock held)
+ *
+ * Each chain is one packet, and a TAP write takes exactly one packet, so
+ * chains can't share a writev. With a ring, the burst is queued as one
+ * writev SQE per packet and sent with a single io_uring_enter; TAP writes
+ * don't block, so the kernel completes them inline, in order.
+ */
+static void virtio_net_tx_burst(struct virtio_net_queue *q, int n)
+{
+    struct virtqueue_elem *elem;
+    int i;
+
+    q->tx_pending = (uint32_t)((1ULL << n) - 1);
+
+    if (q->tx_ring) {
+        for (i = 0; i < n; i++) {
+            elem = &q->tx_elems[i];
+            uring_prepv(q->tx_ring, URING_OP_WRITE, q->tap_fd,
+                        virtqueue_elem_out(elem), elem->out_num, 0, i);
+        }
+
+        while (q->tx_pending) {
+            q->tx_syscalls++;
+            if (uring_submit_and_wait(q->tx_ring, 1) < 0)
+                break;
+            uring_reap(q->tx_ring, virtio_net_tx_done, q);
+        }
+        if (!q->tx_pending)
+            return;
+
+        /* Entries still queued would be resubmitted: drop the ring */
+        perror("io_uring_enter");
+        log_warn("%s: TX io_uring failed, using writev",
+                 q->vdev->device.name);
+        uring_destroy(q->tx_ring);
+        q->tx_ring = NULL;
     }
 
-    desc = &vq->desc[desc->next];
-    data = vm_gpa_to_hva(vm, desc->addr, desc->len);
-    if (!data) {
-        log_error("Failed to translate data GPA");
-        return -1;
+    for (i = 0; i < n; i++) {
+        if (!(q->tx_pending & (1U << i)))
+            continue;
+
+        /* Write header and packet to TAP straight from the guest buffers */
+        elem = &q->tx_elems[i];
+        q->tx_syscalls++;
+        virtio_net_tx_done(q, i, writev(q->tap_fd, virtqueue_elem_out(elem),
+                                         elem->out_num) < 0 ? -errno : 0);
     }
+}
 
-    /* Write packet to TAP */
-    ret = write(s->tap_fd, data, desc->len);
-    if (ret < 0) {
-        perror("write tap");
+/*
+ * Handle TX queue (guest -> host): send everything the guest has posted,
+ * a burst at a time
+ */
+static int virtio_net_handle_tx(struct virtio_dev *vdev,
+                                 struct virtqueue *vq)
+{
+    struct virtio_net_state *s = vdev->priv;
+    struct virtio_net_queue *q = &s->queues[vq->index / 2];
+    struct virtqueue_elem *elem;
+    int n, ret = 0;
+
+    do {
+        n = 0;
+        while (n < VIRTIO_NET_TX_BURST) {
+            elem = &q->tx_elems[n];
+            if (!virtqueue_pop_chain(vq, elem))
+                break;
+
+            if (iov_size(virtqueue_elem_out(elem), elem->out_num) <
+                sizeof(struct virtio_net_hdr)) {
+                log_error("TX packet shorter than header");
+                virtqueue_fill(vq, elem->head, 0);
+                ret = -1;
+                continue;
+            }
+            n++;
+        }
+
+        if (n)
+            virtio_net_tx_burst(q, n);
+    } while (n == VIRTIO_NET_TX_BURST);
+
+    return ret;
+}
+
+/*
+ * Handle the control queue: one command per chain, a class/cmd header and
+ * its data followed by a writable status byte
+ */
+static int virtio_net_handle_ctrl(struct virtio_dev *vdev,
+                                   struct virtqueue *vq)
+{
+    struct virtio_net_state *s = vdev->priv;
+    struct virtqueue_elem *elem = &s->ctrl_elem;
+    struct virtio_net_ctrl_hdr ctrl;
+    uint8_t status = VIRTIO_NET_ERR;
+    struct iovec *out;
+    int out_num;
+    uint16_t pairs;
+
+    if (!virtqueue_pop_chain(vq, elem))
+        return 0;
+
+    out = virtqueue_elem_out(elem);
+    out_num = elem->out_num;
+
+    if (iov_to_buf(out, out_num, 0, &ctrl, sizeof(ctrl)) != sizeof(ctrl) ||
+        elem->in_num == 0) {
+        log_error("Malformed control command");
+        virtqueue_fill(vq, elem->head, 0);
         return -1;
     }
+    iov_discard_front(&out, &out_num, sizeof(ctrl));
 
-    /* Complete request */
-    virtqueue_push(vq, 0, 0);
+    if (ctrl.class == VIRTIO_NET_CTRL_MQ &&
+        ctrl.cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET &&
+        iov_to_buf(out, out_num, 0, &pairs, sizeof(pairs)) == sizeof(pairs)) {
+        if (pairs >= 1 && pairs <= s->max_queue_pairs &&
+            virtio_net_set_queue_pairs(s, pairs) == 0) {
+            log_debug("%s: %u queue pairs enabled", vdev->device.name, pairs);
+            status = VIRTIO_NET_OK;
+        }
+    } else {
+        log_debug("Unsupported control command %u/%u", ctrl.class, ctrl.cmd);
+    }
+
+    iov_from_buf(virtqueue_elem_in(elem), elem->in_num, 0, &status, sizeof(status));
+    virtqueue_fill(vq, elem->head, sizeof(status));
 
     return 0;
 }
 
 /*
  * Handle queue notification
+ *
+ * Virtqueues are RX/TX pairs, then the control queue: after the last pair
+ * when VIRTIO_NET_F_MQ is negotiated, at index 2 otherwise.
  */
 static int virtio_net_queue_notify(struct virtio_dev *vdev,
                                     struct virtqueue *vq)
 {
-    /* Handle based on queue index */
-    if (vq->index == 0)
-        return virtio_net_handle_rx(vdev, vq);
-    else if (vq->index == 1)
-        return virtio_net_handle_tx(vdev, vq);
+    struct virtio_net_state *s = vdev->priv;
+    uint32_t ctrl_index = 2;
+
+    if (vdev->driver_features & (1ULL << VIRTIO_NET_F_MQ))
+        ctrl_index = 2 * s->max_queue_pairs;
+
+    if ((vdev->driver_features & (1ULL << VIRTIO_NET_F_CTRL_VQ)) &&
+        vq->index == ctrl_index)
+        return virtio_net_handle_ctrl(vdev, vq);
+
+    if (vq->index >= 2 * s->max_queue_pairs)
+        return 0;
+
+    return (vq->index & 1) ? virtio_net_handle_tx(vdev, vq) :
+                             virtio_net_handle_rx(vdev, vq);
+}
+
+/*
+ * Device reset: back to a single queue pair until the driver asks for more
+ */
+static void virtio_net_reset(struct virtio_dev *vdev)
+{
+    struct virtio_net_state *s = vdev->priv;
+    uint32_t i;
+
+    /* Cached RX buffers belong to the old rings */
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        pthread_mutex_lock(&vdev->queues[2 * i].lock);
+        virtio_net_rx_drop_bufs(&s->queues[i]);
+        pthread_mutex_unlock(&vdev->queues[2 * i].lock);
+    }
+    s->mergeable = 0;
+
+    virtio_net_set_queue_pairs(s, 1);
+    if (s->guest_offloads)
+        virtio_net_set_offload(s, 0);
+}
+
+/*
+ * Current TAP MTU (1500 if it can't be read)
+ */
+static int virtio_net_tap_mtu(struct virtio_net_state *s)
+{
+    struct ifreq ifr;
+    int fd, mtu = 1500;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return mtu;
+
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, IFNAMSIZ, "%s", s->tap_name);
+    if (ioctl(fd, SIOCGIFMTU, &ifr) == 0)
+        mtu = ifr.ifr_mtu;
+
+    close(fd);
+    return mtu;
+}
+
+/*
+ * Features negotiated: size mergeable RX batches and enable the guest
+ * offloads on the TAP
+ */
+static void virtio_net_set_features(struct virtio_dev *vdev, uint64_t features)
+{
+    struct virtio_net_state *s = vdev->priv;
+    uint64_t gso = (1ULL << VIRTIO_NET_F_GUEST_TSO4) |
+                   (1ULL << VIRTIO_NET_F_GUEST_TSO6) |
+                   (1ULL << VIRTIO_NET_F_GUEST_UFO);
+
+    s->mergeable = !!(features & (1ULL << VIRTIO_NET_F_MRG_RXBUF));
+    s->rx_max = sizeof(struct virtio_net_hdr);
+    if (features & gso)
+        s->rx_max += VIRTIO_NET_MAX_FRAME;
+    else
+        s->rx_max += virtio_net_tap_mtu(s) + VIRTIO_NET_FRAME_OVERHEAD;
+
+    if (s->guest_offloads && virtio_net_set_offload(s, features) == 0)
+        log_debug("%s: guest offloads 0x%lx", vdev->device.name,
+                  features & s->guest_offloads);
+}
+
+/*
+ * Hand pair i to vhost-net: the rings, then the TAP queue. Our own
+ * datapath for the pair stops first; RX buffers it had gathered are
+ * returned empty, since vhost starts at the next avail entry.
+ */
+static int virtio_net_vhost_start(struct virtio_net_state *s, uint32_t i)
+{
+    struct virtio_net_queue *q = &s->queues[i];
+    struct vhost_dev *hdev = &s->vhost_devs[i];
+    int n;
+
+    virtio_net_tap_watch(q, 0);
+
+    pthread_mutex_lock(&q->rx_vq->lock);
+    for (n = 0; n < q->rx_nbufs; n++)
+        virtqueue_fill(q->rx_vq, q->rx_bufs[n].head, 0);
+    virtio_net_rx_drop_bufs(q);
+    if (virtqueue_flush(q->rx_vq))
+        virtqueue_notify(q->rx_vq);
+    pthread_mutex_unlock(&q->rx_vq->lock);
+
+    if (vhost_dev_start(hdev, q->vdev, 2 * i, 2) < 0)
+        goto err;
+
+    if (vhost_net_set_backend(hdev, 0, q->tap_fd) < 0 ||
+        vhost_net_set_backend(hdev, 1, q->tap_fd) < 0) {
+        vhost_net_set_backend(hdev, 0, -1);
+        vhost_dev_stop(hdev);
+        goto err;
+    }
 
     return 0;
+
+err:
+    virtio_net_tap_watch(q, 1);
+    return -1;
+}
+
+/*
+ * Take pair i back from vhost-net
+ */
+static void virtio_net_vhost_stop(struct virtio_net_state *s, uint32_t i)
+{
+    struct vhost_dev *hdev = &s->vhost_devs[i];
+
+    if (!hdev->started)
+        return;
+
+    vhost_net_set_backend(hdev, 0, -1);
+    vhost_net_set_backend(hdev, 1, -1);
+    vhost_dev_stop(hdev);
+    virtio_net_tap_watch(&s->queues[i], 1);
+}
+
+/*
+ * Driver ready: with vhost=on, move the datapath of every pair the driver
+ * set up into the kernel. A pair that can't be handed over keeps running
+ * here.
+ */
+static void virtio_net_start(struct virtio_dev *vdev)
+{
+    struct virtio_net_state *s = vdev->priv;
+    uint32_t i;
+
+    if (!s->vhost)
+        return;
+
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        struct virtio_net_queue *q = &s->queues[i];
+
+        if (!q->rx_vq->ready || !q->tx_vq->ready)
+            continue;
+
+        if (virtio_net_vhost_start(s, i) < 0)
+            log_warn("%s: vhost-net failed, pair %u stays in userspace",
+                     vdev->device.name, i);
+    }
+}
+
+/*
+ * Leaving DRIVER_OK (reset or detach): the kernel lets go of the rings
+ */
+static void virtio_net_stop(struct virtio_dev *vdev)
+{
+    struct virtio_net_state *s = vdev->priv;
+    uint32_t i;
+
+    if (!s->vhost)
+        return;
+
+    for (i = 0; i < s->max_queue_pairs; i++)
+        virtio_net_vhost_stop(s, i);
 }
 
 /* Device operations */
@@ -276,33 +958,329 @@ static int virtio_net_write(struct device *dev, uint64_t offset,
     return virtio_mmio_write(vdev, offset, data, size);
 }
 
+/*
+ * Close the TAP queues
+ */
+static void virtio_net_close_tap(struct virtio_net_state *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        if (s->queues[i].tap_fd >= 0)
+            close(s->queues[i].tap_fd);
+        s->queues[i].tap_fd = -1;
+    }
+}
+
+/*
+ * Open one TAP queue per queue pair; all but the first start detached.
+ * Every queue carries a struct virtio_net_hdr in front of each packet.
+ */
+static int virtio_net_open_tap(struct virtio_net_state *s, const char *ifname)
+{
+    int multi_queue = s->max_queue_pairs > 1;
+    int hdr_size;
+    uint32_t i;
+
+    for (i = 0; i < s->max_queue_pairs; i++)
+        s->queues[i].tap_fd = -1;
+
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        /* Later queues join the interface the first one created */
+        s->queues[i].tap_fd = open_tap(i ? s->tap_name : ifname, multi_queue,
+                                       s->tap_name);
+        if (s->queues[i].tap_fd < 0) {
+            virtio_net_close_tap(s);
+            return -1;
+        }
+        s->queues[i].enabled = 1;
+    }
+
+    hdr_size = sizeof(struct virtio_net_hdr);
+    if (ioctl(s->queues[0].tap_fd, TUNSETVNETHDRSZ, &hdr_size) < 0) {
+        perror("ioctl TUNSETVNETHDRSZ");
+        virtio_net_close_tap(s);
+        return -1;
+    }
+
+    if (virtio_net_set_queue_pairs(s, 1) < 0) {
+        virtio_net_close_tap(s);
+        return -1;
+    }
+
+    log_info("Opened TAP device: %s (%u queue%s)", s->tap_name,
+             s->max_queue_pairs, multi_queue ? "s" : "");
+    return 0;
+}
+
+static void virtio_net_tx_cleanup(struct virtio_net_state *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        if (s->queues[i].tx_ring)
+            uring_destroy(s->queues[i].tx_ring);
+        s->queues[i].tx_ring = NULL;
+    }
+}
+
+/*
+ * Give each TX queue a ring for its bursts; without io_uring, packets go
+ * out with one writev each
+ */
+static void virtio_net_tx_setup(struct virtio_net_state *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        s->queues[i].tx_ring = uring_create(VIRTIO_NET_TX_BURST);
+        if (!s->queues[i].tx_ring) {
+            log_info("io_uring unavailable (%s), TX uses writev",
+                     strerror(errno));
+            virtio_net_tx_cleanup(s);
+            return;
+        }
+    }
+}
+
+/*
+ * vhost=on: one vhost-net instance per queue pair
+ */
+static int virtio_net_vhost_init(struct virtio_net_state *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        if (vhost_kernel_init(&s->vhost_devs[i], "/dev/vhost-net") < 0) {
+            while (i-- > 0)
+                vhost_dev_cleanup(&s->vhost_devs[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void virtio_net_vhost_cleanup(struct virtio_net_state *s)
+{
+    uint32_t i;
+
+    if (!s->vhost)
+        return;
+
+    for (i = 0; i < s->max_queue_pairs; i++)
+        vhost_dev_cleanup(&s->vhost_devs[i]);
+}
+
+/*
+ * Print virtqueue statistics, then packets per TAP syscall for each pair
+ */
+static void virtio_net_print_stats(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    struct virtio_net_state *s = vdev->priv;
+    char line[128];
+    uint32_t i;
+
+    virtio_print_stats(dev);
+
+    fprintf(stderr, "╔══════════════════════════════════════════════════════════════════╗\n");
+    snprintf(line, sizeof(line), "%s TAP Statistics", dev->name);
+    fprintf(stderr, "║  %-64s║\n", line);
+    fprintf(stderr, "╠══════════════════════════════════════════════════════════════════╣\n");
+
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        struct virtio_net_queue *q = &s->queues[i];
+        uint64_t packets, syscalls;
+
+        pthread_mutex_lock(&q->rx_vq->lock);
+        packets = q->rx_packets;
+        syscalls = q->rx_syscalls;
+        pthread_mutex_unlock(&q->rx_vq->lock);
+
+        snprintf(line, sizeof(line), "Pair %u:", i);
+        fprintf(stderr, "║  %-64s║\n", line);
+        snprintf(line, sizeof(line), "  RX packets:         %20lu", packets);
+        fprintf(stderr, "║  %-64s║\n", line);
+        snprintf(line, sizeof(line), "  RX syscalls:        %20lu", syscalls);
+        fprintf(stderr, "║  %-64s║\n", line);
+        if (syscalls) {
+            snprintf(line, sizeof(line), "  RX packets/syscall: %20.1f",
+                     (double)packets / syscalls);
+            fprintf(stderr, "║  %-64s║\n", line);
+        }
+
+        pthread_mutex_lock(&q->tx_vq->lock);
+        packets = q->tx_packets;
+        syscalls = q->tx_syscalls;
+        pthread_mutex_unlock(&q->tx_vq->lock);
+
+        snprintf(line, sizeof(line), "  TX packets:         %20lu", packets);
+        fprintf(stderr, "║  %-64s║\n", line);
+        snprintf(line, sizeof(line), "  TX syscalls:        %20lu", syscalls);
+        fprintf(stderr, "║  %-64s║\n", line);
+        if (syscalls) {
+            snprintf(line, sizeof(line), "  TX packets/syscall: %20.1f",
+                     (double)packets / syscalls);
+            fprintf(stderr, "║  %-64s║\n", line);
+        }
+    }
+
+    fprintf(stderr, "╚══════════════════════════════════════════════════════════════════╝\n");
+}
+
 static void virtio_net_destroy(struct device *dev)
 {
     struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
     struct virtio_net_state *s = vdev->priv;
 
-    if (s && s->tap_fd >= 0)
-        close(s->tap_fd);
+    if (s) {
+        virtio_net_vhost_cleanup(s);
+        virtio_net_tx_cleanup(s);
+        virtio_net_close_tap(s);
+        pthread_mutex_destroy(&s->pairs_lock);
+    }
 
     virtio_cleanup(vdev);
     free(s);
+    free(vdev->device.name);
     free(vdev);
 }
 
+/*
+ * Detach: stop watching the TAP queues, then the virtqueues
+ */
+static void virtio_net_detach(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    struct virtio_net_state *s = vdev->priv;
+    uint32_t i;
+
+    /* Give the rings back from vhost while the I/O threads are known */
+    pthread_mutex_lock(&vdev->lock);
+    if (vdev->device_status & VIRTIO_CONFIG_S_DRIVER_OK)
+        virtio_net_stop(vdev);
+    pthread_mutex_unlock(&vdev->lock);
+
+    /* Waits for a running TAP handler */
+    for (i = 0; i < s->max_queue_pairs; i++)
+        virtio_net_tap_watch(&s->queues[i], 0);
+
+    virtio_detach(dev);
+}
+
+/*
+ * Attach: set up the virtqueues, then watch each TAP queue on the thread
+ * that serves its RX queue
+ */
+static int virtio_net_attach(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    struct virtio_net_state *s = vdev->priv;
+    uint32_t i;
+
+    if (virtio_attach(dev) < 0)
+        return -1;
+
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        if (virtio_net_tap_watch(&s->queues[i], 1) < 0) {
+            virtio_net_detach(dev);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static const struct device_ops virtio_net_ops = {
     .name = "virtio-net",
     .read = virtio_net_read,
     .write = virtio_net_write,
+    .attach = virtio_net_attach,
+    .detach = virtio_net_detach,
     .destroy = virtio_net_destroy,
+    .print_stats = virtio_net_print_stats,
+    .irq_pending = virtio_irq_pending,
 };
 
+/*
+ * Parse "ifname[,queues=N][,offload=on|off][,vhost=on|off][,rx-usecs=N]
+ *       [,rx-frames=N][,tx-usecs=N][,tx-frames=N]"
+ * Returns the interface name (caller frees) or NULL on error.
+ */
+static char* virtio_net_parse_opts(const char *spec, struct virtio_net_state *s)
+{
+    char *ifname, *opt, *save = NULL;
+
+    ifname = strdup(spec);
+    if (!ifname)
+        return NULL;
+
+    opt = strchr(ifname, ',');
+    if (!opt)
+        return ifname;
+    *opt++ = '\0';
+
+    for (opt = strtok_r(opt, ",", &save); opt; opt = strtok_r(NULL, ",", &save)) {
+        int ret;
+
+        if (strcmp(opt, "offload=on") == 0) {
+            s->offload = 1;
+            continue;
+        } else if (strcmp(opt, "offload=off") == 0) {
+            s->offload = 0;
+            continue;
+        } else if (strcmp(opt, "vhost=on") == 0) {
+            s->vhost = 1;
+            continue;
+        } else if (strcmp(opt, "vhost=off") == 0) {
+            s->vhost = 0;
+            continue;
+        }
+
+        ret = virtio_parse_uint_opt(opt, "queues", &s->max_queue_pairs);
+
+        if (ret == 0)
+            ret = virtio_parse_uint_opt(opt, "rx-usecs", &s->rx_usecs);
+        if (ret == 0)
+            ret = virtio_parse_uint_opt(opt, "rx-frames", &s->rx_frames);
+        if (ret == 0)
+            ret = virtio_parse_uint_opt(opt, "tx-usecs", &s->tx_usecs);
+        if (ret == 0)
+            ret = virtio_parse_uint_opt(opt, "tx-frames", &s->tx_frames);
+        if (ret == 0)
+            log_error("Unknown network option: %s", opt);
+        if (ret <= 0) {
+            free(ifname);
+            return NULL;
+        }
+    }
+
+    if (s->max_queue_pairs < 1 || s->max_queue_pairs > VIRTIO_NET_MAX_QUEUE_PAIRS) {
+        log_error("Invalid number of network queues: %u (1-%d)",
+                  s->max_queue_pairs, VIRTIO_NET_MAX_QUEUE_PAIRS);
+        free(ifname);
+        return NULL;
+    }
+
+    if (virtio_check_coalescing("rx-frames", s->rx_frames, "rx-usecs", s->rx_usecs) < 0 ||
+        virtio_check_coalescing("tx-frames", s->tx_frames, "tx-usecs", s->tx_usecs) < 0) {
+        free(ifname);
+        return NULL;
+    }
+
+    return ifname;
+}
+
 /*
  * Create virtio network device
  */
-struct device* virtio_net_create(const char *tap_name)
+struct device* virtio_net_create(const char *net_spec)
 {
     struct virtio_dev *vdev;
     struct virtio_net_state *s;
+    char *ifname;
+    uint32_t i;
 
     vdev = calloc(1, sizeof(*vdev));
     if (!vdev)
@@ -314,17 +1292,36 @@ struct device* virtio_net_create(const char *tap_name)
         return NULL;
     }
 
+    s->max_queue_pairs = 1;
+    s->offload = 1;
+    ifname = virtio_net_parse_opts(net_spec, s);
+    if (!ifname) {
+        free(s);
+        free(vdev);
+        return NULL;
+    }
+
     /* Open TAP device */
-    s->tap_fd = open_tap(tap_name);
-    if (s->tap_fd < 0) {
+    pthread_mutex_init(&s->pairs_lock, NULL);
+    if (virtio_net_open_tap(s, ifname) < 0) {
+        pthread_mutex_destroy(&s->pairs_lock);
+        free(ifname);
         free(s);
         free(vdev);
         return NULL;
     }
+    free(ifname);
 
-    /* Set non-blocking */
-    int flags = fcntl(s->tap_fd, F_GETFL, 0);
-    fcntl(s->tap_fd, F_SETFL, flags | O_NONBLOCK);
+    if (s->offload)
+        virtio_net_probe_offload(s);
+
+    if (s->vhost && virtio_net_vhost_init(s) < 0) {
+        virtio_net_close_tap(s);
+        pthread_mutex_destroy(&s->pairs_lock);
+        free(s);
+        free(vdev);
+        return NULL;
+    }
 
     /* Initialize config */
     s->config.mac[0] = 0x02;
@@ -334,7 +1331,7 @@ struct device* virtio_net_create(const char *tap_name)
     s->config.mac[4] = 0x00;
     s->config.mac[5] = 0x01;
     s->config.status = 0x01;  /* Link up */
-    s->config.max_virtqueue_pairs = 1;
+    s->config.max_virtqueue_pairs = s->max_queue_pairs;
 
     /* Initialize virtio device */
     virtio_init(vdev, VIRTIO_ID_NET);
@@ -342,7 +1339,43 @@ struct device* virtio_net_create(const char *tap_name)
     vdev->priv = s;
     vdev->config_read = virtio_net_config_read;
     vdev->config_write = virtio_net_config_write;
+
+    /* Large packets can span several small RX buffers */
+    vdev->device_features |= 1ULL << VIRTIO_NET_F_MRG_RXBUF;
+
+    /* Checksum and segmentation offloads in both directions */
+    if (s->offload)
+        vdev->device_features |= VIRTIO_NET_HOST_OFFLOADS | s->guest_offloads;
+
+    /* Ring features the kernel datapath lacks */
+    if (s->vhost)
+        vdev->device_features &= ~(VIRTIO_NET_VHOST_FEATURES &
+                                   ~s->vhost_devs[0].features);
+
+    /* Multi-queue: a control queue follows the pairs */
+    if (s->max_queue_pairs > 1) {
+        vdev->device_features |= (1ULL << VIRTIO_NET_F_CTRL_VQ) |
+                                 (1ULL << VIRTIO_NET_F_MQ);
+        virtio_setup_queues(vdev, 2 * s->max_queue_pairs + 1);
+    } else {
+        virtio_setup_queues(vdev, 2);
+    }
+    for (i = 0; i < s->max_queue_pairs; i++) {
+        s->queues[i].vdev = vdev;
+        s->queues[i].rx_vq = &vdev->queues[2 * i];
+        s->queues[i].tx_vq = &vdev->queues[2 * i + 1];
+        virtqueue_set_coalescing(s->queues[i].rx_vq, s->rx_frames, s->rx_usecs);
+        virtqueue_set_coalescing(s->queues[i].tx_vq, s->tx_frames, s->tx_usecs);
+    }
+    virtio_net_tx_setup(s);
+
+    /* Each RX/TX pair is served by one I/O thread */
+    vdev->queues_per_iothread = 2;
     vdev->queue_notify = virtio_net_queue_notify;
+    vdev->reset = virtio_net_reset;
+    vdev->set_features = virtio_net_set_features;
+    vdev->start = virtio_net_start;
+    vdev->stop = virtio_net_stop;
 
     /* Setup device */
     vdev->device.ops = &virtio_net_ops;
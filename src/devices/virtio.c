@@ -10,9 +10,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 
-/* Virtio MMIO magic value */
-#define VIRTIO_MMIO_MAGIC_VALUE 0x74726976
+/* Virtio MMIO magic value ("virt") */
+#define VIRTIO_MMIO_MAGIC 0x74726976
+
+static void virtqueue_raise_irq(struct virtqueue *vq);
 
 /* Register access helper */
 static inline uint32_t virtio_read_reg(uint32_t *reg, uint32_t offset)
@@ -33,10 +39,16 @@ int virtio_init(struct virtio_dev *vdev, enum virtio_device_id id)
     memset(vdev, 0, sizeof(*vdev));
 
     vdev->device_id = id;
-    vdev->device_features = (1U << VIRTIO_F_VERSION_1);
+    vdev->device_features = (1ULL << VIRTIO_F_VERSION_1) |
+                            (1ULL << VIRTIO_F_RING_INDIRECT_DESC) |
+                            (1ULL << VIRTIO_F_RING_EVENT_IDX) |
+                            (1ULL << VIRTIO_F_RING_PACKED);
     vdev->driver_features = 0;
     vdev->device_status = 0;
     vdev->num_queues = 0;
+    vdev->device.irq_fd = -1;
+    vdev->device.irq_resample_fd = -1;
+    pthread_mutex_init(&vdev->lock, NULL);
 
     log_debug("Initialized virtio device %d", id);
     return 0;
@@ -53,6 +65,8 @@ void virtio_cleanup(struct virtio_dev *vdev)
         virtqueue_cleanup(&vdev->queues[i]);
     }
 
+    pthread_mutex_destroy(&vdev->lock);
+
     log_debug("Cleaned up virtio device %d", vdev->device_id);
 }
 
@@ -69,6 +83,9 @@ int virtqueue_setup(struct virtqueue *vq, struct device *dev, uint16_t index)
     vq->ready = 0;
     vq->last_avail_idx = 0;
     vq->last_used_idx = 0;
+    vq->kick_fd = -1;
+    vq->coalesce_timer_fd = -1;
+    pthread_mutex_init(&vq->lock, NULL);
 
     log_debug("Setup virtqueue %d for device %s", index, dev->name);
     return 0;
@@ -83,6 +100,290 @@ void virtqueue_cleanup(struct virtqueue *vq)
     vq->desc = NULL;
     vq->avail = NULL;
     vq->used = NULL;
+    vq->desc_packed = NULL;
+    vq->driver_event = NULL;
+    vq->device_event = NULL;
+
+    if (vq->kick_fd >= 0) {
+        close(vq->kick_fd);
+        vq->kick_fd = -1;
+    }
+
+    if (vq->coalesce_timer_fd >= 0) {
+        close(vq->coalesce_timer_fd);
+        vq->coalesce_timer_fd = -1;
+    }
+
+    pthread_mutex_destroy(&vq->lock);
+}
+
+/*
+ * Create the device's virtqueues
+ */
+int virtio_setup_queues(struct virtio_dev *vdev, int num_queues)
+{
+    int i;
+
+    if (num_queues > VIRTIO_MAX_QUEUES) {
+        log_error("Too many virtqueues: %d (max %d)", num_queues, VIRTIO_MAX_QUEUES);
+        return -1;
+    }
+
+    for (i = 0; i < num_queues; i++) {
+        virtqueue_setup(&vdev->queues[i], &vdev->device, i);
+        vdev->queues[i].isr = &vdev->interrupt_status;
+    }
+
+    vdev->num_queues = num_queues;
+    return 0;
+}
+
+/*
+ * Packed ring: is the slot at idx available in the lap given by wrap?
+ */
+static inline int virtqueue_packed_desc_avail(struct virtqueue *vq,
+                                              uint16_t idx, int wrap)
+{
+    uint16_t flags = __atomic_load_n(&vq->desc_packed[idx].flags, __ATOMIC_ACQUIRE);
+
+    return !!(flags & VRING_PACKED_DESC_F_AVAIL) == wrap &&
+           !!(flags & VRING_PACKED_DESC_F_USED) != wrap;
+}
+
+/*
+ * Position of the next avail entry; includes the packed wrap counter so
+ * that popping a full lap still counts as progress
+ */
+static inline uint32_t virtqueue_avail_pos(struct virtqueue *vq)
+{
+    return vq->last_avail_idx | ((uint32_t)vq->avail_wrap_counter << 16);
+}
+
+/*
+ * True if there is nothing left to pop
+ */
+static int virtqueue_empty(struct virtqueue *vq)
+{
+    if (!vq->ready)
+        return 1;
+
+    if (vq->packed)
+        return !virtqueue_packed_desc_avail(vq, vq->last_avail_idx,
+                                            vq->avail_wrap_counter);
+
+    return vq->last_avail_idx == __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Run the device's queue handler until the queue is empty or stops making
+ * progress (kicks are coalesced, so one kick may cover several requests).
+ * Guest kicks are suppressed while we drain.
+ */
+static void virtio_process_queue(struct virtio_dev *vdev, struct virtqueue *vq)
+{
+    uint32_t last;
+
+    if (!vdev->queue_notify)
+        return;
+
+    pthread_mutex_lock(&vq->lock);
+    for (;;) {
+        virtqueue_disable_notify(vq);
+
+        do {
+            last = virtqueue_avail_pos(vq);
+            vdev->queue_notify(vdev, vq);
+        } while (virtqueue_avail_pos(vq) != last && !virtqueue_empty(vq));
+
+        /* Stalled handlers (no buffers, throttled) are resumed elsewhere */
+        if (!virtqueue_enable_notify(vq) || virtqueue_avail_pos(vq) == last)
+            break;
+    }
+
+    /* Everything the handler completed goes out with one interrupt */
+    if (virtqueue_flush(vq))
+        virtqueue_notify(vq);
+    pthread_mutex_unlock(&vq->lock);
+}
+
+/*
+ * Kick handler (runs on the queue's I/O thread)
+ */
+static void virtio_kick_handler(int fd, uint32_t events, void *opaque)
+{
+    struct virtqueue *vq = opaque;
+    struct virtio_dev *vdev = container_of(vq->dev, struct virtio_dev, device);
+    uint64_t count;
+
+    (void)events;
+
+    if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return;
+
+    virtio_process_queue(vdev, vq);
+}
+
+/*
+ * Moderation timer expired (runs on the queue's I/O thread)
+ */
+static void virtio_coalesce_timer_handler(int fd, uint32_t events, void *opaque)
+{
+    struct virtqueue *vq = opaque;
+    uint64_t expirations;
+
+    (void)events;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        return;
+
+    pthread_mutex_lock(&vq->lock);
+    vq->coalesce_timer_armed = 0;
+    if (vq->ready && vq->irq_pending)
+        virtqueue_raise_irq(vq);
+    pthread_mutex_unlock(&vq->lock);
+}
+
+/*
+ * Create a queue's moderation timer on the I/O thread
+ */
+static int virtio_coalesce_timer_add(struct virtqueue *vq, struct iothread *iothread)
+{
+    vq->coalesce_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (vq->coalesce_timer_fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    if (iothread_add_fd(iothread, vq->coalesce_timer_fd, EPOLLIN,
+                        virtio_coalesce_timer_handler, vq) < 0) {
+        close(vq->coalesce_timer_fd);
+        vq->coalesce_timer_fd = -1;
+        return -1;
+    }
+
+    vq->coalesce_timer_armed = 0;
+    return 0;
+}
+
+/*
+ * Attach queue notifications (device_ops.attach)
+ *
+ * Each queue (or group of queues_per_iothread queues, such as a net RX/TX
+ * pair) gets its own pick from the I/O thread pool, so the queues of a
+ * multi-queue device are spread over the pool's threads.
+ */
+int virtio_attach(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    uint64_t notify_gpa = dev->gpa_start + VIRTIO_MMIO_QUEUE_NOTIFY;
+    struct iothread *iothread = NULL;
+    int group = vdev->queues_per_iothread > 0 ? vdev->queues_per_iothread : 1;
+    int i, routed = 0;
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        struct virtqueue *vq = &vdev->queues[i];
+
+        if (i % group == 0) {
+            iothread = vm_get_iothread(dev->vm);
+            if (!iothread)
+                goto err;
+        }
+
+        vq->kick_fd = eventfd(0, EFD_NONBLOCK);
+        if (vq->kick_fd < 0) {
+            perror("eventfd");
+            goto err;
+        }
+
+        if (iothread_add_fd(iothread, vq->kick_fd, EPOLLIN,
+                            virtio_kick_handler, vq) < 0) {
+            close(vq->kick_fd);
+            vq->kick_fd = -1;
+            goto err;
+        }
+        vq->iothread = iothread;
+
+        if (vq->coalesce_usecs && virtio_coalesce_timer_add(vq, iothread) < 0)
+            goto err;
+
+        /* Writes of this queue's index to QueueNotify only signal kick_fd */
+        if (hv_ioeventfd(dev->vm->hv_vm, vq->kick_fd, notify_gpa, 4, i,
+                         HV_IOEVENTFD_DATAMATCH, 1) == 0) {
+            vq->kick_routed = 1;
+            routed++;
+        }
+
+        log_debug("%s: queue %d on I/O thread %d", dev->name, i, iothread->index);
+    }
+
+    log_debug("%s: %d/%d queue notifications via ioeventfd",
+              dev->name, routed, vdev->num_queues);
+    return 0;
+
+err:
+    virtio_detach(dev);
+    return -1;
+}
+
+/*
+ * Detach queue notifications (device_ops.detach)
+ */
+void virtio_detach(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    uint64_t notify_gpa = dev->gpa_start + VIRTIO_MMIO_QUEUE_NOTIFY;
+    int i;
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        struct virtqueue *vq = &vdev->queues[i];
+
+        if (vq->kick_routed) {
+            hv_ioeventfd(dev->vm->hv_vm, vq->kick_fd, notify_gpa, 4, i,
+                         HV_IOEVENTFD_DATAMATCH, 0);
+            vq->kick_routed = 0;
+        }
+
+        if (vq->kick_fd >= 0) {
+            /* Waits for a running kick handler to finish */
+            if (vq->iothread && !vq->kick_external)
+                iothread_del_fd(vq->iothread, vq->kick_fd);
+            close(vq->kick_fd);
+            vq->kick_fd = -1;
+            vq->kick_external = 0;
+        }
+
+        if (vq->coalesce_timer_fd >= 0) {
+            if (vq->iothread)
+                iothread_del_fd(vq->iothread, vq->coalesce_timer_fd);
+            close(vq->coalesce_timer_fd);
+            vq->coalesce_timer_fd = -1;
+        }
+
+        vq->iothread = NULL;
+    }
+}
+
+/*
+ * Number of avail entries not yet popped. avail->idx is only re-read once
+ * the previously seen entries are consumed, so draining a batch costs one
+ * acquire load.
+ */
+static uint16_t virtqueue_avail_pending(struct virtqueue *vq)
+{
+    uint16_t pending;
+
+    if (vq->shadow_avail_idx == vq->last_avail_idx)
+        vq->shadow_avail_idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+
+    pending = vq->shadow_avail_idx - vq->last_avail_idx;
+    if (unlikely(pending > vq->size)) {
+        log_warn("Virtio: avail index jumped by %u (queue size %u)",
+                 pending, vq->size);
+        vq->shadow_avail_idx = vq->last_avail_idx;
+        return 0;
+    }
+
+    return pending;
 }
 
 /*
@@ -90,208 +391,1247 @@ void virtqueue_cleanup(struct virtqueue *vq)
  */
 struct vring_desc* virtqueue_pop(struct virtqueue *vq)
 {
-    struct vring_avail *avail;
-    uint16_t avail_idx;
     uint16_t desc_idx;
-    struct vring_desc *desc;
 
-    if (!vq->ready || !vq->desc || !vq->avail)
+    if (!vq->ready || !vq->desc || !vq->avail || !vq->size)
         return NULL;
 
-    avail = vq->avail;
-    avail_idx = avail->idx;
-
-    if (vq->last_avail_idx == avail_idx)
+    if (!virtqueue_avail_pending(vq))
         return NULL;  /* No new descriptors */
 
-    desc_idx = avail->ring[vq->last_avail_idx % vq->size];
-    desc = &vq->desc[desc_idx];
-
+    desc_idx = vq->avail->ring[vq->last_avail_idx % vq->size];
     vq->last_avail_idx++;
 
-    return desc;
+    if (desc_idx >= vq->size) {
+        log_warn("Virtio: descriptor index %u out of range", desc_idx);
+        return NULL;
+    }
+
+    return &vq->desc[desc_idx];
 }
 
 /*
- * Push descriptor to used ring
+ * Give back the last popped chain
  */
-void virtqueue_push(struct virtqueue *vq, uint32_t id, uint32_t len)
+void virtqueue_unpop(struct virtqueue *vq)
 {
-    struct vring_used *used;
-    uint16_t used_idx;
-
-    if (!vq->ready || !vq->used)
+    if (vq->packed) {
+        if (vq->last_avail_idx < vq->popped_slots) {
+            vq->last_avail_idx += vq->size;
+            vq->avail_wrap_counter ^= 1;
+        }
+        vq->last_avail_idx -= vq->popped_slots;
         return;
+    }
 
-    used = vq->used;
-    used_idx = used->idx;
+    vq->last_avail_idx--;
+}
 
-    used->ring[used_idx % vq->size].id = id;
-    used->ring[used_idx % vq->size].len = len;
+/*
+ * Map one descriptor into elem
+ */
+static int virtqueue_map_desc(struct vm *vm, struct virtqueue_elem *elem,
+                              const struct vring_desc *desc)
+{
+    int n;
 
-    used->idx++;
-    vq->last_used_idx++;
+    if (desc->flags & VRING_DESC_F_WRITE) {
+        n = vm_gpa_to_iov(vm, desc->addr, desc->len,
+                          elem->iov + elem->out_num + elem->in_num,
+                          VIRTQUEUE_MAX_SEGS - elem->out_num - elem->in_num);
+        if (n < 0)
+            return -1;
+        elem->in_num += n;
+    } else {
+        if (elem->in_num) {
+            log_warn("Virtio: readable descriptor after writable one");
+            return -1;
+        }
+        n = vm_gpa_to_iov(vm, desc->addr, desc->len, elem->iov + elem->out_num,
+                          VIRTQUEUE_MAX_SEGS - elem->out_num);
+        if (n < 0)
+            return -1;
+        elem->out_num += n;
+    }
 
-    /* Notify guest */
-    virtqueue_notify(vq);
+    return 0;
 }
 
 /*
- * Notify guest about used buffers
+ * Map an indirect descriptor table of entry_size-byte descriptors. The
+ * table is translated once and must lie in one memory slot; it may hold at
+ * most VIRTQUEUE_MAX_SIZE descriptors, which also bounds the walk over
+ * zero-length entries.
  */
-void virtqueue_notify(struct virtqueue *vq)
+static void* virtqueue_map_indirect(struct vm *vm, uint64_t gpa, uint32_t len,
+                                    size_t entry_size, unsigned int *num)
 {
-    /* This would trigger an interrupt to the guest */
-    /* For now, we just set a flag that the hypervisor checks */
-    device_assert_irq(vq->dev);
+    void *table;
+
+    if (len == 0 || len % entry_size || len / entry_size > VIRTQUEUE_MAX_SIZE) {
+        log_warn("Virtio: invalid indirect table size %u", len);
+        return NULL;
+    }
+
+    table = vm_gpa_to_hva(vm, gpa, len);
+    if (!table)
+        return NULL;
+
+    *num = len / entry_size;
+    return table;
 }
 
 /*
- * Handle virtio MMIO read
+ * Walk the chain starting at elem->head (0 on success, -1 if malformed)
  */
-int virtio_mmio_read(struct virtio_dev *vdev, uint64_t offset,
-                      void *data, size_t size)
+static int virtqueue_walk_chain(struct virtqueue *vq, struct virtqueue_elem *elem)
 {
-    uint32_t val = 0;
+    struct vm *vm = vq->dev->vm;
+    struct vring_desc *table = vq->desc;
+    struct vring_desc desc;
+    unsigned int max = vq->size, idx = elem->head, count = 0;
+    int indirect = 0;
 
-    /* Most registers are 32-bit */
-    if (size != 4) {
-        log_warn("Virtio: non-32-bit read");
+    for (;;) {
+        if (idx >= max) {
+            log_warn("Virtio: descriptor index %u out of range", idx);
+            return -1;
+        }
+
+        /* Snapshot: the guest may change the table under us */
+        desc = table[idx];
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (indirect || (desc.flags & VRING_DESC_F_NEXT)) {
+                log_warn("Virtio: invalid indirect descriptor");
+                return -1;
+            }
+
+            table = virtqueue_map_indirect(vm, desc.addr, desc.len,
+                                           sizeof(struct vring_desc), &max);
+            if (!table)
+                return -1;
+
+            idx = 0;
+            count = 0;
+            indirect = 1;
+            continue;
+        }
+
+        /* A chain can't be longer than its table without looping */
+        if (++count > max) {
+            log_warn("Virtio: descriptor chain loop");
+            return -1;
+        }
+
+        if (virtqueue_map_desc(vm, elem, &desc) < 0)
+            return -1;
+
+        if (!(desc.flags & VRING_DESC_F_NEXT))
+            return 0;
+        idx = desc.next;
+    }
+}
+
+/*
+ * Map a packed indirect table (read sequentially, NEXT is not used)
+ */
+static int virtqueue_packed_map_indirect(struct virtqueue *vq,
+                                         struct virtqueue_elem *elem,
+                                         const struct vring_packed_desc *ind)
+{
+    struct vm *vm = vq->dev->vm;
+    struct vring_packed_desc *table;
+    unsigned int i, n;
+
+    table = virtqueue_map_indirect(vm, ind->addr, ind->len, sizeof(*table), &n);
+    if (!table)
         return -1;
+
+    for (i = 0; i < n; i++) {
+        struct vring_packed_desc pd = table[i];
+        struct vring_desc desc = { pd.addr, pd.len, pd.flags, 0 };
+
+        if (pd.flags & VRING_DESC_F_INDIRECT) {
+            log_warn("Virtio: nested indirect descriptor");
+            return -1;
+        }
+        if (virtqueue_map_desc(vm, elem, &desc) < 0)
+            return -1;
     }
 
-    switch (offset) {
-    case 0x00:  /* Magic value */
-        val = VIRTIO_MMIO_MAGIC_VALUE;
-        break;
+    return 0;
+}
 
-    case 0x04:  /* Version */
-        val = 1;  /* Legacy virtio */
-        break;
+/*
+ * Pop the next chain from a packed ring. A chain takes consecutive ring
+ * slots and carries its buffer id in the last one; the slot count is
+ * remembered per id, since the used entry must skip the same number.
+ */
+static int virtqueue_packed_pop_chain(struct virtqueue *vq,
+                                      struct virtqueue_elem *elem)
+{
+    struct vm *vm = vq->dev->vm;
 
-    case 0x08:  /* Device ID */
-        val = vdev->device_id;
-        break;
+    if (!vq->ready || !vq->desc_packed)
+        return 0;
 
-    case 0x0C:  /* Vendor ID */
-        val = 0;  /* No vendor ID */
-        break;
+    while (virtqueue_packed_desc_avail(vq, vq->last_avail_idx,
+                                       vq->avail_wrap_counter)) {
+        struct vring_packed_desc pd;
+        uint16_t idx = vq->last_avail_idx, count = 0;
+        int err = 0;
 
-    case 0x10:  /* Device features */
-        val = vdev->device_features;
-        break;
+        elem->out_num = 0;
+        elem->in_num = 0;
 
-    case 0x14:  /* Device features selector */
-        val = 0;
-        break;
+        do {
+            /* Without an end in sight the ring can't be resynchronized */
+            if (++count > vq->size) {
+                log_warn("Virtio: packed chain longer than the ring, "
+                         "stopping queue %u", vq->index);
+                vq->ready = 0;
+                return 0;
+            }
 
-    case 0x20:  /* Queue num max */
-        val = 32;  /* Maximum queue size */
-        break;
+            /* Snapshot: the guest may change the ring under us */
+            pd = vq->desc_packed[idx];
+            if (++idx == vq->size)
+                idx = 0;
 
-    case 0x24:  /* Queue num */
-        val = vdev->queues[vdev->num_queues > 0 ? vdev->num_queues - 1 : 0].size;
-        break;
+            /* Keep walking a bad chain to find its id */
+            if (err)
+                continue;
 
-    case 0x30:  /* Queue ready */
-        val = vdev->queues[vdev->num_queues > 0 ? vdev->num_queues - 1 : 0].ready;
-        break;
+            if (pd.flags & VRING_DESC_F_INDIRECT) {
+                if (count > 1 || (pd.flags & VRING_DESC_F_NEXT)) {
+                    log_warn("Virtio: invalid indirect descriptor");
+                    err = 1;
+                } else {
+                    err = virtqueue_packed_map_indirect(vq, elem, &pd) < 0;
+                }
+            } else {
+                struct vring_desc desc = { pd.addr, pd.len, pd.flags, 0 };
 
-    case 0x38:  /* Interrupt status */
-        val = 0x01;  /* Interrupt pending */
-        break;
+                err = virtqueue_map_desc(vm, elem, &desc) < 0;
+            }
+        } while (pd.flags & VRING_DESC_F_NEXT);
 
-    case 0x40:  /* Device status */
-        val = vdev->device_status;
-        break;
+        vq->last_avail_idx += count;
+        if (vq->last_avail_idx >= vq->size) {
+            vq->last_avail_idx -= vq->size;
+            vq->avail_wrap_counter ^= 1;
+        }
+        vq->popped_slots = count;
 
-    default:
-        if (offset >= 0x100 && vdev->config_read) {
-            /* Device-specific config */
-            return vdev->config_read(vdev, offset - 0x100, data, size);
-        } else {
-            log_debug("Virtio: read from unknown offset 0x%lx", offset);
+        if (pd.id >= vq->size) {
+            log_warn("Virtio: buffer id %u out of range, stopping queue %u",
+                     pd.id, vq->index);
+            vq->ready = 0;
+            return 0;
         }
-        break;
+        elem->head = pd.id;
+        vq->desc_count[pd.id] = count;
+
+        if (!err)
+            return 1;
+
+        /* Hand malformed chains straight back so the guest doesn't stall */
+        virtqueue_fill(vq, elem->head, 0);
     }
 
-    *(uint32_t *)data = val;
     return 0;
 }
 
 /*
- * Handle virtio MMIO write
+ * Pop the next descriptor chain and map it to iovecs
  */
-int virtio_mmio_write(struct virtio_dev *vdev, uint64_t offset,
-                       const void *data, size_t size)
+int virtqueue_pop_chain(struct virtqueue *vq, struct virtqueue_elem *elem)
 {
-    uint32_t val = *(const uint32_t *)data;
+    if (vq->packed)
+        return virtqueue_packed_pop_chain(vq, elem);
 
-    if (size != 4) {
-        log_warn("Virtio: non-32-bit write");
-        return -1;
-    }
+    if (!vq->ready || !vq->desc || !vq->avail || !vq->size)
+        return 0;
 
-    switch (offset) {
-    case 0x14:  /* Device features selector */
-        /* Not implemented */
-        break;
+    while (virtqueue_avail_pending(vq)) {
+        elem->head = vq->avail->ring[vq->last_avail_idx % vq->size];
+        elem->out_num = 0;
+        elem->in_num = 0;
+        vq->last_avail_idx++;
 
-    case 0x18:  /* Driver features */
-        vdev->driver_features = val;
-        break;
+        if (virtqueue_walk_chain(vq, elem) == 0)
+            return 1;
 
-    case 0x1C:  /* Driver features selector */
-        /* Not implemented */
-        break;
+        /* Hand malformed chains straight back so the guest doesn't stall */
+        if (elem->head < vq->size)
+            virtqueue_fill(vq, elem->head, 0);
+    }
 
-    case 0x20:  /* Guest page size */
-        /* Page size - not used in modern virtio */
-        break;
+    return 0;
+}
 
-    case 0x24:  /* Queue select */
-        /* Select queue - not implemented yet */
-        break;
+/*
+ * Total bytes in an iovec array
+ */
+size_t iov_size(const struct iovec *iov, int cnt)
+{
+    size_t len = 0;
+    int i;
 
-    case 0x28:  /* Queue num */
-        /* Set queue size - not implemented yet */
-        break;
+    for (i = 0; i < cnt; i++)
+        len += iov[i].iov_len;
+    return len;
+}
 
-    case 0x30:  /* Queue ready */
-        /* Set queue ready - not implemented yet */
-        break;
+/*
+ * Copy out of an iovec array, starting offset bytes in
+ */
+size_t iov_to_buf(const struct iovec *iov, int cnt, size_t offset,
+                  void *buf, size_t len)
+{
+    size_t done = 0;
+    int i;
 
-    case 0x34:  /* Queue notify */
-        /* Queue notification - handle this */
-        if (vdev->queue_notify) {
-            struct virtqueue *vq = &vdev->queues[val & 0xFF];
-            vdev->queue_notify(vdev, vq);
+    for (i = 0; i < cnt && done < len; i++) {
+        size_t n;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
         }
-        break;
+        n = MIN(iov[i].iov_len - offset, len - done);
+        memcpy((char *)buf + done, (char *)iov[i].iov_base + offset, n);
+        done += n;
+        offset = 0;
+    }
 
-    case 0x38:  /* Interrupt ACK */
-        /* Acknowledge interrupt */
-        device_deassert_irq(&vdev->device);
-        break;
+    return done;
+}
 
-    case 0x40:  /* Device status */
-        vdev->device_status = val;
+/*
+ * Copy into an iovec array, starting offset bytes in
+ */
+size_t iov_from_buf(const struct iovec *iov, int cnt, size_t offset,
+                    const void *buf, size_t len)
+{
+    size_t done = 0;
+    int i;
 
-        /* Check for driver OK */
-        if (val & VIRTIO_CONFIG_S_DRIVER_OK) {
-            log_info("Virtio device %d: driver OK", vdev->device_id);
+    for (i = 0; i < cnt && done < len; i++) {
+        size_t n;
+
+        if (offset >= iov[i].iov_len) {
+            offset -= iov[i].iov_len;
+            continue;
         }
-        break;
+        n = MIN(iov[i].iov_len - offset, len - done);
+        memcpy((char *)iov[i].iov_base + offset, (const char *)buf + done, n);
+        done += n;
+        offset = 0;
+    }
 
-    default:
-        if (offset >= 0x100 && vdev->config_write) {
-            /* Device-specific config */
-            return vdev->config_write(vdev, offset - 0x100, data, size);
-        } else {
-            log_debug("Virtio: write to unknown offset 0x%lx", offset);
+    return done;
+}
+
+/*
+ * Drop bytes from the front of an iovec array
+ */
+size_t iov_discard_front(struct iovec **iov, int *cnt, size_t len)
+{
+    size_t done = 0;
+
+    while (*cnt > 0 && done < len) {
+        struct iovec *v = *iov;
+        size_t n = MIN(v->iov_len, len - done);
+
+        v->iov_base = (char *)v->iov_base + n;
+        v->iov_len -= n;
+        done += n;
+        if (v->iov_len == 0) {
+            (*iov)++;
+            (*cnt)--;
         }
+    }
+
+    return done;
+}
+
+/*
+ * Drop bytes from the back of an iovec array
+ */
+size_t iov_discard_back(struct iovec *iov, int *cnt, size_t len)
+{
+    size_t done = 0;
+
+    while (*cnt > 0 && done < len) {
+        struct iovec *v = &iov[*cnt - 1];
+        size_t n = MIN(v->iov_len, len - done);
+
+        v->iov_len -= n;
+        done += n;
+        if (v->iov_len == 0)
+            (*cnt)--;
+    }
+
+    return done;
+}
+
+/*
+ * Packed ring: write a used entry over the chain's first slot. All but the
+ * first entry of a batch get their flags now; the first one's flags are
+ * stored by flush, which exposes the whole batch at once since the driver
+ * reads used entries in ring order.
+ */
+static void virtqueue_packed_fill(struct virtqueue *vq, uint32_t id, uint32_t len)
+{
+    struct vring_packed_desc *desc = &vq->desc_packed[vq->used_fill_idx];
+    uint16_t flags = vq->used_fill_wrap ?
+                     VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED : 0;
+
+    desc->id = id;
+    desc->len = len;
+
+    if (vq->used_pending == 0)
+        vq->used_head_flags = flags;
+    else
+        __atomic_store_n(&desc->flags, flags, __ATOMIC_RELEASE);
+    vq->used_pending++;
+
+    /* The entry stands for every slot the chain took */
+    vq->used_fill_idx += id < vq->size ? vq->desc_count[id] : 1;
+    if (vq->used_fill_idx >= vq->size) {
+        vq->used_fill_idx -= vq->size;
+        vq->used_fill_wrap ^= 1;
+    }
+}
+
+/*
+ * Write a used entry without publishing it
+ */
+void virtqueue_fill(struct virtqueue *vq, uint32_t id, uint32_t len)
+{
+    struct vring_used_elem *elem;
+
+    if (!vq->ready)
+        return;
+
+    if (vq->packed) {
+        virtqueue_packed_fill(vq, id, len);
+        return;
+    }
+
+    if (!vq->used)
+        return;
+
+    elem = &vq->used->ring[(uint16_t)(vq->last_used_idx + vq->used_pending) % vq->size];
+    elem->id = id;
+    elem->len = len;
+    vq->used_pending++;
+}
+
+/*
+ * Publish all filled used entries with one index update
+ */
+int virtqueue_flush(struct virtqueue *vq)
+{
+    int n = vq->used_pending;
+
+    if (n == 0)
+        return 0;
+
+    if (vq->packed) {
+        if (!vq->desc_packed)
+            return 0;
+
+        __atomic_store_n(&vq->desc_packed[vq->last_used_idx].flags,
+                         vq->used_head_flags, __ATOMIC_RELEASE);
+
+        /* signalled_used is an offset in the previous lap now */
+        if (vq->used_fill_wrap != vq->used_wrap_counter)
+            vq->signalled_used_valid = 0;
+
+        vq->last_used_idx = vq->used_fill_idx;
+        vq->used_wrap_counter = vq->used_fill_wrap;
+        vq->used_pending = 0;
+        vq->irq_pending += n;
+        vq->stat_completions += n;
+        return n;
+    }
+
+    if (!vq->used)
+        return 0;
+
+    vq->last_used_idx += n;
+    vq->used_pending = 0;
+    vq->irq_pending += n;
+    vq->stat_completions += n;
+
+    /* Entries must be visible before the index that exposes them */
+    __atomic_store_n(&vq->used->idx, vq->last_used_idx, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * Push descriptor to used ring
+ */
+void virtqueue_push(struct virtqueue *vq, uint32_t id, uint32_t len)
+{
+    virtqueue_fill(vq, id, len);
+    if (virtqueue_flush(vq))
+        virtqueue_notify(vq);
+}
+
+/*
+ * Packed ring: consult the driver's event suppression structure
+ */
+static int virtqueue_packed_should_notify(struct virtqueue *vq)
+{
+    uint16_t flags, off_wrap, off, old, new;
+    int valid;
+
+    /* Used flags must be visible before we read the guest's state */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    flags = __atomic_load_n(&vq->driver_event->flags, __ATOMIC_ACQUIRE);
+    off_wrap = __atomic_load_n(&vq->driver_event->off_wrap, __ATOMIC_RELAXED);
+
+    old = vq->signalled_used;
+    valid = vq->signalled_used_valid;
+    new = vq->signalled_used = vq->last_used_idx;
+    vq->signalled_used_valid = 1;
+
+    if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+        return 0;
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC || !vq->event_idx)
+        return 1;
+
+    /* An offset from the previous lap lies before the start of the ring */
+    off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+    if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != vq->used_wrap_counter)
+        off -= vq->size;
+
+    return !valid || vring_need_event(off, new, old);
+}
+
+/*
+ * Decide whether the guest wants an interrupt for the used entries
+ * published since the last one
+ */
+static int virtqueue_should_notify(struct virtqueue *vq)
+{
+    uint16_t old, new;
+    int valid;
+
+    if (vq->packed)
+        return vq->driver_event ? virtqueue_packed_should_notify(vq) : 1;
+
+    if (!vq->avail || !vq->used)
+        return 1;
+
+    /* used->idx must be visible before we read the guest's state */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!vq->event_idx)
+        return !(__atomic_load_n(&vq->avail->flags, __ATOMIC_RELAXED) &
+                 VRING_AVAIL_F_NO_INTERRUPT);
+
+    old = vq->signalled_used;
+    valid = vq->signalled_used_valid;
+    new = vq->signalled_used = vq->last_used_idx;
+    vq->signalled_used_valid = 1;
+
+    return !valid || vring_need_event(__atomic_load_n(vring_used_event(vq),
+                                                      __ATOMIC_RELAXED),
+                                      new, old);
+}
+
+/*
+ * Interrupt the guest now for everything published so far
+ */
+static void virtqueue_raise_irq(struct virtqueue *vq)
+{
+    vq->irq_pending = 0;
+
+    if (!virtqueue_should_notify(vq)) {
+        vq->stat_irqs_suppressed++;
+        return;
+    }
+
+    if (vq->isr)
+        __atomic_or_fetch(vq->isr, VIRTIO_MMIO_INT_VRING, __ATOMIC_RELEASE);
+    device_assert_irq(vq->dev);
+    vq->stat_irqs++;
+}
+
+/*
+ * Start the moderation timer for the oldest unsignalled completion
+ */
+static int virtqueue_arm_coalesce_timer(struct virtqueue *vq)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = vq->coalesce_usecs / 1000000;
+    its.it_value.tv_nsec = (vq->coalesce_usecs % 1000000) * 1000;
+
+    if (timerfd_settime(vq->coalesce_timer_fd, 0, &its, NULL) < 0) {
+        perror("timerfd_settime");
+        return -1;
+    }
+
+    vq->coalesce_timer_armed = 1;
+    return 0;
+}
+
+/*
+ * Notify guest about used buffers
+ *
+ * Under moderation the interrupt is held until coalesce_frames completions
+ * are pending or the timer fires. A timer armed for an earlier batch is
+ * left running, so a held interrupt may come early but never later than
+ * coalesce_usecs.
+ */
+void virtqueue_notify(struct virtqueue *vq)
+{
+    if (vq->coalesce_timer_fd >= 0 &&
+        (vq->coalesce_frames == 0 || vq->irq_pending < vq->coalesce_frames)) {
+        if (vq->coalesce_timer_armed || virtqueue_arm_coalesce_timer(vq) == 0) {
+            vq->stat_irqs_coalesced++;
+            return;
+        }
+    }
+
+    virtqueue_raise_irq(vq);
+}
+
+/*
+ * Interrupt for used buffers published by an external backend
+ */
+void virtqueue_interrupt(struct virtqueue *vq)
+{
+    if (vq->isr)
+        __atomic_or_fetch(vq->isr, VIRTIO_MMIO_INT_VRING, __ATOMIC_RELEASE);
+    device_assert_irq(vq->dev);
+    vq->stat_irqs++;
+}
+
+/*
+ * Move a queue's kicks between its I/O thread and an external backend.
+ * Removing the fd waits for a running kick handler, so the caller must not
+ * hold the queue lock.
+ */
+int virtqueue_set_kick_external(struct virtqueue *vq, int external)
+{
+    if (vq->kick_fd < 0 || !vq->iothread)
+        return -1;
+
+    if (vq->kick_external == external)
+        return 0;
+
+    if (external) {
+        if (iothread_del_fd(vq->iothread, vq->kick_fd) < 0)
+            return -1;
+    } else if (iothread_add_fd(vq->iothread, vq->kick_fd, EPOLLIN,
+                               virtio_kick_handler, vq) < 0) {
+        return -1;
+    }
+
+    vq->kick_external = external;
+    return 0;
+}
+
+/*
+ * Configure interrupt moderation
+ */
+void virtqueue_set_coalescing(struct virtqueue *vq, uint32_t frames, uint32_t usecs)
+{
+    vq->coalesce_frames = frames;
+    vq->coalesce_usecs = usecs;
+}
+
+/*
+ * Ask the guest not to kick while we are draining the queue
+ */
+void virtqueue_disable_notify(struct virtqueue *vq)
+{
+    if (!vq->ready)
+        return;
+
+    /* With EVENT_IDX a stale avail_event already suppresses kicks */
+    if (vq->event_idx)
+        return;
+
+    if (vq->packed && vq->device_event)
+        __atomic_store_n(&vq->device_event->flags,
+                         VRING_PACKED_EVENT_FLAG_DISABLE, __ATOMIC_RELAXED);
+    else if (vq->used)
+        vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+/*
+ * Packed ring: re-enable guest kicks; returns 1 if buffers arrived
+ */
+static int virtqueue_packed_enable_notify(struct virtqueue *vq)
+{
+    uint16_t flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+
+    if (!vq->device_event)
+        return 0;
+
+    if (vq->event_idx) {
+        __atomic_store_n(&vq->device_event->off_wrap,
+                         vq->last_avail_idx |
+                         vq->avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR,
+                         __ATOMIC_RELAXED);
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    }
+    __atomic_store_n(&vq->device_event->flags, flags, __ATOMIC_RELEASE);
+
+    /* Publish the above before re-checking the ring */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return virtqueue_packed_desc_avail(vq, vq->last_avail_idx,
+                                       vq->avail_wrap_counter);
+}
+
+/*
+ * Re-enable guest kicks; returns 1 if buffers arrived in the meantime
+ */
+int virtqueue_enable_notify(struct virtqueue *vq)
+{
+    if (!vq->ready)
+        return 0;
+
+    if (vq->packed)
+        return virtqueue_packed_enable_notify(vq);
+
+    if (!vq->used || !vq->avail)
+        return 0;
+
+    if (vq->event_idx)
+        __atomic_store_n(vring_avail_event(vq), vq->shadow_avail_idx,
+                         __ATOMIC_RELAXED);
+    else
+        vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+
+    /* Publish the above before re-checking avail->idx */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    vq->shadow_avail_idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+    return vq->shadow_avail_idx != vq->last_avail_idx;
+}
+
+/*
+ * Map the selected queue's rings and start it (QueueReady = 1)
+ */
+static int virtio_queue_enable(struct virtio_dev *vdev, struct virtqueue *vq)
+{
+    struct vm *vm = vdev->device.vm;
+    uint64_t desc_size, avail_size, used_size;
+    int packed = !!(vdev->driver_features & (1ULL << VIRTIO_F_RING_PACKED));
+
+    /* Packed rings need not be a power of two */
+    if (vq->size == 0 || vq->size > VIRTQUEUE_MAX_SIZE ||
+        (!packed && (vq->size & (vq->size - 1)))) {
+        log_warn("%s: invalid size %u for queue %u",
+                 vdev->device.name, vq->size, vq->index);
+        return -1;
+    }
+
+    if (packed) {
+        /* Descriptor ring plus the two event suppression structures */
+        vq->desc_packed = vm_gpa_to_hva(vm, vq->desc_gpa,
+                                        sizeof(struct vring_packed_desc) * vq->size);
+        vq->driver_event = vm_gpa_to_hva(vm, vq->avail_gpa,
+                                         sizeof(struct vring_packed_desc_event));
+        vq->device_event = vm_gpa_to_hva(vm, vq->used_gpa,
+                                         sizeof(struct vring_packed_desc_event));
+        if (!vq->desc_packed || !vq->driver_event || !vq->device_event) {
+            log_warn("%s: queue %u rings are not in guest RAM",
+                     vdev->device.name, vq->index);
+            vq->desc_packed = NULL;
+            vq->driver_event = NULL;
+            vq->device_event = NULL;
+            return -1;
+        }
+    } else {
+        /* Rings include the trailing used_event/avail_event words */
+        desc_size = sizeof(struct vring_desc) * vq->size;
+        avail_size = sizeof(struct vring_avail) + sizeof(uint16_t) * (vq->size + 1);
+        used_size = sizeof(struct vring_used) +
+                    sizeof(struct vring_used_elem) * vq->size + sizeof(uint16_t);
+
+        vq->desc = vm_gpa_to_hva(vm, vq->desc_gpa, desc_size);
+        vq->avail = vm_gpa_to_hva(vm, vq->avail_gpa, avail_size);
+        vq->used = vm_gpa_to_hva(vm, vq->used_gpa, used_size);
+        if (!vq->desc || !vq->avail || !vq->used) {
+            log_warn("%s: queue %u rings are not in guest RAM",
+                     vdev->device.name, vq->index);
+            vq->desc = NULL;
+            vq->avail = NULL;
+            vq->used = NULL;
+            return -1;
+        }
+    }
+
+    vq->last_avail_idx = 0;
+    vq->shadow_avail_idx = 0;
+    vq->last_used_idx = 0;
+    vq->used_pending = 0;
+    vq->irq_pending = 0;
+    vq->signalled_used_valid = 0;
+    vq->event_idx = !!(vdev->driver_features & (1ULL << VIRTIO_F_RING_EVENT_IDX));
+
+    /* Both sides start in lap 1 */
+    vq->packed = packed;
+    vq->avail_wrap_counter = packed;
+    vq->used_wrap_counter = packed;
+    vq->used_fill_idx = 0;
+    vq->used_fill_wrap = packed;
+    vq->ready = 1;
+
+    log_debug("%s: queue %u ready (size %u, desc 0x%lx, avail 0x%lx, used 0x%lx)",
+              vdev->device.name, vq->index, vq->size,
+              vq->desc_gpa, vq->avail_gpa, vq->used_gpa);
+    return 0;
+}
+
+/*
+ * Stop a queue and forget its configuration
+ */
+static void virtio_queue_reset(struct virtqueue *vq)
+{
+    vq->ready = 0;
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+    vq->packed = 0;
+    vq->desc_packed = NULL;
+    vq->driver_event = NULL;
+    vq->device_event = NULL;
+    vq->avail_wrap_counter = 0;
+    vq->used_wrap_counter = 0;
+    vq->used_fill_idx = 0;
+    vq->used_fill_wrap = 0;
+    vq->size = 0;
+    vq->desc_gpa = 0;
+    vq->avail_gpa = 0;
+    vq->used_gpa = 0;
+    vq->last_avail_idx = 0;
+    vq->shadow_avail_idx = 0;
+    vq->last_used_idx = 0;
+    vq->used_pending = 0;
+    vq->irq_pending = 0;
+    vq->event_idx = 0;
+    vq->signalled_used_valid = 0;
+}
+
+/*
+ * Device reset (Status = 0)
+ */
+static void virtio_reset(struct virtio_dev *vdev)
+{
+    int i;
+
+    if ((vdev->device_status & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->stop)
+        vdev->stop(vdev);
+
+    /* Queues are kicked regardless of DRIVER_OK */
+    if (vdev->drain)
+        vdev->drain(vdev);
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        pthread_mutex_lock(&vdev->queues[i].lock);
+        virtio_queue_reset(&vdev->queues[i]);
+        pthread_mutex_unlock(&vdev->queues[i].lock);
+    }
+
+    vdev->driver_features = 0;
+    vdev->device_features_sel = 0;
+    vdev->driver_features_sel = 0;
+    vdev->queue_sel = 0;
+    vdev->device_status = 0;
+    __atomic_store_n(&vdev->interrupt_status, 0, __ATOMIC_RELAXED);
+    device_deassert_irq(&vdev->device);
+
+    if (vdev->reset)
+        vdev->reset(vdev);
+
+    log_debug("%s: reset", vdev->device.name);
+}
+
+/*
+ * Queue currently selected by QueueSel, or NULL
+ */
+static struct virtqueue* virtio_selected_queue(struct virtio_dev *vdev)
+{
+    if (vdev->queue_sel >= (uint32_t)vdev->num_queues)
+        return NULL;
+    return &vdev->queues[vdev->queue_sel];
+}
+
+/*
+ * Parse a "key=<unsigned>" device option
+ */
+int virtio_parse_uint_opt(const char *opt, const char *key, uint32_t *val)
+{
+    size_t len = strlen(key);
+    unsigned long v;
+    char *end;
+
+    if (strncmp(opt, key, len) != 0 || opt[len] != '=')
+        return 0;
+
+    errno = 0;
+    v = strtoul(opt + len + 1, &end, 10);
+    if (errno || end == opt + len + 1 || *end || v > UINT32_MAX) {
+        log_error("Invalid value for %s: %s", key, opt + len + 1);
+        return -1;
+    }
+
+    *val = v;
+    return 1;
+}
+
+/*
+ * Check a parsed frames/usecs pair for virtqueue_set_coalescing()
+ */
+int virtio_check_coalescing(const char *frames_key, uint32_t frames,
+                            const char *usecs_key, uint32_t usecs)
+{
+    /* The frame limit only cuts a held interrupt short; nothing is held without usecs */
+    if (frames && !usecs) {
+        log_error("%s needs %s", frames_key, usecs_key);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Interrupt still unacknowledged by the guest (device_ops.irq_pending)
+ */
+int virtio_irq_pending(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+
+    return __atomic_load_n(&vdev->interrupt_status, __ATOMIC_ACQUIRE) != 0;
+}
+
+/*
+ * Set DEVICE_NEEDS_RESET and tell the driver with a configuration change
+ * interrupt. The bit stays set until the driver writes Status 0.
+ */
+void virtio_set_needs_reset(struct virtio_dev *vdev)
+{
+    vdev->device_status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+    __atomic_or_fetch(&vdev->interrupt_status, VIRTIO_MMIO_INT_CONFIG, __ATOMIC_RELEASE);
+    device_assert_irq(&vdev->device);
+    log_warn("%s: device needs reset", vdev->device.name);
+}
+
+/*
+ * Print per-queue statistics (device_ops.print_stats)
+ */
+void virtio_print_stats(struct device *dev)
+{
+    struct virtio_dev *vdev = container_of(dev, struct virtio_dev, device);
+    char line[128];
+    int i;
+
+    fprintf(stderr, "\n");
+    fprintf(stderr, "╔══════════════════════════════════════════════════════════════════╗\n");
+    snprintf(line, sizeof(line), "%s Statistics", dev->name);
+    fprintf(stderr, "║  %-64s║\n", line);
+    fprintf(stderr, "╠══════════════════════════════════════════════════════════════════╣\n");
+
+    for (i = 0; i < vdev->num_queues; i++) {
+        struct virtqueue *vq = &vdev->queues[i];
+
+        pthread_mutex_lock(&vq->lock);
+        snprintf(line, sizeof(line), "Queue %d:", i);
+        fprintf(stderr, "║  %-64s║\n", line);
+        snprintf(line, sizeof(line), "  Completions:        %20lu", vq->stat_completions);
+        fprintf(stderr, "║  %-64s║\n", line);
+        snprintf(line, sizeof(line), "  Interrupts:         %20lu", vq->stat_irqs);
+        fprintf(stderr, "║  %-64s║\n", line);
+        snprintf(line, sizeof(line), "  Suppressed (guest): %20lu", vq->stat_irqs_suppressed);
+        fprintf(stderr, "║  %-64s║\n", line);
+        snprintf(line, sizeof(line), "  Coalesced:          %20lu", vq->stat_irqs_coalesced);
+        fprintf(stderr, "║  %-64s║\n", line);
+        if (vq->stat_irqs) {
+            snprintf(line, sizeof(line), "  Completions/IRQ:    %20.1f",
+                     (double)vq->stat_completions / vq->stat_irqs);
+            fprintf(stderr, "║  %-64s║\n", line);
+        }
+        if (vq->coalesce_usecs) {
+            if (vq->coalesce_frames)
+                snprintf(line, sizeof(line), "  Moderation:         %17u us, %u frames",
+                         vq->coalesce_usecs, vq->coalesce_frames);
+            else
+                snprintf(line, sizeof(line), "  Moderation:         %17u us",
+                         vq->coalesce_usecs);
+            fprintf(stderr, "║  %-64s║\n", line);
+        }
+        pthread_mutex_unlock(&vq->lock);
+    }
+
+    fprintf(stderr, "╚══════════════════════════════════════════════════════════════════╝\n");
+}
+
+/*
+ * Handle virtio MMIO read
+ */
+int virtio_mmio_read(struct virtio_dev *vdev, uint64_t offset,
+                      void *data, size_t size)
+{
+    struct virtqueue *vq;
+    uint32_t val = 0;
+
+    /* Device-specific config allows 8/16/32-bit accesses */
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        int ret = 0;
+
+        pthread_mutex_lock(&vdev->lock);
+        if (vdev->config_read)
+            ret = vdev->config_read(vdev, offset - VIRTIO_MMIO_CONFIG, data, size);
+        else
+            memset(data, 0, size);
+        pthread_mutex_unlock(&vdev->lock);
+        return ret;
+    }
+
+    /* Registers are 32-bit */
+    if (size != 4) {
+        log_warn("Virtio: %zu-byte read at 0x%lx", size, offset);
+        return -1;
+    }
+
+    pthread_mutex_lock(&vdev->lock);
+    vq = virtio_selected_queue(vdev);
+
+    switch (offset) {
+    case VIRTIO_MMIO_MAGIC_VALUE:
+        val = VIRTIO_MMIO_MAGIC;
+        break;
+
+    case VIRTIO_MMIO_VERSION:
+        val = 2;
+        break;
+
+    case VIRTIO_MMIO_DEVICE_ID:
+        val = vdev->device_id;
+        break;
+
+    case VIRTIO_MMIO_VENDOR_ID:
+        val = 0;  /* No vendor ID */
+        break;
+
+    case VIRTIO_MMIO_DEVICE_FEATURES:
+        if (vdev->device_features_sel < 2)
+            val = vdev->device_features >> (32 * vdev->device_features_sel);
+        break;
+
+    case VIRTIO_MMIO_QUEUE_NUM_MAX:
+        val = vq ? VIRTQUEUE_MAX_SIZE : 0;
+        break;
+
+    case VIRTIO_MMIO_QUEUE_READY:
+        val = vq ? vq->ready : 0;
+        break;
+
+    case VIRTIO_MMIO_INTERRUPT_STATUS:
+        val = __atomic_load_n(&vdev->interrupt_status, __ATOMIC_ACQUIRE);
+        break;
+
+    case VIRTIO_MMIO_STATUS:
+        val = vdev->device_status;
+        break;
+
+    case VIRTIO_MMIO_CONFIG_GENERATION:
+        val = vdev->config_generation;
+        break;
+
+    default:
+        log_debug("Virtio: read from unknown offset 0x%lx", offset);
+        break;
+    }
+
+    pthread_mutex_unlock(&vdev->lock);
+
+    *(uint32_t *)data = val;
+    return 0;
+}
+
+/*
+ * Handle a Status register write
+ */
+static void virtio_set_status(struct virtio_dev *vdev, uint32_t val)
+{
+    if (val == 0) {
+        virtio_reset(vdev);
+        return;
+    }
+
+    /* Only a reset clears what the device set */
+    val |= vdev->device_status & VIRTIO_CONFIG_S_NEEDS_RESET;
+
+    /* The driver may only accept features we offered */
+    if ((val & VIRTIO_CONFIG_S_FEATURES_OK) &&
+        !(vdev->device_status & VIRTIO_CONFIG_S_FEATURES_OK) &&
+        (vdev->driver_features & ~vdev->device_features)) {
+        log_warn("%s: driver accepted unoffered features 0x%lx",
+                 vdev->device.name, vdev->driver_features & ~vdev->device_features);
+        val &= ~VIRTIO_CONFIG_S_FEATURES_OK;
+    }
+
+    if ((val & VIRTIO_CONFIG_S_FEATURES_OK) &&
+        !(vdev->device_status & VIRTIO_CONFIG_S_FEATURES_OK) && vdev->set_features)
+        vdev->set_features(vdev, vdev->driver_features);
+
+    if ((val & VIRTIO_CONFIG_S_DRIVER_OK) &&
+        !(vdev->device_status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        log_info("Virtio device %d: driver OK (features 0x%lx)",
+                 vdev->device_id, vdev->driver_features);
+        vdev->device_status = val;
+        if (vdev->start)
+            vdev->start(vdev);
+        return;
+    }
+
+    vdev->device_status = val;
+}
+
+/*
+ * Handle virtio MMIO write
+ */
+int virtio_mmio_write(struct virtio_dev *vdev, uint64_t offset,
+                       const void *data, size_t size)
+{
+    struct virtqueue *vq;
+    uint32_t val;
+
+    if (offset >= VIRTIO_MMIO_CONFIG) {
+        int ret = 0;
+
+        pthread_mutex_lock(&vdev->lock);
+        if (vdev->config_write)
+            ret = vdev->config_write(vdev, offset - VIRTIO_MMIO_CONFIG, data, size);
+        pthread_mutex_unlock(&vdev->lock);
+        return ret;
+    }
+
+    if (size != 4) {
+        log_warn("Virtio: %zu-byte write at 0x%lx", size, offset);
+        return -1;
+    }
+    val = *(const uint32_t *)data;
+
+    /*
+     * Queue notify: hand the kick to the I/O thread. This path is only
+     * taken when the hypervisor could not attach an ioeventfd.
+     */
+    if (offset == VIRTIO_MMIO_QUEUE_NOTIFY) {
+        uint64_t one = 1;
+
+        if (val >= (uint32_t)vdev->num_queues) {
+            log_warn("Virtio: notify for invalid queue %u", val);
+            return 0;
+        }
+
+        vq = &vdev->queues[val];
+        if (vq->kick_fd >= 0 && vq->iothread) {
+            if (write(vq->kick_fd, &one, sizeof(one)) != sizeof(one))
+                perror("write eventfd");
+        } else {
+            virtio_process_queue(vdev, vq);
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&vdev->lock);
+    vq = virtio_selected_queue(vdev);
+
+    switch (offset) {
+    case VIRTIO_MMIO_DEVICE_FEATURES_SEL:
+        vdev->device_features_sel = val;
+        break;
+
+    case VIRTIO_MMIO_DRIVER_FEATURES:
+        if (vdev->device_status & VIRTIO_CONFIG_S_FEATURES_OK) {
+            log_warn("%s: feature write after FEATURES_OK", vdev->device.name);
+        } else if (vdev->driver_features_sel < 2) {
+            int shift = 32 * vdev->driver_features_sel;
+
+            vdev->driver_features &= ~(0xffffffffULL << shift);
+            vdev->driver_features |= (uint64_t)val << shift;
+        }
+        break;
+
+    case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+        vdev->driver_features_sel = val;
+        break;
+
+    case VIRTIO_MMIO_QUEUE_SEL:
+        vdev->queue_sel = val;
+        break;
+
+    case VIRTIO_MMIO_QUEUE_NUM:
+        if (vq && !vq->ready)
+            vq->size = val;
+        break;
+
+    case VIRTIO_MMIO_QUEUE_READY:
+        if (!vq)
+            break;
+        /* The queue's I/O thread may be draining it */
+        pthread_mutex_lock(&vq->lock);
+        if (val && !vq->ready)
+            virtio_queue_enable(vdev, vq);
+        else if (!val)
+            vq->ready = 0;
+        pthread_mutex_unlock(&vq->lock);
+        break;
+
+    case VIRTIO_MMIO_QUEUE_DESC_LOW:
+    case VIRTIO_MMIO_QUEUE_DESC_HIGH:
+    case VIRTIO_MMIO_QUEUE_AVAIL_LOW:
+    case VIRTIO_MMIO_QUEUE_AVAIL_HIGH:
+    case VIRTIO_MMIO_QUEUE_USED_LOW:
+    case VIRTIO_MMIO_QUEUE_USED_HIGH: {
+        uint64_t *gpa;
+        int shift = (offset & 0x4) ? 32 : 0;
+
+        if (!vq || vq->ready)
+            break;
+
+        if (offset < VIRTIO_MMIO_QUEUE_AVAIL_LOW)
+            gpa = &vq->desc_gpa;
+        else if (offset < VIRTIO_MMIO_QUEUE_USED_LOW)
+            gpa = &vq->avail_gpa;
+        else
+            gpa = &vq->used_gpa;
+
+        *gpa &= ~(0xffffffffULL << shift);
+        *gpa |= (uint64_t)val << shift;
+        break;
+    }
+
+    case VIRTIO_MMIO_INTERRUPT_ACK:
+        /* Lower the line once nothing is left pending */
+        if (__atomic_and_fetch(&vdev->interrupt_status, ~val, __ATOMIC_ACQ_REL) == 0)
+            device_deassert_irq(&vdev->device);
+        break;
+
+    case VIRTIO_MMIO_STATUS:
+        virtio_set_status(vdev, val);
+        break;
+
+    default:
+        log_debug("Virtio: write to unknown offset 0x%lx", offset);
         break;
     }
 
+    pthread_mutex_unlock(&vdev->lock);
     return 0;
 }
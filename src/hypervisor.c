@@ -14,11 +14,28 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 
-/* External hypervisor ops tables */
+/* External hypervisor ops tables (only the backends built for this host) */
+#if defined(__linux__)
+#define HAVE_KVM_OPS
+#elif defined(__APPLE__) && defined(__aarch64__)
+#define HAVE_KVM_OPS        /* kvm_stub.c */
+#define HAVE_HVF_OPS        /* hvf_stub.c */
+#define HAVE_HVF_ARM64_OPS
+#elif defined(__APPLE__)
+#define HAVE_HVF_OPS
+#endif
+
+#ifdef HAVE_KVM_OPS
 extern const struct hv_ops kvm_ops;
+#endif
+#ifdef HAVE_HVF_OPS
 extern const struct hv_ops hvf_ops;
+#endif
+#ifdef HAVE_HVF_ARM64_OPS
 extern const struct hv_ops hvf_arm64_ops;
+#endif
 
 /* Current hypervisor ops */
 static const struct hv_ops *g_hv_ops = NULL;
@@ -57,22 +74,28 @@ int hv_init(enum hv_type type)
     /* Select hypervisor ops based on type */
     switch (type) {
     case HV_TYPE_KVM:
+#ifdef HAVE_KVM_OPS
         g_hv_ops = &kvm_ops;
+#endif
         break;
 
     case HV_TYPE_HVF_X86_64:
+#ifdef HAVE_HVF_OPS
         g_hv_ops = &hvf_ops;
+#endif
         break;
 
     case HV_TYPE_HVF_ARM64:
+#ifdef HAVE_HVF_ARM64_OPS
         g_hv_ops = &hvf_arm64_ops;
+#endif
         break;
 
     case HV_TYPE_HVF:
         /* Legacy HVF - select based on host arch */
-#ifdef __x86_64__
+#if defined(__x86_64__) && defined(HAVE_HVF_OPS)
         g_hv_ops = &hvf_ops;
-#else
+#elif defined(HAVE_HVF_ARM64_OPS)
         g_hv_ops = &hvf_arm64_ops;
 #endif
         break;
@@ -83,7 +106,7 @@ int hv_init(enum hv_type type)
     }
 
     if (!g_hv_ops) {
-        log_error("Hypervisor ops not set");
+        log_error("Hypervisor ops not set (backend not built for this host)");
         return -1;
     }
 
@@ -190,7 +213,7 @@ int hv_vcpu_exit(struct hv_vcpu *vcpu)
     if (!g_hv_ops)
         return -1;
 
-    /* Only ARM64/HVF needs explicit exit request */
+    /* HVF kicks the vCPU itself; KVM only arms immediate_exit */
     if (g_hv_ops->vcpu_exit)
         return g_hv_ops->vcpu_exit(vcpu);
 
@@ -249,6 +272,17 @@ int hv_get_exit(struct hv_vcpu *vcpu, struct hv_exit *exit)
     return g_hv_ops->get_exit(vcpu, exit);
 }
 
+/*
+ * Complete a handled exit
+ */
+int hv_complete_exit(struct hv_vcpu *vcpu, const struct hv_exit *exit)
+{
+    if (!g_hv_ops || !g_hv_ops->complete_exit)
+        return 0;
+
+    return g_hv_ops->complete_exit(vcpu, exit);
+}
+
 /*
  * Get general registers
  */
@@ -293,6 +327,19 @@ int hv_set_sregs(struct hv_vcpu *vcpu, const struct hv_sregs *sregs)
     return g_hv_ops->set_sregs(vcpu, sregs);
 }
 
+/*
+ * Create in-kernel interrupt controllers and timer
+ */
+int hv_create_irqchip(struct hv_vm *vm)
+{
+    if (!g_hv_ops || !g_hv_ops->create_irqchip) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return g_hv_ops->create_irqchip(vm);
+}
+
 /*
  * Assert/deassert IRQ line
  */
@@ -303,3 +350,43 @@ int hv_irq_line(struct hv_vm *vm, int irq, int level)
 
     return g_hv_ops->irq_line(vm, irq, level);
 }
+
+/*
+ * Attach/detach an irqfd
+ */
+int hv_irqfd(struct hv_vm *vm, int fd, int resample_fd, int gsi, int assign)
+{
+    if (!g_hv_ops || !g_hv_ops->irqfd) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return g_hv_ops->irqfd(vm, fd, resample_fd, gsi, assign);
+}
+
+/*
+ * Attach/detach an ioeventfd
+ */
+int hv_ioeventfd(struct hv_vm *vm, int fd, uint64_t addr, uint32_t len,
+                 uint64_t datamatch, uint32_t flags, int assign)
+{
+    if (!g_hv_ops || !g_hv_ops->ioeventfd) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return g_hv_ops->ioeventfd(vm, fd, addr, len, datamatch, flags, assign);
+}
+
+/*
+ * Set the in-kernel halt-poll limit
+ */
+int hv_set_halt_poll(struct hv_vm *vm, uint64_t max_ns)
+{
+    if (!g_hv_ops || !g_hv_ops->set_halt_poll) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    return g_hv_ops->set_halt_poll(vm, max_ns);
+}
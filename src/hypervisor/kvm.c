@@ -34,11 +34,19 @@
 #define KVM_SET_SREGS             _IOW(KVMIO, 0x84, struct kvm_sregs)
 #define KVM_RUN                   _IO(KVMIO, 0x80)
 #define KVM_SET_USER_MEMORY_REGION _IOW(KVMIO, 0x46, struct kvm_userspace_memory_region)
+#define KVM_CREATE_IRQCHIP        _IO(KVMIO, 0x60)
 #define KVM_IRQ_LINE              _IOW(KVMIO, 0x61, struct kvm_irq_level)
+#define KVM_CREATE_PIT2           _IOW(KVMIO, 0x77, struct kvm_pit_config)
+#define KVM_IRQFD                 _IOW(KVMIO, 0x76, struct kvm_irqfd)
+#define KVM_IOEVENTFD             _IOW(KVMIO, 0x79, struct kvm_ioeventfd)
 #define KVM_SET_MSRS              _IOW(KVMIO, 0x89, struct kvm_msrs)
 #define KVM_GET_MSRS              _IOW(KVMIO, 0x88, struct kvm_msrs)
 #define KVM_GET_CPUID2            _IOWR(KVMIO, 0x91, struct kvm_cpuid2)
 #define KVM_SET_CPUID2            _IOW(KVMIO, 0x8a, struct kvm_cpuid2)
+#define KVM_ENABLE_CAP            _IOW(KVMIO, 0xa3, struct kvm_enable_cap)
+
+/* KVM capabilities */
+#define KVM_CAP_HALT_POLL         182
 
 /* KVM exit reasons */
 #define KVM_EXIT_UNKNOWN          0
@@ -68,6 +76,10 @@
 #define KVM_EXIT_IOAPIC_EOI     26
 #define KVM_EXIT_HYPERV         27
 
+/* kvm_run.io.direction */
+#define KVM_EXIT_IO_IN          0
+#define KVM_EXIT_IO_OUT         1
+
 /* KVM memory region flags */
 #define KVM_MEM_LOG_DIRTY_PAGES  (1UL << 0)
 #define KVM_MEM_READONLY         (1UL << 1)
@@ -81,29 +93,11 @@ struct kvm_regs {
     uint64_t rip, rflags;
 };
 
-struct kvm_sregs {
-    struct {
-        uint64_t base;
-        uint32_t limit;
-        uint16_t selector;
-        uint16_t ar;
-    } cs, ds, es, fs, gs, ss, ldt, tr;
-    struct {
-        uint64_t base;
-        uint32_t limit;
-        uint32_t ar;
-    } gdt, idt;
-    uint64_t cr0, cr2, cr3, cr4, cr8;
-    uint64_t efer;
-    uint64_t apic_base;
-    uint64_t interrupt_bitmap[16];
-};
-
 struct kvm_segment {
     uint64_t base;
     uint32_t limit;
     uint16_t selector;
-    uint16_t type;
+    uint8_t  type;
     uint8_t  present, dpl, db, s, l, g, avl;
     uint8_t  unusable;
     uint8_t  padding;
@@ -115,6 +109,16 @@ struct kvm_dtable {
     uint16_t padding[3];
 };
 
+struct kvm_sregs {
+    struct kvm_segment cs, ds, es, fs, gs, ss;
+    struct kvm_segment tr, ldt;
+    struct kvm_dtable gdt, idt;
+    uint64_t cr0, cr2, cr3, cr4, cr8;
+    uint64_t efer;
+    uint64_t apic_base;
+    uint64_t interrupt_bitmap[(256 + 63) / 64];
+};
+
 struct kvm_userspace_memory_region {
     uint32_t slot;
     uint32_t flags;
@@ -131,15 +135,67 @@ struct kvm_irq_level {
     uint32_t level;
 };
 
+struct kvm_pit_config {
+    uint32_t flags;
+    uint32_t pad[15];
+};
+
+#define KVM_PIT_SPEAKER_DUMMY    (1 << 0)
+
+struct kvm_irqfd {
+    uint32_t fd;
+    uint32_t gsi;
+    uint32_t flags;
+    uint32_t resamplefd;
+    uint8_t  pad[16];
+};
+
+#define KVM_IRQFD_FLAG_DEASSIGN  (1 << 0)
+#define KVM_IRQFD_FLAG_RESAMPLE  (1 << 1)
+
+struct kvm_enable_cap {
+    uint32_t cap;
+    uint32_t flags;
+    uint64_t args[4];
+    uint8_t  pad[64];
+};
+
+struct kvm_ioeventfd {
+    uint64_t datamatch;
+    uint64_t addr;
+    uint32_t len;
+    int32_t  fd;
+    uint32_t flags;
+    uint8_t  pad[36];
+};
+
+#define KVM_IOEVENTFD_FLAG_DATAMATCH  (1 << 0)
+#define KVM_IOEVENTFD_FLAG_PIO        (1 << 1)
+#define KVM_IOEVENTFD_FLAG_DEASSIGN   (1 << 2)
+
 struct kvm_run {
     uint8_t request_interrupt_window;
-    uint8_t padding1[7];
+    uint8_t immediate_exit;
+    uint8_t padding1[6];
     uint32_t exit_reason;
     uint8_t ready_for_interrupt_injection;
     uint8_t if_flag;
-    uint8_t padding2[2];
+    uint16_t flags;
+    uint64_t cr8;
+    uint64_t apic_base;
 
     union {
+        struct {
+            uint64_t hardware_entry_failure_reason;
+            uint32_t cpu;
+        } fail_entry;
+        struct {
+            uint8_t  direction;         /* KVM_EXIT_IO_IN/OUT */
+            uint8_t  size;
+            uint16_t port;
+            uint32_t count;
+            uint64_t data_offset;       /* From the start of kvm_run */
+        } io;
         struct {
             uint64_t phys_addr;
             uint8_t  data[8];
@@ -147,27 +203,11 @@ struct kvm_run {
             uint8_t  is_write;
         } mmio;
         struct {
-            uint64_t phys_addr;
-            uint64_t data;
-            uint32_t len;
-            uint8_t  is_write;
-        } mmio_ex;
-        struct {
-            uint16_t direction;
-            uint16_t size;
-            uint16_t port;
-            uint16_t count;
-            uint64_t data_offset;
-        } io;
-        struct {
-            struct {
-                uint64_t addr;
-                uint64_t length;
-                uint8_t  is_write;
-            } data[2];
+            uint32_t suberror;
             uint32_t ndata;
-            uint32_t flags;
+            uint64_t data[16];
         } internal;
+        char padding[256];
     } u;
 };
 
@@ -194,12 +234,14 @@ static int kvm_vm_get_fd(struct hv_vm *vm);
 static struct hv_vcpu* kvm_create_vcpu(struct hv_vm *vm, int index);
 static void kvm_destroy_vcpu(struct hv_vcpu *vcpu);
 static int kvm_vcpu_get_fd(struct hv_vcpu *vcpu);
+static int kvm_vcpu_exit(struct hv_vcpu *vcpu);
 
 static int kvm_map_mem(struct hv_vm *vm, struct hv_memory_slot *slot);
 static int kvm_unmap_mem(struct hv_vm *vm, uint32_t slot);
 
 static int kvm_run(struct hv_vcpu *vcpu);
 static int kvm_get_exit(struct hv_vcpu *vcpu, struct hv_exit *exit);
+static int kvm_complete_exit(struct hv_vcpu *vcpu, const struct hv_exit *exit);
 
 static int kvm_get_regs(struct hv_vcpu *vcpu, struct hv_regs *regs);
 static int kvm_set_regs(struct hv_vcpu *vcpu, const struct hv_regs *regs);
@@ -207,7 +249,12 @@ static int kvm_set_regs(struct hv_vcpu *vcpu, const struct hv_regs *regs);
 static int kvm_get_sregs(struct hv_vcpu *vcpu, struct hv_sregs *sregs);
 static int kvm_set_sregs(struct hv_vcpu *vcpu, const struct hv_sregs *sregs);
 
+static int kvm_create_irqchip(struct hv_vm *vm);
 static int kvm_irq_line(struct hv_vm *vm, int irq, int level);
+static int kvm_irqfd(struct hv_vm *vm, int fd, int resample_fd, int gsi, int assign);
+static int kvm_ioeventfd(struct hv_vm *vm, int fd, uint64_t addr, uint32_t len,
+                         uint64_t datamatch, uint32_t flags, int assign);
+static int kvm_set_halt_poll(struct hv_vm *vm, uint64_t max_ns);
 
 /* KVM ops table */
 const struct hv_ops kvm_ops = {
@@ -221,12 +268,14 @@ const struct hv_ops kvm_ops = {
     .create_vcpu = kvm_create_vcpu,
     .destroy_vcpu = kvm_destroy_vcpu,
     .vcpu_get_fd = kvm_vcpu_get_fd,
+    .vcpu_exit = kvm_vcpu_exit,
 
     .map_mem = kvm_map_mem,
     .unmap_mem = kvm_unmap_mem,
 
     .run = kvm_run,
     .get_exit = kvm_get_exit,
+    .complete_exit = kvm_complete_exit,
 
     .get_regs = kvm_get_regs,
     .set_regs = kvm_set_regs,
@@ -234,7 +283,11 @@ const struct hv_ops kvm_ops = {
     .get_sregs = kvm_get_sregs,
     .set_sregs = kvm_set_sregs,
 
+    .create_irqchip = kvm_create_irqchip,
     .irq_line = kvm_irq_line,
+    .irqfd = kvm_irqfd,
+    .ioeventfd = kvm_ioeventfd,
+    .set_halt_poll = kvm_set_halt_poll,
 };
 
 /*
@@ -435,6 +488,19 @@ static int kvm_vcpu_get_fd(struct hv_vcpu *vcpu)
     return vcpu->fd;
 }
 
+/*
+ * Make the next (or a signal-interrupted) KVM_RUN return EINTR without
+ * entering the guest. The caller signals the vCPU thread to get it out
+ * of a KVM_RUN already in progress.
+ */
+static int kvm_vcpu_exit(struct hv_vcpu *vcpu)
+{
+    struct kvm_vcpu_data *data = vcpu->data;
+
+    __atomic_store_n(&data->run->immediate_exit, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
 /*
  * Map memory into VM
  */
@@ -490,10 +556,11 @@ static int kvm_run(struct hv_vcpu *vcpu)
     struct kvm_vcpu_data *data = vcpu->data;
 
     if (ioctl(vcpu->fd, KVM_RUN, 0) < 0) {
-        if (errno == EINTR) {
-            return 0;  /* Interrupted by signal */
-        }
-        perror("KVM_RUN");
+        /* Interrupted or asked to exit: no exit to handle, errno says so */
+        if (errno == EINTR)
+            data->run->immediate_exit = 0;
+        else
+            perror("KVM_RUN");
         return -1;
     }
 
@@ -531,13 +598,14 @@ static int kvm_get_exit(struct hv_vcpu *vcpu, struct hv_exit *exit)
 
     switch (run->exit_reason) {
     case KVM_EXIT_IO:
-        exit->u.io.direction = (run->u.io.direction == 0) ? HV_IO_IN : HV_IO_OUT;
+        exit->u.io.direction = (run->u.io.direction == KVM_EXIT_IO_IN) ?
+                               HV_IO_IN : HV_IO_OUT;
         exit->u.io.size = run->u.io.size;
         exit->u.io.port = run->u.io.port;
-        if (run->u.io.direction == 0) {
+        if (run->u.io.direction == KVM_EXIT_IO_OUT) {
             memcpy(&exit->u.io.data,
                    (uint8_t *)run + run->u.io.data_offset,
-                   run->u.io.size);
+                   MIN(run->u.io.size, sizeof(exit->u.io.data)));
         }
         break;
 
@@ -546,16 +614,48 @@ static int kvm_get_exit(struct hv_vcpu *vcpu, struct hv_exit *exit)
         exit->u.mmio.size = run->u.mmio.len;
         exit->u.mmio.is_write = run->u.mmio.is_write;
         if (run->u.mmio.is_write) {
-            memcpy(&exit->u.mmio.data, run->u.mmio.data, run->u.mmio.len);
+            memcpy(&exit->u.mmio.data, run->u.mmio.data,
+                   MIN(run->u.mmio.len, sizeof(exit->u.mmio.data)));
         }
         break;
 
     case KVM_EXIT_FAIL_ENTRY:
-        exit->u.error_code = *(uint64_t *)run;
+        exit->u.error_code = run->u.fail_entry.hardware_entry_failure_reason;
         break;
 
     case KVM_EXIT_INTERNAL_ERROR:
-        exit->u.error_code = run->u.internal.ndata;
+        exit->u.error_code = run->u.internal.suberror;
+        break;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/*
+ * Hand the result of an emulated IN or MMIO read back to KVM, which
+ * completes the instruction on the next KVM_RUN
+ */
+static int kvm_complete_exit(struct hv_vcpu *vcpu, const struct hv_exit *exit)
+{
+    struct kvm_vcpu_data *data = vcpu->data;
+    struct kvm_run *run = data->run;
+
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+        if (run->u.io.direction == KVM_EXIT_IO_IN) {
+            memcpy((uint8_t *)run + run->u.io.data_offset, &exit->u.io.data,
+                   MIN(run->u.io.size, sizeof(exit->u.io.data)));
+        }
+        break;
+
+    case KVM_EXIT_MMIO:
+        if (!run->u.mmio.is_write) {
+            memcpy(run->u.mmio.data, &exit->u.mmio.data,
+                   MIN(run->u.mmio.len, sizeof(exit->u.mmio.data)));
+        }
         break;
 
     default:
@@ -634,6 +734,46 @@ static int kvm_set_regs(struct hv_vcpu *vcpu, const struct hv_regs *regs)
     return 0;
 }
 
+/*
+ * Segment access rights, in the VMX layout hv_sregs uses:
+ * type[3:0] s[4] dpl[6:5] p[7] avl[12] l[13] db[14] g[15] unusable[16]
+ */
+static uint32_t kvm_segment_ar(const struct kvm_segment *seg)
+{
+    return seg->type | seg->s << 4 | seg->dpl << 5 | seg->present << 7 |
+           seg->avl << 12 | seg->l << 13 | seg->db << 14 | seg->g << 15 |
+           seg->unusable << 16;
+}
+
+static void kvm_segment_set_ar(struct kvm_segment *seg, uint32_t ar)
+{
+    seg->type = ar & 0xf;
+    seg->s = (ar >> 4) & 1;
+    seg->dpl = (ar >> 5) & 3;
+    seg->present = (ar >> 7) & 1;
+    seg->avl = (ar >> 12) & 1;
+    seg->l = (ar >> 13) & 1;
+    seg->db = (ar >> 14) & 1;
+    seg->g = (ar >> 15) & 1;
+    seg->unusable = (ar >> 16) & 1;
+}
+
+#define KVM_SEG_GET(dst, src)                       \
+    do {                                            \
+        (dst).selector = (src).selector;            \
+        (dst).base = (src).base;                    \
+        (dst).limit = (src).limit;                  \
+        (dst).ar = kvm_segment_ar(&(src));          \
+    } while (0)
+
+#define KVM_SEG_SET(dst, src)                       \
+    do {                                            \
+        (dst).selector = (src).selector;            \
+        (dst).base = (src).base;                    \
+        (dst).limit = (src).limit;                  \
+        kvm_segment_set_ar(&(dst), (src).ar);       \
+    } while (0)
+
 /*
  * Get special registers
  */
@@ -646,43 +786,22 @@ static int kvm_get_sregs(struct hv_vcpu *vcpu, struct hv_sregs *sregs)
         return -1;
     }
 
-    sregs->cs.selector = kvm_sregs.cs.selector;
-    sregs->cs.base = kvm_sregs.cs.base;
-    sregs->cs.limit = kvm_sregs.cs.limit;
-    sregs->cs.ar = kvm_sregs.cs.ar;
-
-    sregs->ds.selector = kvm_sregs.ds.selector;
-    sregs->ds.base = kvm_sregs.ds.base;
-    sregs->ds.limit = kvm_sregs.ds.limit;
-    sregs->ds.ar = kvm_sregs.ds.ar;
-
-    sregs->es.selector = kvm_sregs.es.selector;
-    sregs->es.base = kvm_sregs.es.base;
-    sregs->es.limit = kvm_sregs.es.limit;
-    sregs->es.ar = kvm_sregs.es.ar;
-
-    sregs->fs.selector = kvm_sregs.fs.selector;
-    sregs->fs.base = kvm_sregs.fs.base;
-    sregs->fs.limit = kvm_sregs.fs.limit;
-    sregs->fs.ar = kvm_sregs.fs.ar;
-
-    sregs->gs.selector = kvm_sregs.gs.selector;
-    sregs->gs.base = kvm_sregs.gs.base;
-    sregs->gs.limit = kvm_sregs.gs.limit;
-    sregs->gs.ar = kvm_sregs.gs.ar;
-
-    sregs->ss.selector = kvm_sregs.ss.selector;
-    sregs->ss.base = kvm_sregs.ss.base;
-    sregs->ss.limit = kvm_sregs.ss.limit;
-    sregs->ss.ar = kvm_sregs.ss.ar;
+    KVM_SEG_GET(sregs->cs, kvm_sregs.cs);
+    KVM_SEG_GET(sregs->ds, kvm_sregs.ds);
+    KVM_SEG_GET(sregs->es, kvm_sregs.es);
+    KVM_SEG_GET(sregs->fs, kvm_sregs.fs);
+    KVM_SEG_GET(sregs->gs, kvm_sregs.gs);
+    KVM_SEG_GET(sregs->ss, kvm_sregs.ss);
+    KVM_SEG_GET(sregs->ldt, kvm_sregs.ldt);
+    KVM_SEG_GET(sregs->tr, kvm_sregs.tr);
 
     sregs->gdt.base = kvm_sregs.gdt.base;
     sregs->gdt.limit = kvm_sregs.gdt.limit;
-    sregs->gdt.ar = kvm_sregs.gdt.ar;
+    sregs->gdt.ar = 0;
 
     sregs->idt.base = kvm_sregs.idt.base;
     sregs->idt.limit = kvm_sregs.idt.limit;
-    sregs->idt.ar = kvm_sregs.idt.ar;
+    sregs->idt.ar = 0;
 
     sregs->cr0 = kvm_sregs.cr0;
     sregs->cr2 = kvm_sregs.cr2;
@@ -697,50 +816,37 @@ static int kvm_get_sregs(struct hv_vcpu *vcpu, struct hv_sregs *sregs)
 
 /*
  * Set special registers
+ *
+ * Starts from the current state: an LDT or TR left all-zero by the caller
+ * (no access rights) and a zero APIC base keep their current values, so
+ * a boot path that only sets up flat segments doesn't leave an invalid
+ * task register or turn the local APIC off.
  */
 static int kvm_set_sregs(struct hv_vcpu *vcpu, const struct hv_sregs *sregs)
 {
     struct kvm_sregs kvm_sregs;
 
-    memset(&kvm_sregs, 0, sizeof(kvm_sregs));
-
-    kvm_sregs.cs.selector = sregs->cs.selector;
-    kvm_sregs.cs.base = sregs->cs.base;
-    kvm_sregs.cs.limit = sregs->cs.limit;
-    kvm_sregs.cs.ar = sregs->cs.ar;
-
-    kvm_sregs.ds.selector = sregs->ds.selector;
-    kvm_sregs.ds.base = sregs->ds.base;
-    kvm_sregs.ds.limit = sregs->ds.limit;
-    kvm_sregs.ds.ar = sregs->ds.ar;
-
-    kvm_sregs.es.selector = sregs->es.selector;
-    kvm_sregs.es.base = sregs->es.base;
-    kvm_sregs.es.limit = sregs->es.limit;
-    kvm_sregs.es.ar = sregs->es.ar;
-
-    kvm_sregs.fs.selector = sregs->fs.selector;
-    kvm_sregs.fs.base = sregs->fs.base;
-    kvm_sregs.fs.limit = sregs->fs.limit;
-    kvm_sregs.fs.ar = sregs->fs.ar;
-
-    kvm_sregs.gs.selector = sregs->gs.selector;
-    kvm_sregs.gs.base = sregs->gs.base;
-    kvm_sregs.gs.limit = sregs->gs.limit;
-    kvm_sregs.gs.ar = sregs->gs.ar;
+    if (ioctl(vcpu->fd, KVM_GET_SREGS, &kvm_sregs) < 0) {
+        perror("KVM_GET_SREGS");
+        return -1;
+    }
 
-    kvm_sregs.ss.selector = sregs->ss.selector;
-    kvm_sregs.ss.base = sregs->ss.base;
-    kvm_sregs.ss.limit = sregs->ss.limit;
-    kvm_sregs.ss.ar = sregs->ss.ar;
+    KVM_SEG_SET(kvm_sregs.cs, sregs->cs);
+    KVM_SEG_SET(kvm_sregs.ds, sregs->ds);
+    KVM_SEG_SET(kvm_sregs.es, sregs->es);
+    KVM_SEG_SET(kvm_sregs.fs, sregs->fs);
+    KVM_SEG_SET(kvm_sregs.gs, sregs->gs);
+    KVM_SEG_SET(kvm_sregs.ss, sregs->ss);
+    if (sregs->ldt.ar)
+        KVM_SEG_SET(kvm_sregs.ldt, sregs->ldt);
+    if (sregs->tr.ar)
+        KVM_SEG_SET(kvm_sregs.tr, sregs->tr);
 
     kvm_sregs.gdt.base = sregs->gdt.base;
     kvm_sregs.gdt.limit = sregs->gdt.limit;
-    kvm_sregs.gdt.ar = sregs->gdt.ar;
 
     kvm_sregs.idt.base = sregs->idt.base;
     kvm_sregs.idt.limit = sregs->idt.limit;
-    kvm_sregs.idt.ar = sregs->idt.ar;
 
     kvm_sregs.cr0 = sregs->cr0;
     kvm_sregs.cr2 = sregs->cr2;
@@ -748,7 +854,11 @@ static int kvm_set_sregs(struct hv_vcpu *vcpu, const struct hv_sregs *sregs)
     kvm_sregs.cr4 = sregs->cr4;
     kvm_sregs.cr8 = sregs->cr8;
     kvm_sregs.efer = sregs->efer;
-    kvm_sregs.apic_base = sregs->apic_base;
+    if (sregs->apic_base)
+        kvm_sregs.apic_base = sregs->apic_base;
+
+    /* No interrupt to inject */
+    memset(kvm_sregs.interrupt_bitmap, 0, sizeof(kvm_sregs.interrupt_bitmap));
 
     if (ioctl(vcpu->fd, KVM_SET_SREGS, &kvm_sregs) < 0) {
         perror("KVM_SET_SREGS");
@@ -758,6 +868,33 @@ static int kvm_set_sregs(struct hv_vcpu *vcpu, const struct hv_sregs *sregs)
     return 0;
 }
 
+/*
+ * Create the in-kernel PIC pair, IOAPIC and local APICs, then the PIT
+ *
+ * GSIs 0-15 reach both the PICs and the IOAPIC, 16-23 the IOAPIC only,
+ * which is what KVM_IRQ_LINE and irqfds then address. The PIT drives GSI
+ * 0 from the kernel; its speaker port is a dummy.
+ */
+static int kvm_create_irqchip(struct hv_vm *vm)
+{
+    struct kvm_pit_config pit;
+
+    if (ioctl(vm->fd, KVM_CREATE_IRQCHIP, 0) < 0) {
+        perror("KVM_CREATE_IRQCHIP");
+        return -1;
+    }
+
+    memset(&pit, 0, sizeof(pit));
+    pit.flags = KVM_PIT_SPEAKER_DUMMY;
+    if (ioctl(vm->fd, KVM_CREATE_PIT2, &pit) < 0) {
+        perror("KVM_CREATE_PIT2");
+        return -1;
+    }
+
+    log_debug("KVM in-kernel irqchip and PIT created");
+    return 0;
+}
+
 /*
  * Assert/deassert IRQ line
  */
@@ -775,3 +912,94 @@ static int kvm_irq_line(struct hv_vm *vm, int irq, int level)
 
     return 0;
 }
+
+/*
+ * Attach/detach an irqfd
+ *
+ * Once attached, a write to fd injects the interrupt from whichever thread
+ * wrote it, without a vCPU exit or an extra ioctl.
+ */
+static int kvm_irqfd(struct hv_vm *vm, int fd, int resample_fd, int gsi, int assign)
+{
+    struct kvm_irqfd irqfd;
+
+    memset(&irqfd, 0, sizeof(irqfd));
+    irqfd.fd = fd;
+    irqfd.gsi = gsi;
+
+    if (!assign) {
+        irqfd.flags = KVM_IRQFD_FLAG_DEASSIGN;
+    } else if (resample_fd >= 0) {
+        irqfd.flags = KVM_IRQFD_FLAG_RESAMPLE;
+        irqfd.resamplefd = resample_fd;
+    }
+
+    if (ioctl(vm->fd, KVM_IRQFD, &irqfd) < 0) {
+        log_debug("KVM_IRQFD (gsi %d, %s): %s", gsi,
+                  assign ? "assign" : "deassign", strerror(errno));
+        return -1;
+    }
+
+    log_debug("%s irqfd %d -> GSI %d%s", assign ? "Attached" : "Detached",
+              fd, gsi, resample_fd >= 0 ? " (level)" : "");
+    return 0;
+}
+
+/*
+ * Attach/detach an ioeventfd
+ *
+ * Matching guest writes complete inside the kernel and only signal fd, so
+ * a queue kick costs no exit to userspace.
+ */
+static int kvm_ioeventfd(struct hv_vm *vm, int fd, uint64_t addr, uint32_t len,
+                         uint64_t datamatch, uint32_t flags, int assign)
+{
+    struct kvm_ioeventfd ioeventfd;
+
+    memset(&ioeventfd, 0, sizeof(ioeventfd));
+    ioeventfd.fd = fd;
+    ioeventfd.addr = addr;
+    ioeventfd.len = len;
+
+    if (flags & HV_IOEVENTFD_DATAMATCH) {
+        ioeventfd.flags |= KVM_IOEVENTFD_FLAG_DATAMATCH;
+        ioeventfd.datamatch = datamatch;
+    }
+    if (flags & HV_IOEVENTFD_PIO)
+        ioeventfd.flags |= KVM_IOEVENTFD_FLAG_PIO;
+    if (!assign)
+        ioeventfd.flags |= KVM_IOEVENTFD_FLAG_DEASSIGN;
+
+    if (ioctl(vm->fd, KVM_IOEVENTFD, &ioeventfd) < 0) {
+        log_debug("KVM_IOEVENTFD (0x%lx, %s): %s", addr,
+                  assign ? "assign" : "deassign", strerror(errno));
+        return -1;
+    }
+
+    log_debug("%s ioeventfd %d at 0x%lx", assign ? "Attached" : "Detached",
+              fd, addr);
+    return 0;
+}
+
+/*
+ * Set the VM's halt_poll_ns (KVM_CAP_HALT_POLL)
+ *
+ * Overrides the kvm module's halt_poll_ns for this VM: a vCPU halted in
+ * the kernel polls for up to max_ns (adaptively) before it sleeps.
+ */
+static int kvm_set_halt_poll(struct hv_vm *vm, uint64_t max_ns)
+{
+    struct kvm_enable_cap cap;
+
+    memset(&cap, 0, sizeof(cap));
+    cap.cap = KVM_CAP_HALT_POLL;
+    cap.args[0] = max_ns;
+
+    if (ioctl(vm->fd, KVM_ENABLE_CAP, &cap) < 0) {
+        perror("KVM_ENABLE_CAP(KVM_CAP_HALT_POLL)");
+        return -1;
+    }
+
+    log_debug("KVM halt polling up to %lu ns", max_ns);
+    return 0;
+}
@@ -0,0 +1,384 @@
+/*
+ * I/O threads: epoll loops that run device backends off the vCPU threads
+ */
+
+#include "iothread.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define IOTHREAD_MAX_EVENTS 64
+
+/*
+ * Free handlers removed during the last batch (lock held)
+ */
+static void iothread_reap(struct iothread *t)
+{
+    while (t->zombies) {
+        struct iothread_handler *h = t->zombies;
+
+        t->zombies = h->next;
+        free(h);
+    }
+}
+
+/*
+ * Event loop
+ */
+static void* iothread_run(void *arg)
+{
+    struct iothread *t = arg;
+    struct epoll_event events[IOTHREAD_MAX_EVENTS];
+    char name[16];
+    int i, n;
+
+    snprintf(name, sizeof(name), "iothread%d", t->index);
+    pthread_setname_np(pthread_self(), name);
+
+    for (;;) {
+        n = epoll_wait(t->epoll_fd, events, IOTHREAD_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        pthread_mutex_lock(&t->lock);
+
+        for (i = 0; i < n; i++) {
+            struct iothread_handler *h = events[i].data.ptr;
+
+            if (!h) {
+                /* Stop request */
+                pthread_mutex_unlock(&t->lock);
+                return NULL;
+            }
+
+            if (!h->dead)
+                h->fn(h->fd, events[i].events, h->opaque);
+        }
+
+        iothread_reap(t);
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Parse the n-th CPU from a list like "2,3" or "2-5" (wraps around)
+ */
+static int iothread_cpu_from_list(const char *list, int n)
+{
+    int cpus[CPU_SETSIZE];
+    int count = 0;
+    const char *p = list;
+
+    while (*p && count < CPU_SETSIZE) {
+        char *end;
+        long lo, hi;
+
+        lo = strtol(p, &end, 10);
+        if (end == p || lo < 0)
+            return -1;
+        hi = lo;
+        if (*end == '-') {
+            p = end + 1;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+
+        for (; lo <= hi && count < CPU_SETSIZE; lo++)
+            cpus[count++] = (int)lo;
+
+        if (*end == ',')
+            end++;
+        else if (*end)
+            return -1;
+        p = end;
+    }
+
+    return count ? cpus[n % count] : -1;
+}
+
+/*
+ * Start one thread
+ */
+static int iothread_start(struct iothread *t, int index, int cpu)
+{
+    struct epoll_event ev;
+    pthread_mutexattr_t attr;
+
+    t->index = index;
+    t->cpu = cpu;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&t->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    t->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (t->epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    t->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (t->stop_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, t->stop_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+
+    if (pthread_create(&t->thread, NULL, iothread_run, t) != 0) {
+        log_error("Failed to create I/O thread %d", index);
+        return -1;
+    }
+    t->running = 1;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(t->thread, sizeof(set), &set) != 0)
+            log_warn("Failed to pin I/O thread %d to CPU %d", index, cpu);
+    }
+
+    log_debug("I/O thread %d started (cpu %d)", index, cpu);
+    return 0;
+}
+
+/*
+ * Stop one thread and release its resources
+ */
+static void iothread_stop(struct iothread *t)
+{
+    uint64_t one = 1;
+
+    if (t->running) {
+        if (write(t->stop_fd, &one, sizeof(one)) != sizeof(one))
+            perror("write eventfd");
+        pthread_join(t->thread, NULL);
+        t->running = 0;
+    }
+
+    if (t->num_handlers)
+        log_warn("I/O thread %d stopped with %d fds registered",
+                 t->index, t->num_handlers);
+
+    while (t->handlers) {
+        struct iothread_handler *h = t->handlers;
+
+        t->handlers = h->next;
+        free(h);
+    }
+    iothread_reap(t);
+
+    if (t->stop_fd >= 0)
+        close(t->stop_fd);
+    if (t->epoll_fd >= 0)
+        close(t->epoll_fd);
+    pthread_mutex_destroy(&t->lock);
+}
+
+/*
+ * Create a pool of I/O threads
+ */
+struct iothread_pool* iothread_pool_create(int count, const char *cpus)
+{
+    struct iothread_pool *pool;
+    int i;
+
+    if (count <= 0 || count > IOTHREAD_MAX_COUNT) {
+        log_error("Invalid I/O thread count: %d (max %d)", count, IOTHREAD_MAX_COUNT);
+        return NULL;
+    }
+
+    if (cpus && iothread_cpu_from_list(cpus, 0) < 0) {
+        log_error("Invalid CPU list: %s", cpus);
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    pool->threads = calloc(count, sizeof(*pool->threads));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct iothread *t = &pool->threads[i];
+
+        t->epoll_fd = -1;
+        t->stop_fd = -1;
+        pool->num_threads++;
+
+        if (iothread_start(t, i, cpus ? iothread_cpu_from_list(cpus, i) : -1) < 0) {
+            iothread_pool_destroy(pool);
+            return NULL;
+        }
+    }
+
+    log_info("Started %d I/O thread%s%s%s", count, count == 1 ? "" : "s",
+             cpus ? " on CPUs " : "", cpus ? cpus : "");
+    return pool;
+}
+
+/*
+ * Stop all threads and free the pool
+ */
+void iothread_pool_destroy(struct iothread_pool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+
+    for (i = 0; i < pool->num_threads; i++)
+        iothread_stop(&pool->threads[i]);
+
+    free(pool->threads);
+    free(pool);
+}
+
+/*
+ * Pick a thread for a new device
+ */
+struct iothread* iothread_pool_pick(struct iothread_pool *pool)
+{
+    struct iothread *t;
+
+    t = &pool->threads[pool->next];
+    pool->next = (pool->next + 1) % pool->num_threads;
+    return t;
+}
+
+/*
+ * Register an fd
+ */
+int iothread_add_fd(struct iothread *t, int fd, uint32_t events,
+                    iothread_fn fn, void *opaque)
+{
+    struct iothread_handler *h;
+    struct epoll_event ev;
+
+    h = calloc(1, sizeof(*h));
+    if (!h)
+        return -1;
+
+    h->fd = fd;
+    h->fn = fn;
+    h->opaque = opaque;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = h;
+
+    pthread_mutex_lock(&t->lock);
+
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        pthread_mutex_unlock(&t->lock);
+        perror("epoll_ctl(ADD)");
+        free(h);
+        return -1;
+    }
+
+    h->next = t->handlers;
+    t->handlers = h;
+    t->num_handlers++;
+
+    pthread_mutex_unlock(&t->lock);
+    return 0;
+}
+
+/*
+ * Find the live handler for fd (lock held)
+ */
+static struct iothread_handler** iothread_find(struct iothread *t, int fd)
+{
+    struct iothread_handler **pp;
+
+    for (pp = &t->handlers; *pp; pp = &(*pp)->next) {
+        if ((*pp)->fd == fd)
+            return pp;
+    }
+
+    return NULL;
+}
+
+/*
+ * Change the events an fd is watched for
+ */
+int iothread_mod_fd(struct iothread *t, int fd, uint32_t events)
+{
+    struct iothread_handler **pp;
+    struct epoll_event ev;
+    int ret = -1;
+
+    pthread_mutex_lock(&t->lock);
+
+    pp = iothread_find(t, fd);
+    if (pp) {
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.ptr = *pp;
+        ret = epoll_ctl(t->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        if (ret < 0)
+            perror("epoll_ctl(MOD)");
+    }
+
+    pthread_mutex_unlock(&t->lock);
+    return ret;
+}
+
+/*
+ * Remove an fd
+ */
+int iothread_del_fd(struct iothread *t, int fd)
+{
+    struct iothread_handler **pp, *h;
+
+    /* Waits for the current batch unless called from a callback */
+    pthread_mutex_lock(&t->lock);
+
+    pp = iothread_find(t, fd);
+    if (!pp) {
+        pthread_mutex_unlock(&t->lock);
+        return -1;
+    }
+
+    h = *pp;
+    *pp = h->next;
+    t->num_handlers--;
+
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0)
+        perror("epoll_ctl(DEL)");
+
+    /* Events for it may already be queued in this or the next batch */
+    h->dead = 1;
+    h->next = t->zombies;
+    t->zombies = h;
+
+    pthread_mutex_unlock(&t->lock);
+    return 0;
+}
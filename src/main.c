@@ -32,12 +32,19 @@ struct cmdline_args {
     char     *initrd_path;
     char     *cmdline;
     uint64_t mem_size;
+    enum mm_backing mem_backing;    /* Guest RAM backing */
+    uint64_t mem_page_size;         /* Guest RAM page size */
     int      num_vcpus;
+    uint64_t halt_poll_ns;      /* Halt-poll window limit */
+    int      halt_poll_set;     /* --halt-poll-ns given */
     char     *disk_path;
     char     *net_tap;
+    char     *net_vhost_user;   /* vhost-user backend socket for virtio-net */
     char     *vfio_bdf;
     int      enable_console;
     int      log_level;
+    int      num_iothreads;     /* Device I/O threads */
+    char     *iothread_cpus;    /* CPU list to pin I/O threads to */
     char     *binary_path;      /* Raw binary for testing */
     uint64_t binary_entry;      /* Entry point for raw binary */
 };
@@ -46,6 +53,10 @@ struct cmdline_args {
 #define DEFAULT_MEM_SIZE   (512 * 1024 * 1024)  /* 512 MB */
 #define DEFAULT_NUM_VCPUS  1
 
+/* Guest RAM layout: low RAM below the device window, the rest above 4G */
+#define LOW_RAM_MAX        (128ULL * 1024 * 1024)
+#define HIGH_RAM_BASE      0x100000000ULL
+
 /*
  * Signal handler for graceful shutdown
  */
@@ -119,10 +130,30 @@ static void print_usage(const char *prog)
     fprintf(stderr, "  --cmdline <string>    Kernel command line\n");
     fprintf(stderr, "  --mem <size>          Guest memory size (default: 512M)\n");
     fprintf(stderr, "                        Examples: 512M, 1G, 256M\n");
+    fprintf(stderr, "  --mem-backing <type>  Guest RAM backing: anon, memfd (default: anon)\n");
+    fprintf(stderr, "  --mem-pagesize <size> Guest RAM page size: 4K, 2M, 1G (default: 4K)\n");
+    fprintf(stderr, "                        2M/1G use hugetlbfs pages\n");
     fprintf(stderr, "  --cpus <num>          Number of vCPUs (default: 1)\n");
-    fprintf(stderr, "  --disk <path>         Disk image for virtio-blk\n");
-    fprintf(stderr, "  --net tap=<ifname>    TAP interface for virtio-net\n");
+    fprintf(stderr, "  --halt-poll-ns <ns>   Poll up to <ns> for a wake-up before a halted\n");
+    fprintf(stderr, "                        vCPU sleeps; adaptive (default: 0, sleep at once;\n");
+    fprintf(stderr, "                        KVM's own with the in-kernel irqchip)\n");
+    fprintf(stderr, "  --disk <path>[,opts]  Disk image for virtio-blk; opts:\n");
+    fprintf(stderr, "                        aio=io_uring|sync (default: io_uring),\n");
+    fprintf(stderr, "                        direct=on|off (O_DIRECT), fixed=on|off,\n");
+    fprintf(stderr, "                        queues=N (multi-queue, max 8),\n");
+    fprintf(stderr, "                        coalesce-usecs=N, coalesce-frames=N (needs usecs)\n");
+    fprintf(stderr, "  --disk vhost-user=<socket>[,queues=N] virtio-blk served by a\n");
+    fprintf(stderr, "                        vhost-user backend (implies --mem-backing memfd)\n");
+    fprintf(stderr, "  --net tap=<ifname>[,opts] TAP interface for virtio-net; opts:\n");
+    fprintf(stderr, "                        queues=N (queue pairs, max 8), offload=on|off,\n");
+    fprintf(stderr, "                        vhost=on|off (kernel datapath, /dev/vhost-net),\n");
+    fprintf(stderr, "                        rx-usecs=N, rx-frames=N, tx-usecs=N, tx-frames=N\n");
+    fprintf(stderr, "                        (a frames limit needs the matching usecs)\n");
+    fprintf(stderr, "  --net vhost-user=<socket>[,queues=N] virtio-net served by a\n");
+    fprintf(stderr, "                        vhost-user backend (implies --mem-backing memfd)\n");
     fprintf(stderr, "  --vfio <BDF>          VFIO device passthrough (e.g., 0000:01:00.1)\n");
+    fprintf(stderr, "  --iothreads <num>     Device I/O threads (default: 1)\n");
+    fprintf(stderr, "  --iothread-cpus <list> Pin I/O threads to CPUs (e.g., 2,3 or 2-5)\n");
     fprintf(stderr, "  --console             Enable MMIO debug console\n");
     fprintf(stderr, "  --binary <path>       Load raw binary at entry point\n");
     fprintf(stderr, "  --entry <addr>        Entry point for raw binary (hex)\n");
@@ -142,10 +173,15 @@ static int parse_args(int argc, char *argv[], struct cmdline_args *args)
         { "initrd", required_argument, 0, 'i' },
         { "cmdline", required_argument, 0, 'c' },
         { "mem", required_argument, 0, 'm' },
+        { "mem-backing", required_argument, 0, 'B' },
+        { "mem-pagesize", required_argument, 0, 'P' },
         { "cpus", required_argument, 0, 'n' },
+        { "halt-poll-ns", required_argument, 0, 'H' },
         { "disk", required_argument, 0, 'd' },
         { "net", required_argument, 0, 't' },
         { "vfio", required_argument, 0, 'v' },
+        { "iothreads", required_argument, 0, 'I' },
+        { "iothread-cpus", required_argument, 0, 'A' },
         { "console", no_argument, 0, 'C' },
         { "binary", required_argument, 0, 'b' },
         { "entry", required_argument, 0, 'e' },
@@ -158,10 +194,13 @@ static int parse_args(int argc, char *argv[], struct cmdline_args *args)
 
     memset(args, 0, sizeof(*args));
     args->mem_size = DEFAULT_MEM_SIZE;
+    args->mem_backing = MM_BACKING_ANON;
+    args->mem_page_size = MM_PAGE_SIZE_4K;
     args->num_vcpus = DEFAULT_NUM_VCPUS;
+    args->num_iothreads = IOTHREAD_DEFAULT_COUNT;
     args->log_level = LOG_LEVEL_INFO;
 
-    while ((opt = getopt_long(argc, argv, "k:i:c:m:n:d:t:v:Cb:e:l:h",
+    while ((opt = getopt_long(argc, argv, "k:i:c:m:B:P:n:H:d:t:v:I:A:Cb:e:l:h",
                               long_options, &option_index)) != -1) {
         switch (opt) {
         case 'k':
@@ -184,6 +223,22 @@ static int parse_args(int argc, char *argv[], struct cmdline_args *args)
             }
             break;
 
+        case 'B':
+            if (mm_parse_backing(optarg, &args->mem_backing) < 0) {
+                fprintf(stderr, "Invalid memory backing: %s (use anon or memfd)\n",
+                        optarg);
+                return -1;
+            }
+            break;
+
+        case 'P':
+            if (mm_parse_page_size(optarg, &args->mem_page_size) < 0) {
+                fprintf(stderr, "Invalid page size: %s (use 4K, 2M or 1G)\n",
+                        optarg);
+                return -1;
+            }
+            break;
+
         case 'n':
             args->num_vcpus = atoi(optarg);
             if (args->num_vcpus <= 0 || args->num_vcpus > VM_MAX_VCPUS) {
@@ -193,15 +248,37 @@ static int parse_args(int argc, char *argv[], struct cmdline_args *args)
             }
             break;
 
+        case 'H': {
+            char *end;
+
+            errno = 0;
+            args->halt_poll_ns = strtoull(optarg, &end, 0);
+            if (errno || end == optarg || *end != '\0' ||
+                args->halt_poll_ns > VM_HALT_POLL_MAX_NS) {
+                fprintf(stderr, "Invalid halt-poll window: %s (max %llu ns)\n",
+                        optarg, VM_HALT_POLL_MAX_NS);
+                return -1;
+            }
+            args->halt_poll_set = 1;
+            break;
+        }
+
         case 'd':
             args->disk_path = strdup(optarg);
             break;
 
         case 't':
+            if (args->net_tap || args->net_vhost_user) {
+                fprintf(stderr, "Only one --net device is supported\n");
+                return -1;
+            }
             if (strncmp(optarg, "tap=", 4) == 0) {
                 args->net_tap = strdup(optarg + 4);
+            } else if (strncmp(optarg, "vhost-user=", 11) == 0) {
+                args->net_vhost_user = strdup(optarg + 11);
             } else {
-                fprintf(stderr, "Invalid network format (use tap=<ifname>)\n");
+                fprintf(stderr, "Invalid network format (use tap=<ifname>[,opts] "
+                        "or vhost-user=<socket>[,opts])\n");
                 return -1;
             }
             break;
@@ -210,6 +287,19 @@ static int parse_args(int argc, char *argv[], struct cmdline_args *args)
             args->vfio_bdf = strdup(optarg);
             break;
 
+        case 'I':
+            args->num_iothreads = atoi(optarg);
+            if (args->num_iothreads <= 0 || args->num_iothreads > IOTHREAD_MAX_COUNT) {
+                fprintf(stderr, "Invalid I/O thread count: %s (max %d)\n",
+                        optarg, IOTHREAD_MAX_COUNT);
+                return -1;
+            }
+            break;
+
+        case 'A':
+            args->iothread_cpus = strdup(optarg);
+            break;
+
         case 'C':
             args->enable_console = 1;
             break;
@@ -271,7 +361,9 @@ static void free_args(struct cmdline_args *args)
     free(args->cmdline);
     free(args->disk_path);
     free(args->net_tap);
+    free(args->net_vhost_user);
     free(args->vfio_bdf);
+    free(args->iothread_cpus);
     free(args->binary_path);
 }
 
@@ -329,22 +421,46 @@ int main(int argc, char *argv[])
         vm_set_cmdline(vm, args.cmdline);
     }
 
+    /* vhost-user backends map guest RAM through its memfds */
+    if ((args.net_vhost_user ||
+         (args.disk_path && strncmp(args.disk_path, "vhost-user=", 11) == 0)) &&
+        args.mem_backing != MM_BACKING_MEMFD) {
+        log_info("vhost-user device: backing guest RAM with memfd");
+        args.mem_backing = MM_BACKING_MEMFD;
+    }
+
     /* Add memory regions */
-    log_info("Allocating guest memory: %ld MB", args.mem_size / (1024 * 1024));
+    log_info("Allocating guest memory: %ld MB (%s, %lu KB pages)",
+             args.mem_size / (1024 * 1024), mm_backing_name(args.mem_backing),
+             args.mem_page_size >> 10);
+
+    ret = vm_set_memory_backing(vm, args.mem_backing, args.mem_page_size);
+    if (ret < 0) {
+        fprintf(stderr, "Invalid memory backing\n");
+        goto cleanup;
+    }
 
     /* Map RAM at 0x0, but cap it at 128MB to avoid MMIO regions
      * MMIO devices are at:
-     *   - 0x9000000: MMIO console (144MB mark)
-     *   - 0xa000000: Virtio console (160MB mark)
-     * For our test kernels, 128MB is plenty and avoids the MMIO regions
+     *   - 0xa000000: Virtio devices (160MB mark)
+     *   - 0x90000000: MMIO console
+     * Anything above 128MB is mapped as high RAM starting at 4GB.
      */
-    uint64_t ram_size = (args.mem_size < 128 * 1024 * 1024) ? args.mem_size : 128 * 1024 * 1024;
+    uint64_t ram_size = MIN(args.mem_size, LOW_RAM_MAX);
     ret = vm_add_memory_region(vm, 0, ram_size);
     if (ret < 0) {
         fprintf(stderr, "Failed to add memory region\n");
         goto cleanup;
     }
 
+    if (args.mem_size > ram_size) {
+        ret = vm_add_memory_region(vm, HIGH_RAM_BASE, args.mem_size - ram_size);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to add high memory region\n");
+            goto cleanup;
+        }
+    }
+
     /* Create vCPUs */
     log_info("Creating %d vCPU(s)...", args.num_vcpus);
     ret = vm_create_vcpus(vm, args.num_vcpus);
@@ -356,6 +472,21 @@ int main(int argc, char *argv[])
     /* Register devices */
     log_info("Registering devices...");
 
+    /* Unset, the kernel keeps its own default (kvm.halt_poll_ns) */
+    if (args.halt_poll_set) {
+        ret = vm_set_halt_poll(vm, args.halt_poll_ns);
+        if (ret < 0) {
+            fprintf(stderr, "Invalid halt-poll configuration\n");
+            goto cleanup;
+        }
+    }
+
+    ret = vm_set_iothreads(vm, args.num_iothreads, args.iothread_cpus);
+    if (ret < 0) {
+        fprintf(stderr, "Invalid I/O thread configuration\n");
+        goto cleanup;
+    }
+
     /* MMIO debug console - always enabled for test kernels */
     dev = mmio_console_create();
     if (dev) {
@@ -370,7 +501,10 @@ int main(int argc, char *argv[])
 
     /* Virtio block */
     if (args.disk_path) {
-        dev = virtio_blk_create(args.disk_path);
+        if (strncmp(args.disk_path, "vhost-user=", 11) == 0)
+            dev = vhost_user_blk_create(args.disk_path + 11);
+        else
+            dev = virtio_blk_create(args.disk_path);
         if (dev) {
             vm_register_device(vm, dev);
         }
@@ -384,6 +518,14 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* vhost-user network */
+    if (args.net_vhost_user) {
+        dev = vhost_user_net_create(args.net_vhost_user);
+        if (dev) {
+            vm_register_device(vm, dev);
+        }
+    }
+
     /* VFIO passthrough */
     if (args.vfio_bdf) {
         struct vfio_dev *vfio_dev;
@@ -463,6 +605,8 @@ int main(int argc, char *argv[])
         struct vcpu *vcpu = vm->vcpus[i];
         vcpu_print_stats(vcpu);
     }
+    for (i = 0; i < vm->num_devices; i++)
+        device_print_stats(vm->devices[i]);
 
 cleanup:
     /* Cleanup */
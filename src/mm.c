@@ -8,8 +8,132 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
 #include <sys/mman.h>
 
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#define MAP_HUGE_MASK  0x3f
+#endif
+
+#if defined(__linux__) && !defined(MFD_HUGETLB)
+#define MFD_HUGETLB    0x0004U
+#endif
+
+/* Generation counter for published slot tables */
+static uint64_t mm_table_gen;
+
+/* Per-thread last-hit cache for mm_slot_table_find() */
+static __thread struct {
+    uint64_t gen;
+    const struct mm_slot *slot;
+} mm_last_hit;
+
+/*
+ * Compare slots by GPA (for qsort)
+ */
+static int mm_slot_cmp(const void *a, const void *b)
+{
+    const struct mm_slot *sa = a, *sb = b;
+
+    if (sa->gpa < sb->gpa)
+        return -1;
+    return sa->gpa > sb->gpa;
+}
+
+/*
+ * Build a sorted lookup table
+ */
+struct mm_slot_table* mm_slot_table_build(const struct mm_slot *slots, int num_slots)
+{
+    struct mm_slot_table *table;
+    int i;
+
+    table = calloc(1, sizeof(*table) + num_slots * sizeof(struct mm_slot));
+    if (!table)
+        return NULL;
+
+    memcpy(table->slots, slots, num_slots * sizeof(struct mm_slot));
+    qsort(table->slots, num_slots, sizeof(struct mm_slot), mm_slot_cmp);
+
+    for (i = 1; i < num_slots; i++) {
+        const struct mm_slot *prev = &table->slots[i - 1];
+
+        if (prev->gpa + prev->size > table->slots[i].gpa) {
+            log_error("Memory slots overlap at GPA 0x%lx", table->slots[i].gpa);
+            free(table);
+            return NULL;
+        }
+    }
+
+    table->num_slots = num_slots;
+    table->gen = __atomic_add_fetch(&mm_table_gen, 1, __ATOMIC_RELAXED);
+    return table;
+}
+
+/*
+ * Publish a new table. Readers load the pointer with acquire semantics,
+ * so the table contents are visible before the pointer is.
+ */
+void mm_slot_table_publish(struct mm_slot_table **table, struct mm_slot_table *new_table)
+{
+    new_table->retired = *table;
+    __atomic_store_n(table, new_table, __ATOMIC_RELEASE);
+}
+
+/*
+ * Free a table and all tables it retired
+ */
+void mm_slot_table_free(struct mm_slot_table *table)
+{
+    while (table) {
+        struct mm_slot_table *next = table->retired;
+
+        free(table);
+        table = next;
+    }
+}
+
+/*
+ * Find the slot containing gpa
+ */
+const struct mm_slot* mm_slot_table_find(const struct mm_slot_table *table, uint64_t gpa)
+{
+    const struct mm_slot *slot;
+    int lo, hi;
+
+    if (unlikely(!table))
+        return NULL;
+
+    /* Fast path: same slot as this thread's last lookup */
+    slot = mm_last_hit.slot;
+    if (likely(mm_last_hit.gen == table->gen) &&
+        gpa - slot->gpa < slot->size)
+        return slot;
+
+    /* Binary search for the last slot starting at or below gpa */
+    lo = 0;
+    hi = table->num_slots - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        slot = &table->slots[mid];
+        if (gpa < slot->gpa) {
+            hi = mid - 1;
+        } else if (gpa - slot->gpa >= slot->size) {
+            lo = mid + 1;
+        } else {
+            mm_last_hit.gen = table->gen;
+            mm_last_hit.slot = slot;
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
 /*
  * Create a memory context
  */
@@ -43,6 +167,8 @@ void mm_destroy(struct mm_ctx *mm)
             mm_free_guest_mem(mm->slots[i].hva, mm->slots[i].size);
     }
 
+    mm_slot_table_free(mm->table);
+    free(mm->slots);
     free(mm);
 }
 
@@ -51,21 +177,12 @@ void mm_destroy(struct mm_ctx *mm)
  */
 void* mm_alloc_guest_mem(uint64_t size)
 {
-    void *ptr;
+    struct mm_guest_mem mem;
 
-    /* Align to page size */
-    size = PAGE_ALIGN_UP(size);
-
-    /* Using calloc instead of mmap for simplicity */
-    /* For production, consider using mmap with MAP_ANONYMOUS | MAP_PRIVATE */
-    ptr = calloc(1, size);
-    if (!ptr) {
-        log_error("Failed to allocate guest memory (%ld MB)", size / (1024 * 1024));
+    if (mm_guest_mem_alloc(&mem, size, MM_BACKING_ANON, MM_PAGE_SIZE_4K) < 0)
         return NULL;
-    }
 
-    log_debug("Allocated guest memory: %p (%ld MB)", ptr, size / (1024 * 1024));
-    return ptr;
+    return mem.hva;
 }
 
 /*
@@ -76,20 +193,233 @@ void mm_free_guest_mem(void *ptr, uint64_t size)
     if (!ptr)
         return;
 
-    free(ptr);
+    munmap(ptr, PAGE_ALIGN_UP(size));
     log_debug("Freed guest memory: %p", ptr);
 }
 
+/*
+ * Reserve an address range aligned to 'align' and return its start.
+ * The slack around the aligned window is released again.
+ */
+static void* mm_reserve_aligned(uint64_t size, uint64_t align)
+{
+    uint8_t *base, *aligned;
+    uint64_t head, tail;
+
+    base = mmap(NULL, size + align, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    aligned = (uint8_t *)ALIGN_UP((uintptr_t)base, align);
+    head = aligned - base;
+    tail = align - head;
+
+    if (head)
+        munmap(base, head);
+    if (tail)
+        munmap(aligned + size, tail);
+
+    return aligned;
+}
+
+#ifdef __linux__
+/* Encode a hugetlb page size for MAP_HUGETLB / MFD_HUGETLB */
+static int mm_huge_flags(uint64_t page_size)
+{
+    return (__builtin_ctzll(page_size) & MAP_HUGE_MASK) << MAP_HUGE_SHIFT;
+}
+#endif
+
+/*
+ * Allocate guest memory with an explicit backing and page size
+ */
+int mm_guest_mem_alloc(struct mm_guest_mem *mem, uint64_t size,
+                       enum mm_backing backing, uint64_t page_size)
+{
+    uint64_t align;
+    int prot = PROT_READ | PROT_WRITE;
+    int flags;
+    void *hint, *ptr;
+
+    memset(mem, 0, sizeof(*mem));
+    mem->fd = -1;
+
+    if (page_size != MM_PAGE_SIZE_4K && page_size != MM_PAGE_SIZE_2M &&
+        page_size != MM_PAGE_SIZE_1G) {
+        log_error("Unsupported guest page size: %lu", page_size);
+        return -1;
+    }
+
+#ifndef __linux__
+    if (backing != MM_BACKING_ANON || page_size != MM_PAGE_SIZE_4K) {
+        log_error("memfd and hugepage backing require Linux");
+        return -1;
+    }
+#endif
+
+    size = ALIGN_UP(size, page_size);
+
+    /* Align the HVA so the hypervisor can use large stage-2 mappings */
+    align = page_size;
+    if (page_size == MM_PAGE_SIZE_4K && size >= MM_PAGE_SIZE_2M)
+        align = MM_PAGE_SIZE_2M;
+
+    hint = mm_reserve_aligned(size, align);
+    if (!hint) {
+        log_error("Failed to reserve %lu MB of address space", size >> 20);
+        return -1;
+    }
+
+    flags = MAP_FIXED;
+
+#ifdef __linux__
+    if (backing == MM_BACKING_MEMFD) {
+        unsigned int mfd_flags = MFD_CLOEXEC;
+
+        if (page_size != MM_PAGE_SIZE_4K)
+            mfd_flags |= MFD_HUGETLB | mm_huge_flags(page_size);
+
+        mem->fd = memfd_create("vibevmm-ram", mfd_flags);
+        if (mem->fd < 0) {
+            perror("memfd_create");
+            munmap(hint, size);
+            return -1;
+        }
+
+        if (ftruncate(mem->fd, size) < 0) {
+            perror("ftruncate guest memory");
+            close(mem->fd);
+            munmap(hint, size);
+            return -1;
+        }
+
+        flags |= MAP_SHARED;
+    } else {
+        /* Hugetlb mappings keep their reservation so a short pool fails here */
+        flags |= MAP_PRIVATE | MAP_ANONYMOUS;
+        if (page_size != MM_PAGE_SIZE_4K)
+            flags |= MAP_HUGETLB | mm_huge_flags(page_size);
+        else
+            flags |= MAP_NORESERVE;
+    }
+#else
+    flags |= MAP_PRIVATE | MAP_ANONYMOUS;
+#endif
+
+    ptr = mmap(hint, size, prot, flags, mem->fd, 0);
+    if (ptr == MAP_FAILED) {
+        log_error("Failed to map guest memory (%lu MB, %s, %lu KB pages): %s",
+                  size >> 20, mm_backing_name(backing), page_size >> 10,
+                  strerror(errno));
+        if (page_size != MM_PAGE_SIZE_4K)
+            log_error("Check the hugetlb pool (/proc/sys/vm/nr_hugepages)");
+        if (mem->fd >= 0)
+            close(mem->fd);
+        munmap(hint, size);
+        return -1;
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* Let THP back 4K-mapped guest RAM with 2M pages where possible */
+    if (page_size == MM_PAGE_SIZE_4K && align == MM_PAGE_SIZE_2M)
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+
+    mem->hva = ptr;
+    mem->size = size;
+    mem->page_size = page_size;
+    mem->backing = backing;
+
+    log_debug("Allocated guest memory: %p (%lu MB, %s, %lu KB pages)",
+              ptr, size >> 20, mm_backing_name(backing), page_size >> 10);
+    return 0;
+}
+
+/*
+ * Free guest memory allocated by mm_guest_mem_alloc()
+ */
+void mm_guest_mem_free(struct mm_guest_mem *mem)
+{
+    if (!mem->hva)
+        return;
+
+    munmap(mem->hva, mem->size);
+    if (mem->fd >= 0)
+        close(mem->fd);
+
+    log_debug("Freed guest memory: %p", mem->hva);
+    mem->hva = NULL;
+    mem->fd = -1;
+}
+
+/*
+ * Parse a backing name
+ */
+int mm_parse_backing(const char *str, enum mm_backing *backing)
+{
+    if (strcmp(str, "anon") == 0) {
+        *backing = MM_BACKING_ANON;
+        return 0;
+    }
+
+    if (strcmp(str, "memfd") == 0) {
+        *backing = MM_BACKING_MEMFD;
+        return 0;
+    }
+
+    return -1;
+}
+
+/*
+ * Parse a page size
+ */
+int mm_parse_page_size(const char *str, uint64_t *page_size)
+{
+    if (strcasecmp(str, "4K") == 0)
+        *page_size = MM_PAGE_SIZE_4K;
+    else if (strcasecmp(str, "2M") == 0)
+        *page_size = MM_PAGE_SIZE_2M;
+    else if (strcasecmp(str, "1G") == 0)
+        *page_size = MM_PAGE_SIZE_1G;
+    else
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Get backing name
+ */
+const char *mm_backing_name(enum mm_backing backing)
+{
+    switch (backing) {
+    case MM_BACKING_ANON:  return "anon";
+    case MM_BACKING_MEMFD: return "memfd";
+    default:               return "unknown";
+    }
+}
+
 /*
  * Add a memory slot to context
  */
 int mm_add_slot(struct mm_ctx *mm, uint64_t gpa, void *hva, uint64_t size, uint64_t flags)
 {
+    struct mm_slot_table *table;
     struct mm_slot *slot;
 
-    if (mm->num_slots >= 32) {
-        log_error("Too many memory slots");
-        return -1;
+    if (mm->num_slots == mm->max_slots) {
+        int max_slots = mm->max_slots ? mm->max_slots * 2 : 8;
+        struct mm_slot *slots;
+
+        slots = realloc(mm->slots, max_slots * sizeof(*slots));
+        if (!slots) {
+            log_error("Failed to grow memory slot array");
+            return -1;
+        }
+
+        mm->slots = slots;
+        mm->max_slots = max_slots;
     }
 
     slot = &mm->slots[mm->num_slots];
@@ -99,6 +429,12 @@ int mm_add_slot(struct mm_ctx *mm, uint64_t gpa, void *hva, uint64_t size, uint6
     slot->slot_id = mm->num_slots;
     slot->flags = flags;
 
+    table = mm_slot_table_build(mm->slots, mm->num_slots + 1);
+    if (!table)
+        return -1;
+
+    mm_slot_table_publish(&mm->table, table);
+
     mm->total_size += size;
     mm->num_slots++;
 
@@ -112,16 +448,10 @@ int mm_add_slot(struct mm_ctx *mm, uint64_t gpa, void *hva, uint64_t size, uint6
  */
 struct mm_slot* mm_find_slot(struct mm_ctx *mm, uint64_t gpa)
 {
-    int i;
-
-    for (i = 0; i < mm->num_slots; i++) {
-        struct mm_slot *slot = &mm->slots[i];
+    const struct mm_slot_table *table;
 
-        if (gpa >= slot->gpa && gpa < (slot->gpa + slot->size))
-            return slot;
-    }
-
-    return NULL;
+    table = __atomic_load_n(&mm->table, __ATOMIC_ACQUIRE);
+    return (struct mm_slot *)mm_slot_table_find(table, gpa);
 }
 
 /*
@@ -0,0 +1,537 @@
+/*
+ * Minimal io_uring wrapper (raw syscalls, no liburing)
+ */
+
+#include "uring.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef __linux__
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+/* Kernel limit for a single registered buffer */
+#define URING_MAX_BUFFER_SIZE   (1ULL << 30)
+
+/* Registered buffer */
+struct uring_buffer {
+    uintptr_t base;
+    uint64_t len;
+};
+
+struct uring {
+    int fd;
+    int event_fd;
+
+    /* Submission queue (shared with the kernel) */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;                  /* Next free SQE (not yet published) */
+
+    /* Completion queue (shared with the kernel) */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Mappings */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /* Registered buffers */
+    struct uring_buffer *buffers;
+    int num_buffers;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg,
+                                 unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Create a ring
+ */
+struct uring* uring_create(unsigned entries)
+{
+    struct io_uring_params p;
+    struct uring *ring;
+    char *sq, *cq;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    ring->fd = -1;
+    ring->event_fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        int err = errno;
+
+        log_debug("io_uring_setup: %s", strerror(err));
+        free(ring);
+        errno = err;
+        return NULL;
+    }
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        perror("mmap(sq ring)");
+        ring->sq_ring = NULL;
+        goto err;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            perror("mmap(cq ring)");
+            ring->cq_ring = NULL;
+            goto err;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        perror("mmap(sqes)");
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    sq = ring->sq_ring;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->sqe_tail = *ring->sq_tail;
+
+    cq = ring->cq_ring;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* Completion notifications */
+    ring->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->event_fd < 0) {
+        perror("eventfd");
+        goto err;
+    }
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD,
+                              &ring->event_fd, 1) < 0) {
+        perror("io_uring_register(EVENTFD)");
+        goto err;
+    }
+
+    log_debug("io_uring: %u SQ / %u CQ entries", p.sq_entries, p.cq_entries);
+    return ring;
+
+err:
+    uring_destroy(ring);
+    return NULL;
+}
+
+/*
+ * Destroy a ring (in-flight requests are cancelled or waited for by the kernel)
+ */
+void uring_destroy(struct uring *ring)
+{
+    if (!ring)
+        return;
+
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    if (ring->event_fd >= 0)
+        close(ring->event_fd);
+
+    free(ring->buffers);
+    free(ring);
+}
+
+int uring_event_fd(struct uring *ring)
+{
+    return ring->event_fd;
+}
+
+/*
+ * Register fixed buffers
+ */
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, int count)
+{
+    struct uring_buffer *buffers;
+    struct iovec *vecs;
+    int i, n = 0;
+
+    if (ring->num_buffers) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    for (i = 0; i < count; i++)
+        n += (iov[i].iov_len + URING_MAX_BUFFER_SIZE - 1) / URING_MAX_BUFFER_SIZE;
+
+    buffers = calloc(n, sizeof(*buffers));
+    vecs = calloc(n, sizeof(*vecs));
+    if (!buffers || !vecs) {
+        free(buffers);
+        free(vecs);
+        return -1;
+    }
+
+    n = 0;
+    for (i = 0; i < count; i++) {
+        uintptr_t base = (uintptr_t)iov[i].iov_base;
+        uint64_t left = iov[i].iov_len;
+
+        while (left) {
+            uint64_t len = left < URING_MAX_BUFFER_SIZE ? left : URING_MAX_BUFFER_SIZE;
+
+            buffers[n].base = base;
+            buffers[n].len = len;
+            vecs[n].iov_base = (void *)base;
+            vecs[n].iov_len = len;
+            n++;
+            base += len;
+            left -= len;
+        }
+    }
+
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, vecs, n) < 0) {
+        int err = errno;
+
+        free(buffers);
+        free(vecs);
+        errno = err;
+        return -1;
+    }
+
+    free(vecs);
+    ring->buffers = buffers;
+    ring->num_buffers = n;
+    return n;
+}
+
+/*
+ * Find the registered buffer covering a range
+ */
+int uring_find_buffer(struct uring *ring, const void *buf, uint64_t len)
+{
+    uintptr_t addr = (uintptr_t)buf;
+    int i;
+
+    for (i = 0; i < ring->num_buffers; i++) {
+        struct uring_buffer *b = &ring->buffers[i];
+
+        if (addr >= b->base && addr - b->base + len <= b->len)
+            return i;
+    }
+
+    return -1;
+}
+
+unsigned uring_sq_space(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    return ring->sq_entries - (ring->sqe_tail - head);
+}
+
+/*
+ * Get the next free SQE
+ */
+static struct io_uring_sqe* uring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    if (uring_sq_space(ring) == 0)
+        return NULL;
+
+    sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[ring->sqe_tail & ring->sq_mask] = ring->sqe_tail & ring->sq_mask;
+    ring->sqe_tail++;
+    return sqe;
+}
+
+/*
+ * Queue one operation
+ */
+int uring_prep(struct uring *ring, enum uring_op op, int fd, void *buf,
+               uint32_t len, uint64_t offset, int buf_index, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    switch (op) {
+    case URING_OP_READ:
+        sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        break;
+    case URING_OP_WRITE:
+        sqe->opcode = buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        break;
+    case URING_OP_FDATASYNC:
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        break;
+    }
+
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    if (op != URING_OP_FDATASYNC) {
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = len;
+        if (buf_index >= 0)
+            sqe->buf_index = buf_index;
+    }
+
+    return 0;
+}
+
+/*
+ * Queue a vectored read/write
+ */
+int uring_prepv(struct uring *ring, enum uring_op op, int fd,
+                const struct iovec *iov, int iovcnt, uint64_t offset,
+                uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    if (op == URING_OP_FDATASYNC)
+        return uring_prep(ring, op, fd, NULL, 0, offset, -1, user_data);
+
+    sqe = uring_get_sqe(ring);
+    if (!sqe) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    sqe->opcode = op == URING_OP_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = iovcnt;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+/*
+ * Publish queued SQEs and submit them with one syscall
+ */
+int uring_submit(struct uring *ring)
+{
+    unsigned to_submit;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    /* Includes entries left over from a failed submit */
+    to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0)
+        return 0;
+
+    do {
+        ret = sys_io_uring_enter(ring->fd, to_submit, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        perror("io_uring_enter");
+    return ret;
+}
+
+/*
+ * Submit everything queued and wait for completions, with one syscall
+ */
+int uring_submit_and_wait(struct uring *ring, unsigned min_complete)
+{
+    unsigned to_submit;
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    do {
+        ret = sys_io_uring_enter(ring->fd, to_submit, min_complete,
+                                 IORING_ENTER_GETEVENTS);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+/*
+ * Block until completions are available
+ */
+int uring_wait(struct uring *ring, unsigned min_complete)
+{
+    int ret;
+
+    do {
+        ret = sys_io_uring_enter(ring->fd, 0, min_complete,
+                                 IORING_ENTER_GETEVENTS);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret;
+}
+
+/*
+ * Reap all posted completions
+ */
+int uring_reap(struct uring *ring, uring_complete_fn fn, void *opaque)
+{
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+        fn(opaque, cqe->user_data, cqe->res);
+        head++;
+        n++;
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+#else /* !__linux__ */
+
+struct uring* uring_create(unsigned entries)
+{
+    (void)entries;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    (void)ring;
+}
+
+int uring_event_fd(struct uring *ring)
+{
+    (void)ring;
+    return -1;
+}
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iov, int count)
+{
+    (void)ring; (void)iov; (void)count;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_find_buffer(struct uring *ring, const void *buf, uint64_t len)
+{
+    (void)ring; (void)buf; (void)len;
+    return -1;
+}
+
+unsigned uring_sq_space(struct uring *ring)
+{
+    (void)ring;
+    return 0;
+}
+
+int uring_prep(struct uring *ring, enum uring_op op, int fd, void *buf,
+               uint32_t len, uint64_t offset, int buf_index, uint64_t user_data)
+{
+    (void)ring; (void)op; (void)fd; (void)buf; (void)len;
+    (void)offset; (void)buf_index; (void)user_data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_prepv(struct uring *ring, enum uring_op op, int fd,
+                const struct iovec *iov, int iovcnt, uint64_t offset,
+                uint64_t user_data)
+{
+    (void)ring; (void)op; (void)fd; (void)iov; (void)iovcnt;
+    (void)offset; (void)user_data;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_submit(struct uring *ring)
+{
+    (void)ring;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_submit_and_wait(struct uring *ring, unsigned min_complete)
+{
+    (void)ring; (void)min_complete;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_wait(struct uring *ring, unsigned min_complete)
+{
+    (void)ring; (void)min_complete;
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_reap(struct uring *ring, uring_complete_fn fn, void *opaque)
+{
+    (void)ring; (void)fn; (void)opaque;
+    return 0;
+}
+
+#endif /* __linux__ */
@@ -12,6 +12,36 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+/* Monotonic time in ns */
+static uint64_t vcpu_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Interrupts a vCPU thread's KVM_RUN so it sees should_stop */
+#define VCPU_SIG_KICK   SIGUSR1
+
+static void vcpu_sig_kick(int sig)
+{
+    (void)sig;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
 
 /*
  * vCPU thread function
@@ -19,7 +49,8 @@
 static void* vcpu_thread_func(void *arg)
 {
     struct vcpu *vcpu = arg;
-    int ret;
+    struct hv_exit exit;
+    uint64_t start;
 
     log_debug("vCPU %d thread started", vcpu->index);
 
@@ -50,43 +81,34 @@ static void* vcpu_thread_func(void *arg)
     }
 #endif
 
+    start = vcpu_now_ns();
+
+    /*
+     * Hot path: one iteration per exit, so nothing here logs unless the
+     * exit is fatal (log_trace is compiled out of normal builds).
+     */
     while (!vcpu->should_stop) {
-        log_debug("vCPU %d: About to run (iteration %ld)", vcpu->index, vcpu->exit_count);
-        ret = vcpu_run(vcpu);
-        log_debug("vCPU %d: Run returned, ret=%d, errno=%d", vcpu->index, ret, errno);
-
-        if (ret < 0) {
-            if (errno == EINTR) {
-                log_debug("vCPU %d: Interrupted by signal", vcpu->index);
-                continue;  /* Signal interrupted */
-            }
+        if (unlikely(vcpu_run(vcpu) < 0)) {
+            /* A signal or an exit request (vcpu_stop): recheck should_stop */
+            if (errno == EINTR)
+                continue;
             log_error("vCPU %d run failed", vcpu->index);
             break;
         }
 
-        /* Check for exit */
-        struct hv_exit exit;
-        ret = hv_get_exit(vcpu->hv_vcpu, &exit);
-        if (ret < 0) {
-            log_error("Failed to get exit info");
+        if (unlikely(hv_get_exit(vcpu->hv_vcpu, &exit) < 0)) {
+            log_error("vCPU %d: Failed to get exit info", vcpu->index);
             break;
         }
 
-        log_debug("vCPU %d: Got exit, reason=%d", vcpu->index, exit.reason);
-        ret = vcpu_handle_exit(vcpu, &exit);
-        if (ret < 0) {
-            log_error("Failed to handle exit");
-            break;
-        }
-
-        /* Safety: prevent infinite loop if we keep getting the same exit */
-        vcpu->exit_count++;
-        if (vcpu->exit_count > 1000) {
-            log_error("vCPU %d: Too many exits (%ld), stopping", vcpu->index, vcpu->exit_count);
+        log_trace("vCPU %d: exit reason=%d", vcpu->index, exit.reason);
+        if (unlikely(vcpu_handle_exit(vcpu, &exit) < 0)) {
+            log_error("vCPU %d: Failed to handle exit", vcpu->index);
             break;
         }
     }
 
+    vcpu->stats.total_run_time_us += (vcpu_now_ns() - start) / 1000;
     log_debug("vCPU %d thread stopped", vcpu->index);
     return NULL;
 }
@@ -98,11 +120,12 @@ struct vcpu* vcpu_create(struct vm *vm, int index)
 {
     struct vcpu *vcpu;
 
-    vcpu = calloc(1, sizeof(*vcpu));
-    if (!vcpu) {
+    /* Aligned for the stats' cache lines */
+    if (posix_memalign((void **)&vcpu, CACHELINE_SIZE, sizeof(*vcpu)) != 0) {
         log_error("Failed to allocate vCPU");
         return NULL;
     }
+    memset(vcpu, 0, sizeof(*vcpu));
 
     /* For x86_64, create the vCPU now. For ARM64, the vCPU will be created
      * in the vCPU thread because Apple HVF requires creation and execution
@@ -119,6 +142,14 @@ struct vcpu* vcpu_create(struct vm *vm, int index)
     vcpu->hv_vcpu = NULL;
 #endif
 
+    vcpu->halt_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vcpu->halt_fd < 0) {
+        perror("eventfd");
+        hv_destroy_vcpu(vcpu->hv_vcpu);
+        free(vcpu);
+        return NULL;
+    }
+
     vcpu->vm = vm;
     vcpu->index = index;
     vcpu->state = VCPU_STATE_STOPPED;
@@ -126,19 +157,6 @@ struct vcpu* vcpu_create(struct vm *vm, int index)
     vcpu->has_initial_state = 0;
     vcpu->initial_rip = 0;
 
-    /* Initialize statistics counters */
-    vcpu->exit_count = 0;
-    vcpu->io_count = 0;
-    vcpu->mmio_count = 0;
-    vcpu->halt_count = 0;
-    vcpu->shutdown_count = 0;
-    vcpu->exception_count = 0;
-    vcpu->canceled_count = 0;
-    vcpu->vtimer_count = 0;
-    vcpu->unknown_count = 0;
-    vcpu->total_run_time_us = 0;
-    vcpu->instructions_executed = 0;
-
     log_info("vCPU %d created", index);
     return vcpu;
 }
@@ -156,9 +174,9 @@ void vcpu_destroy(struct vcpu *vcpu)
         vcpu_stop(vcpu);
 
     hv_destroy_vcpu(vcpu->hv_vcpu);
-    free(vcpu);
-
+    close(vcpu->halt_fd);
     log_info("vCPU %d destroyed", vcpu->index);
+    free(vcpu);
 }
 
 /*
@@ -166,6 +184,9 @@ void vcpu_destroy(struct vcpu *vcpu)
  */
 int vcpu_start(struct vcpu *vcpu)
 {
+#if !defined(__aarch64__)
+    struct sigaction sa;
+#endif
     int ret;
 
     if (vcpu->state == VCPU_STATE_RUNNING)
@@ -173,6 +194,15 @@ int vcpu_start(struct vcpu *vcpu)
 
     vcpu->should_stop = 0;
 
+#if !defined(__aarch64__)
+    /* The kick signal only has to interrupt KVM_RUN: no handler work, no
+     * SA_RESTART */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = vcpu_sig_kick;
+    sigemptyset(&sa.sa_mask);
+    sigaction(VCPU_SIG_KICK, &sa, NULL);
+#endif
+
     ret = pthread_create(&vcpu->thread, NULL, vcpu_thread_func, vcpu);
     if (ret != 0) {
         log_error("Failed to create vCPU thread");
@@ -195,6 +225,7 @@ int vcpu_stop(struct vcpu *vcpu)
 
     vcpu->should_stop = 1;
     log_debug("Set should_stop=1 for vCPU %d", vcpu->index);
+    vcpu_kick(vcpu);
 
 #if defined(__aarch64__)
     /* For Apple HVF on ARM64, we need to explicitly request vCPU exit
@@ -208,11 +239,11 @@ int vcpu_stop(struct vcpu *vcpu)
         log_warn("vCPU %d: hv_vcpu is NULL, can't request exit", vcpu->index);
     }
 #else
-    log_debug("Not ARM64, skipping hv_vcpu_exit()");
+    /* Leave KVM_RUN (or don't enter it again), then recheck should_stop */
+    hv_vcpu_exit(vcpu->hv_vcpu);
+    pthread_kill(vcpu->thread, VCPU_SIG_KICK);
 #endif
 
-    /* Cancel and join thread */
-    pthread_cancel(vcpu->thread);
     pthread_join(vcpu->thread, NULL);
 
     vcpu->state = VCPU_STATE_STOPPED;
@@ -298,24 +329,28 @@ int vcpu_handle_exit(struct vcpu *vcpu, struct hv_exit *exit)
 {
     int ret;
 
-    /* Increment total exit counter */
-    vcpu->exit_count++;
+    /* The one place exits are counted */
+    vcpu->stats.exit_count++;
 
     switch (exit->reason) {
     /* Common exit reasons */
     case HV_EXIT_HLT:
-        vcpu->halt_count++;
+        vcpu->stats.halt_count++;
         ret = vcpu_handle_halt(vcpu);
         break;
 
     case HV_EXIT_IO:
-        vcpu->io_count++;
+        vcpu->stats.io_count++;
         ret = vcpu_handle_io_exit(vcpu, &exit->u.io);
+        if (exit->u.io.direction == HV_IO_IN)
+            hv_complete_exit(vcpu->hv_vcpu, exit);
         break;
 
     case HV_EXIT_MMIO:
-        vcpu->mmio_count++;
+        vcpu->stats.mmio_count++;
         ret = vcpu_handle_mmio_exit(vcpu, &exit->u.mmio);
+        if (!exit->u.mmio.is_write)
+            hv_complete_exit(vcpu->hv_vcpu, exit);
         break;
 
     case HV_EXIT_EXTERNAL:
@@ -325,7 +360,7 @@ int vcpu_handle_exit(struct vcpu *vcpu, struct hv_exit *exit)
 
     case HV_EXIT_SHUTDOWN:
         log_info("vCPU %d: Shutdown (triple fault)", vcpu->index);
-        vcpu->shutdown_count++;
+        vcpu->stats.shutdown_count++;
         vcpu->should_stop = 1;
         ret = vcpu_handle_shutdown(vcpu);
         break;
@@ -344,51 +379,51 @@ int vcpu_handle_exit(struct vcpu *vcpu, struct hv_exit *exit)
 
     case HV_EXIT_EXCEPTION:
         log_warn("vCPU %d: Exception - stopping", vcpu->index);
-        vcpu->exception_count++;
+        vcpu->stats.exception_count++;
         vcpu->should_stop = 1;
         ret = 0;  /* Return success to allow cleanup */
         break;
 
     /* KVM x86_64 specific exit reasons */
     case HV_EXIT_IRQ_WINDOW_OPEN:
-        log_debug("vCPU %d: IRQ window open", vcpu->index);
+        log_trace("vCPU %d: IRQ window open", vcpu->index);
         /* Interrupt window opened - can inject IRQ now */
         ret = 0;
         break;
 
     case HV_EXIT_SET_TPR:
-        log_debug("vCPU %d: TPR access", vcpu->index);
+        log_trace("vCPU %d: TPR access", vcpu->index);
         /* Task Priority Register access (x86 APIC) */
         ret = 0;
         break;
 
     case HV_EXIT_TPR_ACCESS:
-        log_debug("vCPU %d: TPR access below window", vcpu->index);
+        log_trace("vCPU %d: TPR access below window", vcpu->index);
         /* TPR read/write below window */
         ret = 0;
         break;
 
     case HV_EXIT_NMI:
-        log_debug("vCPU %d: NMI window open", vcpu->index);
+        log_trace("vCPU %d: NMI window open", vcpu->index);
         /* NMI window opened - can inject NMI now */
         ret = 0;
         break;
 
     case HV_EXIT_SYSTEM_EVENT:
         log_info("vCPU %d: System event", vcpu->index);
-        vcpu->shutdown_count++;
+        vcpu->stats.shutdown_count++;
         vcpu->should_stop = 1;
         ret = 0;
         break;
 
     case HV_EXIT_X86_RDMSR:
-        log_debug("vCPU %d: RDMSR instruction", vcpu->index);
+        log_trace("vCPU %d: RDMSR instruction", vcpu->index);
         /* Read Model-Specific Register - intercept for debugging */
         ret = 0;
         break;
 
     case HV_EXIT_X86_WRMSR:
-        log_debug("vCPU %d: WRMSR instruction", vcpu->index);
+        log_trace("vCPU %d: WRMSR instruction", vcpu->index);
         /* Write Model-Specific Register - intercept for debugging */
         ret = 0;
         break;
@@ -414,26 +449,26 @@ int vcpu_handle_exit(struct vcpu *vcpu, struct hv_exit *exit)
     /* KVM ARM64 specific exit reasons */
     case HV_EXIT_ARM_EXCEPTION:
         log_warn("vCPU %d: ARM64 exception from lower EL", vcpu->index);
-        vcpu->exception_count++;
+        vcpu->stats.exception_count++;
         /* Exception from lower exception level */
         ret = -1;
         break;
 
     case HV_EXIT_ARM_TRAP:
-        log_debug("vCPU %d: ARM64 trap to higher EL", vcpu->index);
+        log_trace("vCPU %d: ARM64 trap to higher EL", vcpu->index);
         /* Trap to higher exception level (e.g., WFI, MRS, system regs) */
         ret = 0;
         break;
 
     case HV_EXIT_ARM_MMIO:
-        log_debug("vCPU %d: ARM64 MMIO fault", vcpu->index);
-        vcpu->mmio_count++;
+        log_trace("vCPU %d: ARM64 MMIO fault", vcpu->index);
+        vcpu->stats.mmio_count++;
         /* ARM64 MMIO fault - similar to HV_EXIT_MMIO */
         ret = 0;
         break;
 
     case HV_EXIT_ARM_IRQ:
-        log_debug("vCPU %d: ARM64 external IRQ", vcpu->index);
+        log_trace("vCPU %d: ARM64 external IRQ", vcpu->index);
         /* External IRQ on ARM64 */
         ret = 0;
         break;
@@ -441,14 +476,14 @@ int vcpu_handle_exit(struct vcpu *vcpu, struct hv_exit *exit)
     /* HVF ARM64 specific exit reasons (Apple Silicon) */
     case HV_EXIT_CANCELED:
         log_info("vCPU %d: Exit canceled (async request)", vcpu->index);
-        vcpu->canceled_count++;
+        vcpu->stats.canceled_count++;
         vcpu->should_stop = 1;
         ret = 0;
         break;
 
     case HV_EXIT_VTIMER:
-        log_debug("vCPU %d: Virtual timer activated", vcpu->index);
-        vcpu->vtimer_count++;
+        log_trace("vCPU %d: Virtual timer activated", vcpu->index);
+        vcpu->stats.vtimer_count++;
         /* VTimer activated - inject timer interrupt into guest */
         /* For now, just continue - proper implementation would inject IRQ */
         ret = 0;
@@ -470,14 +505,14 @@ int vcpu_handle_exit(struct vcpu *vcpu, struct hv_exit *exit)
     case HV_EXIT_ARM_NISV:
         log_warn("vCPU %d: Unsupported exit reason %d (architecture-specific)",
                  vcpu->index, exit->reason);
-        vcpu->unknown_count++;
+        vcpu->stats.unknown_count++;
         ret = 0;
         break;
 
     default:
         log_warn("vCPU %d: Unknown exit reason %d",
                  vcpu->index, exit->reason);
-        vcpu->unknown_count++;
+        vcpu->stats.unknown_count++;
         ret = -1;
         break;
     }
@@ -490,10 +525,20 @@ int vcpu_handle_exit(struct vcpu *vcpu, struct hv_exit *exit)
  */
 int vcpu_handle_io_exit(struct vcpu *vcpu, struct hv_io *io)
 {
-    struct vcpu *vcpu_local = vcpu;  /* For future use */
-    uint8_t data[8];
+    struct vm *vm = vcpu->vm;
     int i;
 
+    /* Devices registered on the port I/O bus take precedence */
+    if (bus_find(&vm->pio_bus, io->port, &vcpu->pio_cache)) {
+        if (io->direction == HV_IO_OUT)
+            return bus_write(&vm->pio_bus, io->port, &io->data, io->size,
+                             &vcpu->pio_cache);
+
+        io->data = 0;
+        return bus_read(&vm->pio_bus, io->port, &io->data, io->size,
+                        &vcpu->pio_cache);
+    }
+
     /* Handle debug console on port 0x3f8 (COM1) */
     if (io->port == 0x3f8 || io->port == 0x3f9) {
         if (io->direction == HV_IO_OUT) {
@@ -507,7 +552,6 @@ int vcpu_handle_io_exit(struct vcpu *vcpu, struct hv_io *io)
             /* Read from console (not implemented) */
             io->data = 0;
         }
-        (void)vcpu_local;
         return 0;
     }
 
@@ -532,16 +576,18 @@ int vcpu_handle_io_exit(struct vcpu *vcpu, struct hv_io *io)
 int vcpu_handle_mmio_exit(struct vcpu *vcpu, struct hv_mmio *mmio)
 {
     struct vm *vm = vcpu->vm;
+    const struct bus_range *range;
     struct device *dev;
-    uint64_t data = mmio->data;
+    uint64_t data = 0;
+    uint64_t offset;
     int ret;
 
-    log_info("vcpu_handle_mmio_exit: GPA=0x%lx, size=%zu, is_write=%d, data=0x%lx",
-             mmio->addr, mmio->size, mmio->is_write, mmio->data);
+    log_trace("vcpu_handle_mmio_exit: GPA=0x%lx, size=%u, is_write=%d, data=0x%lx",
+              mmio->addr, mmio->size, mmio->is_write, mmio->data);
 
-    /* Find device at this GPA */
-    dev = vm_find_device_at_gpa(vm, mmio->addr);
-    if (!dev) {
+    /* Find device at this GPA (usually the same one as last time) */
+    range = bus_find(&vm->mmio_bus, mmio->addr, &vcpu->mmio_cache);
+    if (!range) {
         log_warn("MMIO to unmapped address: 0x%lx", mmio->addr);
         log_warn("");
         log_warn("The guest kernel is trying to access a device at GPA 0x%lx", mmio->addr);
@@ -561,36 +607,118 @@ int vcpu_handle_mmio_exit(struct vcpu *vcpu, struct hv_mmio *mmio)
         return 0;
     }
 
-    log_info("Found device '%s' at GPA 0x%lx (offset=%lu)",
-             dev->ops->name, dev->gpa_start, mmio->addr - dev->gpa_start);
+    dev = range->dev;
+    offset = mmio->addr - range->base + range->dev_offset;
+
+    log_trace("Found device '%s' at GPA 0x%lx (offset=%lu)",
+              dev->name, range->base, offset);
 
     /* Handle device access */
+    if (unlikely(!dev->ops || (mmio->is_write ? !dev->ops->write : !dev->ops->read))) {
+        log_warn("Device %s has no %s handler", dev->name,
+                 mmio->is_write ? "write" : "read");
+        return -1;
+    }
+
     if (mmio->is_write) {
-        log_info("Calling device write handler");
-        ret = dev->ops->write(dev, mmio->addr - dev->gpa_start,
-                              &mmio->data, mmio->size);
-        log_info("Device write handler returned: %d", ret);
+        ret = dev->ops->write(dev, offset, &mmio->data, mmio->size);
     } else {
-        log_info("Calling device read handler");
-        ret = dev->ops->read(dev, mmio->addr - dev->gpa_start,
-                             &data, mmio->size);
-        /* For KVM, we need to write back the data */
-        if (ret == 0) {
-            /* Data will be written back to vCPU run structure */
-        }
+        ret = dev->ops->read(dev, offset, &data, mmio->size);
+        /* Hand the value back for the backend to complete the load */
+        if (ret == 0)
+            mmio->data = data;
     }
 
     return ret;
 }
 
+/*
+ * Wake the vCPU from HLT
+ *
+ * The kick is recorded first; the eventfd is only written if the vCPU
+ * already sleeps on it, so kicking a running or polling vCPU costs no
+ * syscall. Pairs with the re-check in vcpu_halt_sleep().
+ */
+void vcpu_kick(struct vcpu *vcpu)
+{
+    __atomic_store_n(&vcpu->kick_pending, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&vcpu->halt_state, __ATOMIC_SEQ_CST) == VCPU_HALT_SLEEPING) {
+        if (eventfd_write(vcpu->halt_fd, 1) < 0)
+            perror("eventfd_write");
+    }
+}
+
+/*
+ * Spin for a kick until deadline; returns 1 if one came
+ */
+static int vcpu_halt_poll(struct vcpu *vcpu, uint64_t deadline)
+{
+    __atomic_store_n(&vcpu->halt_state, VCPU_HALT_POLLING, __ATOMIC_RELAXED);
+
+    do {
+        if (__atomic_exchange_n(&vcpu->kick_pending, 0, __ATOMIC_ACQ_REL))
+            return 1;
+        cpu_relax();
+    } while (vcpu_now_ns() < deadline);
+
+    return 0;
+}
+
+/*
+ * Sleep on halt_fd until kicked (or asked to stop)
+ */
+static void vcpu_halt_sleep(struct vcpu *vcpu)
+{
+    struct pollfd pfd = { .fd = vcpu->halt_fd, .events = POLLIN };
+    eventfd_t count;
+
+    __atomic_store_n(&vcpu->halt_state, VCPU_HALT_SLEEPING, __ATOMIC_SEQ_CST);
+
+    while (!__atomic_exchange_n(&vcpu->kick_pending, 0, __ATOMIC_SEQ_CST) &&
+           !vcpu->should_stop) {
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        eventfd_read(vcpu->halt_fd, &count);
+    }
+}
+
 /*
  * Handle HLT
+ *
+ * Only reached without an in-kernel irqchip: with one, the hypervisor
+ * keeps a halted vCPU asleep until it has an interrupt.
+ *
+ * The vCPU stays halted until vcpu_kick(). With a halt-poll limit it
+ * first spins for the current window, then sleeps. A wake-up that came
+ * while sleeping but within the limit would have been caught by a longer
+ * poll, so the window doubles; one beyond the limit shrinks it.
  */
 int vcpu_handle_halt(struct vcpu *vcpu)
 {
-    (void)vcpu;
-    /* VCPU is halted, wait for interrupt */
-    /* In a real implementation, we'd wait on an eventfd */
+    uint64_t max = vcpu->vm->halt_poll_max_ns;
+    uint64_t start = vcpu_now_ns();
+    uint64_t waited;
+
+    if (vcpu->halt_poll_ns && vcpu_halt_poll(vcpu, start + vcpu->halt_poll_ns)) {
+        vcpu->stats.halt_poll_success++;
+        waited = vcpu_now_ns() - start;
+    } else {
+        vcpu_halt_sleep(vcpu);
+        vcpu->stats.halt_sleep_count++;
+        waited = vcpu_now_ns() - start;
+
+        if (waited > max)
+            vcpu->halt_poll_ns /= 2;
+        else if (vcpu->halt_poll_ns < max)
+            vcpu->halt_poll_ns = MIN(MAX(vcpu->halt_poll_ns * 2,
+                                         VCPU_HALT_POLL_START_NS), max);
+    }
+
+    __atomic_store_n(&vcpu->halt_state, VCPU_HALT_NONE, __ATOMIC_RELAXED);
+    vcpu->stats.halt_wait_ns += waited;
     return 0;
 }
 
@@ -651,33 +779,53 @@ int vcpu_set_sregs(struct vcpu *vcpu, const struct hv_sregs *sregs)
  */
 void vcpu_print_stats(struct vcpu *vcpu)
 {
+    const struct vcpu_stats *st;
+
     if (!vcpu) {
         fprintf(stderr, "Invalid vCPU\n");
         return;
     }
 
+    st = &vcpu->stats;
+
     fprintf(stderr, "\n");
     fprintf(stderr, "╔══════════════════════════════════════════════════════════════════╗\n");
     fprintf(stderr, "║  vCPU %d Statistics                                                 ║\n", vcpu->index);
     fprintf(stderr, "╠══════════════════════════════════════════════════════════════════╣\n");
     fprintf(stderr, "║  Exit Statistics:                                                   ║\n");
-    fprintf(stderr, "║    Total VM Exits:     %20llu                             ║\n", vcpu->exit_count);
-    fprintf(stderr, "║    I/O Exits:          %20llu                             ║\n", vcpu->io_count);
-    fprintf(stderr, "║    MMIO Exits:         %20llu                             ║\n", vcpu->mmio_count);
-    fprintf(stderr, "║    HLT Exits:          %20llu                             ║\n", vcpu->halt_count);
-    fprintf(stderr, "║    Shutdown Exits:     %20llu                             ║\n", vcpu->shutdown_count);
-    fprintf(stderr, "║    Exception Exits:   %20llu                             ║\n", vcpu->exception_count);
-    fprintf(stderr, "║    Canceled Exits:     %20llu (ARM64)                   ║\n", vcpu->canceled_count);
-    fprintf(stderr, "║    VTimer Exits:       %20llu (ARM64)                   ║\n", vcpu->vtimer_count);
-    fprintf(stderr, "║    Unknown Exits:      %20llu                             ║\n", vcpu->unknown_count);
+    fprintf(stderr, "║    Total VM Exits:     %20llu                             ║\n",
+            (unsigned long long)st->exit_count);
+    fprintf(stderr, "║    I/O Exits:          %20llu                             ║\n",
+            (unsigned long long)st->io_count);
+    fprintf(stderr, "║    MMIO Exits:         %20llu                             ║\n",
+            (unsigned long long)st->mmio_count);
+    fprintf(stderr, "║    HLT Exits:          %20llu                             ║\n",
+            (unsigned long long)st->halt_count);
+    fprintf(stderr, "║      Woken Polling:    %20llu                             ║\n",
+            (unsigned long long)st->halt_poll_success);
+    fprintf(stderr, "║      Woken Sleeping:   %20llu                             ║\n",
+            (unsigned long long)st->halt_sleep_count);
+    fprintf(stderr, "║      Halted Time:      %20llu microseconds            ║\n",
+            (unsigned long long)(st->halt_wait_ns / 1000));
+    fprintf(stderr, "║    Shutdown Exits:     %20llu                             ║\n",
+            (unsigned long long)st->shutdown_count);
+    fprintf(stderr, "║    Exception Exits:   %20llu                             ║\n",
+            (unsigned long long)st->exception_count);
+    fprintf(stderr, "║    Canceled Exits:     %20llu (ARM64)                   ║\n",
+            (unsigned long long)st->canceled_count);
+    fprintf(stderr, "║    VTimer Exits:       %20llu (ARM64)                   ║\n",
+            (unsigned long long)st->vtimer_count);
+    fprintf(stderr, "║    Unknown Exits:      %20llu                             ║\n",
+            (unsigned long long)st->unknown_count);
     fprintf(stderr, "║                                                                     ║\n");
     fprintf(stderr, "║  Performance Statistics:                                           ║\n");
-    fprintf(stderr, "║    Total Run Time:     %20llu microseconds            ║\n", vcpu->total_run_time_us);
-    if (vcpu->total_run_time_us > 0) {
-        uint64_t exits_per_sec = (vcpu->exit_count * 1000000ULL) / vcpu->total_run_time_us;
-        fprintf(stderr, "║    Exits/Second:       %20llu                             ║\n", exits_per_sec);
+    fprintf(stderr, "║    Total Run Time:     %20llu microseconds            ║\n",
+            (unsigned long long)st->total_run_time_us);
+    if (st->total_run_time_us > 0) {
+        uint64_t exits_per_sec = (st->exit_count * 1000000ULL) / st->total_run_time_us;
+        fprintf(stderr, "║    Exits/Second:       %20llu                             ║\n",
+                (unsigned long long)exits_per_sec);
     }
-    fprintf(stderr, "║    Instructions:       %20llu (estimated)               ║\n", vcpu->instructions_executed);
     fprintf(stderr, "╚══════════════════════════════════════════════════════════════════╝\n");
     fprintf(stderr, "\n");
 }
@@ -691,17 +839,7 @@ void vcpu_reset_stats(struct vcpu *vcpu)
         return;
     }
 
-    vcpu->exit_count = 0;
-    vcpu->io_count = 0;
-    vcpu->mmio_count = 0;
-    vcpu->halt_count = 0;
-    vcpu->shutdown_count = 0;
-    vcpu->exception_count = 0;
-    vcpu->canceled_count = 0;
-    vcpu->vtimer_count = 0;
-    vcpu->unknown_count = 0;
-    vcpu->total_run_time_us = 0;
-    vcpu->instructions_executed = 0;
+    memset(&vcpu->stats, 0, sizeof(vcpu->stats));
 
     log_info("vcpu_reset_stats: vCPU %d statistics reset", vcpu->index);
 }
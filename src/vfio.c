@@ -661,6 +661,8 @@ int vfio_register_with_vm(struct vm *vm, struct vfio_dev *vdev, const char *bdf)
     dev->name = strdup(bdf);
     dev->data = vdev;
     dev->ops = &vfio_device_ops;
+    dev->irq_fd = -1;
+    dev->irq_resample_fd = -1;
 
     /* Map BARs to guest physical address space */
     gpa = 0xb000000;  /* Start GPA for VFIO devices */
@@ -39,12 +39,32 @@ struct vm* vm_create(void)
 
     vm->hv_vm = hv_vm;
     vm->state = VM_STATE_STOPPED;
+    pthread_mutex_init(&vm->mem_lock, NULL);
     vm->mem_size = 0;
+    vm->mem_backing = MM_BACKING_ANON;
+    vm->mem_page_size = MM_PAGE_SIZE_4K;
     vm->num_vcpus = 0;
     vm->num_devices = 0;
     vm->irq_base = 5;  /* Start IRQs at 5 */
+    vm->next_irq = vm->irq_base;
+    vm->num_iothreads = IOTHREAD_DEFAULT_COUNT;
 
-    log_info("VM created");
+    if (bus_init(&vm->mmio_bus, "mmio") < 0 ||
+        bus_init(&vm->pio_bus, "pio") < 0) {
+        log_error("Failed to create device buses");
+        bus_destroy(&vm->mmio_bus);
+        hv_destroy_vm(hv_vm);
+        free(vm);
+        return NULL;
+    }
+
+    /* Must precede the vCPUs, whose local APICs it creates */
+    if (hv_create_irqchip(hv_vm) == 0)
+        vm->irqchip = 1;
+    else if (errno != ENOSYS)
+        log_warn("No in-kernel irqchip: interrupts and HLT go through userspace");
+
+    log_info("VM created%s", vm->irqchip ? " (in-kernel irqchip)" : "");
     return vm;
 }
 
@@ -62,28 +82,37 @@ void vm_destroy(struct vm *vm)
     if (vm->state == VM_STATE_RUNNING)
         vm_stop(vm);
 
-    /* Destroy vCPUs */
+    /* Destroy devices (unregistering shrinks the array) */
+    while (vm->num_devices > 0)
+        device_unregister(vm->devices[vm->num_devices - 1]);
+    free(vm->devices);
+    bus_destroy(&vm->mmio_bus);
+    bus_destroy(&vm->pio_bus);
+
+    /* Devices are gone, so no fds are left on the I/O threads */
+    iothread_pool_destroy(vm->iothreads);
+    free(vm->iothread_cpus);
+
+    /* Destroy vCPUs (after the devices, whose interrupts kick them) */
     for (i = 0; i < vm->num_vcpus; i++) {
         if (vm->vcpus[i])
             vcpu_destroy(vm->vcpus[i]);
     }
 
-    /* Destroy devices */
-    for (i = 0; i < vm->num_devices; i++) {
-        if (vm->devices[i])
-            device_unregister(vm->devices[i]);
-    }
-
     /* Free memory regions */
-    for (i = 0; i < VM_MAX_SLOTS; i++) {
+    for (i = 0; i < vm->num_mem_regions; i++) {
         if (vm->mem_regions[i].used) {
             /* Unmap from hypervisor */
             hv_unmap_mem(vm->hv_vm, vm->mem_regions[i].slot);
             /* Free guest memory */
-            free(vm->mem_regions[i].hva);
+            mm_guest_mem_free(&vm->mem_regions[i].mem);
         }
     }
 
+    mm_slot_table_free(vm->mem_table);
+    free(vm->mem_regions);
+    pthread_mutex_destroy(&vm->mem_lock);
+
     /* Free configuration strings */
     free(vm->kernel_path);
     free(vm->initrd_path);
@@ -160,6 +189,58 @@ int vm_pause(struct vm *vm)
     return 0;
 }
 
+/*
+ * Set backing type and page size used for subsequently added memory regions
+ */
+int vm_set_memory_backing(struct vm *vm, enum mm_backing backing, uint64_t page_size)
+{
+    if (page_size != MM_PAGE_SIZE_4K && page_size != MM_PAGE_SIZE_2M &&
+        page_size != MM_PAGE_SIZE_1G) {
+        log_error("Unsupported guest page size: %lu", page_size);
+        return -1;
+    }
+
+    vm->mem_backing = backing;
+    vm->mem_page_size = page_size;
+    return 0;
+}
+
+/*
+ * Rebuild and publish the GPA -> HVA index (mem_lock held)
+ */
+static int vm_publish_mem_table(struct vm *vm)
+{
+    struct mm_slot_table *table;
+    struct mm_slot *slots;
+    int i, n = 0;
+
+    slots = calloc(vm->num_mem_regions ? vm->num_mem_regions : 1, sizeof(*slots));
+    if (!slots)
+        return -1;
+
+    for (i = 0; i < vm->num_mem_regions; i++) {
+        struct vm_mem_region *region = &vm->mem_regions[i];
+
+        if (!region->used)
+            continue;
+
+        slots[n].gpa = region->gpa;
+        slots[n].hva = region->hva;
+        slots[n].size = region->size;
+        slots[n].slot_id = region->slot;
+        slots[n].flags = 0;
+        n++;
+    }
+
+    table = mm_slot_table_build(slots, n);
+    free(slots);
+    if (!table)
+        return -1;
+
+    mm_slot_table_publish(&vm->mem_table, table);
+    return 0;
+}
+
 /*
  * Add a memory region to the VM
  */
@@ -167,37 +248,74 @@ int vm_add_memory_region(struct vm *vm, uint64_t gpa, uint64_t size)
 {
     struct vm_mem_region *region;
     struct hv_memory_slot slot;
-    void *hva;
+    struct mm_guest_mem mem;
+    uint64_t page_size = vm->mem_page_size;
     int i, ret;
 
-    /* Find free slot */
-    region = NULL;
-    for (i = 0; i < VM_MAX_SLOTS; i++) {
-        if (!vm->mem_regions[i].used) {
-            region = &vm->mem_regions[i];
-            break;
+    /* Align to page boundaries */
+    gpa = PAGE_ALIGN_DOWN(gpa);
+    size = PAGE_ALIGN_UP(size);
+
+    /*
+     * A region that isn't a whole number of 1G pages (the 128M of low RAM)
+     * would be rounded up to one, holding most of a 1G hugepage for
+     * nothing. Back it with 2M pages from the same pool kind instead.
+     */
+    if (page_size == MM_PAGE_SIZE_1G && !IS_ALIGNED(size, page_size)) {
+        log_info("Memory region 0x%lx+0x%lx uses 2048 KB pages "
+                 "(not a multiple of 1 GB)", gpa, size);
+        page_size = MM_PAGE_SIZE_2M;
+    }
+
+    /* Large pages need a GPA aligned to the page size to be mapped large */
+    if (!IS_ALIGNED(gpa, page_size))
+        log_warn("GPA 0x%lx is not aligned to the %lu KB guest page size",
+                 gpa, page_size >> 10);
+
+    pthread_mutex_lock(&vm->mem_lock);
+
+    /* Reject overlaps up front; the hypervisor would too */
+    for (i = 0; i < vm->num_mem_regions; i++) {
+        region = &vm->mem_regions[i];
+        if (region->used && gpa < region->gpa + region->size &&
+            region->gpa < gpa + size) {
+            log_error("Memory region 0x%lx+0x%lx overlaps slot %u",
+                      gpa, size, region->slot);
+            goto err_unlock;
         }
     }
 
-    if (!region) {
-        log_error("No free memory slots");
-        return -1;
+    /* Grow the region array (slot number == array index) */
+    if (vm->num_mem_regions == vm->max_mem_regions) {
+        int max = vm->max_mem_regions ? vm->max_mem_regions * 2 : 8;
+        struct vm_mem_region *regions;
+
+        regions = realloc(vm->mem_regions, max * sizeof(*regions));
+        if (!regions) {
+            log_error("No free memory slots");
+            goto err_unlock;
+        }
+
+        memset(regions + vm->max_mem_regions, 0,
+               (max - vm->max_mem_regions) * sizeof(*regions));
+        vm->mem_regions = regions;
+        vm->max_mem_regions = max;
     }
 
-    /* Allocate guest memory */
-    hva = calloc(1, size);
-    if (!hva) {
+    i = vm->num_mem_regions;
+    region = &vm->mem_regions[i];
+
+    /* Allocate guest memory (mapping may be rounded up to the page size) */
+    ret = mm_guest_mem_alloc(&mem, size, vm->mem_backing, page_size);
+    if (ret < 0) {
         log_error("Failed to allocate guest memory");
-        return -1;
+        goto err_unlock;
     }
 
-    /* Align to page boundaries */
-    gpa = PAGE_ALIGN_DOWN(gpa);
-
     /* Set up slot */
     slot.slot = i;
     slot.gpa = gpa;
-    slot.hva = hva;
+    slot.hva = mem.hva;
     slot.size = size;
     slot.flags = 0;
 
@@ -205,45 +323,95 @@ int vm_add_memory_region(struct vm *vm, uint64_t gpa, uint64_t size)
     ret = hv_map_mem(vm->hv_vm, slot.slot, slot.gpa, slot.hva, slot.size);
     if (ret < 0) {
         log_error("Failed to map memory into hypervisor");
-        free(hva);
-        return -1;
+        mm_guest_mem_free(&mem);
+        goto err_unlock;
     }
 
     /* Record region */
     region->gpa = gpa;
-    region->hva = hva;
+    region->hva = mem.hva;
     region->size = size;
     region->slot = i;
     region->used = 1;
+    region->mem = mem;
+    vm->num_mem_regions++;
+
+    /* Publish the new lookup table */
+    if (vm_publish_mem_table(vm) < 0) {
+        log_error("Failed to publish memory table");
+        hv_unmap_mem(vm->hv_vm, region->slot);
+        mm_guest_mem_free(&region->mem);
+        memset(region, 0, sizeof(*region));
+        vm->num_mem_regions--;
+        goto err_unlock;
+    }
 
     vm->mem_size += size;
+    pthread_mutex_unlock(&vm->mem_lock);
 
-    log_info("Added memory region: GPA 0x%lx -> HVA %p (size=%ld MB)",
-             gpa, hva, size / (1024 * 1024));
+    log_info("Added memory region: GPA 0x%lx -> HVA %p (size=%ld MB, %s, %lu KB pages)",
+             gpa, mem.hva, size / (1024 * 1024), mm_backing_name(mem.backing),
+             mem.page_size >> 10);
     return 0;
+
+err_unlock:
+    pthread_mutex_unlock(&vm->mem_lock);
+    return -1;
 }
 
 /*
  * Translate GPA to HVA
+ *
+ * Lock-free: reads the published slot table, which is never modified.
  */
 void* vm_gpa_to_hva(struct vm *vm, uint64_t gpa, uint64_t size)
 {
-    int i;
+    const struct mm_slot_table *table;
+    const struct mm_slot *slot;
 
-    for (i = 0; i < VM_MAX_SLOTS; i++) {
-        struct vm_mem_region *region = &vm->mem_regions[i];
+    table = __atomic_load_n(&vm->mem_table, __ATOMIC_ACQUIRE);
+    slot = mm_slot_table_find(table, gpa);
+    if (likely(slot && size <= slot->size - (gpa - slot->gpa)))
+        return (char *)slot->hva + (gpa - slot->gpa);
 
-        if (!region->used)
-            continue;
+    log_warn("GPA 0x%lx not mapped", gpa);
+    return NULL;
+}
+
+/*
+ * Translate a guest range to host iovecs, splitting at slot boundaries
+ */
+int vm_gpa_to_iov(struct vm *vm, uint64_t gpa, uint64_t size,
+                  struct iovec *iov, int max_iov)
+{
+    const struct mm_slot_table *table;
+    int n = 0;
+
+    table = __atomic_load_n(&vm->mem_table, __ATOMIC_ACQUIRE);
+
+    while (size) {
+        const struct mm_slot *slot = mm_slot_table_find(table, gpa);
+        uint64_t len;
 
-        if (gpa >= region->gpa && (gpa + size) <= (region->gpa + region->size)) {
-            uint64_t offset = gpa - region->gpa;
-            return (char *)region->hva + offset;
+        if (unlikely(!slot)) {
+            log_warn("GPA 0x%lx not mapped", gpa);
+            return -1;
+        }
+        if (unlikely(n == max_iov)) {
+            log_warn("GPA range 0x%lx needs more than %d segments", gpa, max_iov);
+            return -1;
         }
+
+        len = MIN(size, slot->size - (gpa - slot->gpa));
+        iov[n].iov_base = (char *)slot->hva + (gpa - slot->gpa);
+        iov[n].iov_len = len;
+        n++;
+
+        gpa += len;
+        size -= len;
     }
 
-    log_warn("GPA 0x%lx not mapped", gpa);
-    return NULL;
+    return n;
 }
 
 /*
@@ -251,33 +419,88 @@ void* vm_gpa_to_hva(struct vm *vm, uint64_t gpa, uint64_t size)
  */
 int vm_register_device(struct vm *vm, struct device *dev)
 {
-    if (vm->num_devices >= VM_MAX_DEVICES) {
-        log_error("Too many devices");
+    return device_register(vm, dev);
+}
+
+/*
+ * Find device at GPA
+ */
+struct device* vm_find_device_at_gpa(struct vm *vm, uint64_t gpa)
+{
+    const struct bus_range *range = bus_find(&vm->mmio_bus, gpa, NULL);
+
+    return range ? range->dev : NULL;
+}
+
+/*
+ * Configure I/O threads
+ */
+int vm_set_iothreads(struct vm *vm, int count, const char *cpus)
+{
+    if (vm->iothreads) {
+        log_error("I/O threads already started");
         return -1;
     }
 
-    vm->devices[vm->num_devices++] = dev;
+    if (count <= 0 || count > IOTHREAD_MAX_COUNT) {
+        log_error("Invalid I/O thread count: %d (max %d)", count, IOTHREAD_MAX_COUNT);
+        return -1;
+    }
 
-    log_info("Registered device: %s at GPA 0x%lx-0x%lx",
-             dev->name, dev->gpa_start, dev->gpa_end);
+    free(vm->iothread_cpus);
+    vm->iothread_cpus = cpus ? strdup(cpus) : NULL;
+    vm->num_iothreads = count;
     return 0;
 }
 
 /*
- * Find device at GPA
+ * Configure halt polling
+ *
+ * With the in-kernel irqchip HLT never exits to us, so the limit is
+ * handed to the hypervisor's own halt polling.
  */
-struct device* vm_find_device_at_gpa(struct vm *vm, uint64_t gpa)
+int vm_set_halt_poll(struct vm *vm, uint64_t max_ns)
+{
+    if (max_ns > VM_HALT_POLL_MAX_NS) {
+        log_error("Halt-poll window too large: %lu ns (max %lu)",
+                  max_ns, (uint64_t)VM_HALT_POLL_MAX_NS);
+        return -1;
+    }
+
+    if (vm->irqchip && hv_set_halt_poll(vm->hv_vm, max_ns) < 0) {
+        log_error("Halt polling not supported with the in-kernel irqchip");
+        return -1;
+    }
+
+    vm->halt_poll_max_ns = max_ns;
+    return 0;
+}
+
+/*
+ * Kick every vCPU out of HLT
+ */
+void vm_kick_vcpus(struct vm *vm)
 {
     int i;
 
-    for (i = 0; i < vm->num_devices; i++) {
-        struct device *dev = vm->devices[i];
+    for (i = 0; i < vm->num_vcpus; i++) {
+        if (vm->vcpus[i])
+            vcpu_kick(vm->vcpus[i]);
+    }
+}
 
-        if (gpa >= dev->gpa_start && gpa <= dev->gpa_end)
-            return dev;
+/*
+ * Get an I/O thread for a device, starting the pool on first use
+ */
+struct iothread* vm_get_iothread(struct vm *vm)
+{
+    if (!vm->iothreads) {
+        vm->iothreads = iothread_pool_create(vm->num_iothreads, vm->iothread_cpus);
+        if (!vm->iothreads)
+            return NULL;
     }
 
-    return NULL;
+    return iothread_pool_pick(vm->iothreads);
 }
 
 /*
@@ -0,0 +1,198 @@
+/*
+ * VM exit throughput benchmark
+ *
+ * Runs tests/kernels/x86_pio_loop.bin, a real-mode guest that does nothing
+ * but OUT its iteration count to port 0x80, on one vCPU for a fixed time.
+ * Every iteration is a full round trip through the run loop: KVM_RUN,
+ * exit decode, PIO bus dispatch to a sink device and back into the guest.
+ * Reports exits per second and the cost of one exit, and checks that the
+ * guest's count matches the I/O exits the vCPU handled.
+ *
+ * Needs /dev/kvm and the kernel (built by make bench); skipped otherwise.
+ *
+ * Build and run with: make bench
+ */
+
+#include "vm.h"
+#include "vcpu.h"
+#include "devices.h"
+#include "hypervisor.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_KERNEL    "tests/kernels/x86_pio_loop.bin"
+#define BENCH_ENTRY     0x1000
+#define BENCH_PORT      0x80
+#define BENCH_RAM       (2 << 20)
+#define BENCH_RUN_MS    1000
+
+/* Last count the guest wrote */
+static uint32_t guest_count;
+
+static int sink_read(struct device *dev, uint64_t offset, void *data, size_t size)
+{
+    (void)dev;
+    (void)offset;
+    memset(data, 0, size);
+    return 0;
+}
+
+static int sink_write(struct device *dev, uint64_t offset, const void *data, size_t size)
+{
+    (void)dev;
+    (void)offset;
+    memcpy(&guest_count, data, MIN(size, sizeof(guest_count)));
+    return 0;
+}
+
+static const struct device_ops sink_ops = {
+    .name = "pio-sink",
+    .read = sink_read,
+    .write = sink_write,
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Copy the kernel to BENCH_ENTRY; returns its size, or -1 */
+static long load_kernel(struct vm *vm, const char *path)
+{
+    FILE *fp;
+    void *hva;
+    long size;
+
+    fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+
+    hva = vm_gpa_to_hva(vm, BENCH_ENTRY, 4096);
+    size = hva ? (long)fread(hva, 1, 4096, fp) : -1;
+    fclose(fp);
+    return size > 0 ? size : -1;
+}
+
+/* Real mode, flat 64K segments at 0, starting at BENCH_ENTRY */
+static int setup_vcpu(struct vcpu *vcpu)
+{
+    struct hv_sregs sregs;
+    struct hv_regs regs;
+
+    if (vcpu_get_sregs(vcpu, &sregs) < 0)
+        return -1;
+
+    sregs.cs.selector = 0;
+    sregs.cs.base = 0;
+    sregs.cs.limit = 0xffff;
+    sregs.cs.ar = 0x9b;     /* Present, code, readable, accessed */
+
+    sregs.ds.selector = 0;
+    sregs.ds.base = 0;
+    sregs.ds.limit = 0xffff;
+    sregs.ds.ar = 0x93;     /* Present, data, writable, accessed */
+
+    sregs.es = sregs.ds;
+    sregs.fs = sregs.ds;
+    sregs.gs = sregs.ds;
+    sregs.ss = sregs.ds;
+
+    if (vcpu_set_sregs(vcpu, &sregs) < 0)
+        return -1;
+
+    memset(&regs, 0, sizeof(regs));
+    regs.rip = BENCH_ENTRY;
+    regs.rflags = 0x2;
+
+    return vcpu_set_regs(vcpu, &regs);
+}
+
+int main(void)
+{
+    struct device *sink;
+    struct vcpu *vcpu;
+    struct vm *vm;
+    uint64_t t0, elapsed, exits, io;
+    long size;
+
+    log_level = LOG_LEVEL_ERROR;
+
+    printf("VM exit throughput (PIO loop guest, %d ms)\n", BENCH_RUN_MS);
+
+#if !defined(__x86_64__)
+    printf("skipped (x86 guest)\n");
+    return 0;
+#endif
+
+    if (access("/dev/kvm", R_OK | W_OK) < 0 || hv_init(HV_TYPE_KVM) < 0) {
+        printf("skipped (no /dev/kvm)\n");
+        return 0;
+    }
+
+    vm = vm_create();
+    if (!vm || vm_add_memory_region(vm, 0, BENCH_RAM) < 0 ||
+        vm_create_vcpus(vm, 1) < 0) {
+        fprintf(stderr, "VM setup failed\n");
+        return 1;
+    }
+
+    size = load_kernel(vm, BENCH_KERNEL);
+    if (size < 0) {
+        printf("skipped (no %s, run make bench)\n", BENCH_KERNEL);
+        vm_destroy(vm);
+        hv_cleanup();
+        return 0;
+    }
+
+    sink = device_create("pio-sink", 0);
+    if (!sink) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+    sink->ops = &sink_ops;
+    if (vm_register_device(vm, sink) < 0 ||
+        device_add_pio_range(sink, BENCH_PORT, 4, 0) < 0) {
+        fprintf(stderr, "device setup failed\n");
+        return 1;
+    }
+
+    vcpu = vm->vcpus[0];
+    if (setup_vcpu(vcpu) < 0) {
+        fprintf(stderr, "vCPU setup failed\n");
+        return 1;
+    }
+
+    t0 = now_ns();
+    if (vcpu_start(vcpu) < 0) {
+        fprintf(stderr, "vCPU start failed\n");
+        return 1;
+    }
+    usleep(BENCH_RUN_MS * 1000);
+    vcpu_stop(vcpu);
+    elapsed = now_ns() - t0;
+
+    exits = vcpu->stats.exit_count;
+    io = vcpu->stats.io_count;
+
+    printf("exits %10llu  io %10llu  guest count %10u\n",
+           (unsigned long long)exits, (unsigned long long)io, guest_count);
+    printf("%.0f exits/s  %.1f ns/exit\n",
+           exits * 1e9 / elapsed, exits ? (double)elapsed / exits : 0.0);
+
+    if (io == 0 || guest_count != (uint32_t)io) {
+        fprintf(stderr, "guest count does not match I/O exits\n");
+        return 1;
+    }
+
+    vm_destroy(vm);
+    hv_cleanup();
+    return 0;
+}
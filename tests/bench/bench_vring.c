@@ -0,0 +1,390 @@
+/*
+ * Split vs packed virtqueue microbenchmark
+ *
+ * Emulates a guest driver against the real device-side code: queues are
+ * configured through the virtio-mmio registers, the device pops chains
+ * with virtqueue_pop_chain() and completes them with virtqueue_fill() and
+ * virtqueue_flush(). Each request is a two-descriptor chain (16-byte
+ * header, 4 KiB buffer), like a block or net TX request.
+ *
+ *   batch   - one thread: the guest posts a batch, the device drains it,
+ *             the guest reclaims it (per-request cost, ns)
+ *   stream  - guest and device on separate threads, both polling, so ring
+ *             cache lines move between CPUs (needs two CPUs)
+ *
+ * Build and run with: make bench
+ */
+
+#include "virtio.h"
+#include "devices.h"
+#include "vm.h"
+#include "mm.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#define BENCH_QUEUE_SIZE    256
+#define BENCH_ELEMS         (2 * 1000 * 1000)
+#define BENCH_RAM_SIZE      (4 << 20)
+
+/* Guest-physical layout */
+#define BENCH_DESC_GPA      0x0000
+#define BENCH_DRIVER_GPA    0x4000      /* Split avail ring / packed driver event */
+#define BENCH_DEVICE_GPA    0x5000      /* Split used ring / packed device event */
+#define BENCH_HDR_GPA       0x10000
+#define BENCH_BUF_GPA       0x100000
+
+/* Chains are two descriptors long */
+#define BENCH_CHAIN_LEN     2
+#define BENCH_MAX_INFLIGHT  (BENCH_QUEUE_SIZE / BENCH_CHAIN_LEN)
+
+/* Guest driver state */
+struct guest {
+    char *ram;
+    int packed;
+
+    /* Split */
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    uint16_t avail_idx;
+    uint16_t used_idx;
+
+    /* Packed */
+    struct vring_packed_desc *ring;
+    uint16_t next_avail;
+    int avail_wrap;
+    uint16_t next_used;
+    int used_wrap;
+
+    uint16_t free_ids[BENCH_MAX_INFLIGHT];
+    int num_free;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void mmio_write(struct virtio_dev *vdev, uint64_t offset, uint32_t val)
+{
+    virtio_mmio_write(vdev, offset, &val, sizeof(val));
+}
+
+/*
+ * Driver initialization through the transport registers
+ */
+static int setup_queue(struct virtio_dev *vdev, struct guest *g, int packed)
+{
+    uint64_t features = (1ULL << VIRTIO_F_VERSION_1) |
+                        (packed ? 1ULL << VIRTIO_F_RING_PACKED : 0);
+    uint32_t ready;
+    int i;
+
+    mmio_write(vdev, VIRTIO_MMIO_STATUS, 0);
+    memset(g->ram, 0, BENCH_HDR_GPA);
+    mmio_write(vdev, VIRTIO_MMIO_STATUS,
+               VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+    mmio_write(vdev, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+    mmio_write(vdev, VIRTIO_MMIO_DRIVER_FEATURES, (uint32_t)features);
+    mmio_write(vdev, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
+    mmio_write(vdev, VIRTIO_MMIO_DRIVER_FEATURES, features >> 32);
+    mmio_write(vdev, VIRTIO_MMIO_STATUS, VIRTIO_CONFIG_S_ACKNOWLEDGE |
+               VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_FEATURES_OK);
+    mmio_write(vdev, VIRTIO_MMIO_QUEUE_SEL, 0);
+    mmio_write(vdev, VIRTIO_MMIO_QUEUE_NUM, BENCH_QUEUE_SIZE);
+    mmio_write(vdev, VIRTIO_MMIO_QUEUE_DESC_LOW, BENCH_DESC_GPA);
+    mmio_write(vdev, VIRTIO_MMIO_QUEUE_AVAIL_LOW, BENCH_DRIVER_GPA);
+    mmio_write(vdev, VIRTIO_MMIO_QUEUE_USED_LOW, BENCH_DEVICE_GPA);
+    mmio_write(vdev, VIRTIO_MMIO_QUEUE_READY, 1);
+    virtio_mmio_read(vdev, VIRTIO_MMIO_QUEUE_READY, &ready, sizeof(ready));
+    if (!ready)
+        return -1;
+
+    g->packed = packed;
+    g->desc = (struct vring_desc *)(g->ram + BENCH_DESC_GPA);
+    g->avail = (struct vring_avail *)(g->ram + BENCH_DRIVER_GPA);
+    g->used = (struct vring_used *)(g->ram + BENCH_DEVICE_GPA);
+    g->ring = (struct vring_packed_desc *)(g->ram + BENCH_DESC_GPA);
+    g->avail_idx = 0;
+    g->used_idx = 0;
+    g->next_avail = 0;
+    g->avail_wrap = 1;
+    g->next_used = 0;
+    g->used_wrap = 1;
+
+    g->num_free = 0;
+    for (i = BENCH_MAX_INFLIGHT - 1; i >= 0; i--)
+        g->free_ids[g->num_free++] = i;
+    return 0;
+}
+
+/*
+ * Guest: make one request available
+ */
+static void guest_post_split(struct guest *g, uint16_t id)
+{
+    uint16_t head = id * BENCH_CHAIN_LEN;
+    struct vring_desc *d = &g->desc[head];
+
+    d[0].addr = BENCH_HDR_GPA + id * 16;
+    d[0].len = 16;
+    d[0].flags = VRING_DESC_F_NEXT;
+    d[0].next = head + 1;
+    d[1].addr = BENCH_BUF_GPA + (uint64_t)id * 4096;
+    d[1].len = 4096;
+    d[1].flags = VRING_DESC_F_WRITE;
+
+    g->avail->ring[g->avail_idx % BENCH_QUEUE_SIZE] = head;
+    g->avail_idx++;
+}
+
+static void guest_post_packed(struct guest *g, uint16_t id)
+{
+    uint16_t avail = g->avail_wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+    struct vring_packed_desc *head = &g->ring[g->next_avail];
+    struct vring_packed_desc *d;
+    uint16_t head_flags = VRING_DESC_F_NEXT | avail;
+
+    head->addr = BENCH_HDR_GPA + id * 16;
+    head->len = 16;
+    head->id = id;
+    if (++g->next_avail == BENCH_QUEUE_SIZE) {
+        g->next_avail = 0;
+        g->avail_wrap ^= 1;
+    }
+
+    d = &g->ring[g->next_avail];
+    d->addr = BENCH_BUF_GPA + (uint64_t)id * 4096;
+    d->len = 4096;
+    d->id = id;
+    d->flags = VRING_DESC_F_WRITE |
+               (g->avail_wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED);
+    if (++g->next_avail == BENCH_QUEUE_SIZE) {
+        g->next_avail = 0;
+        g->avail_wrap ^= 1;
+    }
+
+    /* The head's flags expose the chain */
+    __atomic_store_n(&head->flags, head_flags, __ATOMIC_RELEASE);
+}
+
+static int guest_post(struct guest *g, int count)
+{
+    int i;
+
+    for (i = 0; i < count && g->num_free; i++) {
+        uint16_t id = g->free_ids[--g->num_free];
+
+        if (g->packed)
+            guest_post_packed(g, id);
+        else
+            guest_post_split(g, id);
+    }
+
+    if (!g->packed)
+        __atomic_store_n(&g->avail->idx, g->avail_idx, __ATOMIC_RELEASE);
+    return i;
+}
+
+/*
+ * Guest: reclaim completed requests
+ */
+static int guest_reclaim(struct guest *g)
+{
+    int n = 0;
+
+    if (!g->packed) {
+        uint16_t used_idx = __atomic_load_n(&g->used->idx, __ATOMIC_ACQUIRE);
+
+        while (g->used_idx != used_idx) {
+            uint32_t head = g->used->ring[g->used_idx % BENCH_QUEUE_SIZE].id;
+
+            g->free_ids[g->num_free++] = head / BENCH_CHAIN_LEN;
+            g->used_idx++;
+            n++;
+        }
+        return n;
+    }
+
+    for (;;) {
+        struct vring_packed_desc *d = &g->ring[g->next_used];
+        uint16_t flags = __atomic_load_n(&d->flags, __ATOMIC_ACQUIRE);
+
+        if (!!(flags & VRING_PACKED_DESC_F_AVAIL) != g->used_wrap ||
+            !!(flags & VRING_PACKED_DESC_F_USED) != g->used_wrap)
+            break;
+
+        g->free_ids[g->num_free++] = d->id;
+        g->next_used += BENCH_CHAIN_LEN;
+        if (g->next_used >= BENCH_QUEUE_SIZE) {
+            g->next_used -= BENCH_QUEUE_SIZE;
+            g->used_wrap ^= 1;
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Device: drain the queue, complete everything, publish once
+ */
+static int device_drain(struct virtqueue *vq, struct virtqueue_elem *elem)
+{
+    int n = 0;
+
+    while (virtqueue_pop_chain(vq, elem)) {
+        virtqueue_fill(vq, elem->head, 4096);
+        n++;
+    }
+    virtqueue_flush(vq);
+    return n;
+}
+
+static uint64_t run_batch(struct virtio_dev *vdev, struct guest *g,
+                          struct virtqueue_elem *elem, int batch)
+{
+    struct virtqueue *vq = &vdev->queues[0];
+    uint64_t t0;
+    int done = 0;
+
+    t0 = now_ns();
+    while (done < BENCH_ELEMS) {
+        guest_post(g, batch);
+        device_drain(vq, elem);
+        done += guest_reclaim(g);
+    }
+
+    return now_ns() - t0;
+}
+
+/* Two-thread streaming run */
+struct stream {
+    struct virtqueue *vq;
+    struct virtqueue_elem *elem;
+    int stop;
+};
+
+static void* device_thread(void *opaque)
+{
+    struct stream *st = opaque;
+
+    while (!__atomic_load_n(&st->stop, __ATOMIC_RELAXED))
+        device_drain(st->vq, st->elem);
+    return NULL;
+}
+
+static uint64_t run_stream(struct virtio_dev *vdev, struct guest *g,
+                           struct virtqueue_elem *elem)
+{
+    struct stream st = { &vdev->queues[0], elem, 0 };
+    pthread_t thread;
+    uint64_t t0;
+    int done = 0;
+
+    if (pthread_create(&thread, NULL, device_thread, &st) != 0)
+        return 0;
+
+    t0 = now_ns();
+    while (done < BENCH_ELEMS) {
+        guest_post(g, BENCH_MAX_INFLIGHT);
+        done += guest_reclaim(g);
+    }
+    t0 = now_ns() - t0;
+
+    __atomic_store_n(&st.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+    return t0;
+}
+
+int main(void)
+{
+    static const int batches[] = { 1, 8, 32, 128 };
+    static struct virtio_dev vdev;
+    static struct virtqueue_elem elem;
+    struct mm_slot slot;
+    struct guest g;
+    struct vm vm;
+    size_t i;
+
+    log_level = LOG_LEVEL_ERROR;
+
+    memset(&g, 0, sizeof(g));
+    g.ram = calloc(1, BENCH_RAM_SIZE);
+    if (!g.ram) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+
+    /* A VM with nothing but guest RAM */
+    memset(&vm, 0, sizeof(vm));
+    memset(&slot, 0, sizeof(slot));
+    slot.hva = g.ram;
+    slot.size = BENCH_RAM_SIZE;
+    vm.mem_table = mm_slot_table_build(&slot, 1);
+    if (!vm.mem_table) {
+        fprintf(stderr, "allocation failed\n");
+        return 1;
+    }
+
+    virtio_init(&vdev, VIRTIO_ID_BLOCK);
+    vdev.device.name = "bench";
+    vdev.device.vm = &vm;
+    vdev.device.irq_fd = eventfd(0, EFD_NONBLOCK);
+    virtio_setup_queues(&vdev, 1);
+
+    printf("Split vs packed virtqueue (%d requests per run, %d-entry queue, ns/request)\n",
+           BENCH_ELEMS, BENCH_QUEUE_SIZE);
+    for (i = 0; i < ARRAY_SIZE(batches); i++) {
+        uint64_t t_split, t_packed;
+
+        if (setup_queue(&vdev, &g, 0) < 0)
+            return 1;
+        t_split = run_batch(&vdev, &g, &elem, batches[i]);
+
+        if (setup_queue(&vdev, &g, 1) < 0)
+            return 1;
+        t_packed = run_batch(&vdev, &g, &elem, batches[i]);
+
+        printf("batch %4d: split %7.2f ns  packed %7.2f ns  (%.2fx)\n",
+               batches[i],
+               (double)t_split / BENCH_ELEMS,
+               (double)t_packed / BENCH_ELEMS,
+               (double)t_split / t_packed);
+    }
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        printf("stream:     skipped (needs two CPUs)\n");
+    } else {
+        uint64_t t_split, t_packed;
+
+        if (setup_queue(&vdev, &g, 0) < 0)
+            return 1;
+        t_split = run_stream(&vdev, &g, &elem);
+
+        if (setup_queue(&vdev, &g, 1) < 0)
+            return 1;
+        t_packed = run_stream(&vdev, &g, &elem);
+
+        printf("stream:     split %7.2f ns  packed %7.2f ns  (%.2fx)\n",
+               (double)t_split / BENCH_ELEMS,
+               (double)t_packed / BENCH_ELEMS,
+               (double)t_split / t_packed);
+    }
+
+    mmio_write(&vdev, VIRTIO_MMIO_STATUS, 0);
+    close(vdev.device.irq_fd);
+    virtio_cleanup(&vdev);
+    mm_slot_table_free(vm.mem_table);
+    free(g.ram);
+    return 0;
+}
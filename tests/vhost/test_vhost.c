@@ -0,0 +1,282 @@
+/*
+ * vhost ring hand-over against a stub backend
+ *
+ * The vhost layer is driven through a stand-in transport (vhost_ops)
+ * that records every request instead of issuing VHOST_* ioctls, so the
+ * in-kernel path can be checked without /dev/vhost-net. The device is a
+ * virtio console, set up by a driver through its MMIO registers.
+ *
+ * Checks the request sequence of vhost_dev_start() and vhost_dev_stop(),
+ * and that the ring position the backend returns with GET_VRING_BASE
+ * becomes the virtqueue's again: after a normal stop, and when a start
+ * fails half-way and the rings already handed over are taken back.
+ *
+ * Needs /dev/kvm for the VM; skipped otherwise.
+ *
+ * Build and run with: make check
+ */
+
+#include "vhost_test.h"
+#include "vhost.h"
+
+#include <errno.h>
+#include <string.h>
+
+#define CONSOLE_GPA     0xa000000
+#define MAX_LOG         64
+
+/* One recorded request */
+struct stub_req {
+    unsigned long req;
+    unsigned int index;
+    unsigned int num;           /* vring_state.num */
+    int fd;                     /* vring_file.fd */
+    uint64_t addr;              /* vring_addr.desc_user_addr, mem table HVA */
+};
+
+/* Stub backend state */
+static struct stub_req stub_log[MAX_LOG];
+static int stub_nlog;
+static unsigned int stub_base[VHOST_MAX_VQS];
+static struct vring_avail *stub_avail[VHOST_MAX_VQS];
+static unsigned long stub_fail_req;     /* Fail this request ... */
+static unsigned int stub_fail_index;    /* ... on this ring */
+
+static int stub_request(struct vhost_dev *hdev, unsigned long req, void *arg)
+{
+    struct stub_req *r = &stub_log[stub_nlog < MAX_LOG ? stub_nlog++ : MAX_LOG - 1];
+    struct vhost_vring_state *state = arg;
+    struct vhost_vring_file *file = arg;
+    struct vhost_vring_addr *addr = arg;
+    struct vhost_memory *mem = arg;
+
+    (void)hdev;
+
+    memset(r, 0, sizeof(*r));
+    r->req = req;
+    r->fd = -2;
+
+    switch (req) {
+    case VHOST_SET_MEM_TABLE:
+        r->num = mem->nregions;
+        r->addr = mem->nregions ? mem->regions[0].userspace_addr : 0;
+        break;
+    case VHOST_SET_VRING_NUM:
+        r->index = state->index;
+        r->num = state->num;
+        break;
+    case VHOST_SET_VRING_BASE:
+        r->index = state->index;
+        r->num = stub_base[state->index] = state->num;
+        break;
+    case VHOST_GET_VRING_BASE:
+        r->index = state->index;
+        r->num = state->num = stub_base[state->index];
+        break;
+    case VHOST_SET_VRING_ADDR:
+        r->index = addr->index;
+        r->addr = addr->desc_user_addr;
+        stub_avail[addr->index] = (struct vring_avail *)(uintptr_t)addr->avail_user_addr;
+        break;
+    case VHOST_SET_VRING_KICK:
+    case VHOST_SET_VRING_CALL:
+        r->index = file->index;
+        r->fd = file->fd;
+        break;
+    }
+
+    if (req == stub_fail_req && r->index == stub_fail_index) {
+        errno = EIO;
+        return -1;
+    }
+
+    /* Once it has the kick, the backend takes what the driver posted */
+    if (req == VHOST_SET_VRING_KICK && file->fd >= 0 && stub_avail[file->index])
+        stub_base[file->index] = stub_avail[file->index]->idx;
+
+    return 0;
+}
+
+static void stub_cleanup(struct vhost_dev *hdev)
+{
+    (void)hdev;
+}
+
+static const struct vhost_ops stub_ops = {
+    .request = stub_request,
+    .cleanup = stub_cleanup,
+};
+
+/* Index in the log of the first req on ring index at or after from, or -1 */
+static int stub_find(int from, unsigned long req, unsigned int index)
+{
+    int i;
+
+    if (from < 0)
+        return -1;
+
+    for (i = from; i < stub_nlog; i++) {
+        if (stub_log[i].req == req && stub_log[i].index == index)
+            return i;
+    }
+    return -1;
+}
+
+static void stub_reset(void)
+{
+    memset(stub_log, 0, sizeof(stub_log));
+    memset(stub_base, 0, sizeof(stub_base));
+    memset(stub_avail, 0, sizeof(stub_avail));
+    stub_nlog = 0;
+    stub_fail_req = 0;
+}
+
+/* Start: features, memory table, then each ring's setup in order */
+static void test_start(struct vm *vm, struct virtio_dev *vdev, struct vhost_dev *hdev)
+{
+    int n, i, ret;
+
+    stub_reset();
+    test_post_buffers(vm, 1, 3);
+
+    pthread_mutex_lock(&vdev->lock);
+    ret = vhost_dev_start(hdev, vdev, 0, 2);
+    pthread_mutex_unlock(&vdev->lock);
+    CHECK(ret == 0, "vhost_dev_start failed");
+
+    CHECK(stub_nlog > 0 && stub_log[0].req == VHOST_SET_FEATURES,
+          "SET_FEATURES is not the first request");
+    i = stub_find(0, VHOST_SET_MEM_TABLE, 0);
+    CHECK(i == 1, "SET_MEM_TABLE not sent after SET_FEATURES");
+    CHECK(i >= 0 && stub_log[i].num == 1 &&
+          stub_log[i].addr == (uintptr_t)test_gpa(vm, 0),
+          "memory table doesn't describe guest RAM");
+
+    for (n = 0; n < 2; n++) {
+        int num = stub_find(0, VHOST_SET_VRING_NUM, n);
+        int base = stub_find(num, VHOST_SET_VRING_BASE, n);
+        int addr = stub_find(base, VHOST_SET_VRING_ADDR, n);
+        int call = stub_find(addr, VHOST_SET_VRING_CALL, n);
+        int kick = stub_find(call, VHOST_SET_VRING_KICK, n);
+
+        CHECK(num >= 0 && base >= 0 && addr >= 0 && call >= 0 && kick >= 0,
+              "ring %d: NUM, BASE, ADDR, CALL, KICK out of order", n);
+        if (kick < 0)
+            continue;
+        CHECK(stub_log[num].num == TEST_QUEUE_SIZE, "ring %d: size %u", n,
+              stub_log[num].num);
+        CHECK(stub_log[base].num == 0, "ring %d: base %u", n, stub_log[base].num);
+        CHECK(stub_log[addr].addr == (uintptr_t)test_gpa(vm, TEST_DESC_GPA(n)),
+              "ring %d: descriptor address isn't the table's HVA", n);
+        CHECK(stub_log[call].fd >= 0, "ring %d: no call eventfd", n);
+        CHECK(stub_log[kick].fd == vdev->queues[n].kick_fd,
+              "ring %d: kick fd isn't the queue's", n);
+        CHECK(vdev->queues[n].kick_external, "ring %d: kicks still ours", n);
+    }
+    CHECK(stub_base[1] == 3, "backend didn't pick up the posted buffers");
+}
+
+/* Stop: GET_VRING_BASE, then unbind both eventfds; the position comes back */
+static void test_stop(struct virtio_dev *vdev, struct vhost_dev *hdev)
+{
+    struct virtqueue *vq = &vdev->queues[1];
+    int n;
+
+    stub_nlog = 0;
+    pthread_mutex_lock(&vdev->lock);
+    vhost_dev_stop(hdev);
+    pthread_mutex_unlock(&vdev->lock);
+
+    for (n = 0; n < 2; n++) {
+        int get = stub_find(0, VHOST_GET_VRING_BASE, n);
+        int kick = stub_find(get, VHOST_SET_VRING_KICK, n);
+        int call = stub_find(get, VHOST_SET_VRING_CALL, n);
+
+        CHECK(get >= 0 && kick >= 0 && call >= 0,
+              "ring %d: GET_VRING_BASE doesn't come before the unbinds", n);
+        CHECK(kick < 0 || stub_log[kick].fd == -1, "ring %d: kick not unbound", n);
+        CHECK(call < 0 || stub_log[call].fd == -1, "ring %d: call not unbound", n);
+        CHECK(!vdev->queues[n].kick_external, "ring %d: kicks not taken back", n);
+    }
+
+    CHECK(vq->last_avail_idx == 3 && vq->shadow_avail_idx == 3,
+          "ring 1 resumes at %u/%u, backend stopped at 3",
+          vq->last_avail_idx, vq->shadow_avail_idx);
+
+    for (n = 0; n < hdev->nvqs; n++)
+        CHECK(hdev->call_fds[n] == -1, "ring %d: call eventfd left open", n);
+}
+
+/*
+ * A start that fails on ring 1 hands ring 0 back: ring 0 must resume
+ * where the backend left it, not where it was before the start
+ */
+static void test_failed_start(struct vm *vm, struct virtio_dev *vdev,
+                              struct vhost_dev *hdev)
+{
+    struct virtqueue *vq = &vdev->queues[0];
+    uint16_t before = vq->last_avail_idx;
+    int ret;
+
+    stub_reset();
+    test_post_buffers(vm, 0, 2);
+    stub_fail_req = VHOST_SET_VRING_KICK;
+    stub_fail_index = 1;
+
+    pthread_mutex_lock(&vdev->lock);
+    ret = vhost_dev_start(hdev, vdev, 0, 2);
+    pthread_mutex_unlock(&vdev->lock);
+
+    CHECK(ret < 0, "vhost_dev_start succeeded with a failing backend");
+    CHECK(stub_find(0, VHOST_GET_VRING_BASE, 0) >= 0, "ring 0 not stopped");
+    CHECK(!vq->kick_external && !vdev->queues[1].kick_external,
+          "kicks not taken back");
+    CHECK(vq->last_avail_idx == (uint16_t)(before + 2) &&
+          vq->shadow_avail_idx == vq->last_avail_idx,
+          "ring 0 resumes at %u, backend stopped at %u",
+          vq->last_avail_idx, before + 2);
+}
+
+int main(void)
+{
+    struct vhost_dev hdev;
+    struct virtio_dev *vdev;
+    struct device *dev;
+    struct vm *vm;
+
+    log_level = LOG_LEVEL_ERROR;
+
+    printf("vhost ring hand-over (stub backend)\n");
+
+    vm = test_vm_create(MM_BACKING_ANON);
+    if (!vm)
+        return 0;
+
+    dev = virtio_console_create();
+    if (!dev || vm_register_device(vm, dev) < 0) {
+        fprintf(stderr, "device setup failed\n");
+        return 1;
+    }
+    vdev = container_of(dev, struct virtio_dev, device);
+
+    /* Rings only: the driver never sets DRIVER_OK, so nothing else runs */
+    if (test_driver_init(vm, CONSOLE_GPA, 1ULL << VIRTIO_F_VERSION_1, 2, 0) < 0) {
+        fprintf(stderr, "driver init failed\n");
+        return 1;
+    }
+
+    memset(&hdev, 0, sizeof(hdev));
+    hdev.ops = &stub_ops;
+    hdev.fd = -1;
+    hdev.features = 1ULL << VIRTIO_F_VERSION_1;
+
+    test_start(vm, vdev, &hdev);
+    test_stop(vdev, &hdev);
+    test_failed_start(vm, vdev, &hdev);
+
+    vm_destroy(vm);
+    hv_cleanup();
+
+    printf("%s\n", test_failures ? "FAILED" : "ok");
+    return test_failures ? 1 : 0;
+}
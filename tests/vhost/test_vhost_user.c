@@ -0,0 +1,796 @@
+/*
+ * vhost-user protocol against a stand-in backend
+ *
+ * The backend is a thread on the other end of the unix socket. It speaks
+ * just enough of the protocol to serve a block device (and a network
+ * device without protocol extensions), records every message with the
+ * fds that came with it, and maps guest RAM from the memfds it is sent,
+ * as a real backend process would.
+ *
+ * Checks:
+ *  - the GET_FEATURES / GET_PROTOCOL_FEATURES / SET_PROTOCOL_FEATURES
+ *    handshake, and the legacy one without protocol extensions
+ *  - SET_MEM_TABLE: one memfd per region passed with SCM_RIGHTS, and an
+ *    mmap_offset under which the backend sees guest RAM
+ *  - SET_VRING_NUM/BASE/ADDR/CALL/KICK per ring, then SET_VRING_ENABLE
+ *  - REPLY_ACK: every request but the GETs waits for a status, and a
+ *    failing one makes the device ask the driver for a reset
+ *  - teardown on reset: GET_VRING_BASE, then KICK and CALL with NOFD
+ *
+ * Needs /dev/kvm for the VM; skipped otherwise.
+ *
+ * Build and run with: make check
+ */
+
+#include "vhost_test.h"
+#include "vhost.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define BLK_GPA         0xa001000
+#define NET_GPA         0xa002000
+
+#define MAX_LOG         128
+#define MAX_PAYLOAD     512
+#define MAX_FDS         8
+#define MAX_RINGS       4
+
+/* Wire format */
+#define MSG_VERSION         0x1
+#define MSG_FLAG_REPLY      (1U << 2)
+#define MSG_FLAG_NEED_REPLY (1U << 3)
+#define MSG_HDR_SIZE        12
+
+#define REQ_GET_FEATURES            1
+#define REQ_SET_FEATURES            2
+#define REQ_SET_OWNER               3
+#define REQ_SET_MEM_TABLE           5
+#define REQ_SET_VRING_NUM           8
+#define REQ_SET_VRING_ADDR          9
+#define REQ_SET_VRING_BASE          10
+#define REQ_GET_VRING_BASE          11
+#define REQ_SET_VRING_KICK          12
+#define REQ_SET_VRING_CALL          13
+#define REQ_GET_PROTOCOL_FEATURES   15
+#define REQ_SET_PROTOCOL_FEATURES   16
+#define REQ_GET_QUEUE_NUM           17
+#define REQ_SET_VRING_ENABLE        18
+#define REQ_GET_CONFIG              24
+
+#define F_PROTOCOL_FEATURES     30
+#define PROTOCOL_F_MQ           0
+#define PROTOCOL_F_REPLY_ACK    3
+#define PROTOCOL_F_CONFIG       9
+#define PROTOCOL_F_UNKNOWN      20      /* Offered, must not be accepted */
+#define VRING_NOFD              (1ULL << 8)
+
+#define BLK_CAPACITY    2048
+#define BLK_QUEUES      2
+#define BLK_F_MQ        12      /* VIRTIO_BLK_F_MQ */
+
+struct msg_hdr {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+} PACKED;
+
+struct mem_region {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t uaddr;
+    uint64_t mmap_offset;
+};
+
+/* One received message */
+struct msg {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size;
+    int nfds;
+    uint8_t payload[MAX_PAYLOAD];
+};
+
+struct ring {
+    uint32_t num;
+    uint32_t base;              /* Next avail entry to take */
+    int enabled;
+    struct vring_desc *desc;
+    struct vring_avail *avail;
+    struct vring_used *used;
+    int call;
+};
+
+struct backend {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int listen_fd;
+    int fd;
+    pthread_t thread;
+
+    /* Set before the device connects */
+    int protocol;               /* Offer protocol extensions */
+    uint64_t features;
+
+    /* Fail this request (REPLY_ACK status 1) on this ring */
+    uint32_t nack_request;
+    uint32_t nack_index;
+
+    pthread_mutex_t lock;       /* Everything below */
+    struct msg log[MAX_LOG];
+    int nlog;
+    struct mem_region regions[MAX_FDS];
+    void *maps[MAX_FDS];
+    int memfds[MAX_FDS];
+    int nregions;
+    struct ring rings[MAX_RINGS];
+};
+
+static void backend_send(struct backend *b, uint32_t request, const void *payload,
+                         uint32_t size)
+{
+    uint8_t buf[MSG_HDR_SIZE + MAX_PAYLOAD];
+    struct msg_hdr hdr = { request, MSG_VERSION | MSG_FLAG_REPLY, size };
+
+    memcpy(buf, &hdr, MSG_HDR_SIZE);
+    memcpy(buf + MSG_HDR_SIZE, payload, size);
+    if (write(b->fd, buf, MSG_HDR_SIZE + size) != (ssize_t)(MSG_HDR_SIZE + size))
+        perror("backend write");
+}
+
+/* Our HVA -> the backend's mapping, through the memory table */
+static void *backend_map(struct backend *b, uint64_t uaddr)
+{
+    int i;
+
+    for (i = 0; i < b->nregions; i++) {
+        struct mem_region *r = &b->regions[i];
+
+        if (uaddr >= r->uaddr && uaddr < r->uaddr + r->size)
+            return (uint8_t *)b->maps[i] + (uaddr - r->uaddr);
+    }
+    return NULL;
+}
+
+static void *backend_map_gpa(struct backend *b, uint64_t gpa)
+{
+    int i;
+
+    for (i = 0; i < b->nregions; i++) {
+        struct mem_region *r = &b->regions[i];
+
+        if (gpa >= r->gpa && gpa < r->gpa + r->size)
+            return (uint8_t *)b->maps[i] + (gpa - r->gpa);
+    }
+    return NULL;
+}
+
+/* Complete everything posted on an enabled ring, then call */
+static void backend_process(struct backend *b, int n)
+{
+    struct ring *ring = &b->rings[n];
+    uint16_t avail_idx;
+    int done = 0;
+
+    if (!ring->enabled || !ring->avail || !ring->used)
+        return;
+
+    avail_idx = __atomic_load_n(&ring->avail->idx, __ATOMIC_ACQUIRE);
+    while ((uint16_t)ring->base != avail_idx) {
+        uint16_t head = ring->avail->ring[ring->base % ring->num];
+        uint16_t used_idx = ring->used->idx;
+        struct vring_desc *d = &ring->desc[head];
+        uint8_t *buf = backend_map_gpa(b, d->addr);
+
+        if (buf && (d->flags & VRING_DESC_F_WRITE))
+            memset(buf, 0xab, d->len);
+        ring->used->ring[used_idx % ring->num].id = head;
+        ring->used->ring[used_idx % ring->num].len = d->len;
+        __atomic_store_n(&ring->used->idx, used_idx + 1, __ATOMIC_RELEASE);
+        ring->base++;
+        done++;
+    }
+
+    if (done && ring->call >= 0)
+        eventfd_write(ring->call, 1);
+}
+
+/* Handle one message; returns the REPLY_ACK status */
+static uint64_t backend_handle(struct backend *b, struct msg *m, int *fds)
+{
+    struct vhost_vring_state *state = (struct vhost_vring_state *)m->payload;
+    struct vhost_vring_addr *addr = (struct vhost_vring_addr *)m->payload;
+    uint64_t u64, status = 0;
+    int i, n;
+
+    memcpy(&u64, m->payload, sizeof(u64));
+
+    switch (m->request) {
+    case REQ_GET_FEATURES:
+        u64 = b->features;
+        if (b->protocol)
+            u64 |= 1ULL << F_PROTOCOL_FEATURES;
+        backend_send(b, m->request, &u64, sizeof(u64));
+        break;
+
+    case REQ_GET_PROTOCOL_FEATURES:
+        u64 = (1ULL << PROTOCOL_F_MQ) | (1ULL << PROTOCOL_F_REPLY_ACK) |
+              (1ULL << PROTOCOL_F_CONFIG) | (1ULL << PROTOCOL_F_UNKNOWN);
+        backend_send(b, m->request, &u64, sizeof(u64));
+        break;
+
+    case REQ_GET_QUEUE_NUM:
+        u64 = BLK_QUEUES;
+        backend_send(b, m->request, &u64, sizeof(u64));
+        break;
+
+    case REQ_GET_CONFIG: {
+        uint8_t reply[MAX_PAYLOAD];
+        uint64_t capacity = BLK_CAPACITY;
+        uint16_t queues = BLK_QUEUES;
+
+        memset(reply, 0, sizeof(reply));
+        memcpy(reply, m->payload, 12);
+        memcpy(reply + 12, &capacity, sizeof(capacity));
+        memcpy(reply + 12 + 34, &queues, sizeof(queues));
+        backend_send(b, m->request, reply, m->size);
+        break;
+    }
+
+    case REQ_SET_MEM_TABLE:
+        for (i = 0; i < b->nregions; i++) {
+            munmap(b->maps[i], b->regions[i].size);
+            close(b->memfds[i]);
+        }
+        memcpy(&b->nregions, m->payload, sizeof(uint32_t));
+        for (i = 0; i < b->nregions && i < m->nfds; i++) {
+            memcpy(&b->regions[i], m->payload + 8 + i * sizeof(struct mem_region),
+                   sizeof(struct mem_region));
+            b->memfds[i] = fds[i];
+            b->maps[i] = mmap(NULL, b->regions[i].size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fds[i], b->regions[i].mmap_offset);
+            if (b->maps[i] == MAP_FAILED) {
+                perror("backend mmap");
+                status = 1;
+            }
+        }
+        break;
+
+    case REQ_SET_VRING_NUM:
+        b->rings[state->index % MAX_RINGS].num = state->num;
+        break;
+
+    case REQ_SET_VRING_BASE:
+        b->rings[state->index % MAX_RINGS].base = state->num;
+        break;
+
+    case REQ_SET_VRING_ADDR:
+        n = addr->index % MAX_RINGS;
+        b->rings[n].desc = backend_map(b, addr->desc_user_addr);
+        b->rings[n].avail = backend_map(b, addr->avail_user_addr);
+        b->rings[n].used = backend_map(b, addr->used_user_addr);
+        break;
+
+    case REQ_GET_VRING_BASE: {
+        struct vhost_vring_state reply = *state;
+
+        n = state->index % MAX_RINGS;
+        reply.num = b->rings[n].base;
+        b->rings[n].enabled = 0;
+        backend_send(b, m->request, &reply, sizeof(reply));
+        break;
+    }
+
+    case REQ_SET_VRING_KICK:
+    case REQ_SET_VRING_CALL:
+        n = (u64 & 0xff) % MAX_RINGS;
+        if (m->request == REQ_SET_VRING_CALL) {
+            if (b->rings[n].call >= 0)
+                close(b->rings[n].call);
+            b->rings[n].call = m->nfds ? fds[0] : -1;
+        } else {
+            if (m->nfds)
+                close(fds[0]);
+            /* Without protocol extensions a ring runs once it has a kick */
+            if (!b->protocol && m->nfds) {
+                b->rings[n].enabled = 1;
+                backend_process(b, n);
+            }
+        }
+        break;
+
+    case REQ_SET_VRING_ENABLE:
+        n = state->index % MAX_RINGS;
+        b->rings[n].enabled = state->num;
+        backend_process(b, n);
+        break;
+    }
+
+    if (m->request == b->nack_request && state->index == b->nack_index)
+        status = 1;
+    return status;
+}
+
+static int backend_recv(struct backend *b, struct msg *m, int *fds)
+{
+    char control[CMSG_SPACE(MAX_FDS * sizeof(int))];
+    struct msg_hdr hdr;
+    struct iovec iov = { &hdr, MSG_HDR_SIZE };
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+
+    if (recvmsg(b->fd, &mh, MSG_WAITALL) != MSG_HDR_SIZE)
+        return -1;
+
+    memset(m, 0, sizeof(*m));
+    m->request = hdr.request;
+    m->flags = hdr.flags;
+    m->size = hdr.size;
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            m->nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), m->nfds * sizeof(int));
+        }
+    }
+
+    if (m->size > MAX_PAYLOAD ||
+        (m->size && recv(b->fd, m->payload, m->size, MSG_WAITALL) != (ssize_t)m->size))
+        return -1;
+    return 0;
+}
+
+static void *backend_thread(void *opaque)
+{
+    struct backend *b = opaque;
+    int fds[MAX_FDS];
+    struct msg m;
+
+    b->fd = accept(b->listen_fd, NULL, NULL);
+    if (b->fd < 0) {
+        perror("backend accept");
+        return NULL;
+    }
+
+    while (backend_recv(b, &m, fds) == 0) {
+        uint64_t status;
+
+        pthread_mutex_lock(&b->lock);
+        if (b->nlog < MAX_LOG)
+            b->log[b->nlog++] = m;
+        status = backend_handle(b, &m, fds);
+        pthread_mutex_unlock(&b->lock);
+
+        if (m.flags & MSG_FLAG_NEED_REPLY)
+            backend_send(b, m.request, &status, sizeof(status));
+    }
+
+    close(b->fd);
+    return NULL;
+}
+
+static void backend_start(struct backend *b, const char *dir, const char *name,
+                          int protocol, uint64_t features)
+{
+    struct sockaddr_un addr;
+    int i;
+
+    memset(b, 0, sizeof(*b));
+    b->protocol = protocol;
+    b->features = features;
+    b->fd = -1;
+    for (i = 0; i < MAX_RINGS; i++)
+        b->rings[i].call = -1;
+    pthread_mutex_init(&b->lock, NULL);
+    snprintf(b->path, sizeof(b->path), "%s/%s", dir, name);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, b->path);
+
+    b->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (b->listen_fd < 0 || bind(b->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(b->listen_fd, 1) < 0 ||
+        pthread_create(&b->thread, NULL, backend_thread, b) != 0) {
+        perror("backend");
+        exit(1);
+    }
+}
+
+/* After the device is gone: the VMM closed its end */
+static void backend_stop(struct backend *b)
+{
+    int i;
+
+    pthread_join(b->thread, NULL);
+    close(b->listen_fd);
+    unlink(b->path);
+    for (i = 0; i < b->nregions; i++) {
+        munmap(b->maps[i], b->regions[i].size);
+        close(b->memfds[i]);
+    }
+    for (i = 0; i < MAX_RINGS; i++) {
+        if (b->rings[i].call >= 0)
+            close(b->rings[i].call);
+    }
+}
+
+/* Index of the first request at or after from (on ring index if >= 0), or -1 */
+static int backend_find(struct backend *b, int from, uint32_t request, int index)
+{
+    int i, ret = -1;
+
+    if (from < 0)
+        return -1;
+
+    pthread_mutex_lock(&b->lock);
+    for (i = from; i < b->nlog; i++) {
+        struct msg *m = &b->log[i];
+        uint32_t ring;
+
+        memcpy(&ring, m->payload, sizeof(ring));
+        if (m->request == request && (index < 0 || (ring & 0xff) == (uint32_t)index)) {
+            ret = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    return ret;
+}
+
+/* Wait for request to show up in the log (non-acked requests are async) */
+static int backend_wait(struct backend *b, int from, uint32_t request, int index)
+{
+    int i, ret;
+
+    for (i = 0; i < 1000; i++) {
+        ret = backend_find(b, from, request, index);
+        if (ret >= 0)
+            return ret;
+        usleep(1000);
+    }
+    return -1;
+}
+
+static int backend_mark(struct backend *b)
+{
+    int n;
+
+    pthread_mutex_lock(&b->lock);
+    n = b->nlog;
+    pthread_mutex_unlock(&b->lock);
+    return n;
+}
+
+static uint64_t msg_u64(struct backend *b, int i)
+{
+    uint64_t v;
+
+    memcpy(&v, b->log[i].payload, sizeof(v));
+    return v;
+}
+
+static int is_memfd(int fd)
+{
+    char link[64], target[PATH_MAX];
+    ssize_t len;
+
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    len = readlink(link, target, sizeof(target) - 1);
+    if (len < 0)
+        return 0;
+    target[len] = '\0';
+    return strncmp(target, "/memfd:", 7) == 0;
+}
+
+/* Each ring: NUM, BASE, ADDR, CALL, KICK in that order, with the ring's HVAs */
+static void check_ring_setup(struct vm *vm, struct virtio_dev *vdev,
+                             struct backend *b, int from, int nrings, int acked)
+{
+    int n;
+
+    for (n = 0; n < nrings; n++) {
+        int num = backend_wait(b, from, REQ_SET_VRING_NUM, n);
+        int base = backend_wait(b, num, REQ_SET_VRING_BASE, n);
+        int addr = backend_wait(b, base, REQ_SET_VRING_ADDR, n);
+        int call = backend_wait(b, addr, REQ_SET_VRING_CALL, n);
+        int kick = backend_wait(b, call, REQ_SET_VRING_KICK, n);
+        struct vhost_vring_addr *a;
+
+        CHECK(kick >= 0, "ring %d: NUM, BASE, ADDR, CALL, KICK out of order", n);
+        if (kick < 0)
+            continue;
+
+        CHECK(msg_u64(b, num) >> 32 == TEST_QUEUE_SIZE, "ring %d: wrong size", n);
+        CHECK(msg_u64(b, base) >> 32 == 0, "ring %d: wrong base", n);
+
+        a = (struct vhost_vring_addr *)b->log[addr].payload;
+        CHECK(a->desc_user_addr == (uintptr_t)test_gpa(vm, TEST_DESC_GPA(n)) &&
+              a->avail_user_addr == (uintptr_t)test_gpa(vm, TEST_AVAIL_GPA(n)) &&
+              a->used_user_addr == (uintptr_t)test_gpa(vm, TEST_USED_GPA(n)),
+              "ring %d: ring addresses aren't our HVAs", n);
+
+        CHECK(b->log[call].nfds == 1 && !(msg_u64(b, call) & VRING_NOFD),
+              "ring %d: call eventfd not passed", n);
+        CHECK(b->log[kick].nfds == 1 && !(msg_u64(b, kick) & VRING_NOFD),
+              "ring %d: kick eventfd not passed", n);
+        CHECK(vdev->queues[n].kick_external, "ring %d: kicks still ours", n);
+
+        if (acked) {
+            CHECK((b->log[num].flags & b->log[base].flags & b->log[addr].flags &
+                   b->log[call].flags & b->log[kick].flags) & MSG_FLAG_NEED_REPLY,
+                  "ring %d: ring setup not acked", n);
+        }
+    }
+}
+
+/* GET_VRING_BASE first, then kick and call unbound with NOFD and no fd */
+static void check_ring_teardown(struct backend *b, int from, int ring)
+{
+    int get = backend_wait(b, from, REQ_GET_VRING_BASE, ring);
+    int kick = backend_wait(b, get, REQ_SET_VRING_KICK, ring);
+    int call = backend_wait(b, get, REQ_SET_VRING_CALL, ring);
+
+    CHECK(get >= 0, "ring %d: no GET_VRING_BASE", ring);
+    CHECK(kick >= 0 && (msg_u64(b, kick) & VRING_NOFD) && b->log[kick].nfds == 0,
+          "ring %d: kick not unbound with NOFD", ring);
+    CHECK(call >= 0 && (msg_u64(b, call) & VRING_NOFD) && b->log[call].nfds == 0,
+          "ring %d: call not unbound with NOFD", ring);
+}
+
+/* Wait for the backend to complete n buffers on queue q */
+static int wait_used(struct vm *vm, int q, uint16_t n)
+{
+    struct vring_used *used = test_gpa(vm, TEST_USED_GPA(q));
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+        if (__atomic_load_n(&used->idx, __ATOMIC_ACQUIRE) == n)
+            return 1;
+        usleep(1000);
+    }
+    return 0;
+}
+
+/* Handshake with protocol extensions: REPLY_ACK from SET_OWNER on */
+static void test_blk_handshake(struct backend *b, struct vm *vm)
+{
+    uint64_t want = (1ULL << PROTOCOL_F_MQ) | (1ULL << PROTOCOL_F_REPLY_ACK) |
+                    (1ULL << PROTOCOL_F_CONFIG);
+
+    CHECK(b->nlog >= 4, "handshake too short");
+    if (b->nlog < 4)
+        return;
+
+    CHECK(b->log[0].request == REQ_GET_FEATURES, "first request %u", b->log[0].request);
+    CHECK(b->log[1].request == REQ_GET_PROTOCOL_FEATURES,
+          "GET_PROTOCOL_FEATURES doesn't follow GET_FEATURES");
+    CHECK(b->log[2].request == REQ_SET_PROTOCOL_FEATURES,
+          "SET_PROTOCOL_FEATURES doesn't follow");
+    CHECK(msg_u64(b, 2) == want, "accepted protocol features 0x%lx, want 0x%lx",
+          msg_u64(b, 2), want);
+    CHECK(b->log[3].request == REQ_SET_OWNER &&
+          (b->log[3].flags & MSG_FLAG_NEED_REPLY),
+          "SET_OWNER not sent with NEED_REPLY");
+    CHECK(backend_find(b, 0, REQ_GET_QUEUE_NUM, -1) >= 0, "no GET_QUEUE_NUM");
+    CHECK(backend_find(b, 0, REQ_GET_CONFIG, -1) >= 0, "no GET_CONFIG");
+    CHECK(test_mmio_read(vm, BLK_GPA, VIRTIO_MMIO_CONFIG) == BLK_CAPACITY,
+          "capacity not read from the backend");
+}
+
+/* Driver ready: memory table, rings, enable; the backend serves them */
+static void test_blk_start(struct backend *b, struct vm *vm, struct virtio_dev *vdev)
+{
+    uint8_t *guest = test_gpa(vm, 0x3000);
+    int from, i, mem, q;
+
+    test_post_buffers(vm, 0, 2);
+    test_post_buffers(vm, 1, 3);
+    memcpy(guest, "guest RAM", 10);
+
+    from = backend_mark(b);
+    CHECK(test_driver_init(vm, BLK_GPA, (1ULL << VIRTIO_F_VERSION_1) |
+                           (1ULL << BLK_F_MQ), BLK_QUEUES, 1) == 0,
+          "driver init failed");
+    CHECK(!(test_mmio_read(vm, BLK_GPA, VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_NEEDS_RESET),
+          "device needs reset after start");
+
+    i = backend_find(b, from, REQ_SET_FEATURES, -1);
+    CHECK(i >= 0 && (msg_u64(b, i) & (1ULL << F_PROTOCOL_FEATURES)) &&
+          (msg_u64(b, i) & (1ULL << VIRTIO_F_VERSION_1)),
+          "SET_FEATURES without PROTOCOL_FEATURES or VERSION_1");
+
+    mem = backend_find(b, i, REQ_SET_MEM_TABLE, -1);
+    CHECK(mem >= 0, "no SET_MEM_TABLE after SET_FEATURES");
+    if (mem >= 0) {
+        pthread_mutex_lock(&b->lock);
+        CHECK(b->log[mem].flags & MSG_FLAG_NEED_REPLY, "SET_MEM_TABLE not acked");
+        CHECK(b->nregions > 0 && b->log[mem].nfds == b->nregions,
+              "%d fds for %d regions", b->log[mem].nfds, b->nregions);
+        for (i = 0; i < b->nregions; i++) {
+            CHECK(is_memfd(b->memfds[i]), "region %d: fd isn't a memfd", i);
+            CHECK(b->regions[i].uaddr == (uintptr_t)test_gpa(vm, b->regions[i].gpa),
+                  "region %d: userspace_addr isn't our HVA", i);
+        }
+        /* The backend's view through fd + mmap_offset is guest RAM */
+        CHECK(backend_map_gpa(b, 0x3000) &&
+              memcmp(backend_map_gpa(b, 0x3000), "guest RAM", 10) == 0,
+              "memfd at mmap_offset doesn't map guest RAM");
+        pthread_mutex_unlock(&b->lock);
+    }
+
+    check_ring_setup(vm, vdev, b, mem, BLK_QUEUES, 1);
+
+    for (q = 0; q < BLK_QUEUES; q++) {
+        int kick = backend_find(b, from, REQ_SET_VRING_KICK, q);
+        int enable = backend_find(b, kick, REQ_SET_VRING_ENABLE, q);
+
+        CHECK(enable >= 0 && (msg_u64(b, enable) >> 32) == 1,
+              "ring %d: not enabled after setup", q);
+    }
+
+    CHECK(wait_used(vm, 0, 2) && wait_used(vm, 1, 3), "backend didn't complete buffers");
+    for (i = 0; i < 1000; i++) {
+        if (test_mmio_read(vm, BLK_GPA, VIRTIO_MMIO_INTERRUPT_STATUS) & VIRTIO_MMIO_INT_VRING)
+            break;
+        usleep(1000);
+    }
+    CHECK(i < 1000, "backend call didn't interrupt the guest");
+    test_mmio_write(vm, BLK_GPA, VIRTIO_MMIO_INTERRUPT_ACK, VIRTIO_MMIO_INT_VRING);
+}
+
+/* Reset takes the rings back */
+static void test_blk_reset(struct backend *b, struct vm *vm, struct virtio_dev *vdev)
+{
+    int from = backend_mark(b);
+    int q;
+
+    test_mmio_write(vm, BLK_GPA, VIRTIO_MMIO_STATUS, 0);
+    CHECK(test_mmio_read(vm, BLK_GPA, VIRTIO_MMIO_STATUS) == 0, "Status not 0 after reset");
+
+    for (q = 0; q < BLK_QUEUES; q++) {
+        check_ring_teardown(b, from, q);
+        CHECK(!vdev->queues[q].kick_external, "ring %d: kicks not taken back", q);
+    }
+}
+
+/*
+ * A request the backend fails under REPLY_ACK aborts the start: the rings
+ * set up so far are taken back and the driver is asked to reset
+ */
+static void test_blk_nack(struct backend *b, struct vm *vm, struct virtio_dev *vdev)
+{
+    uint32_t status;
+    int from;
+
+    pthread_mutex_lock(&b->lock);
+    b->nack_request = REQ_SET_VRING_ADDR;
+    b->nack_index = 1;
+    pthread_mutex_unlock(&b->lock);
+
+    from = backend_mark(b);
+    test_driver_init(vm, BLK_GPA, 1ULL << VIRTIO_F_VERSION_1 | (1ULL << BLK_F_MQ),
+                     BLK_QUEUES, 1);
+
+    status = test_mmio_read(vm, BLK_GPA, VIRTIO_MMIO_STATUS);
+    CHECK(status & VIRTIO_CONFIG_S_NEEDS_RESET, "Status 0x%x without NEEDS_RESET", status);
+    CHECK(test_mmio_read(vm, BLK_GPA, VIRTIO_MMIO_INTERRUPT_STATUS) & VIRTIO_MMIO_INT_CONFIG,
+          "no configuration change interrupt");
+    CHECK(backend_find(b, from, REQ_SET_VRING_KICK, 1) < 0, "ring 1 set up after a failure");
+    check_ring_teardown(b, from, 0);
+    CHECK(!vdev->queues[0].kick_external && !vdev->queues[1].kick_external,
+          "kicks not taken back");
+
+    /* A status write keeps the bit; a reset clears it and the device works again */
+    test_mmio_write(vm, BLK_GPA, VIRTIO_MMIO_STATUS, status & ~VIRTIO_CONFIG_S_NEEDS_RESET);
+    CHECK(test_mmio_read(vm, BLK_GPA, VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_NEEDS_RESET,
+          "driver cleared NEEDS_RESET");
+
+    pthread_mutex_lock(&b->lock);
+    b->nack_request = 0;
+    pthread_mutex_unlock(&b->lock);
+
+    test_mmio_write(vm, BLK_GPA, VIRTIO_MMIO_STATUS, 0);
+    CHECK(test_mmio_read(vm, BLK_GPA, VIRTIO_MMIO_STATUS) == 0, "Status not 0 after reset");
+    test_driver_init(vm, BLK_GPA, 1ULL << VIRTIO_F_VERSION_1, BLK_QUEUES, 1);
+    status = test_mmio_read(vm, BLK_GPA, VIRTIO_MMIO_STATUS);
+    CHECK((status & VIRTIO_CONFIG_S_DRIVER_OK) && !(status & VIRTIO_CONFIG_S_NEEDS_RESET),
+          "device not usable after reset (Status 0x%x)", status);
+
+    test_mmio_write(vm, BLK_GPA, VIRTIO_MMIO_STATUS, 0);
+}
+
+/* Without protocol extensions: no PROTOCOL_FEATURES, acks or ENABLE */
+static void test_net_legacy(struct backend *b, struct vm *vm, struct virtio_dev *vdev)
+{
+    int from, i;
+
+    CHECK(b->log[0].request == REQ_GET_FEATURES, "first request %u", b->log[0].request);
+    i = backend_wait(b, 1, REQ_SET_OWNER, -1);
+    CHECK(i == 1, "SET_OWNER doesn't follow GET_FEATURES");
+    CHECK(i < 0 || !(b->log[i].flags & MSG_FLAG_NEED_REPLY), "SET_OWNER wants a reply");
+    CHECK(backend_find(b, 0, REQ_GET_PROTOCOL_FEATURES, -1) < 0,
+          "protocol features asked for without F_PROTOCOL_FEATURES");
+
+    /* The block device's rings were here */
+    memset(test_gpa(vm, TEST_RING_GPA(0)), 0, 2 * 0x20000);
+    test_post_buffers(vm, 1, 1);
+    from = backend_mark(b);
+    CHECK(test_driver_init(vm, NET_GPA, 1ULL << VIRTIO_F_VERSION_1, 2, 1) == 0,
+          "driver init failed");
+
+    i = backend_wait(b, from, REQ_SET_MEM_TABLE, -1);
+    CHECK(i >= 0 && !(b->log[i].flags & MSG_FLAG_NEED_REPLY) && b->log[i].nfds > 0,
+          "SET_MEM_TABLE without fds, or acked");
+    check_ring_setup(vm, vdev, b, from, 2, 0);
+    CHECK(backend_find(b, from, REQ_SET_VRING_ENABLE, -1) < 0,
+          "SET_VRING_ENABLE without protocol extensions");
+    CHECK(wait_used(vm, 1, 1), "backend didn't complete the TX buffer");
+
+    from = backend_mark(b);
+    test_mmio_write(vm, NET_GPA, VIRTIO_MMIO_STATUS, 0);
+    check_ring_teardown(b, from, 0);
+    check_ring_teardown(b, from, 1);
+}
+
+int main(void)
+{
+    char dir[] = "/tmp/vhost-user-test.XXXXXX";
+    struct backend blk, net;
+    struct device *dev;
+    struct vm *vm;
+
+    log_level = LOG_LEVEL_ERROR;
+
+    printf("vhost-user protocol (stand-in backend)\n");
+
+    vm = test_vm_create(MM_BACKING_MEMFD);
+    if (!vm)
+        return 0;
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    /* Block device, protocol extensions with REPLY_ACK */
+    backend_start(&blk, dir, "blk.sock", 1,
+                  (1ULL << VIRTIO_F_VERSION_1) | (1ULL << BLK_F_MQ));
+    dev = vhost_user_blk_create(blk.path);
+    if (!dev || vm_register_device(vm, dev) < 0) {
+        fprintf(stderr, "vhost-user-blk setup failed\n");
+        return 1;
+    }
+    test_blk_handshake(&blk, vm);
+    test_blk_start(&blk, vm, container_of(dev, struct virtio_dev, device));
+    test_blk_reset(&blk, vm, container_of(dev, struct virtio_dev, device));
+    test_blk_nack(&blk, vm, container_of(dev, struct virtio_dev, device));
+
+    /* Network device, legacy handshake; reuses the rings' guest memory */
+    backend_start(&net, dir, "net.sock", 0, 1ULL << VIRTIO_F_VERSION_1);
+    dev = vhost_user_net_create(net.path);
+    if (!dev || vm_register_device(vm, dev) < 0) {
+        fprintf(stderr, "vhost-user-net setup failed\n");
+        return 1;
+    }
+    test_net_legacy(&net, vm, container_of(dev, struct virtio_dev, device));
+
+    vm_destroy(vm);
+    hv_cleanup();
+    backend_stop(&blk);
+    backend_stop(&net);
+    rmdir(dir);
+
+    printf("%s\n", test_failures ? "FAILED" : "ok");
+    return test_failures ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Shared helpers for the vhost stand-in backend tests
+ *
+ * A VM with RAM but no vCPUs, and just enough of a virtio-mmio driver to
+ * negotiate features and set up split rings at fixed guest addresses.
+ * Register accesses go through device_handle_mmio(), as a vCPU's would.
+ */
+
+#ifndef VIBE_VMM_TESTS_VHOST_TEST_H
+#define VIBE_VMM_TESTS_VHOST_TEST_H
+
+#include "vm.h"
+#include "virtio.h"
+#include "devices.h"
+#include "hypervisor.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TEST_RAM            (16 << 20)
+#define TEST_QUEUE_SIZE     64
+
+/* Queue q: descriptors, then the avail ring; the used ring 64K in */
+#define TEST_RING_GPA(q)    (0x100000 + (uint64_t)(q) * 0x20000)
+#define TEST_DESC_GPA(q)    TEST_RING_GPA(q)
+#define TEST_AVAIL_GPA(q)   (TEST_RING_GPA(q) + 16 * TEST_QUEUE_SIZE)
+#define TEST_USED_GPA(q)    (TEST_RING_GPA(q) + 0x10000)
+
+static int test_failures;
+
+#define CHECK(cond, ...) do {                                           \
+        if (!(cond)) {                                                  \
+            test_failures++;                                            \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);        \
+            fprintf(stderr, __VA_ARGS__);                               \
+            fprintf(stderr, "\n");                                      \
+        }                                                               \
+    } while (0)
+
+static uint32_t test_mmio_read(struct vm *vm, uint64_t base, uint64_t reg)
+{
+    uint64_t val = 0;
+
+    device_handle_mmio(vm, base + reg, 0, &val, 4);
+    return (uint32_t)val;
+}
+
+static void test_mmio_write(struct vm *vm, uint64_t base, uint64_t reg, uint32_t val)
+{
+    uint64_t v = val;
+
+    device_handle_mmio(vm, base + reg, 1, &v, 4);
+}
+
+static void *test_gpa(struct vm *vm, uint64_t gpa)
+{
+    return vm_gpa_to_hva(vm, gpa, 1);
+}
+
+/*
+ * Driver side of device initialization: negotiate features (those the
+ * device offers out of the ones given) and set up queues 0..nq-1.
+ * Stops short of DRIVER_OK unless driver_ok is set. Returns 0 or -1.
+ */
+static int test_driver_init(struct vm *vm, uint64_t base, uint64_t features,
+                            int nq, int driver_ok)
+{
+    uint64_t offered;
+    int q;
+
+    test_mmio_write(vm, base, VIRTIO_MMIO_STATUS, 0);
+    test_mmio_write(vm, base, VIRTIO_MMIO_STATUS, VIRTIO_CONFIG_S_ACKNOWLEDGE);
+    test_mmio_write(vm, base, VIRTIO_MMIO_STATUS,
+                    VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+
+    test_mmio_write(vm, base, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 0);
+    offered = test_mmio_read(vm, base, VIRTIO_MMIO_DEVICE_FEATURES);
+    test_mmio_write(vm, base, VIRTIO_MMIO_DEVICE_FEATURES_SEL, 1);
+    offered |= (uint64_t)test_mmio_read(vm, base, VIRTIO_MMIO_DEVICE_FEATURES) << 32;
+    features &= offered;
+
+    test_mmio_write(vm, base, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 0);
+    test_mmio_write(vm, base, VIRTIO_MMIO_DRIVER_FEATURES, (uint32_t)features);
+    test_mmio_write(vm, base, VIRTIO_MMIO_DRIVER_FEATURES_SEL, 1);
+    test_mmio_write(vm, base, VIRTIO_MMIO_DRIVER_FEATURES, features >> 32);
+
+    test_mmio_write(vm, base, VIRTIO_MMIO_STATUS,
+                    VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+                    VIRTIO_CONFIG_S_FEATURES_OK);
+    if (!(test_mmio_read(vm, base, VIRTIO_MMIO_STATUS) & VIRTIO_CONFIG_S_FEATURES_OK))
+        return -1;
+
+    for (q = 0; q < nq; q++) {
+        test_mmio_write(vm, base, VIRTIO_MMIO_QUEUE_SEL, q);
+        if (test_mmio_read(vm, base, VIRTIO_MMIO_QUEUE_NUM_MAX) < TEST_QUEUE_SIZE)
+            return -1;
+        test_mmio_write(vm, base, VIRTIO_MMIO_QUEUE_NUM, TEST_QUEUE_SIZE);
+        test_mmio_write(vm, base, VIRTIO_MMIO_QUEUE_DESC_LOW, TEST_DESC_GPA(q));
+        test_mmio_write(vm, base, VIRTIO_MMIO_QUEUE_DESC_HIGH, 0);
+        test_mmio_write(vm, base, VIRTIO_MMIO_QUEUE_AVAIL_LOW, TEST_AVAIL_GPA(q));
+        test_mmio_write(vm, base, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, 0);
+        test_mmio_write(vm, base, VIRTIO_MMIO_QUEUE_USED_LOW, TEST_USED_GPA(q));
+        test_mmio_write(vm, base, VIRTIO_MMIO_QUEUE_USED_HIGH, 0);
+        test_mmio_write(vm, base, VIRTIO_MMIO_QUEUE_READY, 1);
+        if (test_mmio_read(vm, base, VIRTIO_MMIO_QUEUE_READY) != 1)
+            return -1;
+    }
+
+    if (driver_ok)
+        test_mmio_write(vm, base, VIRTIO_MMIO_STATUS,
+                        VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+                        VIRTIO_CONFIG_S_FEATURES_OK | VIRTIO_CONFIG_S_DRIVER_OK);
+    return 0;
+}
+
+/* Post n one-descriptor buffers on queue q (avail->idx += n) */
+static void test_post_buffers(struct vm *vm, int q, int n)
+{
+    struct vring_desc *desc = test_gpa(vm, TEST_DESC_GPA(q));
+    struct vring_avail *avail = test_gpa(vm, TEST_AVAIL_GPA(q));
+    uint16_t idx = avail->idx;
+    int i;
+
+    for (i = 0; i < n; i++, idx++) {
+        uint16_t head = idx % TEST_QUEUE_SIZE;
+
+        desc[head].addr = 0x400000 + (uint64_t)head * 0x1000;
+        desc[head].len = 0x1000;
+        desc[head].flags = VRING_DESC_F_WRITE;
+        desc[head].next = 0;
+        avail->ring[head] = head;
+    }
+    __atomic_store_n(&avail->idx, idx, __ATOMIC_RELEASE);
+}
+
+/* A VM to attach devices to, or NULL (and a note) if KVM is unavailable */
+static struct vm *test_vm_create(enum mm_backing backing)
+{
+    struct vm *vm;
+
+    if (access("/dev/kvm", R_OK | W_OK) < 0 || hv_init(HV_TYPE_KVM) < 0) {
+        printf("skipped (no /dev/kvm)\n");
+        return NULL;
+    }
+
+    vm = vm_create();
+    if (!vm || vm_set_memory_backing(vm, backing, MM_PAGE_SIZE_4K) < 0 ||
+        vm_add_memory_region(vm, 0, TEST_RAM) < 0) {
+        fprintf(stderr, "VM setup failed\n");
+        exit(1);
+    }
+    return vm;
+}
+
+#endif /* VIBE_VMM_TESTS_VHOST_TEST_H */